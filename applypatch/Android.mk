@@ -17,22 +17,23 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_CLANG := true
-LOCAL_SRC_FILES := applypatch.cpp bspatch.cpp freecache.cpp imgpatch.cpp utils.cpp
+LOCAL_SRC_FILES := add_bytes.cpp applypatch.cpp bspatch.cpp freecache.cpp imgpatch.cpp utils.cpp
 LOCAL_MODULE := libapplypatch
 LOCAL_MODULE_TAGS := eng
 LOCAL_C_INCLUDES += bootable/recovery
-LOCAL_STATIC_LIBRARIES += libbase libotafault libmtdutils libcrypto_static libbz libz
+LOCAL_STATIC_LIBRARIES += libbase libotafault libmtdutils libcrypto_static libbz libxz libzstd \
+                          libz
 
 include $(BUILD_STATIC_LIBRARY)
 
 include $(CLEAR_VARS)
 
 LOCAL_CLANG := true
-LOCAL_SRC_FILES := bspatch.cpp imgpatch.cpp utils.cpp
+LOCAL_SRC_FILES := add_bytes.cpp bspatch.cpp imgpatch.cpp utils.cpp
 LOCAL_MODULE := libimgpatch
 LOCAL_C_INCLUDES += bootable/recovery
 LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)/include
-LOCAL_STATIC_LIBRARIES += libcrypto_static libbz libz
+LOCAL_STATIC_LIBRARIES += libcrypto_static libbz libxz libzstd libz
 
 include $(BUILD_STATIC_LIBRARY)
 
@@ -40,11 +41,11 @@ ifeq ($(HOST_OS),linux)
 include $(CLEAR_VARS)
 
 LOCAL_CLANG := true
-LOCAL_SRC_FILES := bspatch.cpp imgpatch.cpp utils.cpp
+LOCAL_SRC_FILES := add_bytes.cpp bspatch.cpp imgpatch.cpp utils.cpp
 LOCAL_MODULE := libimgpatch
 LOCAL_C_INCLUDES += bootable/recovery
 LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)/include
-LOCAL_STATIC_LIBRARIES += libcrypto_static libbz libz
+LOCAL_STATIC_LIBRARIES += libcrypto_static libbz libxz libzstd libz
 
 include $(BUILD_HOST_STATIC_LIBRARY)
 endif  # HOST_OS == linux
@@ -56,7 +57,7 @@ LOCAL_SRC_FILES := main.cpp
 LOCAL_MODULE := applypatch
 LOCAL_C_INCLUDES += bootable/recovery
 LOCAL_STATIC_LIBRARIES += libapplypatch libbase libotafault libmtdutils libcrypto_static libbz \
-                          libedify \
+                          libxz libzstd libedify \
 
 LOCAL_SHARED_LIBRARIES += libz libcutils libc
 
@@ -69,6 +70,29 @@ LOCAL_SRC_FILES := imgdiff.cpp utils.cpp bsdiff.cpp
 LOCAL_MODULE := imgdiff
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_C_INCLUDES += external/zlib external/bzip2
-LOCAL_STATIC_LIBRARIES += libz libbz
+LOCAL_STATIC_LIBRARIES += libz libbz libzstd liblzma
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# Measures the throughput of the kernels that add the old data to the diff
+# strings of bsdiff patches.
+include $(CLEAR_VARS)
+
+LOCAL_CLANG := true
+LOCAL_SRC_FILES := add_bytes_bench.cpp add_bytes.cpp
+LOCAL_MODULE := add_bytes_bench
+LOCAL_STATIC_LIBRARIES += libbase
+
+include $(BUILD_HOST_EXECUTABLE)
+
+# Compares the size of bsdiff patches in the BSDIFF40 and BSDFZ containers,
+# and how fast they apply.
+include $(CLEAR_VARS)
+
+LOCAL_CLANG := true
+LOCAL_SRC_FILES := bsdiff_bench.cpp bsdiff.cpp
+LOCAL_MODULE := bsdiff_bench
+LOCAL_C_INCLUDES += bootable/recovery external/bzip2
+LOCAL_STATIC_LIBRARIES += libimgpatch libbase libcrypto_static libbz libxz libzstd liblzma libz
 
 include $(BUILD_HOST_EXECUTABLE)
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "add_bytes.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define ADD_BYTES_X86 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define ADD_BYTES_NEON 1
+#endif
+
+static void AddBytesScalar(uint8_t* dst, const uint8_t* src, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        dst[i] += src[i];
+    }
+}
+
+// The vector kernels add as many whole vectors as fit with unaligned loads
+// and stores, which cost the same as aligned ones on the CPUs that have
+// these instruction sets, and leave the remaining bytes to the scalar loop.
+
+#if defined(ADD_BYTES_X86)
+
+__attribute__((target("sse2")))
+static void AddBytesSse2(uint8_t* dst, const uint8_t* src, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_add_epi8(d, s));
+    }
+    AddBytesScalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void AddBytesAvx2(uint8_t* dst, const uint8_t* src, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i d0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        __m256i d1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i + 32));
+        __m256i s0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i s1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 32));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_add_epi8(d0, s0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 32), _mm256_add_epi8(d1, s1));
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_add_epi8(d, s));
+    }
+    AddBytesScalar(dst + i, src + i, len - i);
+}
+
+#elif defined(ADD_BYTES_NEON)
+
+// NEON is part of the ABI on arm64, and on arm only used when the build
+// targets it, so it needs no runtime check.
+
+static void AddBytesNeon(uint8_t* dst, const uint8_t* src, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        uint8x16_t d0 = vld1q_u8(dst + i);
+        uint8x16_t d1 = vld1q_u8(dst + i + 16);
+        vst1q_u8(dst + i, vaddq_u8(d0, vld1q_u8(src + i)));
+        vst1q_u8(dst + i + 16, vaddq_u8(d1, vld1q_u8(src + i + 16)));
+    }
+    for (; i + 16 <= len; i += 16) {
+        vst1q_u8(dst + i, vaddq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+    }
+    AddBytesScalar(dst + i, src + i, len - i);
+}
+
+#endif
+
+std::vector<AddBytesKernel> GetAddBytesKernels() {
+    std::vector<AddBytesKernel> kernels;
+    kernels.push_back({ "scalar", AddBytesScalar });
+#if defined(ADD_BYTES_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        kernels.push_back({ "sse2", AddBytesSse2 });
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back({ "avx2", AddBytesAvx2 });
+    }
+#elif defined(ADD_BYTES_NEON)
+    kernels.push_back({ "neon", AddBytesNeon });
+#endif
+    return kernels;
+}
+
+void AddBytes(uint8_t* dst, const uint8_t* src, size_t len) {
+    static const AddBytesFn fn = GetAddBytesKernels().back().fn;
+    fn(dst, src, len);
+}
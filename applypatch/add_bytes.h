@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _APPLYPATCH_ADD_BYTES_H
+#define _APPLYPATCH_ADD_BYTES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Adds src[i] to dst[i] modulo 256 for every i < len, which is how bspatch
+// applies the diff string to the old data. There is a portable kernel and
+// vectorized ones for SSE2 and AVX2 on x86, picked by what the CPU supports
+// at runtime, and for NEON on ARM when the build targets it. All of them
+// produce the same output for any alignment of dst and src; the buffers
+// must not overlap unless they're the same.
+
+typedef void (*AddBytesFn)(uint8_t* dst, const uint8_t* src, size_t len);
+
+struct AddBytesKernel {
+    const char* name;
+    AddBytesFn fn;
+};
+
+// Adds the bytes with the fastest kernel available.
+void AddBytes(uint8_t* dst, const uint8_t* src, size_t len);
+
+// Returns the kernels available on this CPU, the portable one first and the
+// one AddBytes() uses last.
+std::vector<AddBytesKernel> GetAddBytesKernels();
+
+#endif  // _APPLYPATCH_ADD_BYTES_H
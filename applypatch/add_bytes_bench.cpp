@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures the throughput of the kernels of add_bytes.h, and of the loop
+// bspatch used before them, which checked the bounds of the old data for
+// every byte:
+//
+//    add_bytes_bench [-s <bytes per call>] [-m <MiB per kernel>]
+//
+// Each call adds <bytes per call> old bytes (64 KiB by default) to a diff
+// string, like one control entry of a bsdiff patch does; the buffers stay in
+// the cache, so this is the cost of the loop itself.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <vector>
+
+#include <android-base/parseint.h>
+
+#include "add_bytes.h"
+
+// The loop of ApplyBSDiffPatch() before the kernels, for reference.
+static void AddBytesChecked(uint8_t* p, const uint8_t* old_data, off_t old_size, off_t oldpos,
+        off_t len) {
+    for (off_t i = 0; i < len; ++i) {
+        if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
+            p[i] += old_data[oldpos+i];
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t size = 64 << 10;
+    size_t mib = 1024;
+
+    int c;
+    while ((c = getopt(argc, argv, "s:m:")) != -1) {
+        switch (c) {
+          case 's':
+            if (!android::base::ParseUint(optarg, &size) || size == 0) {
+                fprintf(stderr, "invalid size %s\n", optarg);
+                return 2;
+            }
+            break;
+          case 'm':
+            if (!android::base::ParseUint(optarg, &mib) || mib == 0) {
+                fprintf(stderr, "invalid amount %s\n", optarg);
+                return 2;
+            }
+            break;
+          default:
+            printf("usage: %s [-s <bytes per call>] [-m <MiB per kernel>]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<uint8_t> old_data(size + 1);
+    std::vector<uint8_t> diff(size + 1);
+    for (size_t i = 0; i < old_data.size(); ++i) {
+        old_data[i] = rand();
+        diff[i] = rand();
+    }
+
+    // Unaligned, as the positions in a patch are arbitrary.
+    uint8_t* p = diff.data() + 1;
+    const uint8_t* old = old_data.data() + 1;
+    size_t calls = (static_cast<uint64_t>(mib) << 20) / size + 1;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < calls; ++i) {
+        AddBytesChecked(p, old, size, 0, size);
+    }
+    std::chrono::duration<double> checked = std::chrono::steady_clock::now() - start;
+    double checked_mibps = calls * size / 1048576.0 / checked.count();
+    printf("%-8s %9.1f MiB/s\n", "checked", checked_mibps);
+
+    for (const auto& kernel : GetAddBytesKernels()) {
+        start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < calls; ++i) {
+            kernel.fn(p, old, size);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        double mibps = calls * size / 1048576.0 / elapsed.count();
+        printf("%-8s %9.1f MiB/s  %5.1fx\n", kernel.name, mibps, mibps / checked_mibps);
+    }
+
+    // Keeps the additions from being optimized away.
+    unsigned sum = 0;
+    for (uint8_t b : diff) {
+        sum += b;
+    }
+    return sum == 0xffffffff;
+}
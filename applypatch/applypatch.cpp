@@ -32,6 +32,7 @@
 
 #include "openssl/sha.h"
 #include "applypatch.h"
+#include "bsdiff.h"
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
 #include "ota_io.h"
@@ -808,6 +809,9 @@ static int GenerateTarget(FileContents* source_file,
     bool use_bsdiff = false;
     if (header_bytes_read >= 8 && memcmp(header, "BSDIFF40", 8) == 0) {
         use_bsdiff = true;
+    } else if (header_bytes_read >= BSDFZ_MAGIC_LEN &&
+            memcmp(header, BSDFZ_MAGIC, BSDFZ_MAGIC_LEN) == 0) {
+        use_bsdiff = true;
     } else if (header_bytes_read >= 8 && memcmp(header, "IMGDIFF2", 8) == 0) {
         use_bsdiff = false;
     } else {
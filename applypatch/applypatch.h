@@ -19,6 +19,7 @@
 
 #include <sys/stat.h>
 
+#include <atomic>
 #include <vector>
 
 #include "openssl/sha.h"
@@ -67,6 +68,31 @@ int FindMatchingPatch(uint8_t* sha1, char* const * const patch_sha1_str,
 
 // bsdiff.cpp
 void ShowBSDiffLicense();
+
+// Accounts for memory held while applying a patch, on top of the source data,
+// for as long as the object is in scope.
+class ScopedPatchAlloc {
+  public:
+    explicit ScopedPatchAlloc(size_t size);
+    ~ScopedPatchAlloc();
+
+  private:
+    size_t size_;
+};
+
+// Returns the most memory accounted for at once by ScopedPatchAlloc on the
+// calling thread since the previous call. ApplyBSDiffPatch() only holds a
+// fixed-size output window, while ApplyBSDiffPatchMem() holds its whole
+// output. The deflate chunks of ApplyImagePatch() hold their expanded
+// source, and their compressed output until it is written when patched on
+// other threads; those are accounted for on the calling thread.
+size_t TakePatchPeakAlloc();
+
+// Has ScopedPatchAlloc also store the memory accounted for on the calling
+// thread in 'current', where other threads can read it while the patch is
+// being applied. nullptr stops it.
+void SharePatchAlloc(std::atomic<size_t>* current);
+
 int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
                      const Value* patch, ssize_t patch_offset,
                      SinkFn sink, void* token, SHA_CTX* ctx);
@@ -74,12 +100,30 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
                         const Value* patch, ssize_t patch_offset,
                         std::vector<unsigned char>* new_data);
 
+// Initializes the CRC32 table of xz-embedded, once per process, before
+// the first xz decoder is created on any thread. xz_crc32_init() itself
+// isn't safe to call while another thread decodes.
+void InitXzCrc32();
+
+// Has ApplyBSDiffPatch() decode the blocks of patches with at least
+// 'min_size' bytes of output ahead on a thread each, also on a single CPU
+// if 'one_cpu' is set. The default is 256 KiB, on more than one CPU only.
+void SetBSDiffPipeline(size_t min_size, bool one_cpu);
+
 // imgpatch.cpp
 int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                     const Value* patch,
                     SinkFn sink, void* token, SHA_CTX* ctx,
                     const Value* bonus_data);
 
+// Has ApplyImagePatch() patch the deflate chunks of a patch on up to
+// 'threads' threads, at most 'chunks' of them ahead of the chunk being
+// written out; the output and SHA_CTX still get the chunks in order. Each
+// chunk ahead holds its expanded source, a bsdiff output window and its
+// compressed output, so 'chunks' bounds the extra memory. The default of one thread
+// patches every chunk in turn on the calling thread.
+void SetImagePatchParallelism(int threads, int chunks);
+
 // freecache.cpp
 int MakeFreeSpaceOnCache(size_t bytes_needed);
 
@@ -55,6 +55,14 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <vector>
+
+#include <lzma.h>
+#include <zstd.h>
+
+#include "bsdiff.h"
+
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
 static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
@@ -210,6 +218,92 @@ static void offtout(off_t x,u_char *buf)
 	if(x<0) buf[7]|=0x80;
 }
 
+// Appends a control field to the bzip2 stream of a BSDIFF40 patch, or to
+// the control block of a BSDFZ patch when there is no stream.
+static void WriteCtrl(BZFILE* pfbz2, std::vector<u_char>* cb, off_t x)
+{
+	u_char buf[8];
+	int bz2err;
+
+	offtout(x, buf);
+	if (pfbz2 == NULL) {
+		cb->insert(cb->end(), buf, buf + 8);
+		return;
+	}
+	BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
+	if (bz2err != BZ_OK)
+		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+}
+
+// Compresses one block of a BSDFZ patch into 'out' and returns its codec.
+// zstd decodes several times faster than xz, so xz is only picked when it
+// makes the block at least 1/16 smaller than zstd does; a block that
+// neither makes smaller, like a short control block, is stored.
+static int CompressBlock(const u_char* data, off_t size, std::vector<u_char>* out)
+{
+	std::vector<u_char> zst(ZSTD_compressBound(size));
+	size_t zst_len = ZSTD_compress(zst.data(), zst.size(), data, size, 19);
+	if (ZSTD_isError(zst_len))
+		errx(1, "ZSTD_compress: %s", ZSTD_getErrorName(zst_len));
+	zst.resize(zst_len);
+
+	// The xz decoder of bspatch allocates the whole dictionary a stream
+	// asks for, so it is no larger than the block.
+	lzma_options_lzma opt;
+	if (lzma_lzma_preset(&opt, 9))
+		errx(1, "lzma_lzma_preset");
+	opt.dict_size = std::max<off_t>(std::min<off_t>(opt.dict_size, size), LZMA_DICT_SIZE_MIN);
+	lzma_filter filters[] = {
+		{ LZMA_FILTER_LZMA2, &opt },
+		{ LZMA_VLI_UNKNOWN, NULL },
+	};
+	std::vector<u_char> xz(lzma_stream_buffer_bound(size));
+	size_t xz_len = 0;
+	lzma_ret ret = lzma_stream_buffer_encode(filters, LZMA_CHECK_CRC32, NULL, data, size,
+	                                         xz.data(), &xz_len, xz.size());
+	if (ret != LZMA_OK)
+		errx(1, "lzma_stream_buffer_encode, ret = %d", ret);
+	xz.resize(xz_len);
+
+	int codec = BSDFZ_CODEC_ZSTD;
+	out->swap(zst);
+	if (xz.size() <= out->size() - out->size() / 16) {
+		codec = BSDFZ_CODEC_XZ;
+		out->swap(xz);
+	}
+	if (out->size() >= static_cast<size_t>(size)) {
+		codec = BSDFZ_CODEC_NONE;
+		out->assign(data, data + size);
+	}
+	return codec;
+}
+
+// Writes the header and the blocks of a BSDFZ patch; see bsdiff.h.
+static void WriteBsdfzBlocks(FILE* pf, const char* patch_filename, off_t newsize,
+                             const u_char* cb, off_t cblen, const u_char* db, off_t dblen,
+                             const u_char* eb, off_t eblen)
+{
+	std::vector<u_char> blocks[3];
+	u_char header[BSDFZ_HEADER_LEN];
+
+	memcpy(header, BSDFZ_MAGIC, BSDFZ_MAGIC_LEN);
+	header[5] = CompressBlock(cb, cblen, &blocks[0]);
+	header[6] = CompressBlock(db, dblen, &blocks[1]);
+	header[7] = CompressBlock(eb, eblen, &blocks[2]);
+	offtout(blocks[0].size(), header + 8);
+	offtout(blocks[1].size(), header + 16);
+	offtout(newsize, header + 24);
+	offtout(blocks[2].size(), header + 32);
+
+	if (fwrite(header, BSDFZ_HEADER_LEN, 1, pf) != 1)
+		err(1, "fwrite(%s)", patch_filename);
+	for (int i = 0; i < 3; i++) {
+		if (!blocks[i].empty() &&
+		    fwrite(blocks[i].data(), blocks[i].size(), 1, pf) != 1)
+			err(1, "fwrite(%s)", patch_filename);
+	}
+}
+
 // This is main() from bsdiff.c, with the following changes:
 //
 //    - old, oldsize, newdata, newsize are arguments; we don't load this
@@ -221,8 +315,11 @@ static void offtout(off_t x,u_char *buf)
 //      bsdiff() multiple times with the same 'old' data, we only do
 //      the qsufsort() step the first time.
 //
+//    - with 'bsdfz' set, the blocks are written in the BSDFZ container
+//      of bsdiff.h rather than as BSDIFF40.
+//
 int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* newdata, off_t newsize,
-           const char* patch_filename)
+           const char* patch_filename, bool bsdfz)
 {
 	int fd;
 	off_t *I;
@@ -234,11 +331,11 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* newdata, off_t newsiz
 	off_t i;
 	off_t dblen,eblen;
 	u_char *db,*eb;
-	u_char buf[8];
 	u_char header[32];
 	FILE * pf;
-	BZFILE * pfbz2;
-	int bz2err;
+	BZFILE * pfbz2 = NULL;
+	int bz2err = BZ_OK;
+	std::vector<u_char> cb;
 
         if (*IP == NULL) {
             off_t* V;
@@ -268,15 +365,19 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* newdata, off_t newsiz
 		32	??	Bzip2ed ctrl block
 		??	??	Bzip2ed diff block
 		??	??	Bzip2ed extra block */
-	memcpy(header,"BSDIFF40",8);
-	offtout(0, header + 8);
-	offtout(0, header + 16);
-	offtout(newsize, header + 24);
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", patch_filename);
-
-	/* Compute the differences, writing ctrl as we go */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
+	/* BSDFZ patches are written once all blocks are known; see bsdiff.h */
+	if (!bsdfz) {
+		memcpy(header,"BSDIFF40",8);
+		offtout(0, header + 8);
+		offtout(0, header + 16);
+		offtout(newsize, header + 24);
+		if (fwrite(header, 32, 1, pf) != 1)
+			err(1, "fwrite(%s)", patch_filename);
+	}
+
+	/* Compute the differences, writing ctrl as we go (or keeping it, for
+	   BSDFZ) */
+	if (!bsdfz && (pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
 		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
 	scan=0;len=0;
 	lastscan=0;lastpos=0;lastoffset=0;
@@ -340,65 +441,59 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* newdata, off_t newsiz
 			dblen+=lenf;
 			eblen+=(scan-lenb)-(lastscan+lenf);
 
-			offtout(lenf,buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((scan-lenb)-(lastscan+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((pos-lenb)-(lastpos+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+			WriteCtrl(pfbz2, &cb, lenf);
+			WriteCtrl(pfbz2, &cb, (scan-lenb)-(lastscan+lenf));
+			WriteCtrl(pfbz2, &cb, (pos-lenb)-(lastpos+lenf));
 
 			lastscan=scan-lenb;
 			lastpos=pos-lenb;
 			lastoffset=pos-scan;
 		};
 	};
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Compute size of compressed ctrl data */
-	if ((len = ftello(pf)) == -1)
-		err(1, "ftello");
-	offtout(len-32, header + 8);
-
-	/* Write compressed diff data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Compute size of compressed diff data */
-	if ((newsize = ftello(pf)) == -1)
-		err(1, "ftello");
-	offtout(newsize - len, header + 16);
-
-	/* Write compressed extra data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Seek to the beginning, write the header, and close the file */
-	if (fseeko(pf, 0, SEEK_SET))
-		err(1, "fseeko");
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", patch_filename);
+	if (bsdfz) {
+		WriteBsdfzBlocks(pf, patch_filename, newsize, cb.data(), cb.size(),
+		                 db, dblen, eb, eblen);
+	} else {
+		BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
+		if (bz2err != BZ_OK)
+			errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+
+		/* Compute size of compressed ctrl data */
+		if ((len = ftello(pf)) == -1)
+			err(1, "ftello");
+		offtout(len-32, header + 8);
+
+		/* Write compressed diff data */
+		if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
+			errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
+		BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
+		if (bz2err != BZ_OK)
+			errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+		BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
+		if (bz2err != BZ_OK)
+			errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+
+		/* Compute size of compressed diff data */
+		if ((newsize = ftello(pf)) == -1)
+			err(1, "ftello");
+		offtout(newsize - len, header + 16);
+
+		/* Write compressed extra data */
+		if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
+			errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
+		BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
+		if (bz2err != BZ_OK)
+			errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+		BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
+		if (bz2err != BZ_OK)
+			errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
+
+		/* Seek to the beginning, write the header, and close the file */
+		if (fseeko(pf, 0, SEEK_SET))
+			err(1, "fseeko");
+		if (fwrite(header, 32, 1, pf) != 1)
+			err(1, "fwrite(%s)", patch_filename);
+	}
 	if (fclose(pf))
 		err(1, "fclose");
 
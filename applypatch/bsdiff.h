@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _APPLYPATCH_BSDIFF_H
+#define _APPLYPATCH_BSDIFF_H
+
+#include <sys/types.h>
+
+// bsdiff patches come in two containers, which hold the same control, diff
+// and extra blocks and differ in how those are compressed.
+//
+// BSDIFF40, the format of bsdiff-4.3, has all three compressed with bzip2:
+//   0       8       "BSDIFF40"
+//   8       8       X
+//   16      8       Y
+//   24      8       sizeof(newfile)
+//   32      X       bzip2(control block)
+//   32+X    Y       bzip2(diff block)
+//   32+X+Y  ???     bzip2(extra block)
+//
+// BSDFZ names the codec of each block in the magic, so a block can use
+// whichever of them suits its data, and stores the length of the extra block
+// since a stored block has no end of its own:
+//   0       5       "BSDFZ"
+//   5       1       codec of the control block
+//   6       1       codec of the diff block
+//   7       1       codec of the extra block
+//   8       8       X
+//   16      8       Y
+//   24      8       sizeof(newfile)
+//   32      8       Z
+//   40      X       control block
+//   40+X    Y       diff block
+//   40+X+Y  Z       extra block
+//
+// zstd and xz blocks are a single frame or stream each. The integers are
+// encoded like in BSDIFF40.
+
+#define BSDFZ_MAGIC         "BSDFZ"
+#define BSDFZ_MAGIC_LEN     5
+#define BSDFZ_HEADER_LEN    40
+
+#define BSDFZ_CODEC_NONE    0
+#define BSDFZ_CODEC_BZIP2   1
+#define BSDFZ_CODEC_ZSTD    2
+#define BSDFZ_CODEC_XZ      3
+
+// Writes a patch from old to newdata to patch_filename, in the BSDFZ
+// container if 'bsdfz' is set and in BSDIFF40 otherwise; see bsdiff.cpp.
+int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* newdata, off_t newsize,
+           const char* patch_filename, bool bsdfz = false);
+
+#endif  // _APPLYPATCH_BSDIFF_H
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Makes a patch from <old> to <new> in each of the containers of bsdiff.h,
+// and reports its size and how fast ApplyBSDiffPatchMem() applies it:
+//
+//    bsdiff_bench [-n <runs>] <old> <new>
+//
+// The time is the best of <runs> (10 by default), and the rate is in bytes
+// of <new> per second.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+
+#include "applypatch.h"
+#include "bsdiff.h"
+
+static const char* CodecName(int codec) {
+    switch (codec) {
+      case BSDFZ_CODEC_NONE: return "none";
+      case BSDFZ_CODEC_BZIP2: return "bzip2";
+      case BSDFZ_CODEC_ZSTD: return "zstd";
+      case BSDFZ_CODEC_XZ: return "xz";
+    }
+    return "?";
+}
+
+int main(int argc, char** argv) {
+    size_t runs = 10;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+          case 'n':
+            if (!android::base::ParseUint(optarg, &runs) || runs == 0) {
+                fprintf(stderr, "invalid number of runs %s\n", optarg);
+                return 2;
+            }
+            break;
+          default:
+            printf("usage: %s [-n <runs>] <old> <new>\n", argv[0]);
+            return 2;
+        }
+    }
+    if (argc - optind != 2) {
+        printf("usage: %s [-n <runs>] <old> <new>\n", argv[0]);
+        return 2;
+    }
+
+    std::string old_data, new_data;
+    if (!android::base::ReadFileToString(argv[optind], &old_data) ||
+            !android::base::ReadFileToString(argv[optind + 1], &new_data)) {
+        fprintf(stderr, "failed to read %s or %s\n", argv[optind], argv[optind + 1]);
+        return 1;
+    }
+
+    char patch_filename[] = "/tmp/bsdiff_bench-XXXXXX";
+    int fd = mkstemp(patch_filename);
+    if (fd == -1) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    off_t* I = nullptr;
+    for (bool bsdfz : { false, true }) {
+        bsdiff(reinterpret_cast<u_char*>(&old_data[0]), old_data.size(), &I,
+               reinterpret_cast<u_char*>(&new_data[0]), new_data.size(), patch_filename, bsdfz);
+        std::string patch_data;
+        if (!android::base::ReadFileToString(patch_filename, &patch_data)) {
+            fprintf(stderr, "failed to read %s\n", patch_filename);
+            return 1;
+        }
+
+        std::string codecs = "bzip2/bzip2/bzip2";
+        if (bsdfz) {
+            codecs = std::string(CodecName(patch_data[5])) + "/" + CodecName(patch_data[6]) +
+                     "/" + CodecName(patch_data[7]);
+        }
+
+        Value patch = { VAL_BLOB, static_cast<ssize_t>(patch_data.size()), &patch_data[0] };
+        std::vector<unsigned char> result;
+        std::chrono::duration<double> best = std::chrono::duration<double>::max();
+        for (size_t i = 0; i < runs; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            if (ApplyBSDiffPatchMem(reinterpret_cast<const unsigned char*>(old_data.data()),
+                                    old_data.size(), &patch, 0, &result) != 0) {
+                fprintf(stderr, "failed to apply the %s patch\n", bsdfz ? "BSDFZ" : "BSDIFF40");
+                return 1;
+            }
+            best = std::min<std::chrono::duration<double>>(
+                    best, std::chrono::steady_clock::now() - start);
+        }
+        if (result.size() != new_data.size() ||
+                memcmp(result.data(), new_data.data(), result.size()) != 0) {
+            fprintf(stderr, "the %s patch doesn't produce %s\n", bsdfz ? "BSDFZ" : "BSDIFF40",
+                    argv[optind + 1]);
+            return 1;
+        }
+
+        printf("%-8s %-17s %10zu bytes  %8.3f ms  %8.1f MiB/s\n",
+               bsdfz ? "BSDFZ" : "BSDIFF40", codecs.c_str(), patch_data.size(),
+               best.count() * 1000, new_data.size() / 1048576.0 / best.count());
+    }
+
+    unlink(patch_filename);
+    free(I);
+    return 0;
+}
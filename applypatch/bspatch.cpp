@@ -20,6 +20,8 @@
 // applypatch with the -l option will display the bsdiff license
 // notice.
 
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -27,10 +29,18 @@
 #include <unistd.h>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
 #include <bzlib.h>
+#include <xz.h>
+#include <zstd.h>
 
 #include "openssl/sha.h"
+#include "add_bytes.h"
 #include "applypatch.h"
+#include "bsdiff.h"
 
 void ShowBSDiffLicense() {
     puts("The bsdiff library used herein is:\n"
@@ -82,112 +92,614 @@ static off_t offtin(u_char *buf)
     return y;
 }
 
-int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
-    stream->next_out = (char*)buffer;
-    stream->avail_out = size;
-    while (stream->avail_out > 0) {
-        int bzerr = BZ2_bzDecompress(stream);
-        if (bzerr != BZ_OK && bzerr != BZ_STREAM_END) {
-            printf("bz error %d decompressing\n", bzerr);
+// Memory held for patch output on this thread, and the most held at once
+// since the last call to TakePatchPeakAlloc().
+static thread_local size_t patch_alloc = 0;
+static thread_local size_t patch_peak_alloc = 0;
+static thread_local std::atomic<size_t>* patch_alloc_shared = nullptr;
+
+ScopedPatchAlloc::ScopedPatchAlloc(size_t size) : size_(size) {
+    patch_alloc += size_;
+    if (patch_alloc > patch_peak_alloc) {
+        patch_peak_alloc = patch_alloc;
+    }
+    if (patch_alloc_shared != nullptr) {
+        *patch_alloc_shared = patch_alloc;
+    }
+}
+
+ScopedPatchAlloc::~ScopedPatchAlloc() {
+    patch_alloc -= size_;
+    if (patch_alloc_shared != nullptr) {
+        *patch_alloc_shared = patch_alloc;
+    }
+}
+
+void SharePatchAlloc(std::atomic<size_t>* current) {
+    patch_alloc_shared = current;
+    if (current != nullptr) {
+        *current = patch_alloc;
+    }
+}
+
+size_t TakePatchPeakAlloc() {
+    size_t peak = patch_peak_alloc;
+    patch_peak_alloc = patch_alloc;
+    return peak;
+}
+
+// Output is assembled in a window of this many bytes and handed to the sink
+// whenever the window fills up, rather than after the whole target has been
+// built.
+#define BSPATCH_WINDOW (1 << 20)
+
+struct PatchOutput {
+    SinkFn sink;
+    void* token;
+    SHA_CTX* ctx;
+    std::vector<unsigned char> window;
+    size_t fill;
+};
+
+// Patches of at least this many bytes of output have their control, diff
+// and extra streams decoded ahead on a thread each, into a ring of
+// BSPATCH_RING bytes per stream, while the calling thread only assembles the
+// output. Smaller patches, and all patches on a single CPU, are decoded on
+// demand, where starting the threads would cost more than it saves.
+#define BSPATCH_PIPELINE_MIN (256 << 10)
+#define BSPATCH_RING (256 << 10)
+#define BSPATCH_DECODE_CHUNK (64 << 10)
+
+// Patches with at least 'bspatch_pipeline_min' bytes of output are decoded
+// ahead, on a single CPU too if 'bspatch_pipeline_one_cpu' is set; see
+// SetBSDiffPipeline().
+static ssize_t bspatch_pipeline_min = BSPATCH_PIPELINE_MIN;
+static bool bspatch_pipeline_one_cpu = false;
+
+void SetBSDiffPipeline(size_t min_size, bool one_cpu) {
+    bspatch_pipeline_min = std::min<size_t>(min_size, SSIZE_MAX);
+    bspatch_pipeline_one_cpu = one_cpu;
+}
+
+// The zstd and xz blocks of BSDFZ patches may use windows and dictionaries
+// up to this large; bsdiff.cpp keeps them within the size of the block.
+#define BSPATCH_DECODER_MEM (64 << 20)
+
+// Returns the memory the decoder of a zstd or xz block with up to 'size'
+// bytes of output may take for its window or dictionary. As bsdiff.cpp keeps
+// them within the size of the block, twice that covers the rounding up of
+// the size in the headers.
+static size_t PatchDecoderMem(uint64_t size) {
+    return std::min<uint64_t>(std::max<uint64_t>(size * 2, 4096), BSPATCH_DECODER_MEM);
+}
+
+// Returns the window or dictionary size that the first frame or block of
+// the zstd or xz block at 'data' asks for, which is what its decoder
+// allocates, or 'limit' if that's larger or can't be told from the header.
+static size_t DeclaredDecoderMem(int codec, const unsigned char* data, size_t size,
+        size_t limit) {
+    uint64_t declared = limit;
+    if (codec == BSDFZ_CODEC_ZSTD && size >= 14 && data[0] == 0x28 && data[1] == 0xb5 &&
+            data[2] == 0x2f && data[3] == 0xfd) {
+        // Frame header descriptor, then the window descriptor unless the
+        // frame is a single segment, whose window is the content size.
+        unsigned char fhd = data[4];
+        if (fhd & 0x20) {
+            static const size_t kDictIdSize[4] = { 0, 1, 2, 4 };
+            static const size_t kContentSizeSize[4] = { 1, 2, 4, 8 };
+            const unsigned char* p = data + 5 + kDictIdSize[fhd & 3];
+            size_t len = kContentSizeSize[fhd >> 6];
+            declared = 0;
+            for (size_t i = len; i > 0; --i) {
+                declared = (declared << 8) | p[i - 1];
+            }
+            if (len == 2) {
+                declared += 256;
+            }
+        } else {
+            uint64_t base = static_cast<uint64_t>(1) << (10 + (data[5] >> 3));
+            declared = base + base / 8 * (data[5] & 7);
+        }
+    } else if (codec == BSDFZ_CODEC_XZ && size >= 12 + 2) {
+        // The stream header, then the header of the first block, with the
+        // LZMA2 filter that bsdiff.cpp writes after the optional sizes.
+        const unsigned char* p = data + 12;
+        size_t header_size = (p[0] + 1) * 4;
+        if (p[0] != 0 && size >= 12 + header_size && (p[1] & 0x03) == 0) {
+            size_t pos = 2;
+            for (int flag = 0x40; flag <= 0x80; flag <<= 1) {
+                if (p[1] & flag) {
+                    while (pos < header_size && (p[pos] & 0x80)) {
+                        ++pos;
+                    }
+                    ++pos;
+                }
+            }
+            if (pos + 3 <= header_size && p[pos] == 0x21 && p[pos + 1] == 1 &&
+                    p[pos + 2] <= 40) {
+                declared = static_cast<uint64_t>(2 | (p[pos + 2] & 1)) << (p[pos + 2] / 2 + 11);
+            }
+        }
+    }
+    return std::min<uint64_t>(declared, limit);
+}
+
+static pthread_once_t xz_crc32_once = PTHREAD_ONCE_INIT;
+
+void InitXzCrc32() {
+    pthread_once(&xz_crc32_once, xz_crc32_init);
+}
+
+// A ring has a single producer, the decoder thread, and a single consumer,
+// the thread applying the patch, like the new data ring of blockimg.cpp. The
+// positions are atomic counts of the bytes decoded and read, so no lock is
+// taken while data flows; the mutex and condition only put a thread to
+// sleep while the ring is empty, or has less than BSPATCH_DECODE_CHUNK
+// bytes free, and wake it up again.
+
+struct PatchStream {
+    const char* name;
+    int codec;                          // BSDFZ_CODEC_*
+    bz_stream bz;
+    ZSTD_DCtx* zstd;
+    ZSTD_inBuffer zstd_in;
+    struct xz_dec* xz;
+    struct xz_buf xz_buf;
+    const unsigned char* in;            // a stored block
+    size_t in_size;
+    size_t in_pos;
+    bool initialized;
+    bool threaded;
+
+    pthread_t thread;
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+    std::vector<unsigned char> ring;
+    std::atomic<size_t> produced;
+    std::atomic<size_t> consumed;
+    std::atomic<bool> producer_waiting;
+    std::atomic<bool> consumer_waiting;
+    std::atomic<bool> done;             // no more data will be produced
+    bool failed;                        // because of an error, reported
+    std::atomic<bool> abort;
+};
+
+static void WakePatchStream(PatchStream* ps) {
+    pthread_mutex_lock(&ps->mu);
+    pthread_cond_broadcast(&ps->cv);
+    pthread_mutex_unlock(&ps->mu);
+}
+
+// Decodes up to 'size' bytes of the stream into 'out', and sets '*decoded'
+// to how many. Returns 1 at the end of the stream, -1 if it's corrupt or
+// truncated, and 0 otherwise.
+static int DecodePatchData(PatchStream& ps, unsigned char* out, size_t size, size_t* decoded) {
+    *decoded = 0;
+    switch (ps.codec) {
+      case BSDFZ_CODEC_NONE: {
+        size_t len = std::min(size, ps.in_size - ps.in_pos);
+        memcpy(out, ps.in + ps.in_pos, len);
+        ps.in_pos += len;
+        *decoded = len;
+        return ps.in_pos == ps.in_size ? 1 : 0;
+      }
+
+      case BSDFZ_CODEC_BZIP2: {
+        ps.bz.next_out = reinterpret_cast<char*>(out);
+        ps.bz.avail_out = size;
+        int bzerr = BZ2_bzDecompress(&ps.bz);
+        *decoded = size - ps.bz.avail_out;
+        if (bzerr == BZ_STREAM_END) {
+            return 1;
+        }
+        if (bzerr != BZ_OK) {
+            printf("bz error %d decompressing %s stream\n", bzerr, ps.name);
             return -1;
         }
-        if (stream->avail_out > 0) {
-            printf("need %d more bytes\n", stream->avail_out);
+        if (*decoded == 0 && ps.bz.avail_in == 0) {
+            printf("%s stream is truncated\n", ps.name);
+            return -1;
+        }
+        return 0;
+      }
+
+      case BSDFZ_CODEC_ZSTD: {
+        ZSTD_outBuffer output = { out, size, 0 };
+        size_t ret = ZSTD_decompressStream(ps.zstd, &output, &ps.zstd_in);
+        *decoded = output.pos;
+        if (ZSTD_isError(ret)) {
+            printf("zstd error decompressing %s stream: %s\n", ps.name, ZSTD_getErrorName(ret));
+            return -1;
+        }
+        if (ret == 0) {
+            return 1;
+        }
+        if (*decoded == 0 && ps.zstd_in.pos == ps.zstd_in.size) {
+            printf("%s stream is truncated\n", ps.name);
+            return -1;
+        }
+        return 0;
+      }
+
+      case BSDFZ_CODEC_XZ: {
+        ps.xz_buf.out = out;
+        ps.xz_buf.out_pos = 0;
+        ps.xz_buf.out_size = size;
+        enum xz_ret ret = xz_dec_run(ps.xz, &ps.xz_buf);
+        *decoded = ps.xz_buf.out_pos;
+        if (ret == XZ_STREAM_END) {
+            return 1;
         }
+        if (ret != XZ_OK) {
+            // bsdiff.cpp writes CRC32 checks, the only ones xz-embedded
+            // verifies.
+            printf("xz error %d decompressing %s stream%s\n", ret, ps.name,
+                   ret == XZ_MEMLIMIT_ERROR ? " (dictionary too large)" :
+                   ret == XZ_UNSUPPORTED_CHECK ? " (unsupported check)" : "");
+            return -1;
+        }
+        return 0;
+      }
     }
-    return 0;
+    return -1;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
+static void* DecodePatchStream(void* cookie) {
+    PatchStream* ps = reinterpret_cast<PatchStream*>(cookie);
+    size_t capacity = ps->ring.size();
+    size_t chunk = std::min<size_t>(capacity, BSPATCH_DECODE_CHUNK);
+    int status = 0;
+
+    while (status == 0) {
+        size_t produced = ps->produced.load(std::memory_order_relaxed);
+        if (capacity - (produced - ps->consumed) < chunk) {
+            pthread_mutex_lock(&ps->mu);
+            ps->producer_waiting = true;
+            while (!ps->abort && capacity - (produced - ps->consumed) < chunk) {
+                pthread_cond_wait(&ps->cv, &ps->mu);
+            }
+            ps->producer_waiting = false;
+            pthread_mutex_unlock(&ps->mu);
+            if (ps->abort) {
+                return nullptr;
+            }
+        }
 
-    std::vector<unsigned char> new_data;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset, &new_data) != 0) {
+        // The free part of the ring is only written here.
+        size_t pos = produced % capacity;
+        size_t space = std::min(capacity - (produced - ps->consumed), capacity - pos);
+        size_t decoded;
+        status = DecodePatchData(*ps, ps->ring.data() + pos, std::min(space, chunk), &decoded);
+
+        ps->produced = produced + decoded;
+        if (status != 0) {
+            ps->failed = status < 0;
+            ps->done = true;
+        }
+        if (ps->consumer_waiting) {
+            WakePatchStream(ps);
+        }
+    }
+
+    return nullptr;
+}
+
+// Opens a block of 'size' bytes at 'data', whose zstd or xz decoder may
+// use up to 'decoder_mem' bytes for its window or dictionary.
+static int OpenPatchStream(PatchStream& ps, const char* name, int codec,
+        const unsigned char* data, size_t size, size_t decoder_mem, bool threaded) {
+    ps.name = name;
+    ps.codec = codec;
+    switch (codec) {
+      case BSDFZ_CODEC_NONE:
+        ps.in = data;
+        ps.in_size = size;
+        ps.in_pos = 0;
+        break;
+
+      case BSDFZ_CODEC_BZIP2: {
+        ps.bz.next_in = const_cast<char*>(reinterpret_cast<const char*>(data));
+        ps.bz.avail_in = size;
+        ps.bz.bzalloc = NULL;
+        ps.bz.bzfree = NULL;
+        ps.bz.opaque = NULL;
+        int bzerr = BZ2_bzDecompressInit(&ps.bz, 0, 0);
+        if (bzerr != BZ_OK) {
+            printf("failed to bzinit %s stream (%d)\n", name, bzerr);
+            return -1;
+        }
+        break;
+      }
+
+      case BSDFZ_CODEC_ZSTD: {
+        ps.zstd = ZSTD_createDCtx();
+        if (ps.zstd == nullptr) {
+            printf("failed to create zstd decoder of %s stream\n", name);
+            return -1;
+        }
+        ZSTD_bounds bounds = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax);
+        int window_log = bounds.lowerBound;
+        while (window_log < bounds.upperBound &&
+                (static_cast<size_t>(1) << (window_log + 1)) <= decoder_mem) {
+            ++window_log;
+        }
+        ZSTD_DCtx_setParameter(ps.zstd, ZSTD_d_windowLogMax, window_log);
+        ps.zstd_in = { data, size, 0 };
+        break;
+      }
+
+      case BSDFZ_CODEC_XZ:
+        InitXzCrc32();
+        ps.xz = xz_dec_init(XZ_DYNALLOC, decoder_mem);
+        if (ps.xz == nullptr) {
+            printf("failed to create xz decoder of %s stream\n", name);
+            return -1;
+        }
+        ps.xz_buf.in = data;
+        ps.xz_buf.in_pos = 0;
+        ps.xz_buf.in_size = size;
+        break;
+
+      default:
+        printf("unknown codec %d of %s stream\n", codec, name);
         return -1;
     }
+    ps.initialized = true;
 
-    if (sink(new_data.data(), new_data.size(), token) < static_cast<ssize_t>(new_data.size())) {
+    // A stored block needs no decoding ahead.
+    if (!threaded || codec == BSDFZ_CODEC_NONE) {
+        return 0;
+    }
+
+    ps.ring.resize(BSPATCH_RING);
+    pthread_mutex_init(&ps.mu, nullptr);
+    pthread_cond_init(&ps.cv, nullptr);
+
+    int error = pthread_create(&ps.thread, nullptr, DecodePatchStream, &ps);
+    if (error != 0) {
+        // Decode it on demand instead.
+        printf("failed to start decoder of %s stream: %s\n", name, strerror(error));
+        pthread_cond_destroy(&ps.cv);
+        pthread_mutex_destroy(&ps.mu);
+        std::vector<unsigned char>().swap(ps.ring);
+        return 0;
+    }
+    ps.threaded = true;
+    return 0;
+}
+
+static void ClosePatchStream(PatchStream& ps) {
+    if (ps.threaded) {
+        ps.abort = true;
+        WakePatchStream(&ps);
+        pthread_join(ps.thread, nullptr);
+        pthread_cond_destroy(&ps.cv);
+        pthread_mutex_destroy(&ps.mu);
+        ps.threaded = false;
+    }
+    if (ps.initialized) {
+        if (ps.codec == BSDFZ_CODEC_BZIP2) {
+            BZ2_bzDecompressEnd(&ps.bz);
+        } else if (ps.codec == BSDFZ_CODEC_ZSTD) {
+            ZSTD_freeDCtx(ps.zstd);
+        } else if (ps.codec == BSDFZ_CODEC_XZ) {
+            xz_dec_end(ps.xz);
+        }
+        ps.initialized = false;
+    }
+}
+
+static int ReadPatchStream(PatchStream& ps, unsigned char* buffer, size_t size) {
+    if (!ps.threaded) {
+        while (size > 0) {
+            if (ps.done) {
+                if (!ps.failed) {
+                    printf("need %zu more bytes of %s stream\n", size, ps.name);
+                }
+                return -1;
+            }
+            size_t decoded;
+            int status = DecodePatchData(ps, buffer, size, &decoded);
+            if (status != 0) {
+                ps.failed = status < 0;
+                ps.done = true;
+            }
+            buffer += decoded;
+            size -= decoded;
+        }
+        return 0;
+    }
+
+    size_t capacity = ps.ring.size();
+    size_t chunk = std::min<size_t>(capacity, BSPATCH_DECODE_CHUNK);
+    while (size > 0) {
+        size_t consumed = ps.consumed.load(std::memory_order_relaxed);
+        size_t available = ps.produced - consumed;
+
+        if (available == 0) {
+            if (ps.done) {
+                // The last data may have been produced with 'done'.
+                if (ps.produced != consumed) {
+                    continue;
+                }
+                if (!ps.failed) {
+                    printf("need %zu more bytes of %s stream\n", size, ps.name);
+                }
+                return -1;
+            }
+
+            pthread_mutex_lock(&ps.mu);
+            ps.consumer_waiting = true;
+            while (ps.produced == consumed && !ps.done) {
+                pthread_cond_wait(&ps.cv, &ps.mu);
+            }
+            ps.consumer_waiting = false;
+            pthread_mutex_unlock(&ps.mu);
+            continue;
+        }
+
+        size_t pos = consumed % capacity;
+        size_t len = std::min(std::min(available, capacity - pos), size);
+        memcpy(buffer, ps.ring.data() + pos, len);
+        buffer += len;
+        size -= len;
+
+        ps.consumed = consumed + len;
+        if (ps.producer_waiting && capacity - (ps.produced - (consumed + len)) >= chunk) {
+            WakePatchStream(&ps);
+        }
+    }
+    return 0;
+}
+
+// Closes the streams of a patch however ApplyBSDiffPatch() returns.
+class ScopedPatchStreams {
+  public:
+    ScopedPatchStreams(PatchStream* streams, size_t count)
+        : streams_(streams), count_(count) {}
+    ~ScopedPatchStreams() {
+        for (size_t i = 0; i < count_; ++i) {
+            ClosePatchStream(streams_[i]);
+        }
+    }
+
+  private:
+    PatchStream* streams_;
+    size_t count_;
+};
+
+static int FlushOutput(PatchOutput& out) {
+    if (out.fill == 0) {
+        return 0;
+    }
+    ssize_t size = out.fill;
+    if (out.sink(out.window.data(), size, out.token) < size) {
         printf("short write of output: %d (%s)\n", errno, strerror(errno));
         return 1;
     }
-    if (ctx) SHA1_Update(ctx, new_data.data(), new_data.size());
+    if (out.ctx) SHA1_Update(out.ctx, out.window.data(), size);
+    out.fill = 0;
     return 0;
 }
 
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        std::vector<unsigned char>* new_data) {
-    // Patch data format:
-    //   0       8       "BSDIFF40"
-    //   8       8       X
-    //   16      8       Y
-    //   24      8       sizeof(newfile)
-    //   32      X       bzip2(control block)
-    //   32+X    Y       bzip2(diff block)
-    //   32+X+Y  ???     bzip2(extra block)
-    // with control block a set of triples (x,y,z) meaning "add x bytes
-    // from oldfile to x bytes from the diff block; copy y bytes from the
-    // extra block; seek forwards in oldfile by z bytes".
-
+struct BSDiffHeader {
+    size_t len;
+    int codecs[3];                      // of the control, diff and extra blocks
+    ssize_t ctrl_len;
+    ssize_t data_len;
+    ssize_t extra_len;
+    ssize_t new_size;
+};
+
+// Reads the header of a BSDIFF40 or BSDFZ patch (see bsdiff.h), and checks
+// that the blocks it describes are within the patch.
+static int ReadBSDiffHeader(const Value* patch, ssize_t patch_offset, BSDiffHeader* h) {
     unsigned char* header = (unsigned char*) patch->data + patch_offset;
-    if (memcmp(header, "BSDIFF40", 8) != 0) {
+    ssize_t patch_len = patch->size - patch_offset;
+    if (patch_len >= 32 && memcmp(header, "BSDIFF40", 8) == 0) {
+        h->len = 32;
+        h->codecs[0] = h->codecs[1] = h->codecs[2] = BSDFZ_CODEC_BZIP2;
+    } else if (patch_len >= BSDFZ_HEADER_LEN &&
+            memcmp(header, BSDFZ_MAGIC, BSDFZ_MAGIC_LEN) == 0) {
+        h->len = BSDFZ_HEADER_LEN;
+        h->codecs[0] = header[5];
+        h->codecs[1] = header[6];
+        h->codecs[2] = header[7];
+    } else {
         printf("corrupt bsdiff patch file header (magic number)\n");
         return 1;
     }
 
-    ssize_t ctrl_len, data_len, new_size;
-    ctrl_len = offtin(header+8);
-    data_len = offtin(header+16);
-    new_size = offtin(header+24);
+    h->ctrl_len = offtin(header+8);
+    h->data_len = offtin(header+16);
+    h->new_size = offtin(header+24);
 
-    if (ctrl_len < 0 || data_len < 0 || new_size < 0) {
+    // BSDIFF40 has the extra block run to the end of the patch.
+    ssize_t streams_len = patch_len - h->len;
+    h->extra_len = (h->len == 32) ? streams_len - h->ctrl_len - h->data_len : offtin(header+32);
+    if (h->ctrl_len < 0 || h->data_len < 0 || h->new_size < 0 || h->extra_len < 0 ||
+            h->ctrl_len > streams_len || h->data_len > streams_len - h->ctrl_len ||
+            h->extra_len > streams_len - h->ctrl_len - h->data_len) {
         printf("corrupt patch file header (data lengths)\n");
         return 1;
     }
+    return 0;
+}
 
-    int bzerr;
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, SHA_CTX* ctx) {
+    // Patch data format: see bsdiff.h. The control block is a set of
+    // triples (x,y,z) meaning "add x bytes from oldfile to x bytes from the
+    // diff block; copy y bytes from the extra block; seek forwards in
+    // oldfile by z bytes".
 
-    bz_stream cstream;
-    cstream.next_in = patch->data + patch_offset + 32;
-    cstream.avail_in = ctrl_len;
-    cstream.bzalloc = NULL;
-    cstream.bzfree = NULL;
-    cstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&cstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit control stream (%d)\n", bzerr);
+    BSDiffHeader h;
+    if (ReadBSDiffHeader(patch, patch_offset, &h) != 0) {
+        return 1;
     }
-
-    bz_stream dstream;
-    dstream.next_in = patch->data + patch_offset + 32 + ctrl_len;
-    dstream.avail_in = data_len;
-    dstream.bzalloc = NULL;
-    dstream.bzfree = NULL;
-    dstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&dstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit diff stream (%d)\n", bzerr);
+    ssize_t new_size = h.new_size;
+
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(patch->data) +
+                                patch_offset + h.len;
+    static const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    bool threaded = new_size >= bspatch_pipeline_min && (cpus > 1 || bspatch_pipeline_one_cpu);
+
+    // The diff and extra blocks hold at most the output. bsdiff.cpp writes
+    // controls that each move the output ahead, so at most one per byte.
+    size_t decoder_mem[3] = {
+        PatchDecoderMem(static_cast<uint64_t>(new_size) * 24),
+        PatchDecoderMem(new_size),
+        PatchDecoderMem(new_size),
+    };
+
+    // cstream, dstream, estream
+    PatchStream streams[3] = {};
+    ScopedPatchStreams streams_holder(streams, 3);
+    if (OpenPatchStream(streams[0], "control", h.codecs[0], data, h.ctrl_len, decoder_mem[0],
+                        threaded) != 0 ||
+            OpenPatchStream(streams[1], "diff", h.codecs[1], data + h.ctrl_len, h.data_len,
+                            decoder_mem[1], threaded) != 0 ||
+            OpenPatchStream(streams[2], "extra", h.codecs[2], data + h.ctrl_len + h.data_len,
+                            h.extra_len, decoder_mem[2], threaded) != 0) {
+        return 1;
     }
-
-    bz_stream estream;
-    estream.next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
-    estream.avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
-    estream.bzalloc = NULL;
-    estream.bzfree = NULL;
-    estream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&estream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit extra stream (%d)\n", bzerr);
+    PatchStream& cstream = streams[0];
+    PatchStream& dstream = streams[1];
+    PatchStream& estream = streams[2];
+    ScopedPatchAlloc ring_alloc(cstream.ring.size() + dstream.ring.size() +
+                                estream.ring.size());
+
+    // The decoders allocate their windows or dictionaries as the blocks ask
+    // for them.
+    const size_t offsets[3] = { 0, static_cast<size_t>(h.ctrl_len),
+                                static_cast<size_t>(h.ctrl_len + h.data_len) };
+    const size_t sizes[3] = { static_cast<size_t>(h.ctrl_len), static_cast<size_t>(h.data_len),
+                              static_cast<size_t>(h.extra_len) };
+    size_t decoders = 0;
+    for (size_t i = 0; i < 3; ++i) {
+        if (h.codecs[i] == BSDFZ_CODEC_ZSTD || h.codecs[i] == BSDFZ_CODEC_XZ) {
+            decoders += DeclaredDecoderMem(h.codecs[i], data + offsets[i], sizes[i],
+                                           decoder_mem[i]);
+        }
     }
+    ScopedPatchAlloc decoder_alloc(decoders);
 
-    new_data->resize(new_size);
+    PatchOutput out;
+    out.sink = sink;
+    out.token = token;
+    out.ctx = ctx;
+    out.window.resize(std::min<ssize_t>(new_size, BSPATCH_WINDOW));
+    out.fill = 0;
+    ScopedPatchAlloc window_alloc(out.window.size());
 
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
-    int i;
+    off_t len;
     unsigned char buf[24];
     while (newpos < new_size) {
         // Read control data
-        if (FillBuffer(buf, 24, &cstream) != 0) {
+        if (ReadPatchStream(cstream, buf, 24) != 0) {
             printf("error while reading control stream\n");
             return 1;
         }
@@ -206,22 +718,33 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
             return 1;
         }
 
-        // Read diff string
-        if (FillBuffer(new_data->data() + newpos, ctrl[0], &dstream) != 0) {
-            printf("error while reading diff stream\n");
-            return 1;
-        }
+        // Read diff string and add old data to it, a window at a time
+        while (ctrl[0] > 0) {
+            len = std::min<off_t>(ctrl[0], out.window.size() - out.fill);
+            unsigned char* p = out.window.data() + out.fill;
+            if (ReadPatchStream(dstream, p, len) != 0) {
+                printf("error while reading diff stream\n");
+                return 1;
+            }
 
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
+            // Only the bytes that have an old byte at the same position
+            // get one added; the rest of the diff string is used as is.
+            off_t start = std::min<off_t>(std::max<off_t>(-oldpos, 0), len);
+            off_t end = std::max<off_t>(std::min<off_t>(old_size - oldpos, len), start);
+            if (end > start) {
+                AddBytes(p + start, old_data + oldpos + start, end - start);
             }
-        }
 
-        // Adjust pointers
-        newpos += ctrl[0];
-        oldpos += ctrl[0];
+            out.fill += len;
+            if (out.fill == out.window.size() && FlushOutput(out) != 0) {
+                return 1;
+            }
+
+            // Adjust pointers
+            newpos += len;
+            oldpos += len;
+            ctrl[0] -= len;
+        }
 
         // Sanity check
         if (newpos + ctrl[1] > new_size) {
@@ -230,18 +753,46 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         }
 
         // Read extra string
-        if (FillBuffer(new_data->data() + newpos, ctrl[1], &estream) != 0) {
-            printf("error while reading extra stream\n");
-            return 1;
+        while (ctrl[1] > 0) {
+            len = std::min<off_t>(ctrl[1], out.window.size() - out.fill);
+            if (ReadPatchStream(estream, out.window.data() + out.fill, len) != 0) {
+                printf("error while reading extra stream\n");
+                return 1;
+            }
+
+            out.fill += len;
+            if (out.fill == out.window.size() && FlushOutput(out) != 0) {
+                return 1;
+            }
+
+            newpos += len;
+            ctrl[1] -= len;
         }
 
         // Adjust pointers
-        newpos += ctrl[1];
         oldpos += ctrl[2];
     }
 
-    BZ2_bzDecompressEnd(&cstream);
-    BZ2_bzDecompressEnd(&dstream);
-    BZ2_bzDecompressEnd(&estream);
-    return 0;
+    return FlushOutput(out);
+}
+
+static ssize_t MemorySink(const unsigned char* data, ssize_t size, void* token) {
+    std::vector<unsigned char>* new_data = reinterpret_cast<std::vector<unsigned char>*>(token);
+    new_data->insert(new_data->end(), data, data + size);
+    return size;
+}
+
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        std::vector<unsigned char>* new_data) {
+    BSDiffHeader h;
+    if (ReadBSDiffHeader(patch, patch_offset, &h) != 0) {
+        return 1;
+    }
+
+    new_data->clear();
+    new_data->reserve(h.new_size);
+    ScopedPatchAlloc new_data_alloc(h.new_size);
+    return ApplyBSDiffPatch(old_data, old_size, patch, patch_offset, &MemorySink, new_data,
+                            nullptr);
 }
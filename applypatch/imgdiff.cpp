@@ -119,6 +119,10 @@
  * patch.  This is used to reduce the size of recovery-from-boot
  * patches by combining the boot image with recovery ramdisk
  * information that is stored on the system partition.
+ *
+ * With -f, the bsdiff patches are written in the BSDFZ container (see
+ * bsdiff.h) instead of BSDIFF40; they decode faster, but only updaters
+ * that know the container can apply them.
  */
 
 #include <errno.h>
@@ -131,6 +135,7 @@
 #include <sys/types.h>
 
 #include "zlib.h"
+#include "bsdiff.h"
 #include "imgdiff.h"
 #include "utils.h"
 
@@ -179,10 +184,6 @@ static int fileentry_compare(const void* a, const void* b) {
   }
 }
 
-// from bsdiff.c
-int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* newdata, off_t newsize,
-           const char* patch_filename);
-
 unsigned char* ReadZip(const char* filename,
                        int* num_chunks, ImageChunk** chunks,
                        int include_pseudo_chunk) {
@@ -625,7 +626,7 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
  * its length in *size.  Return NULL on failure.  We expect the bsdiff
  * program to be in the path.
  */
-unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
+unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size, bool bsdfz) {
   if (tgt->type == CHUNK_NORMAL) {
     if (tgt->len <= 160) {
       tgt->type = CHUNK_RAW;
@@ -645,7 +646,7 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   close(fd); // temporary file is created and we don't need its file
              // descriptor
 
-  int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp);
+  int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp, bsdfz);
   if (r != 0) {
     printf("bsdiff() failed: %d\n", r);
     return NULL;
@@ -810,6 +811,13 @@ void DumpChunks(ImageChunk* chunks, int num_chunks) {
 }
 
 int main(int argc, char** argv) {
+  bool bsdfz = false;
+  if (argc >= 2 && strcmp(argv[1], "-f") == 0) {
+    bsdfz = true;
+    --argc;
+    ++argv;
+  }
+
   int zip_mode = 0;
 
   if (argc >= 2 && strcmp(argv[1], "-z") == 0) {
@@ -845,7 +853,7 @@ int main(int argc, char** argv) {
 
   if (argc != 4) {
     usage:
-    printf("usage: %s [-z] [-b <bonus-file>] <src-img> <tgt-img> <patch-file>\n",
+    printf("usage: %s [-f] [-z] [-b <bonus-file>] <src-img> <tgt-img> <patch-file>\n",
             argv[0]);
     return 2;
   }
@@ -983,9 +991,9 @@ int main(int argc, char** argv) {
       if (tgt_chunks[i].type == CHUNK_DEFLATE &&
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
                                  num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
+        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i, bsdfz);
       } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i, bsdfz);
       }
     } else {
       if (i == 1 && bonus_data) {
@@ -996,7 +1004,7 @@ int main(int argc, char** argv) {
         src_chunks[i].len += bonus_size;
      }
 
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i, bsdfz);
     }
     printf("patch %3d is %zu bytes (of %zu)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
@@ -17,6 +17,7 @@
 // See imgdiff.c in this directory for a description of the patch file
 // format.
 
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/cdefs.h>
 #include <sys/stat.h>
@@ -24,6 +25,8 @@
 #include <unistd.h>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
 #include <vector>
 
 #include "zlib.h"
@@ -41,6 +44,323 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
       old_data, old_size, &patch, sink, token, nullptr, nullptr);
 }
 
+// Deflate chunks are patched on this many threads ahead of the output, and
+// at most 'imgpatch_chunks' of them past the one being written out are
+// patched or held at once; see SetImagePatchParallelism().
+static int imgpatch_threads = 1;
+static int imgpatch_chunks = 1;
+
+void SetImagePatchParallelism(int threads, int chunks) {
+    imgpatch_threads = std::max(threads, 1);
+    imgpatch_chunks = std::max(chunks, 1);
+}
+
+// Size of the buffer deflated chunk data is written out of.
+#define DEFLATE_CHUNK_OUT 32768
+
+struct DeflateSinkState {
+    z_stream strm;
+    std::vector<unsigned char> out;
+    SinkFn sink;
+    void* token;
+    SHA_CTX* ctx;
+};
+
+// Deflates all the input of ds->strm with 'flush', writing the output to
+// the sink as the buffer fills up.
+static int RunDeflate(DeflateSinkState* ds, int flush) {
+    int ret;
+    do {
+        ds->strm.avail_out = ds->out.size();
+        ds->strm.next_out = ds->out.data();
+        ret = deflate(&ds->strm, flush);
+        if (ret == Z_STREAM_ERROR) {
+            printf("deflate of uncompressed data failed\n");
+            return -1;
+        }
+        ssize_t have = ds->out.size() - ds->strm.avail_out;
+
+        if (ds->sink(ds->out.data(), have, ds->token) != have) {
+            printf("failed to write %ld compressed bytes to output\n",
+                   (long)have);
+            return -1;
+        }
+        if (ds->ctx) SHA1_Update(ds->ctx, ds->out.data(), have);
+    } while (flush == Z_FINISH ? ret != Z_STREAM_END : ds->strm.avail_out == 0);
+    return 0;
+}
+
+// Takes the patched data of a deflate chunk from ApplyBSDiffPatch().
+// deflate() produces the same stream however its input is split, as long
+// as it isn't flushed before the end.
+static ssize_t DeflateSink(const unsigned char* data, ssize_t size, void* token) {
+    DeflateSinkState* ds = reinterpret_cast<DeflateSinkState*>(token);
+    ds->strm.next_in = const_cast<unsigned char*>(data);
+    ds->strm.avail_in = size;
+    if (RunDeflate(ds, Z_NO_FLUSH) != 0) {
+        return -1;
+    }
+    return size;
+}
+
+// Applies CHUNK_DEFLATE chunk 'i', whose header starts at 'deflate_header':
+// inflates the source, patches it, and deflates the result to the sink.
+static int ApplyDeflateChunk(const unsigned char* old_data, ssize_t old_size,
+                             const Value* patch, char* deflate_header, int i,
+                             const Value* bonus_data, SinkFn sink, void* token, SHA_CTX* ctx) {
+    size_t src_start = Read8(deflate_header);
+    size_t src_len = Read8(deflate_header+8);
+    size_t patch_offset = Read8(deflate_header+16);
+    size_t expanded_len = Read8(deflate_header+24);
+    int level = Read4(deflate_header+40);
+    int method = Read4(deflate_header+44);
+    int windowBits = Read4(deflate_header+48);
+    int memLevel = Read4(deflate_header+52);
+    int strategy = Read4(deflate_header+56);
+
+    if (src_start + src_len > static_cast<size_t>(old_size)) {
+        printf("source data too short\n");
+        return -1;
+    }
+
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+
+    // Note: expanded_len will include the bonus data size if
+    // the patch was constructed with bonus data.  The
+    // deflation will come up 'bonus_size' bytes short; these
+    // must be appended from the bonus_data value.
+    size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
+
+    std::vector<unsigned char> expanded_source(expanded_len);
+    ScopedPatchAlloc expanded_alloc(expanded_len);
+
+    // inflate() doesn't like strm.next_out being a nullptr even with
+    // avail_out being zero (Z_STREAM_ERROR).
+    if (expanded_len != 0) {
+        z_stream strm;
+        strm.zalloc = Z_NULL;
+        strm.zfree = Z_NULL;
+        strm.opaque = Z_NULL;
+        strm.avail_in = src_len;
+        strm.next_in = (unsigned char*)(old_data + src_start);
+        strm.avail_out = expanded_len;
+        strm.next_out = expanded_source.data();
+
+        int ret;
+        ret = inflateInit2(&strm, -15);
+        if (ret != Z_OK) {
+            printf("failed to init source inflation: %d\n", ret);
+            return -1;
+        }
+
+        // Because we've provided enough room to accommodate the output
+        // data, we expect one call to inflate() to suffice.
+        ret = inflate(&strm, Z_SYNC_FLUSH);
+        if (ret != Z_STREAM_END) {
+            printf("source inflation returned %d\n", ret);
+            return -1;
+        }
+        // We should have filled the output buffer exactly, except
+        // for the bonus_size.
+        if (strm.avail_out != bonus_size) {
+            printf("source inflation short by %zu bytes\n", strm.avail_out-bonus_size);
+            return -1;
+        }
+        inflateEnd(&strm);
+
+        if (bonus_size) {
+            memcpy(expanded_source.data() + (expanded_len - bonus_size),
+                   bonus_data->data, bonus_size);
+        }
+    }
+
+    // Next, apply the bsdiff patch to the uncompressed data, and deflate
+    // each window of output ApplyBSDiffPatch() produces as it comes. The
+    // source has to stay expanded, since the patch may read any part of
+    // it, but the target is never held whole.
+    DeflateSinkState ds;
+    ds.strm.zalloc = Z_NULL;
+    ds.strm.zfree = Z_NULL;
+    ds.strm.opaque = Z_NULL;
+    int ret = deflateInit2(&ds.strm, level, method, windowBits, memLevel, strategy);
+    if (ret != Z_OK) {
+        printf("failed to init uncompressed data deflation: %d\n", ret);
+        return -1;
+    }
+    ds.out.resize(DEFLATE_CHUNK_OUT);
+    ScopedPatchAlloc out_alloc(ds.out.size());
+    ds.sink = sink;
+    ds.token = token;
+    ds.ctx = ctx;
+
+    ret = ApplyBSDiffPatch(expanded_source.data(), expanded_len, patch, patch_offset,
+                           &DeflateSink, &ds, nullptr);
+    if (ret == 0) {
+        // Now finish the deflate stream.
+        ret = RunDeflate(&ds, Z_FINISH);
+    }
+    deflateEnd(&ds.strm);
+    return ret == 0 ? 0 : -1;
+}
+
+// The deflate chunks of a patch are independent of each other, so when
+// there are several, a pool of threads patches them into memory while the
+// calling thread writes out the other chunks, and the patched ones, in
+// order. A thread only starts a chunk less than 'imgpatch_chunks' chunks
+// past the one the calling thread waits for, which bounds the memory the
+// chunks hold to about that many times the largest of them.
+
+struct DeflateJob {
+    char* header;
+    int index;                          // of the chunk in the patch
+    std::vector<unsigned char> output;  // the compressed chunk
+    size_t alloc;                       // the most memory it held
+    bool done;
+    bool failed;
+};
+
+// Memory held by a job while a worker patches it, as ScopedPatchAlloc
+// accounts for it and as its output has grown to.
+struct RunningDeflateJob {
+    std::atomic<size_t> patch;
+    std::atomic<size_t> output;
+};
+
+struct DeflateJobSink {
+    std::vector<unsigned char>* output;
+    std::atomic<size_t>* held;
+};
+
+static ssize_t RunningJobSink(const unsigned char* data, ssize_t size, void* token) {
+    DeflateJobSink* js = reinterpret_cast<DeflateJobSink*>(token);
+    js->output->insert(js->output->end(), data, data + size);
+    *js->held = js->output->capacity();
+    return size;
+}
+
+struct DeflatePool {
+    const unsigned char* old_data;
+    ssize_t old_size;
+    const Value* patch;
+    const Value* bonus_data;
+
+    std::vector<DeflateJob> jobs;
+    std::vector<RunningDeflateJob> running;     // for each job
+    size_t next;                        // the next job to start
+    size_t limit;                       // jobs before this one may start
+    bool abort;
+    pthread_mutex_t mu;
+    pthread_cond_t cv;                  // a job is done, or 'limit' moved
+    std::vector<pthread_t> threads;
+};
+
+static void* DeflateWorker(void* cookie) {
+    DeflatePool* pool = reinterpret_cast<DeflatePool*>(cookie);
+
+    pthread_mutex_lock(&pool->mu);
+    while (true) {
+        while (!pool->abort && pool->next < pool->jobs.size() && pool->next >= pool->limit) {
+            pthread_cond_wait(&pool->cv, &pool->mu);
+        }
+        if (pool->abort || pool->next == pool->jobs.size()) {
+            break;
+        }
+        size_t j = pool->next++;
+        DeflateJob& job = pool->jobs[j];
+        pthread_mutex_unlock(&pool->mu);
+
+        TakePatchPeakAlloc();
+        SharePatchAlloc(&pool->running[j].patch);
+        DeflateJobSink js = { &job.output, &pool->running[j].output };
+        int ret = ApplyDeflateChunk(pool->old_data, pool->old_size, pool->patch, job.header,
+                                    job.index, pool->bonus_data, &RunningJobSink, &js, nullptr);
+        SharePatchAlloc(nullptr);
+        size_t alloc = TakePatchPeakAlloc() + job.output.capacity();
+
+        pthread_mutex_lock(&pool->mu);
+        job.failed = (ret != 0);
+        job.alloc = alloc;
+        job.done = true;
+        pthread_cond_broadcast(&pool->cv);
+    }
+    pthread_mutex_unlock(&pool->mu);
+    return nullptr;
+}
+
+// Starts up to 'threads' workers on the jobs of 'pool', and stops them when
+// it goes out of scope, once they have finished the chunk they're on.
+class ScopedDeflatePool {
+  public:
+    ScopedDeflatePool(DeflatePool* pool, int threads) : pool_(pool) {
+        pthread_mutex_init(&pool_->mu, nullptr);
+        pthread_cond_init(&pool_->cv, nullptr);
+        for (int t = 0; t < threads; ++t) {
+            pthread_t thread;
+            int error = pthread_create(&thread, nullptr, DeflateWorker, pool_);
+            if (error != 0) {
+                printf("failed to start chunk worker: %s\n", strerror(error));
+                break;
+            }
+            pool_->threads.push_back(thread);
+        }
+    }
+    ~ScopedDeflatePool() {
+        pthread_mutex_lock(&pool_->mu);
+        pool_->abort = true;
+        pthread_cond_broadcast(&pool_->cv);
+        pthread_mutex_unlock(&pool_->mu);
+        for (pthread_t thread : pool_->threads) {
+            pthread_join(thread, nullptr);
+        }
+        pthread_cond_destroy(&pool_->cv);
+        pthread_mutex_destroy(&pool_->mu);
+    }
+
+  private:
+    DeflatePool* pool_;
+};
+
+// Waits for deflate job 'j' of the pool and writes its output, accounting
+// for the memory held by it and by the jobs after it, done or running.
+static int WriteDeflateJob(DeflatePool& pool, size_t j, SinkFn sink, void* token,
+                           SHA_CTX* ctx) {
+    DeflateJob& job = pool.jobs[j];
+    size_t held = 0;
+
+    pthread_mutex_lock(&pool.mu);
+    while (!job.done) {
+        pthread_cond_wait(&pool.cv, &pool.mu);
+    }
+    for (size_t k = j; k < pool.next; ++k) {
+        if (pool.jobs[k].done) {
+            held += pool.jobs[k].alloc;
+        } else {
+            held += pool.running[k].patch + pool.running[k].output;
+        }
+    }
+    pthread_mutex_unlock(&pool.mu);
+    ScopedPatchAlloc held_alloc(held);
+
+    if (job.failed) {
+        printf("failed to apply chunk %d deflate patch\n", job.index);
+        return -1;
+    }
+    ssize_t have = job.output.size();
+    if (sink(job.output.data(), have, token) != have) {
+        printf("failed to write %ld compressed bytes to output\n", (long)have);
+        return -1;
+    }
+    if (ctx) SHA1_Update(ctx, job.output.data(), have);
+    std::vector<unsigned char>().swap(job.output);
+
+    pthread_mutex_lock(&pool.mu);
+    pool.limit = j + 1 + imgpatch_chunks;
+    pthread_cond_broadcast(&pool.cv);
+    pthread_mutex_unlock(&pool.mu);
+    return 0;
+}
+
 /*
  * Apply the patch given in 'patch_filename' to the source data given
  * by (old_data, old_size).  Write the patched output to the 'output'
@@ -68,6 +388,40 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
 
     int num_chunks = Read4(header+8);
 
+    // Find the deflate chunks first, to patch them ahead on the pool when
+    // there are several.
+    DeflatePool pool = {};
+    pool.old_data = old_data;
+    pool.old_size = old_size;
+    pool.patch = patch;
+    pool.bonus_data = bonus_data;
+    pool.limit = imgpatch_chunks;
+    for (int i = 0; i < num_chunks && pos + 4 <= patch->size; ++i) {
+        int type = Read4(patch->data + pos);
+        pos += 4;
+        if (type == CHUNK_NORMAL) {
+            pos += 24;
+        } else if (type == CHUNK_RAW && pos + 4 <= patch->size &&
+                Read4(patch->data + pos) >= 0) {
+            pos += 4 + Read4(patch->data + pos);
+        } else if (type == CHUNK_DEFLATE && pos + 60 <= patch->size) {
+            DeflateJob job = {};
+            job.header = patch->data + pos;
+            job.index = i;
+            pool.jobs.push_back(job);
+            pos += 60;
+        } else {
+            // Reported below, when the chunk is reached.
+            break;
+        }
+    }
+    pool.running = std::vector<RunningDeflateJob>(pool.jobs.size());
+    int threads = std::min<int>(imgpatch_threads, pool.jobs.size());
+    ScopedDeflatePool pool_holder(&pool, threads > 1 ? threads : 0);
+    bool parallel = !pool.threads.empty();
+    size_t next_job = 0;
+
+    pos = 12;
     int i;
     for (i = 0; i < num_chunks; ++i) {
         // each chunk's header record starts with 4 bytes.
@@ -94,8 +448,11 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                 printf("source data too short\n");
                 return -1;
             }
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
+            if (ApplyBSDiffPatch(old_data + src_start, src_len,
+                                 patch, patch_offset, sink, token, ctx) != 0) {
+                printf("failed to apply chunk %d bsdiff patch\n", i);
+                return -1;
+            }
         } else if (type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
@@ -106,7 +463,7 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
 
             ssize_t data_len = Read4(raw_header);
 
-            if (pos + data_len > patch->size) {
+            if (data_len < 0 || pos + data_len > patch->size) {
                 printf("failed to read chunk %d raw data\n", i);
                 return -1;
             }
@@ -126,119 +483,19 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                 return -1;
             }
 
-            size_t src_start = Read8(deflate_header);
-            size_t src_len = Read8(deflate_header+8);
-            size_t patch_offset = Read8(deflate_header+16);
-            size_t expanded_len = Read8(deflate_header+24);
-            int level = Read4(deflate_header+40);
-            int method = Read4(deflate_header+44);
-            int windowBits = Read4(deflate_header+48);
-            int memLevel = Read4(deflate_header+52);
-            int strategy = Read4(deflate_header+56);
-
-            if (src_start + src_len > static_cast<size_t>(old_size)) {
-                printf("source data too short\n");
-                return -1;
-            }
-
-            // Decompress the source data; the chunk header tells us exactly
-            // how big we expect it to be when decompressed.
-
-            // Note: expanded_len will include the bonus data size if
-            // the patch was constructed with bonus data.  The
-            // deflation will come up 'bonus_size' bytes short; these
-            // must be appended from the bonus_data value.
-            size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
-
-            std::vector<unsigned char> expanded_source(expanded_len);
-
-            // inflate() doesn't like strm.next_out being a nullptr even with
-            // avail_out being zero (Z_STREAM_ERROR).
-            if (expanded_len != 0) {
-                z_stream strm;
-                strm.zalloc = Z_NULL;
-                strm.zfree = Z_NULL;
-                strm.opaque = Z_NULL;
-                strm.avail_in = src_len;
-                strm.next_in = (unsigned char*)(old_data + src_start);
-                strm.avail_out = expanded_len;
-                strm.next_out = expanded_source.data();
-
-                int ret;
-                ret = inflateInit2(&strm, -15);
-                if (ret != Z_OK) {
-                    printf("failed to init source inflation: %d\n", ret);
+            if (parallel) {
+                // The chunks were found the same way above.
+                if (next_job >= pool.jobs.size() || pool.jobs[next_job].header != deflate_header) {
+                    printf("chunk %d isn't a deflate chunk found ahead\n", i);
                     return -1;
                 }
-
-                // Because we've provided enough room to accommodate the output
-                // data, we expect one call to inflate() to suffice.
-                ret = inflate(&strm, Z_SYNC_FLUSH);
-                if (ret != Z_STREAM_END) {
-                    printf("source inflation returned %d\n", ret);
+                if (WriteDeflateJob(pool, next_job++, sink, token, ctx) != 0) {
                     return -1;
                 }
-                // We should have filled the output buffer exactly, except
-                // for the bonus_size.
-                if (strm.avail_out != bonus_size) {
-                    printf("source inflation short by %zu bytes\n", strm.avail_out-bonus_size);
-                    return -1;
-                }
-                inflateEnd(&strm);
-
-                if (bonus_size) {
-                    memcpy(expanded_source.data() + (expanded_len - bonus_size),
-                           bonus_data->data, bonus_size);
-                }
-            }
-
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            std::vector<unsigned char> uncompressed_target_data;
-            if (ApplyBSDiffPatchMem(expanded_source.data(), expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data) != 0) {
+            } else if (ApplyDeflateChunk(old_data, old_size, patch, deflate_header, i,
+                                         bonus_data, sink, token, ctx) != 0) {
                 return -1;
             }
-
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            if (expanded_source.size() < 32768U) {
-                expanded_source.resize(32768U);
-            }
-
-            {
-                std::vector<unsigned char>& temp_data = expanded_source;
-
-                // now the deflate stream
-                z_stream strm;
-                strm.zalloc = Z_NULL;
-                strm.zfree = Z_NULL;
-                strm.opaque = Z_NULL;
-                strm.avail_in = uncompressed_target_data.size();
-                strm.next_in = uncompressed_target_data.data();
-                int ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-                if (ret != Z_OK) {
-                    printf("failed to init uncompressed data deflation: %d\n", ret);
-                    return -1;
-                }
-                do {
-                    strm.avail_out = temp_data.size();
-                    strm.next_out = temp_data.data();
-                    ret = deflate(&strm, Z_FINISH);
-                    ssize_t have = temp_data.size() - strm.avail_out;
-
-                    if (sink(temp_data.data(), have, token) != have) {
-                        printf("failed to write %ld compressed bytes to output\n",
-                               (long)have);
-                        return -1;
-                    }
-                    if (ctx) SHA1_Update(ctx, temp_data.data(), have);
-                } while (ret != Z_STREAM_END);
-                deflateEnd(&strm);
-            }
         } else {
             printf("patch chunk %d is unknown type %d\n", i, type);
             return -1;
@@ -20,6 +20,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "config.h"
@@ -117,6 +118,25 @@ ssize_t ota_read(int fd, void* buf, size_t nbyte) {
     return status;
 }
 
+ssize_t ota_preadv(int fd, const struct iovec* iov, int iovcnt, off64_t offset) {
+    if (should_fault_inject(OTAIO_READ)) {
+        auto cached = filename_cache.find(fd);
+        const char* cached_path = cached->second;
+        if (cached != filename_cache.end()
+                && get_hit_file(cached_path, read_fault_file_name)) {
+            read_fault_file_name = "";
+            errno = EIO;
+            have_eio_error = true;
+            return -1;
+        }
+    }
+    ssize_t status = preadv64(fd, iov, iovcnt, offset);
+    if (status == -1 && errno == EIO) {
+        have_eio_error = true;
+    }
+    return status;
+}
+
 size_t ota_fwrite(const void* ptr, size_t size, size_t count, FILE* stream) {
     if (should_fault_inject(OTAIO_WRITE)) {
         auto cached = filename_cache.find((intptr_t)stream);
@@ -155,6 +175,25 @@ ssize_t ota_write(int fd, const void* buf, size_t nbyte) {
     return status;
 }
 
+ssize_t ota_pwritev(int fd, const struct iovec* iov, int iovcnt, off64_t offset) {
+    if (should_fault_inject(OTAIO_WRITE)) {
+        auto cached = filename_cache.find(fd);
+        const char* cached_path = cached->second;
+        if (cached != filename_cache.end() &&
+                get_hit_file(cached_path, write_fault_file_name)) {
+            write_fault_file_name = "";
+            errno = EIO;
+            have_eio_error = true;
+            return -1;
+        }
+    }
+    ssize_t status = pwritev64(fd, iov, iovcnt, offset);
+    if (status == -1 && errno == EIO) {
+        have_eio_error = true;
+    }
+    return status;
+}
+
 int ota_fsync(int fd) {
     if (should_fault_inject(OTAIO_FSYNC)) {
         auto cached = filename_cache.find(fd);
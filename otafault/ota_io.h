@@ -25,6 +25,7 @@
 
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #define OTAIO_CACHE_FNAME "/cache/saved.file"
 
@@ -44,10 +45,14 @@ size_t ota_fread(void* ptr, size_t size, size_t nitems, FILE* stream);
 
 ssize_t ota_read(int fd, void* buf, size_t nbyte);
 
+ssize_t ota_preadv(int fd, const struct iovec* iov, int iovcnt, off64_t offset);
+
 size_t ota_fwrite(const void* ptr, size_t size, size_t count, FILE* stream);
 
 ssize_t ota_write(int fd, const void* buf, size_t nbyte);
 
+ssize_t ota_pwritev(int fd, const struct iovec* iov, int iovcnt, off64_t offset);
+
 int ota_fsync(int fd);
 
 #endif
@@ -23,13 +23,19 @@ LOCAL_MODULE := recovery_unit_test
 LOCAL_ADDITIONAL_DEPENDENCIES := $(LOCAL_PATH)/Android.mk
 LOCAL_STATIC_LIBRARIES := \
     libverifier \
-    libminui
+    libminui \
+    libapplypatch \
+    libupdater \
+    libbase
 
 LOCAL_SRC_FILES := unit/asn1_decoder_test.cpp
 LOCAL_SRC_FILES += unit/recovery_test.cpp
 LOCAL_SRC_FILES += unit/locale_test.cpp
+LOCAL_SRC_FILES += unit/add_bytes_test.cpp
+LOCAL_SRC_FILES += unit/transfer_list_parser_test.cpp
+LOCAL_SRC_FILES += unit/stash_format_test.cpp
 LOCAL_C_INCLUDES := bootable/recovery
-LOCAL_SHARED_LIBRARIES := liblog
+LOCAL_SHARED_LIBRARIES := liblog libz
 include $(BUILD_NATIVE_TEST)
 
 # Component tests
@@ -41,9 +47,19 @@ LOCAL_MODULE := recovery_component_test
 LOCAL_C_INCLUDES := bootable/recovery
 LOCAL_SRC_FILES := \
     component/verifier_test.cpp \
-    component/applypatch_test.cpp
+    component/applypatch_test.cpp \
+    component/updater_test.cpp
 LOCAL_FORCE_STATIC_EXECUTABLE := true
+tune2fs_static_libraries := \
+    libext2_com_err \
+    libext2_blkid \
+    libext2_quota \
+    libext2_uuid_static \
+    libext2_e2p \
+    libext2fs
 LOCAL_STATIC_LIBRARIES := \
+    libupdater \
+    libedify \
     libapplypatch \
     libotafault \
     libmtdutils \
@@ -53,8 +69,19 @@ LOCAL_STATIC_LIBRARIES := \
     libcrypto_static \
     libminui \
     libminzip \
+    libfec \
+    libfec_rs \
+    libext4_utils_static \
+    libsquashfs_utils \
+    libsparse_static \
+    libtune2fs \
+    $(tune2fs_static_libraries) \
+    libselinux \
     libcutils \
+    liblog \
     libbz \
+    libzstd \
+    libxz \
     libz \
     libc
 
@@ -24,12 +24,18 @@
 #include <time.h>
 
 #include <string>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/stringprintf.h>
 #include <android-base/test_utils.h>
+#include <bzlib.h>
+#include <zlib.h>
+#include <zstd.h>
 
 #include "applypatch/applypatch.h"
+#include "applypatch/bsdiff.h"
+#include "applypatch/imgdiff.h"
 #include "common/test_constants.h"
 #include "openssl/sha.h"
 #include "print_sha1.h"
@@ -390,3 +396,437 @@ TEST_F(ApplyPatchDoubleCacheTest, ApplyDoubleCorruptedInNewLocation) {
     ASSERT_NE(0, ap_result);
     ASSERT_FALSE(file_cmp(output_loc, new_file));
 }
+
+static void offtout(off_t x, unsigned char* buf) {
+    off_t y = x < 0 ? -x : x;
+    for (int i = 0; i < 8; ++i) {
+        buf[i] = y % 256;
+        y /= 256;
+    }
+    if (x < 0) {
+        buf[7] |= 0x80;
+    }
+}
+
+static std::string bzip2(const std::string& data) {
+    std::vector<char> out(data.size() + data.size() / 100 + 600);
+    unsigned int size = out.size();
+    if (BZ2_bzBuffToBuffCompress(out.data(), &size, const_cast<char*>(data.data()), data.size(),
+                                 9, 0, 0) != BZ_OK) {
+        return "";
+    }
+    return std::string(out.data(), size);
+}
+
+// The old bytes are added to the diff string only where the old position is
+// within the old data; the controls below move it before the start and past
+// the end of the old data in the middle of diff strings.
+TEST(BSDiffPatchTest, AddsOldBytesInBounds) {
+    std::string old_data;
+    for (int i = 0; i < 5000; ++i) {
+        old_data.push_back(rand());
+    }
+
+    // add, copy extra, seek
+    const off_t controls[][3] = {
+        { 300, 10, -400 },              // to -100
+        { 250, 0, 4800 },               // from -100 to 150, then to 4950
+        { 200, 5, 0 },                  // from 4950 past the end
+        { 3000, 0, -8000 },             // entirely past the end, then to 150
+        { 4999, 0, 0 },                 // from 150 past the end
+    };
+
+    std::string ctrl;
+    std::string diff;
+    std::string extra;
+    std::string expected;
+    off_t oldpos = 0;
+    for (const auto& c : controls) {
+        unsigned char buf[24];
+        offtout(c[0], buf);
+        offtout(c[1], buf + 8);
+        offtout(c[2], buf + 16);
+        ctrl.append(reinterpret_cast<char*>(buf), sizeof(buf));
+
+        for (off_t i = 0; i < c[0]; ++i, ++oldpos) {
+            char d = rand();
+            diff.push_back(d);
+            bool in_bounds = oldpos >= 0 && oldpos < static_cast<off_t>(old_data.size());
+            expected.push_back(d + (in_bounds ? old_data[oldpos] : 0));
+        }
+        for (off_t i = 0; i < c[1]; ++i) {
+            extra.push_back(rand());
+            expected.push_back(extra.back());
+        }
+        oldpos += c[2];
+    }
+
+    std::string bz_ctrl = bzip2(ctrl);
+    std::string bz_diff = bzip2(diff);
+    std::string bz_extra = bzip2(extra);
+    ASSERT_FALSE(bz_ctrl.empty() || bz_diff.empty() || bz_extra.empty());
+
+    unsigned char header[32];
+    memcpy(header, "BSDIFF40", 8);
+    offtout(bz_ctrl.size(), header + 8);
+    offtout(bz_diff.size(), header + 16);
+    offtout(expected.size(), header + 24);
+    std::string patch_data = std::string(reinterpret_cast<char*>(header), sizeof(header)) +
+                             bz_ctrl + bz_diff + bz_extra;
+
+    Value patch;
+    patch.type = VAL_BLOB;
+    patch.size = patch_data.size();
+    patch.data = &patch_data[0];
+
+    std::vector<unsigned char> new_data;
+    ASSERT_EQ(0, ApplyBSDiffPatchMem(reinterpret_cast<const unsigned char*>(old_data.data()),
+                                     old_data.size(), &patch, 0, &new_data));
+    ASSERT_EQ(expected, std::string(new_data.begin(), new_data.end()));
+}
+
+// A BSDFZ patch names the codec of each block; this one has a stored control
+// block, a zstd diff block and a bzip2 extra block, which only the stored
+// length bounds.
+TEST(BSDiffPatchTest, AppliesBsdfz) {
+    std::string old_data;
+    for (int i = 0; i < 5000; ++i) {
+        old_data.push_back(rand());
+    }
+
+    unsigned char ctrl[24];
+    offtout(old_data.size(), ctrl);
+    offtout(100, ctrl + 8);
+    offtout(0, ctrl + 16);
+
+    std::string diff(old_data.size(), '\0');
+    diff[10] = 1;
+    std::string extra;
+    for (int i = 0; i < 100; ++i) {
+        extra.push_back(rand());
+    }
+    std::string expected = old_data;
+    expected[10] += 1;
+    expected += extra;
+
+    std::vector<char> zst(ZSTD_compressBound(diff.size()));
+    size_t zst_len = ZSTD_compress(zst.data(), zst.size(), diff.data(), diff.size(), 3);
+    ASSERT_FALSE(ZSTD_isError(zst_len));
+    std::string bz_extra = bzip2(extra);
+    ASSERT_FALSE(bz_extra.empty());
+
+    unsigned char header[BSDFZ_HEADER_LEN];
+    memcpy(header, BSDFZ_MAGIC, BSDFZ_MAGIC_LEN);
+    header[5] = BSDFZ_CODEC_NONE;
+    header[6] = BSDFZ_CODEC_ZSTD;
+    header[7] = BSDFZ_CODEC_BZIP2;
+    offtout(sizeof(ctrl), header + 8);
+    offtout(zst_len, header + 16);
+    offtout(expected.size(), header + 24);
+    offtout(bz_extra.size(), header + 32);
+    std::string patch_data = std::string(reinterpret_cast<char*>(header), sizeof(header)) +
+                             std::string(reinterpret_cast<char*>(ctrl), sizeof(ctrl)) +
+                             std::string(zst.data(), zst_len) + bz_extra;
+
+    Value patch;
+    patch.type = VAL_BLOB;
+    patch.size = patch_data.size();
+    patch.data = &patch_data[0];
+
+    std::vector<unsigned char> new_data;
+    ASSERT_EQ(0, ApplyBSDiffPatchMem(reinterpret_cast<const unsigned char*>(old_data.data()),
+                                     old_data.size(), &patch, 0, &new_data));
+    ASSERT_EQ(expected, std::string(new_data.begin(), new_data.end()));
+
+    // The extra block may not run past the end of the patch, nor use an
+    // unknown codec.
+    offtout(bz_extra.size() + 1, reinterpret_cast<unsigned char*>(&patch_data[32]));
+    ASSERT_NE(0, ApplyBSDiffPatchMem(reinterpret_cast<const unsigned char*>(old_data.data()),
+                                     old_data.size(), &patch, 0, &new_data));
+    offtout(bz_extra.size(), reinterpret_cast<unsigned char*>(&patch_data[32]));
+    patch_data[7] = 9;
+    ASSERT_NE(0, ApplyBSDiffPatchMem(reinterpret_cast<const unsigned char*>(old_data.data()),
+                                     old_data.size(), &patch, 0, &new_data));
+}
+
+// Output sink that fails once 'limit' bytes have been written.
+struct LimitedSink {
+    std::string data;
+    size_t limit;
+};
+
+static ssize_t LimitedStringSink(const unsigned char* data, ssize_t size, void* token) {
+    LimitedSink* sink = reinterpret_cast<LimitedSink*>(token);
+    if (sink->data.size() + size > sink->limit) {
+        return -1;
+    }
+    sink->data.append(reinterpret_cast<const char*>(data), size);
+    return size;
+}
+
+static int ApplyToSink(const std::string& old_data, std::string& patch_data, LimitedSink* sink) {
+    Value patch;
+    patch.type = VAL_BLOB;
+    patch.size = patch_data.size();
+    patch.data = &patch_data[0];
+    sink->data.clear();
+    return ApplyBSDiffPatch(reinterpret_cast<const unsigned char*>(old_data.data()),
+                            old_data.size(), &patch, 0, LimitedStringSink, sink, nullptr);
+}
+
+// Patches with more output than the pipeline threshold have their blocks
+// decoded on threads of their own, also on a single CPU in this test. The
+// result has to be the same, and failures have to stop the threads however
+// far ahead they are.
+TEST(BSDiffPatchTest, DecodesBlocksAhead) {
+    std::string old_data;
+    for (int i = 0; i < 400000; ++i) {
+        old_data.push_back(rand());
+    }
+
+    // Each diff string is longer than a ring, and each extra string longer
+    // than a decode chunk.
+    std::string ctrl;
+    std::string diff;
+    std::string extra;
+    std::string expected;
+    off_t oldpos = 0;
+    for (int i = 0; i < 3; ++i) {
+        const off_t c[3] = { 300000, 80000, -300000 + 1000 };
+        unsigned char buf[24];
+        offtout(c[0], buf);
+        offtout(c[1], buf + 8);
+        offtout(c[2], buf + 16);
+        ctrl.append(reinterpret_cast<char*>(buf), sizeof(buf));
+
+        for (off_t j = 0; j < c[0]; ++j, ++oldpos) {
+            char d = (j % 1000 == 0) ? rand() : 0;
+            diff.push_back(d);
+            expected.push_back(d + old_data[oldpos]);
+        }
+        for (off_t j = 0; j < c[1]; ++j) {
+            extra.push_back("extra"[j % 5]);
+            expected.push_back(extra.back());
+        }
+        oldpos += c[2];
+    }
+
+    std::string bz_ctrl = bzip2(ctrl);
+    std::vector<char> zst(ZSTD_compressBound(diff.size()));
+    size_t zst_len = ZSTD_compress(zst.data(), zst.size(), diff.data(), diff.size(), 3);
+    ASSERT_FALSE(ZSTD_isError(zst_len));
+    std::string zst_diff(zst.data(), zst_len);
+    std::string bz_extra = bzip2(extra);
+    ASSERT_FALSE(bz_ctrl.empty() || bz_extra.empty());
+
+    auto make_patch = [&](const std::string& c, const std::string& d, const std::string& e) {
+        unsigned char header[BSDFZ_HEADER_LEN];
+        memcpy(header, BSDFZ_MAGIC, BSDFZ_MAGIC_LEN);
+        header[5] = BSDFZ_CODEC_BZIP2;
+        header[6] = BSDFZ_CODEC_ZSTD;
+        header[7] = BSDFZ_CODEC_BZIP2;
+        offtout(c.size(), header + 8);
+        offtout(d.size(), header + 16);
+        offtout(expected.size(), header + 24);
+        offtout(e.size(), header + 32);
+        return std::string(reinterpret_cast<char*>(header), sizeof(header)) + c + d + e;
+    };
+    std::string patch_data = make_patch(bz_ctrl, zst_diff, bz_extra);
+
+    LimitedSink sink;
+    sink.limit = SIZE_MAX;
+
+    // Decoded on demand
+    TakePatchPeakAlloc();
+    ASSERT_EQ(0, ApplyToSink(old_data, patch_data, &sink));
+    ASSERT_EQ(expected, sink.data);
+    size_t serial_alloc = TakePatchPeakAlloc();
+
+    // Decoded ahead, into a ring for each block
+    SetBSDiffPipeline(256 << 10, true);
+    ASSERT_EQ(0, ApplyToSink(old_data, patch_data, &sink));
+    ASSERT_EQ(expected, sink.data);
+    ASSERT_GE(TakePatchPeakAlloc(), serial_alloc + 3 * (256 << 10));
+
+    // Truncated blocks
+    std::string truncated = make_patch(bz_ctrl, zst_diff.substr(0, zst_diff.size() / 2),
+                                       bz_extra);
+    ASSERT_NE(0, ApplyToSink(old_data, truncated, &sink));
+    truncated = make_patch(bz_ctrl, zst_diff, bz_extra.substr(0, bz_extra.size() / 2));
+    ASSERT_NE(0, ApplyToSink(old_data, truncated, &sink));
+    truncated = make_patch(bzip2(ctrl.substr(0, 24)), zst_diff, bz_extra);
+    ASSERT_NE(0, ApplyToSink(old_data, truncated, &sink));
+
+    // Failures while the decoders are blocked on full rings: a corrupt
+    // control, and an output write that fails.
+    std::string corrupt_ctrl = ctrl;
+    corrupt_ctrl[24 + 7] |= 0x80;
+    std::string corrupt = make_patch(bzip2(corrupt_ctrl), zst_diff, bz_extra);
+    ASSERT_NE(0, ApplyToSink(old_data, corrupt, &sink));
+    sink.limit = 0;
+    ASSERT_NE(0, ApplyToSink(old_data, patch_data, &sink));
+    sink.limit = SIZE_MAX;
+
+    // Below the threshold, the blocks are decoded on demand.
+    SetBSDiffPipeline(expected.size() + 1, true);
+    TakePatchPeakAlloc();
+    ASSERT_EQ(0, ApplyToSink(old_data, patch_data, &sink));
+    ASSERT_EQ(expected, sink.data);
+    ASSERT_EQ(serial_alloc, TakePatchPeakAlloc());
+
+    SetBSDiffPipeline(256 << 10, false);
+}
+
+static std::string Deflate(const std::string& data) {
+    z_stream strm = {};
+    std::vector<char> out(deflateBound(&strm, data.size()) + 64);
+    if (deflateInit2(&strm, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return "";
+    }
+    strm.next_in = reinterpret_cast<unsigned char*>(const_cast<char*>(data.data()));
+    strm.avail_in = data.size();
+    strm.next_out = reinterpret_cast<unsigned char*>(out.data());
+    strm.avail_out = out.size();
+    int ret = deflate(&strm, Z_FINISH);
+    deflateEnd(&strm);
+    return ret == Z_STREAM_END ? std::string(out.data(), strm.total_out) : "";
+}
+
+static void Append4(std::string* s, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        s->push_back(value >> (i * 8));
+    }
+}
+
+static void Append8(std::string* s, uint64_t value) {
+    unsigned char buf[8];
+    offtout(value, buf);
+    s->append(reinterpret_cast<char*>(buf), sizeof(buf));
+}
+
+static ssize_t StringSink(const unsigned char* data, ssize_t size, void* token) {
+    reinterpret_cast<std::string*>(token)->append(reinterpret_cast<const char*>(data), size);
+    return size;
+}
+
+// Deflate chunks patched on several threads come out, and are hashed, in
+// the order of the patch, between the raw chunks around them, whatever the
+// number of chunks allowed in flight.
+TEST(ImagePatchTest, DeflateChunksInOrder) {
+    const int kChunks = 12;
+    std::string old_data;
+    std::string chunk_headers;
+    std::string patches;
+    std::string expected;
+    std::vector<std::string> chunk_patches;
+    for (int i = 0; i < kChunks; ++i) {
+        std::string src(1000 + i * 3000, 'a' + i);
+        std::string tgt;
+        for (size_t j = 0; j < src.size(); ++j) {
+            tgt.push_back(j % 7 == 0 ? rand() % 4 + 'A' : 'a' + i);
+        }
+        std::string src_deflated = Deflate(src);
+        std::string tgt_deflated = Deflate(tgt);
+        ASSERT_FALSE(src_deflated.empty() || tgt_deflated.empty());
+
+        // A bsdiff patch that takes the whole target from its extra block.
+        std::string ctrl;
+        Append8(&ctrl, 0);
+        Append8(&ctrl, tgt.size());
+        Append8(&ctrl, 0);
+        std::string bz_ctrl = bzip2(ctrl);
+        std::string bz_diff = bzip2("");
+        std::string bz_extra = bzip2(tgt);
+        std::string patch = "BSDIFF40";
+        Append8(&patch, bz_ctrl.size());
+        Append8(&patch, bz_diff.size());
+        Append8(&patch, tgt.size());
+        chunk_patches.push_back(patch + bz_ctrl + bz_diff + bz_extra);
+
+        Append4(&chunk_headers, CHUNK_DEFLATE);
+        Append8(&chunk_headers, old_data.size());
+        Append8(&chunk_headers, src_deflated.size());
+        chunk_headers.append(8, '\0');          // the patch offset, filled in below
+        Append8(&chunk_headers, src.size());
+        Append8(&chunk_headers, tgt.size());
+        Append4(&chunk_headers, 6);
+        Append4(&chunk_headers, Z_DEFLATED);
+        Append4(&chunk_headers, -15);
+        Append4(&chunk_headers, 8);
+        Append4(&chunk_headers, Z_DEFAULT_STRATEGY);
+        old_data += src_deflated;
+        expected += tgt_deflated;
+
+        std::string raw(i + 1, '0' + i);
+        Append4(&chunk_headers, CHUNK_RAW);
+        Append4(&chunk_headers, raw.size());
+        chunk_headers += raw;
+        expected += raw;
+    }
+
+    std::string patch_data = "IMGDIFF2";
+    Append4(&patch_data, kChunks * 2);
+    size_t offset = patch_data.size() + chunk_headers.size();
+    for (int i = 0, pos = 0; i < kChunks; ++i) {
+        std::string patch_offset;
+        Append8(&patch_offset, offset);
+        chunk_headers.replace(pos + 4 + 16, 8, patch_offset);
+        offset += chunk_patches[i].size();
+        pos += 4 + 60 + 4 + 4 + i + 1;
+    }
+    patch_data += chunk_headers;
+    for (const auto& p : chunk_patches) {
+        patch_data += p;
+    }
+
+    Value patch;
+    patch.type = VAL_BLOB;
+    patch.size = patch_data.size();
+    patch.data = &patch_data[0];
+
+    uint8_t expected_sha1[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const uint8_t*>(expected.data()), expected.size(), expected_sha1);
+
+    const int settings[][2] = { { 1, 1 }, { 4, 1 }, { 4, 3 }, { 16, 64 } };
+    for (const auto& s : settings) {
+        SetImagePatchParallelism(s[0], s[1]);
+        std::string output;
+        SHA_CTX ctx;
+        SHA1_Init(&ctx);
+        ASSERT_EQ(0, ApplyImagePatch(reinterpret_cast<const unsigned char*>(old_data.data()),
+                                     old_data.size(), &patch, &StringSink, &output, &ctx,
+                                     nullptr));
+        uint8_t sha1[SHA_DIGEST_LENGTH];
+        SHA1_Final(sha1, &ctx);
+        ASSERT_EQ(expected, output) << s[0] << " threads, " << s[1] << " chunks";
+        ASSERT_EQ(0, memcmp(expected_sha1, sha1, SHA_DIGEST_LENGTH));
+    }
+
+    // A chunk that fails to patch fails the whole patch.
+    size_t bad = offset - chunk_patches[kChunks - 1].size() - chunk_patches[kChunks - 2].size();
+    patch_data[bad] ^= 0xff;
+    SetImagePatchParallelism(4, 2);
+    std::string output;
+    ASSERT_NE(0, ApplyImagePatch(reinterpret_cast<const unsigned char*>(old_data.data()),
+                                 old_data.size(), &patch, &StringSink, &output, nullptr,
+                                 nullptr));
+    patch_data[bad] ^= 0xff;
+
+    // So does a raw chunk with a negative length, which also stops the
+    // search for the deflate chunks after it.
+    size_t raw_len = 12;
+    for (int i = 0; i < 5; ++i) {
+        raw_len += 4 + 60 + 4 + 4 + i + 1;
+    }
+    raw_len += 4 + 60 + 4;
+    std::string negative;
+    Append4(&negative, 0xffffffff);
+    patch_data.replace(raw_len, 4, negative);
+    for (int threads : { 1, 4 }) {
+        SetImagePatchParallelism(threads, 2);
+        ASSERT_NE(0, ApplyImagePatch(reinterpret_cast<const unsigned char*>(old_data.data()),
+                                     old_data.size(), &patch, &StringSink, &output, nullptr,
+                                     nullptr));
+    }
+    SetImagePatchParallelism(1, 1);
+}
@@ -0,0 +1,528 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agree to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android-base/test_utils.h>
+#include <bzlib.h>
+#include <cutils/properties.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#include "edify/expr.h"
+#include "minzip/SysUtil.h"
+#include "minzip/Zip.h"
+#include "openssl/sha.h"
+#include "print_sha1.h"
+#include "updater/blockimg.h"
+#include "updater/transfer_list_encoder.h"
+#include "updater/updater.h"
+
+struct selabel_handle* sehandle = nullptr;
+
+static const size_t kBlockSize = 4096;
+
+static std::string sha1(const std::string& data) {
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const uint8_t*>(data.data()), data.size(), digest);
+    return print_sha1(digest);
+}
+
+static std::string random_blocks(size_t count) {
+    std::string data(count * kBlockSize, '\0');
+    for (auto& c : data) {
+        c = rand();
+    }
+    return data;
+}
+
+static std::string blocks(const std::string& image, size_t first, size_t end) {
+    return image.substr(first * kBlockSize, (end - first) * kBlockSize);
+}
+
+static void set_blocks(std::string& image, size_t first, const std::string& data) {
+    image.replace(first * kBlockSize, data.size(), data);
+}
+
+static std::string range(size_t first, size_t end) {
+    return android::base::StringPrintf("2,%zu,%zu", first, end);
+}
+
+// Returns a version 4 transfer list with the given commands.
+static std::string transfer_list(size_t total_blocks, size_t stash_entries,
+                                 size_t stash_max_blocks, const std::vector<std::string>& commands) {
+    return android::base::StringPrintf("4\n%zu\n%zu\n%zu\n", total_blocks, stash_entries,
+                                       stash_max_blocks) +
+           android::base::Join(commands, '\n') + "\n";
+}
+
+static void append4(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out += static_cast<char>(value >> (i * 8));
+    }
+}
+
+static void append2(std::string& out, uint16_t value) {
+    out += static_cast<char>(value);
+    out += static_cast<char>(value >> 8);
+}
+
+static void append8(std::string& out, uint64_t value) {
+    for (int i = 0; i < 8; ++i) {
+        out += static_cast<char>(value >> (i * 8));
+    }
+}
+
+static std::string bz2(const std::string& data) {
+    unsigned int size = data.size() + data.size() / 100 + 600;
+    std::string out(size, '\0');
+    int ret = BZ2_bzBuffToBuffCompress(&out[0], &size, const_cast<char*>(data.data()),
+                                       data.size(), 9, 0, 0);
+    EXPECT_EQ(BZ_OK, ret);
+    out.resize(size);
+    return out;
+}
+
+// Returns a bsdiff patch that leaves 'size' bytes as they are, with the
+// given magic.
+static std::string identity_bsdiff(size_t size, const char* magic) {
+    std::string ctrl;
+    append8(ctrl, size);
+    append8(ctrl, 0);
+    append8(ctrl, 0);
+    std::string ctrl_block = bz2(ctrl);
+    std::string diff_block = bz2(std::string(size, '\0'));
+
+    std::string patch = magic;
+    append8(patch, ctrl_block.size());
+    append8(patch, diff_block.size());
+    append8(patch, size);
+    return patch + ctrl_block + diff_block + bz2("");
+}
+
+// Returns a zip archive holding 'entries' stored, as the updater needs the
+// transfer list and patch data to be.
+static std::string stored_zip(const std::vector<std::pair<std::string, std::string>>& entries) {
+    std::string zip;
+    std::string directory;
+    for (const auto& entry : entries) {
+        uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(entry.second.data()),
+                             entry.second.size());
+        uint32_t offset = zip.size();
+
+        append4(zip, 0x04034b50);
+        append2(zip, 10);                   // version needed
+        append2(zip, 0);                    // flags
+        append2(zip, 0);                    // stored
+        append4(zip, 0);                    // time and date
+        append4(zip, crc);
+        append4(zip, entry.second.size());
+        append4(zip, entry.second.size());
+        append2(zip, entry.first.size());
+        append2(zip, 0);                    // extra length
+        zip += entry.first + entry.second;
+
+        append4(directory, 0x02014b50);
+        append2(directory, 10);             // version made by
+        append2(directory, 10);             // version needed
+        append2(directory, 0);
+        append2(directory, 0);
+        append4(directory, 0);
+        append4(directory, crc);
+        append4(directory, entry.second.size());
+        append4(directory, entry.second.size());
+        append2(directory, entry.first.size());
+        append2(directory, 0);              // extra length
+        append2(directory, 0);              // comment length
+        append2(directory, 0);              // disk
+        append2(directory, 0);              // internal attributes
+        append4(directory, 0);              // external attributes
+        append4(directory, offset);
+        directory += entry.first;
+    }
+
+    uint32_t directory_offset = zip.size();
+    zip += directory;
+    append4(zip, 0x06054b50);
+    append2(zip, 0);
+    append2(zip, 0);
+    append2(zip, entries.size());
+    append2(zip, entries.size());
+    append4(zip, directory.size());
+    append4(zip, directory_offset);
+    append2(zip, 0);
+    return zip;
+}
+
+// Sets a property for the lifetime of the object.
+class ScopedProperty {
+  public:
+    ScopedProperty(const char* key, const char* value) : key_(key) {
+        property_set(key_, value);
+    }
+    ~ScopedProperty() {
+        property_set(key_, "");
+    }
+
+  private:
+    const char* key_;
+};
+
+static std::string transfer_list_blob;
+
+// Returns the transfer list of the package as a blob, the way
+// package_extract_file() hands it to the updater script.
+static Value* TransferListFn(const char* name, State* state, int argc, Expr* argv[]) {
+    Value* v = static_cast<Value*>(malloc(sizeof(Value)));
+    v->type = VAL_BLOB;
+    v->size = transfer_list_blob.size();
+    v->data = static_cast<char*>(malloc(v->size));
+    memcpy(v->data, transfer_list_blob.data(), v->size);
+    return v;
+}
+
+// Runs the block image functions on a partition image in a file, from a
+// package holding the transfer list, new data and patch data.
+class BlockImageTest : public ::testing::Test {
+  protected:
+    virtual void SetUp() override {
+        RegisterBuiltins();
+        RegisterBlockImageFunctions();
+        FinishRegistration();
+    }
+
+    void WritePackage(const std::string& transfer_list, const std::string& new_data,
+                      const std::string& patch_data = "") {
+        transfer_list_blob = transfer_list;
+        ASSERT_TRUE(android::base::WriteStringToFile(stored_zip({
+                { "system.transfer.list", transfer_list },
+                { "system.new.dat", new_data },
+                { "system.patch.dat", patch_data } }), package_.path));
+    }
+
+    void WriteImage(const std::string& image) {
+        ASSERT_TRUE(android::base::WriteStringToFile(image, image_.path));
+    }
+
+    std::string ReadImage() {
+        std::string image;
+        android::base::ReadFileToString(image_.path, &image);
+        return image;
+    }
+
+    // Calls block_image_verify() or block_image_update() on the image and
+    // returns whether it succeeded. The transfer list is passed as a blob,
+    // or by its name in the package if 'list_by_name' is set.
+    bool Run(const char* function, bool list_by_name = false) {
+        MemMapping map;
+        if (sysMapFile(package_.path, &map) != 0) {
+            ADD_FAILURE() << "failed to map " << package_.path;
+            return false;
+        }
+        ZipArchive za;
+        if (mzOpenZipArchive(map.addr, map.length, &za) != 0) {
+            sysReleaseMap(&map);
+            ADD_FAILURE() << "failed to open " << package_.path;
+            return false;
+        }
+
+        FILE* cmd_pipe = fopen("/dev/null", "w");
+        UpdaterInfo ui;
+        ui.cmd_pipe = cmd_pipe;
+        ui.package_zip = &za;
+        ui.version = 4;
+        ui.package_zip_addr = map.addr;
+        ui.package_zip_len = map.length;
+
+        char script[] = "";
+        State state;
+        state.cookie = &ui;
+        state.script = script;
+        state.errmsg = nullptr;
+
+        const char* args[] = { image_.path, "system.transfer.list", "system.new.dat",
+                               "system.patch.dat" };
+        Expr exprs[4];
+        Expr* argv[4];
+        for (size_t i = 0; i < 4; ++i) {
+            exprs[i] = { Literal, args[i], 0, nullptr, 0, 0 };
+            argv[i] = &exprs[i];
+        }
+        if (!list_by_name) {
+            exprs[1] = { TransferListFn, "transfer_list", 0, nullptr, 0, 0 };
+        }
+
+        Value* result = FindFunction(function)(function, &state, 4, argv);
+        bool success = result != nullptr && result->data[0] != '\0';
+        FreeValue(result);
+        free(state.errmsg);
+        fclose(cmd_pipe);
+        mzCloseZipArchive(&za);
+        sysReleaseMap(&map);
+        return success;
+    }
+
+    TemporaryFile package_;
+    TemporaryFile image_;
+};
+
+TEST_F(BlockImageTest, ParallelMatchesSerial) {
+    std::string src = random_blocks(64);
+    std::string new_data = random_blocks(8);
+    std::string stash_id = sha1(blocks(src, 0, 4));
+
+    // Each of the first commands conflicts with the one before it: the move
+    // overwrites the source of the stash, the new data the source of the
+    // move, and the next move and free use the stash.
+    std::vector<std::string> commands = {
+        "stash " + stash_id + " " + range(0, 4),
+        "move " + sha1(blocks(src, 8, 12)) + " " + range(0, 4) + " 4 " + range(8, 12),
+        "new " + range(8, 12),
+        "move " + stash_id + " " + range(16, 20) + " 4 - " + stash_id + ":" + range(0, 4),
+        "free " + stash_id,
+        "zero " + range(20, 24),
+    };
+    std::string expected = src;
+    set_blocks(expected, 0, blocks(src, 8, 12));
+    set_blocks(expected, 8, blocks(new_data, 0, 4));
+    set_blocks(expected, 16, blocks(src, 0, 4));
+    set_blocks(expected, 20, std::string(4 * kBlockSize, '\0'));
+
+    // The rest are independent of each other.
+    for (size_t i = 0; i < 8; ++i) {
+        size_t from = 40 + i * 2;
+        size_t to = 24 + i * 2;
+        commands.push_back("move " + sha1(blocks(src, from, from + 2)) + " " +
+                           range(to, to + 2) + " 2 " + range(from, from + 2));
+        set_blocks(expected, to, blocks(src, from, from + 2));
+    }
+    commands.push_back("new " + range(56, 60));
+    set_blocks(expected, 56, blocks(new_data, 4, 8));
+
+    WritePackage(transfer_list(36, 1, 4, commands), new_data);
+
+    WriteImage(src);
+    ASSERT_TRUE(Run("block_image_verify"));
+    ASSERT_TRUE(Run("block_image_update"));
+    ASSERT_EQ(expected, ReadImage());
+
+    ScopedProperty workers("updater.blockimg.workers", "4");
+    WriteImage(src);
+    ASSERT_TRUE(Run("block_image_update"));
+    ASSERT_EQ(expected, ReadImage());
+}
+
+TEST_F(BlockImageTest, ResumesAfterCheckpoint) {
+    std::string src = random_blocks(32);
+    std::string new_data = random_blocks(12);
+    std::string patch = identity_bsdiff(4 * kBlockSize, "BSDIFF40");
+    std::string corrupt_patch = identity_bsdiff(4 * kBlockSize, "BSDIFF41");
+    ASSERT_EQ(patch.size(), corrupt_patch.size());
+    std::vector<std::string> commands = {
+        "new " + range(0, 4),
+        "move " + sha1(blocks(src, 16, 20)) + " " + range(4, 8) + " 4 " + range(16, 20),
+        "new " + range(8, 12),
+        "zero " + range(12, 16),
+        android::base::StringPrintf("bsdiff 0 %zu ", patch.size()) + sha1(blocks(src, 24, 28)) +
+                " " + sha1(blocks(src, 24, 28)) + " " + range(28, 32) + " 4 " + range(24, 28),
+        "new " + range(20, 24),
+    };
+    std::string list = transfer_list(24, 0, 0, commands);
+
+    // Record a checkpoint after every command, and fail at the bsdiff, which
+    // leaves the first four commands completed.
+    ScopedProperty sync_bytes("updater.blockimg.sync_bytes", "4096");
+    WritePackage(list, new_data.substr(0, 8 * kBlockSize), corrupt_patch);
+    WriteImage(src);
+    ASSERT_FALSE(Run("block_image_update"));
+
+    // Commands that are recorded as completed aren't executed again, so
+    // blocks they wrote that get changed in the meantime stay changed.
+    std::string image = ReadImage();
+    std::string marker(4 * kBlockSize, 'x');
+    set_blocks(image, 0, marker);
+    set_blocks(image, 12, marker);
+    WriteImage(image);
+
+    // The resumed run still has to skip the new data of the completed
+    // commands to give the last 'new' its own.
+    WritePackage(list, new_data, patch);
+    ASSERT_TRUE(Run("block_image_update"));
+
+    std::string expected = src;
+    set_blocks(expected, 0, marker);
+    set_blocks(expected, 4, blocks(src, 16, 20));
+    set_blocks(expected, 8, blocks(new_data, 4, 8));
+    set_blocks(expected, 12, marker);
+    set_blocks(expected, 20, blocks(new_data, 8, 12));
+    set_blocks(expected, 28, blocks(src, 24, 28));
+    ASSERT_EQ(expected, ReadImage());
+}
+
+TEST_F(BlockImageTest, BinaryListMatchesText) {
+    std::string src = random_blocks(32);
+    std::string new_data = random_blocks(4);
+    std::string stash_id = sha1(blocks(src, 0, 4));
+    std::string list = transfer_list(16, 1, 4, {
+        "stash " + stash_id + " " + range(0, 4),
+        "move " + sha1(blocks(src, 8, 12)) + " " + range(0, 4) + " 4 " + range(8, 12),
+        "move " + stash_id + " " + range(12, 16) + " 4 - " + stash_id + ":" + range(0, 4),
+        "free " + stash_id,
+        "new " + range(16, 20),
+        "zero " + range(20, 24),
+    });
+    std::string binary;
+    ASSERT_TRUE(EncodeTransferList(list, binary));
+    ASSERT_NE(list, binary);
+
+    std::string expected = src;
+    set_blocks(expected, 0, blocks(src, 8, 12));
+    set_blocks(expected, 12, blocks(src, 0, 4));
+    set_blocks(expected, 16, new_data);
+    set_blocks(expected, 20, std::string(4 * kBlockSize, '\0'));
+
+    WritePackage(binary, new_data);
+    WriteImage(src);
+    ASSERT_TRUE(Run("block_image_verify"));
+    ASSERT_TRUE(Run("block_image_update"));
+    ASSERT_EQ(expected, ReadImage());
+
+    // The same list read straight from the package.
+    WriteImage(src);
+    ASSERT_TRUE(Run("block_image_verify", true));
+    ASSERT_TRUE(Run("block_image_update", true));
+    ASSERT_EQ(expected, ReadImage());
+
+    // A source that doesn't match its hash fails the same way as in text.
+    set_blocks(src, 8, std::string(kBlockSize, 'x'));
+    WriteImage(src);
+    ASSERT_FALSE(Run("block_image_verify"));
+}
+
+TEST_F(BlockImageTest, StreamsMovesThroughWindow) {
+    std::string src = random_blocks(64);
+    std::string stash_id = sha1(blocks(src, 48, 52));
+    std::string stashed_src = blocks(src, 52, 64) + blocks(src, 48, 52);
+
+    // Both sources are four times the window, and the second one has its
+    // last blocks in a stash.
+    std::vector<std::string> commands = {
+        "stash " + stash_id + " " + range(48, 52),
+        "move " + sha1(blocks(src, 0, 16)) + " " + range(16, 32) + " 16 " + range(0, 16),
+        "move " + sha1(stashed_src) + " " + range(32, 48) + " 16 " + range(52, 64) + " " +
+                range(0, 12) + " " + stash_id + ":" + range(12, 16),
+        "free " + stash_id,
+    };
+    std::string expected = src;
+    set_blocks(expected, 16, blocks(src, 0, 16));
+    set_blocks(expected, 32, stashed_src);
+
+    WritePackage(transfer_list(32, 1, 4, commands), "");
+    ScopedProperty move_window("updater.blockimg.move_window", "16384");
+
+    WriteImage(src);
+    ASSERT_TRUE(Run("block_image_verify"));
+    ASSERT_TRUE(Run("block_image_update"));
+    ASSERT_EQ(expected, ReadImage());
+
+    // With the sources hashed ahead by the verify pool.
+    ScopedProperty verify_threads("updater.blockimg.verify_threads", "2");
+    WriteImage(src);
+    ASSERT_TRUE(Run("block_image_verify"));
+    ASSERT_EQ(src, ReadImage());
+}
+
+TEST_F(BlockImageTest, StreamedMoveRejectsCorruptSource) {
+    std::string src = random_blocks(32);
+    std::vector<std::string> commands = {
+        "move " + sha1(blocks(src, 0, 16)) + " " + range(16, 32) + " 16 " + range(0, 16),
+    };
+    WritePackage(transfer_list(16, 0, 0, commands), "");
+    ScopedProperty move_window("updater.blockimg.move_window", "16384");
+
+    std::string corrupt = src;
+    set_blocks(corrupt, 5, random_blocks(1));
+
+    WriteImage(corrupt);
+    ASSERT_FALSE(Run("block_image_verify"));
+    ASSERT_FALSE(Run("block_image_update"));
+    ASSERT_EQ(corrupt, ReadImage());
+
+    ScopedProperty verify_threads("updater.blockimg.verify_threads", "2");
+    ASSERT_FALSE(Run("block_image_verify"));
+    ASSERT_EQ(corrupt, ReadImage());
+}
+
+TEST_F(BlockImageTest, StopsNewDataThreadOnFailure) {
+    // The new data is larger than the ring, so the new data thread is still
+    // waiting for room when the update fails at its first command.
+    ScopedProperty ring("updater.blockimg.new_data_buffer", "65536");
+    std::string src = random_blocks(96);
+    std::string new_data = random_blocks(64);
+    WritePackage(transfer_list(96, 0, 0, {
+        "move " + sha1(std::string(4 * kBlockSize, 'x')) + " " + range(0, 4) + " 4 " +
+                range(8, 12),
+        "new " + range(32, 96),
+    }), new_data);
+    WriteImage(src);
+    ASSERT_FALSE(Run("block_image_update"));
+
+    // The thread has been stopped and joined, and a new update starts afresh.
+    WritePackage(transfer_list(96, 0, 0, { "new " + range(32, 96) }), new_data);
+    ASSERT_TRUE(Run("block_image_update"));
+    std::string expected = src;
+    set_blocks(expected, 32, new_data);
+    ASSERT_EQ(expected, ReadImage());
+}
+
+TEST_F(BlockImageTest, RejectsCorruptCompressedNewData) {
+    std::string src = random_blocks(8);
+    std::string new_data = random_blocks(4);
+    std::string list = transfer_list(8, 0, 0, { "new " + range(0, 4) });
+
+    std::string zst(ZSTD_compressBound(new_data.size()), '\0');
+    size_t size = ZSTD_compress(&zst[0], zst.size(), new_data.data(), new_data.size(), 3);
+    ASSERT_FALSE(ZSTD_isError(size));
+    zst.resize(size);
+
+    // A truncated frame is a decoding error, not new data that ends early.
+    ASSERT_TRUE(android::base::WriteStringToFile(stored_zip({
+            { "system.transfer.list", list },
+            { "system.new.dat.zst", zst.substr(0, zst.size() / 2) },
+            { "system.patch.dat", "" } }), package_.path));
+    transfer_list_blob = list;
+    WriteImage(src);
+    ASSERT_FALSE(Run("block_image_update"));
+
+    ASSERT_TRUE(android::base::WriteStringToFile(stored_zip({
+            { "system.transfer.list", list },
+            { "system.new.dat.zst", zst },
+            { "system.patch.dat", "" } }), package_.path));
+    ASSERT_TRUE(Run("block_image_update"));
+    std::string expected = src;
+    set_blocks(expected, 0, new_data);
+    ASSERT_EQ(expected, ReadImage());
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "applypatch/add_bytes.h"
+
+static std::vector<uint8_t> RandomBytes(size_t size) {
+    std::vector<uint8_t> data(size);
+    for (auto& b : data) {
+        b = rand();
+    }
+    return data;
+}
+
+// Runs a kernel on every length up to a few vectors and a few longer ones,
+// at every combination of misalignments of the two buffers, and checks that
+// it adds exactly the bytes in range and nothing else.
+static void CheckKernel(const AddBytesKernel& kernel) {
+    const size_t kGuard = 64;
+    std::vector<size_t> lengths;
+    for (size_t len = 0; len <= 200; ++len) {
+        lengths.push_back(len);
+    }
+    lengths.push_back(4095);
+    lengths.push_back(4096);
+    lengths.push_back(65537);
+
+    for (size_t len : lengths) {
+        for (size_t dst_off = 0; dst_off < 33; dst_off += (len > 200 ? 8 : 1)) {
+            for (size_t src_off = 0; src_off < 33; src_off += (len > 200 ? 8 : 3)) {
+                std::vector<uint8_t> dst = RandomBytes(len + kGuard * 2);
+                std::vector<uint8_t> src = RandomBytes(len + kGuard * 2);
+
+                std::vector<uint8_t> expected = dst;
+                for (size_t i = 0; i < len; ++i) {
+                    expected[kGuard + dst_off + i] += src[kGuard + src_off + i];
+                }
+
+                kernel.fn(dst.data() + kGuard + dst_off, src.data() + kGuard + src_off, len);
+                ASSERT_EQ(expected, dst) << kernel.name << ": len " << len << ", dst offset "
+                                         << dst_off << ", src offset " << src_off;
+            }
+        }
+    }
+}
+
+TEST(AddBytesTest, KernelsMatchScalar) {
+    std::vector<AddBytesKernel> kernels = GetAddBytesKernels();
+    ASSERT_FALSE(kernels.empty());
+    for (const auto& kernel : kernels) {
+        CheckKernel(kernel);
+    }
+}
+
+TEST(AddBytesTest, DefaultKernel) {
+    CheckKernel({ "default", AddBytes });
+}
+
+TEST(AddBytesTest, InPlace) {
+    for (const auto& kernel : GetAddBytesKernels()) {
+        std::vector<uint8_t> data = RandomBytes(1000);
+        std::vector<uint8_t> expected = data;
+        for (auto& b : expected) {
+            b *= 2;
+        }
+
+        kernel.fn(data.data() + 1, data.data() + 1, data.size() - 1);
+        expected[0] = data[0];
+        ASSERT_EQ(expected, data) << kernel.name;
+    }
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "updater/stash_format.h"
+
+static const size_t kBlockSize = 4096;
+
+// Returns 'blocks' blocks of text-like data, which compresses well.
+static std::vector<uint8_t> compressible_blocks(size_t blocks) {
+    std::vector<uint8_t> data(blocks * kBlockSize);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = "stash"[i % 5] + (i / 1000) % 3;
+    }
+    return data;
+}
+
+static std::vector<uint8_t> random_blocks(size_t blocks) {
+    std::vector<uint8_t> data(blocks * kBlockSize);
+    for (auto& c : data) {
+        c = rand();
+    }
+    return data;
+}
+
+TEST(StashFormatTest, RoundTrip) {
+    std::vector<uint8_t> data = compressible_blocks(8);
+    std::vector<uint8_t> stash;
+    ASSERT_TRUE(CompressStash(data.data(), 8, kBlockSize, stash));
+    ASSERT_LT(stash.size(), data.size());
+    ASSERT_TRUE(IsCompressedStash(stash.data(), stash.size()));
+
+    // The buffer is only grown, and may be larger than the stash.
+    std::vector<uint8_t> buffer(16 * kBlockSize, 'x');
+    size_t blocks = 0;
+    ASSERT_TRUE(DecompressStash(stash.data(), stash.size(), kBlockSize, buffer, &blocks));
+    ASSERT_EQ(8U, blocks);
+    ASSERT_EQ(16 * kBlockSize, buffer.size());
+    ASSERT_EQ(0, memcmp(data.data(), buffer.data(), data.size()));
+
+    buffer.clear();
+    ASSERT_TRUE(DecompressStash(stash.data(), stash.size(), kBlockSize, buffer, &blocks));
+    ASSERT_EQ(data, buffer);
+}
+
+TEST(StashFormatTest, IncompressibleBlocks) {
+    std::vector<uint8_t> data = random_blocks(4);
+    std::vector<uint8_t> stash;
+    ASSERT_FALSE(CompressStash(data.data(), 4, kBlockSize, stash));
+
+    // Raw stashes aren't mistaken for compressed ones, even if they start
+    // with the magic.
+    memcpy(data.data(), COMPRESSED_STASH_MAGIC, COMPRESSED_STASH_MAGIC_SIZE);
+    ASSERT_FALSE(IsCompressedStash(data.data(), data.size()));
+}
+
+TEST(StashFormatTest, RejectsTruncatedStash) {
+    std::vector<uint8_t> data = compressible_blocks(8);
+    std::vector<uint8_t> stash;
+    ASSERT_TRUE(CompressStash(data.data(), 8, kBlockSize, stash));
+
+    std::vector<uint8_t> buffer;
+    size_t blocks;
+    for (size_t size = 0; size < stash.size(); ++size) {
+        ASSERT_FALSE(DecompressStash(stash.data(), size, kBlockSize, buffer, &blocks)) << size;
+    }
+
+    // A header that agrees with the truncated size.
+    CompressedStashHeader header;
+    memcpy(&header, stash.data(), sizeof(header));
+    header.compressed_size -= 1;
+    memcpy(stash.data(), &header, sizeof(header));
+    ASSERT_FALSE(DecompressStash(stash.data(), stash.size() - 1, kBlockSize, buffer, &blocks));
+}
+
+TEST(StashFormatTest, RejectsCorruptStash) {
+    std::vector<uint8_t> data = compressible_blocks(8);
+    std::vector<uint8_t> stash;
+    ASSERT_TRUE(CompressStash(data.data(), 8, kBlockSize, stash));
+
+    std::vector<uint8_t> buffer;
+    size_t blocks;
+
+    // Fewer or more blocks than the stream holds
+    for (uint32_t count : { 0U, 7U, 9U, UINT32_MAX }) {
+        std::vector<uint8_t> corrupt = stash;
+        CompressedStashHeader header;
+        memcpy(&header, corrupt.data(), sizeof(header));
+        header.blocks = count;
+        memcpy(corrupt.data(), &header, sizeof(header));
+        ASSERT_FALSE(DecompressStash(corrupt.data(), corrupt.size(), kBlockSize, buffer,
+                                     &blocks)) << count;
+    }
+
+    // A corrupt deflate stream
+    std::vector<uint8_t> corrupt = stash;
+    corrupt[sizeof(CompressedStashHeader)] = 0xff;
+    ASSERT_FALSE(DecompressStash(corrupt.data(), corrupt.size(), kBlockSize, buffer, &blocks));
+
+    // Trailing data after the stream
+    corrupt = stash;
+    corrupt.push_back(0);
+    CompressedStashHeader header;
+    memcpy(&header, corrupt.data(), sizeof(header));
+    header.compressed_size += 1;
+    memcpy(corrupt.data(), &header, sizeof(header));
+    ASSERT_FALSE(DecompressStash(corrupt.data(), corrupt.size(), kBlockSize, buffer, &blocks));
+}
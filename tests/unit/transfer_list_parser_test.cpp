@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "print_sha1.h"
+#include "updater/transfer_list.h"
+#include "updater/transfer_list_encoder.h"
+#include "updater/transfer_list_parser.h"
+
+static const char* kHashA = "0123456789abcdef0123456789abcdef01234567";
+static const char* kHashB = "fedcba9876543210fedcba9876543210fedcba98";
+
+// A version 4 list with every command and every kind of argument.
+static const std::string kTransferList = std::string("4\n") +
+        "200\n"
+        "2\n"
+        "12\n"
+        "erase 2,100,200\n"
+        "stash " + kHashA + " 2,0,4\n"
+        "move " + kHashB + " 2,10,14 4 2,20,24\n"
+        "move " + kHashA + " 4,30,32,40,42 4 - " + kHashA + ":2,0,4\n"
+        "bsdiff 0 4096 " + kHashA + " " + kHashB + " 2,50,52 5 2,60,62 2,0,2 " + kHashA +
+        ":4,2,4,5,6\n"
+        "imgdiff 4294967296 12 " + kHashB + " " + kHashA + " 2,70,71 1 2,70,71\n"
+        "free " + kHashA + "\n"
+        "stash extra 2,80,88\n"
+        "move " + kHashB + " 2,90,98 8 - extra:2,0,8\n"
+        "free extra\n"
+        "new 4,0,4,8,10\n"
+        "zero 2,120,130\n";
+
+static std::string Encode(const std::string& text) {
+    std::string binary;
+    EXPECT_TRUE(EncodeTransferList(text, binary));
+    return binary;
+}
+
+static void ExpectSameRange(const RangeSet& r1, const RangeSet& r2) {
+    EXPECT_EQ(r1.count, r2.count);
+    EXPECT_EQ(r1.size, r2.size);
+    EXPECT_EQ(r1.pos, r2.pos);
+}
+
+// Checks that every command of 'binary' reads back the same arguments and
+// footprint as the corresponding command of 'text'.
+static void ExpectSameCommands(const TransferList& text, const TransferList& binary) {
+    EXPECT_EQ(text.version, binary.version);
+    EXPECT_EQ(text.total_blocks, binary.total_blocks);
+    EXPECT_EQ(text.stash_entries, binary.stash_entries);
+    EXPECT_EQ(text.stash_max_blocks, binary.stash_max_blocks);
+
+    size_t b = binary.start;
+    for (size_t t = text.start; t < text.end; ++t) {
+        TransferCommand tc;
+        if (!LoadCommand(text, t, tc)) {
+            continue;
+        }
+        ASSERT_LT(b, binary.end);
+        TransferCommand bc;
+        ASSERT_TRUE(LoadCommand(binary, b++, bc));
+
+        ASSERT_STREQ(tc.cmdname, bc.cmdname);
+        ASSERT_EQ(tc.argc, bc.argc);
+        while (tc.cpos < tc.argc) {
+            EXPECT_EQ(ArgIsNone(tc), ArgIsNone(bc)) << tc.cmdline;
+            EXPECT_EQ(NextArg(tc), NextArg(bc)) << tc.cmdline;
+        }
+
+        CommandFootprint tf, bf;
+        ASSERT_EQ(0, GetCommandFootprint(tc, tf)) << tc.cmdline;
+        ASSERT_EQ(0, GetCommandFootprint(bc, bf)) << tc.cmdline;
+        ExpectSameRange(tf.src, bf.src);
+        ExpectSameRange(tf.tgt, bf.tgt);
+        EXPECT_EQ(tf.stash_read, bf.stash_read);
+        EXPECT_EQ(tf.stash_write, bf.stash_write);
+        EXPECT_EQ(tf.new_data, bf.new_data);
+    }
+    EXPECT_EQ(binary.end, b);
+}
+
+TEST(TransferListParserTest, BinaryMatchesText) {
+    std::string binary = Encode(kTransferList);
+    ASSERT_TRUE(IsBinaryTransferList(binary.data(), binary.size()));
+
+    TransferList text_tl = TransferList();
+    TransferList binary_tl = TransferList();
+    std::string error;
+    ASSERT_EQ(0, ParseTransferList(kTransferList.data(), kTransferList.size(), text_tl, error));
+    ASSERT_EQ(0, ParseTransferList(binary.data(), binary.size(), binary_tl, error)) << error;
+    ASSERT_NE(nullptr, binary_tl.header);
+    ExpectSameCommands(text_tl, binary_tl);
+}
+
+TEST(TransferListParserTest, TypedArguments) {
+    std::string binary = Encode(kTransferList);
+    TransferList tl = TransferList();
+    std::string error;
+    ASSERT_EQ(0, ParseTransferList(binary.data(), binary.size(), tl, error));
+
+    // imgdiff 4294967296 12 <hash> <hash> 2,70,71 1 2,70,71
+    TransferCommand cmd;
+    ASSERT_TRUE(LoadCommand(tl, tl.start + 5, cmd));
+    ASSERT_STREQ("imgdiff", cmd.cmdname);
+    size_t value;
+    ASSERT_TRUE(NextUintArg(cmd, &value));
+    EXPECT_EQ(4294967296ULL, value);
+    ASSERT_TRUE(NextUintArg(cmd, &value));
+    EXPECT_EQ(12U, value);
+    EXPECT_EQ(kHashB, NextArg(cmd));
+    EXPECT_EQ(kHashA, NextArg(cmd));
+    RangeSet rs;
+    NextRangeArg(cmd, rs);
+    EXPECT_EQ(std::vector<size_t>({ 70, 71 }), rs.pos);
+
+    // bsdiff ... <hash>:4,2,4,5,6
+    ASSERT_TRUE(LoadCommand(tl, tl.start + 4, cmd));
+    cmd.cpos = cmd.argc - 1;
+    std::string id;
+    ASSERT_TRUE(NextStashArg(cmd, id, rs));
+    EXPECT_EQ(kHashA, id);
+    EXPECT_EQ(3U, rs.size);
+    EXPECT_EQ(std::vector<size_t>({ 2, 4, 5, 6 }), rs.pos);
+}
+
+TEST(TransferListParserTest, DigestArguments) {
+    std::string binary = Encode(kTransferList);
+    for (const std::string& data : { kTransferList, binary }) {
+        TransferList tl = TransferList();
+        std::string error;
+        ASSERT_EQ(0, ParseTransferList(data.data(), data.size(), tl, error));
+
+        // move <hash> ...
+        TransferCommand cmd;
+        ASSERT_TRUE(LoadCommand(tl, tl.start + 2, cmd));
+        ASSERT_STREQ("move", cmd.cmdname);
+        uint8_t digest[TRANSFER_LIST_HASH_SIZE];
+        ASSERT_TRUE(NextDigestArg(cmd, digest));
+        EXPECT_EQ(kHashB, print_sha1(digest));
+
+        // Ranges and stash ids aren't digests.
+        EXPECT_FALSE(NextDigestArg(cmd, digest));
+        ASSERT_TRUE(LoadCommand(tl, tl.start + 7, cmd));
+        ASSERT_STREQ("stash", cmd.cmdname);
+        EXPECT_FALSE(NextDigestArg(cmd, digest));
+    }
+}
+
+TEST(TransferListParserTest, MisalignedBinaryList) {
+    std::string binary = Encode(kTransferList);
+
+    // Lists stored in a package start wherever the entry does.
+    std::vector<char> buffer(binary.size() + 1);
+    char* data = buffer.data() + (reinterpret_cast<uintptr_t>(buffer.data()) % 4 == 0 ? 1 : 0);
+    memcpy(data, binary.data(), binary.size());
+
+    TransferList text_tl = TransferList();
+    TransferList binary_tl = TransferList();
+    std::string error;
+    ASSERT_EQ(0, ParseTransferList(kTransferList.data(), kTransferList.size(), text_tl, error));
+    ASSERT_EQ(0, ParseTransferList(data, binary.size(), binary_tl, error)) << error;
+    ASSERT_FALSE(binary_tl.aligned.empty());
+    ASSERT_NE(reinterpret_cast<const char*>(binary_tl.header), data);
+    ExpectSameCommands(text_tl, binary_tl);
+}
+
+TEST(TransferListParserTest, RejectsTruncatedList) {
+    std::string binary = Encode(kTransferList);
+    for (size_t size = sizeof(TransferListHeader); size < binary.size(); ++size) {
+        TransferList tl = TransferList();
+        std::string error;
+        ASSERT_EQ(-1, ParseTransferList(binary.data(), size, tl, error)) << size;
+    }
+}
+
+// Returns a copy of 'binary' with a table entry of type T at 'offset'
+// changed by 'modify'.
+template <typename T>
+static std::string Modify(const std::string& binary, size_t offset,
+                          std::function<void(T&)> modify) {
+    T value;
+    memcpy(&value, binary.data() + offset, sizeof(T));
+    modify(value);
+    std::string modified = binary;
+    memcpy(&modified[offset], &value, sizeof(T));
+    return modified;
+}
+
+static int Parse(const std::string& binary) {
+    TransferList tl = TransferList();
+    std::string error;
+    return ParseTransferList(binary.data(), binary.size(), tl, error);
+}
+
+TEST(TransferListParserTest, RejectsInvalidReferences) {
+    std::string binary = Encode(kTransferList);
+    ASSERT_EQ(0, Parse(binary));
+
+    TransferListHeader h;
+    memcpy(&h, binary.data(), sizeof(h));
+    size_t commands = sizeof(TransferListHeader);
+    size_t args = commands + h.command_count * sizeof(TransferListCommand);
+    size_t ranges = args + h.arg_count * sizeof(TransferListArg);
+
+    // Find the first argument of each type.
+    std::vector<size_t> first(TL_ARG_COUNT, SIZE_MAX);
+    for (size_t i = h.arg_count; i-- > 0; ) {
+        TransferListArg arg;
+        memcpy(&arg, binary.data() + args + i * sizeof(arg), sizeof(arg));
+        first[arg.type] = args + i * sizeof(arg);
+    }
+    for (size_t type = TL_ARG_RANGE; type < TL_ARG_COUNT; ++type) {
+        ASSERT_NE(SIZE_MAX, first[type]) << type;
+    }
+
+    EXPECT_EQ(-1, Parse(Modify<TransferListHeader>(binary, 0, [](TransferListHeader& h) {
+        h.format++;
+    })));
+    EXPECT_EQ(-2, Parse(Modify<TransferListHeader>(binary, 0, [](TransferListHeader& h) {
+        h.version = 5;
+    })));
+    EXPECT_EQ(-1, Parse(Modify<TransferListHeader>(binary, 0, [](TransferListHeader& h) {
+        h.total_blocks = UINT32_MAX;
+    })));
+    EXPECT_EQ(-1, Parse(Modify<TransferListHeader>(binary, 0, [](TransferListHeader& h) {
+        h.arg_count = UINT32_MAX;
+    })));
+
+    // Commands
+    EXPECT_EQ(-1, Parse(Modify<TransferListCommand>(binary, commands,
+            [](TransferListCommand& c) { c.op = TL_OP_COUNT; })));
+    EXPECT_EQ(-1, Parse(Modify<TransferListCommand>(binary, commands,
+            [&h](TransferListCommand& c) { c.first_arg = h.arg_count; })));
+    EXPECT_EQ(-1, Parse(Modify<TransferListCommand>(binary, commands,
+            [&h](TransferListCommand& c) { c.arg_count = h.arg_count + 1; })));
+
+    // Arguments
+    EXPECT_EQ(-1, Parse(Modify<TransferListArg>(binary, first[TL_ARG_RANGE],
+            [](TransferListArg& a) { a.type = TL_ARG_COUNT; })));
+    EXPECT_EQ(-1, Parse(Modify<TransferListArg>(binary, first[TL_ARG_RANGE],
+            [&h](TransferListArg& a) { a.a = h.range_words - 1; })));
+    EXPECT_EQ(-1, Parse(Modify<TransferListArg>(binary, first[TL_ARG_RANGE],
+            [](TransferListArg& a) { a.a = UINT32_MAX; })));
+    EXPECT_EQ(-1, Parse(Modify<TransferListArg>(binary, first[TL_ARG_HASH],
+            [&h](TransferListArg& a) { a.a = h.hash_count; })));
+    EXPECT_EQ(-1, Parse(Modify<TransferListArg>(binary, first[TL_ARG_STRING],
+            [&h](TransferListArg& a) { a.b = h.string_bytes - a.a + 1; })));
+    EXPECT_EQ(-1, Parse(Modify<TransferListArg>(binary, first[TL_ARG_STRING],
+            [](TransferListArg& a) { a.a = UINT32_MAX; })));
+    EXPECT_EQ(-1, Parse(Modify<TransferListArg>(binary, first[TL_ARG_STASH_HASH],
+            [&h](TransferListArg& a) { a.a = h.hash_count; })));
+    EXPECT_EQ(-1, Parse(Modify<TransferListArg>(binary, first[TL_ARG_STASH_HASH],
+            [&h](TransferListArg& a) { a.c = h.range_words; })));
+    EXPECT_EQ(-1, Parse(Modify<TransferListArg>(binary, first[TL_ARG_STASH_STRING],
+            [&h](TransferListArg& a) { a.a = h.string_bytes; })));
+
+    // Range records: <count> <size> <first> <last>...
+    EXPECT_EQ(-1, Parse(Modify<uint32_t>(binary, ranges, [](uint32_t& count) {
+        count = 0;
+    })));
+    EXPECT_EQ(-1, Parse(Modify<uint32_t>(binary, ranges, [&h](uint32_t& count) {
+        count = h.range_words;
+    })));
+    EXPECT_EQ(-1, Parse(Modify<uint32_t>(binary, ranges + 4, [](uint32_t& size) {
+        size++;
+    })));
+    EXPECT_EQ(-1, Parse(Modify<uint32_t>(binary, ranges + 8, [](uint32_t& first) {
+        first = 1000;
+    })));
+    EXPECT_EQ(-1, Parse(Modify<uint32_t>(binary, ranges + 12, [](uint32_t& last) {
+        last = 0x80000000;
+    })));
+}
@@ -14,10 +14,44 @@
 
 LOCAL_PATH := $(call my-dir)
 
-updater_src_files := \
+# The updater functions, as a library that the recovery tests link too.
+libupdater_src_files := \
 	install.cpp \
 	blockimg.cpp \
-	updater.cpp
+	stash_format.cpp \
+	transfer_list_encoder.cpp \
+	transfer_list_parser.cpp
+
+include $(CLEAR_VARS)
+LOCAL_CLANG := true
+LOCAL_SRC_FILES := $(libupdater_src_files)
+
+LOCAL_STATIC_LIBRARIES += libfec \
+    libfec_rs \
+    libext4_utils_static \
+    libsquashfs_utils \
+    libcrypto_utils_static \
+    libcrypto_static
+
+LOCAL_CFLAGS += -Wno-unused-parameter
+LOCAL_C_INCLUDES += system/extras/ext4_utils
+LOCAL_C_INCLUDES += external/e2fsprogs/lib
+LOCAL_C_INCLUDES += external/e2fsprogs/misc
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+
+ifneq ($(BOARD_RECOVERY_BLDRMSG_OFFSET),)
+    LOCAL_CFLAGS += -DBOARD_RECOVERY_BLDRMSG_OFFSET=$(BOARD_RECOVERY_BLDRMSG_OFFSET)
+endif
+
+ifeq ($(BOARD_SUPPRESS_EMMC_WIPE),true)
+    LOCAL_CFLAGS += -DSUPPRESS_EMMC_WIPE
+endif
+
+LOCAL_STATIC_LIBRARIES += libapplypatch libbase libotafault libedify libmtdutils libminzip
+LOCAL_STATIC_LIBRARIES += libbz libxz libzstd libz libcutils libselinux libtune2fs
+
+LOCAL_MODULE := libupdater
+include $(BUILD_STATIC_LIBRARY)
 
 #
 # Build a statically-linked binary to include in OTA packages
@@ -31,7 +65,9 @@ LOCAL_MODULE_TAGS := eng
 
 LOCAL_CLANG := true
 
-LOCAL_SRC_FILES := $(updater_src_files)
+LOCAL_SRC_FILES := updater.cpp
+
+LOCAL_STATIC_LIBRARIES += libupdater
 
 LOCAL_STATIC_LIBRARIES += libfec \
     libfec_rs \
@@ -49,17 +85,9 @@ LOCAL_STATIC_LIBRARIES += \
 LOCAL_C_INCLUDES += external/e2fsprogs/lib
 LOCAL_STATIC_LIBRARIES += libext2_blkid libext2_uuid
 
-ifneq ($(BOARD_RECOVERY_BLDRMSG_OFFSET),)
-    LOCAL_CFLAGS += -DBOARD_RECOVERY_BLDRMSG_OFFSET=$(BOARD_RECOVERY_BLDRMSG_OFFSET)
-endif
-
-ifeq ($(BOARD_SUPPRESS_EMMC_WIPE),true)
-    LOCAL_CFLAGS += -DSUPPRESS_EMMC_WIPE
-endif
-
 LOCAL_STATIC_LIBRARIES += $(TARGET_RECOVERY_UPDATER_LIBS) $(TARGET_RECOVERY_UPDATER_EXTRA_LIBS)
 LOCAL_STATIC_LIBRARIES += libapplypatch libbase libotafault libedify libmtdutils libminzip libz
-LOCAL_STATIC_LIBRARIES += libbz
+LOCAL_STATIC_LIBRARIES += libbz libxz libzstd
 LOCAL_STATIC_LIBRARIES += libcutils liblog libc
 LOCAL_STATIC_LIBRARIES += libselinux
 tune2fs_static_libraries := \
@@ -127,3 +155,40 @@ LOCAL_32_BIT_ONLY := true
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 
 include $(BUILD_EXECUTABLE)
+
+# Converts transfer lists between the text format and the binary encoding
+# that block_image_update() can execute without parsing.
+include $(CLEAR_VARS)
+LOCAL_CLANG := true
+LOCAL_SRC_FILES := transfer_list_convert.cpp transfer_list_encoder.cpp
+LOCAL_MODULE := transfer_list_convert
+LOCAL_STATIC_LIBRARIES := libbase
+include $(BUILD_HOST_EXECUTABLE)
+
+# Creates the restart index that lets block_image_update() inflate the new
+# data on several threads.
+include $(CLEAR_VARS)
+LOCAL_CLANG := true
+LOCAL_SRC_FILES := new_data_index.cpp
+LOCAL_MODULE := new_data_index
+LOCAL_STATIC_LIBRARIES := libbase libz
+include $(BUILD_HOST_EXECUTABLE)
+
+# Predicts the memory, stash space, I/O and time that applying a transfer
+# list takes on a given storage profile.
+include $(CLEAR_VARS)
+LOCAL_CLANG := true
+LOCAL_SRC_FILES := transfer_list_sim.cpp transfer_list_parser.cpp
+LOCAL_MODULE := transfer_list_sim
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+LOCAL_STATIC_LIBRARIES := libbase libcrypto_static
+include $(BUILD_HOST_EXECUTABLE)
+
+# Measures stash write and load throughput in the raw and the compressed
+# stash file formats.
+include $(CLEAR_VARS)
+LOCAL_CLANG := true
+LOCAL_SRC_FILES := stash_bench.cpp stash_format.cpp
+LOCAL_MODULE := stash_bench
+LOCAL_STATIC_LIBRARIES := libbase libz
+include $(BUILD_HOST_EXECUTABLE)
@@ -19,6 +19,8 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <linux/falloc.h>
 #include <linux/fs.h>
 #include <pthread.h>
 #include <stdarg.h>
@@ -27,28 +29,44 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
 #include <fec/io.h>
-
+#include <xz.h>
+#include <zlib.h>
+#include <zstd.h>
+#include <zstd_errors.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
 #include <map>
 #include <memory>
 #include <string>
 #include <vector>
 
+#include <android-base/file.h>
 #include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 
 #include "applypatch/applypatch.h"
+#include "cutils/properties.h"
 #include "edify/expr.h"
 #include "error_code.h"
 #include "install.h"
 #include "openssl/sha.h"
 #include "minzip/Hash.h"
+#include "new_data_index.h"
 #include "ota_io.h"
 #include "print_sha1.h"
+#include "stash_format.h"
+#include "transfer_list_parser.h"
 #include "unique_fd.h"
 #include "updater.h"
 
@@ -63,129 +81,498 @@
 #define STASH_DIRECTORY_MODE 0700
 #define STASH_FILE_MODE 0600
 
-struct RangeSet {
-    size_t count;             // Limit is INT_MAX.
-    size_t size;
-    std::vector<size_t> pos;  // Actual limit is INT_MAX.
-};
+// Number of threads used to execute transfer list commands. Setting this
+// property to a value greater than one enables the parallel executor for
+// version 3+ transfer lists; see PerformCommandsParallel() below.
+#define WORKERS_PROPERTY "updater.blockimg.workers"
+#define MAX_WORKERS 16
+
+// Maximum number of commands the parallel executor looks ahead of the
+// oldest command that hasn't completed yet.
+#define PARALLEL_WINDOW 256
+
+// Batched syncs for version 3+ transfer lists. When either limit is set, the
+// partition and stashes are synced once this many bytes have been written, or
+// this many milliseconds have passed, instead of after every command. Zero
+// disables the limit; see FlushCheckpoint() below.
+#define SYNC_BYTES_PROPERTY "updater.blockimg.sync_bytes"
+#define SYNC_MS_PROPERTY "updater.blockimg.sync_ms"
+
+#define CHECKPOINT_FILE "checkpoint"
+
+// Bytes of stash data kept in memory instead of /cache for version 3+
+// transfer lists executed serially. Zero keeps every stash on /cache; see
+// CacheStash() below.
+#define STASH_CACHE_PROPERTY "updater.blockimg.stash_cache"
+
+// Move commands of version 3+ lists whose source doesn't overlap their
+// target, and is larger than this many bytes, are copied through a window of
+// this size instead of loading the whole source; see PerformStreamedMove().
+// Zero loads the whole source as before.
+#define MOVE_WINDOW_PROPERTY "updater.blockimg.move_window"
+#define MOVE_WINDOW_SIZE (16 << 20)
+
+// Writes stash files compressed when set to a non-zero value; see
+// stash_format.h. Stashes are loaded in either format regardless.
+#define STASH_COMPRESS_PROPERTY "updater.blockimg.stash_compress"
+
+// Size of the buffer the new data is inflated into ahead of the commands
+// that need it. See NewThreadInfo below.
+#define NEW_DATA_BUFFER_PROPERTY "updater.blockimg.new_data_buffer"
+#define NEW_DATA_BUFFER_SIZE (4 << 20)
+#define MIN_NEW_DATA_BUFFER (64 << 10)
+#define MAX_NEW_DATA_BUFFER (64 << 20)
+
+// Most memory the decoder of new data compressed with xz or zstd may use,
+// which limits the dictionary or window size of the stream it accepts; see
+// FindNewData(). A stream that needs more is rejected.
+#define NEW_DATA_DECODER_MEM_PROPERTY "updater.blockimg.new_data_decoder_mem"
+#define NEW_DATA_DECODER_MEM (64 << 20)
+#define NEW_DATA_DECODE_CHUNK (128 << 10)
+
+// Number of threads that inflate the new data when the package contains a
+// restart index for it (see new_data_index.h). Defaults to the number of
+// online CPUs. Each thread buffers one segment of up to MAX_INFLATE_SEGMENT
+// bytes.
+#define INFLATE_THREADS_PROPERTY "updater.blockimg.inflate_threads"
+#define MAX_INFLATE_THREADS 8
+#define MAX_INFLATE_SEGMENT (32 << 20)
+
+// Number of threads that hash source and target blocks ahead of the commands
+// during verification of a version 3+ transfer list. Defaults to the number
+// of online CPUs; see VerifyPool below.
+#define VERIFY_THREADS_PROPERTY "updater.blockimg.verify_threads"
+#define MAX_VERIFY_THREADS 8
+
+// Number of threads that read blocks through libfec in block_image_recover().
+// Defaults to the number of online CPUs; see RecoverWorker below.
+#define RECOVER_THREADS_PROPERTY "updater.blockimg.recover_threads"
+#define MAX_RECOVER_THREADS 8
+
+// Number of threads that patch the deflate chunks of imgdiff commands ahead
+// of their output, defaulting to the number of online CPUs, and the most
+// chunks past the one being written that are patched or held at once, which
+// bounds the memory they take; see SetImagePatchParallelism().
+#define IMGPATCH_THREADS_PROPERTY "updater.blockimg.imgpatch_threads"
+#define MAX_IMGPATCH_THREADS 8
+#define IMGPATCH_CHUNKS_PROPERTY "updater.blockimg.imgpatch_chunks"
+#define IMGPATCH_CHUNKS 4
+
+// Number of commands ahead of the current one whose source blocks are read
+// into the page cache in advance during an update; see Prefetcher below.
+// Zero disables prefetching.
+#define PREFETCH_PROPERTY "updater.blockimg.prefetch"
+#define PREFETCH_DEPTH 8
+
+// The page cache hits of prefetching are sampled at one command in this
+// many, as counting them maps every source extent of the command.
+#define PREFETCH_SAMPLE_INTERVAL 16
+
+// Bytes of partition writes gathered before they are issued, sorted and
+// merged; see WriteBack below. Zero writes every piece right away.
+#define WRITEBACK_PROPERTY "updater.blockimg.writeback"
+#define WRITEBACK_SIZE (4 << 20)
+
+// Keeps the digests of ranges of a partition that are known from hashing or
+// writing them in an index on /cache, so that checking them again doesn't
+// have to read the blocks; see HashIndex below.
+#define HASH_INDEX_PROPERTY "updater.blockimg.hash_index"
+#define HASH_INDEX_MAGIC "hashindex1"
+
+// s_magic of the ext4 superblock, whose mount fields tell if the partition
+// changed since the index was written.
+#define HASH_INDEX_EXT4_MAGIC 0xEF53
+
+// Number of commands whose writes are announced in the index at once.
+#define HASH_INDEX_BATCH 64
+
+// Reads and writes the partition with O_DIRECT, bypassing the page cache,
+// when set to a non-zero value; see DirectIo below.
+#define DIRECT_IO_PROPERTY "updater.blockimg.direct_io"
+
+// Alignment of the memory, offsets and lengths of direct transfers.
+#define DIRECT_IO_ALIGN BLOCKSIZE
+
+// Statistics of each update are written here, by partition name, besides
+// being logged; see ReportStats().
+#define STATS_FILE_FORMAT "/tmp/blockimg_stats_%s.json"
 
 static CauseCode failure_type = kNoCause;
 static bool is_retry = false;
+static bool compress_stash = false;
 static std::map<std::string, RangeSet> stash_map;
 
-static void parse_range(const std::string& range_text, RangeSet& rs) {
+// Maximum size of a single read or write. Longer transfers are split at
+// multiples of this on the device, so that only their first and last
+// requests can be unaligned.
+#define MAX_IO_SIZE (1 << 20)
+
+// Commands are placed in LATENCY_BUCKETS buckets by how long they took:
+// under 1 ms, from 2^(i-1) up to 2^i ms for bucket i, and the rest in the
+// last one.
+#define LATENCY_BUCKETS 16
+
+// Work done by the commands of one type, or by a thread. Reads, writes and
+// their bytes include the stash files, which are also counted separately.
+struct CommandIoStats {
+    size_t commands;
+    size_t max_calls;                   // reads and writes by a single command
+    size_t reads;
+    size_t writes;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t bytes_hashed;
+    size_t stash_loads;
+    size_t stash_writes;
+    uint64_t stash_bytes_read;
+    uint64_t stash_bytes_written;
+    size_t fsyncs;
+    std::chrono::duration<double> fsync_time;
+    std::chrono::duration<double> time;
+    size_t latency[LATENCY_BUCKETS];
+};
 
-    std::vector<std::string> pieces = android::base::Split(range_text, ",");
-    if (pieces.size() < 3) {
-        goto err;
-    }
+// Counters of the calling thread, updated by the I/O helpers below.
+static thread_local CommandIoStats io;
+
+// Adds the counters of 'after' minus those of 'before' to 'stats'.
+static void AddIoStats(CommandIoStats& stats, const CommandIoStats& after,
+        const CommandIoStats& before) {
+    stats.reads += after.reads - before.reads;
+    stats.writes += after.writes - before.writes;
+    stats.bytes_read += after.bytes_read - before.bytes_read;
+    stats.bytes_written += after.bytes_written - before.bytes_written;
+    stats.bytes_hashed += after.bytes_hashed - before.bytes_hashed;
+    stats.stash_loads += after.stash_loads - before.stash_loads;
+    stats.stash_writes += after.stash_writes - before.stash_writes;
+    stats.stash_bytes_read += after.stash_bytes_read - before.stash_bytes_read;
+    stats.stash_bytes_written += after.stash_bytes_written - before.stash_bytes_written;
+    stats.fsyncs += after.fsyncs - before.fsyncs;
+    stats.fsync_time += after.fsync_time - before.fsync_time;
+}
 
-    size_t num;
-    if (!android::base::ParseUint(pieces[0].c_str(), &num, static_cast<size_t>(INT_MAX))) {
-        goto err;
-    }
+// Accounts a command that has just been executed on this thread, given the
+// counters of the thread before it started.
+static void RecordCommand(CommandIoStats& stats, const CommandIoStats& before,
+        std::chrono::duration<double> time) {
+    AddIoStats(stats, io, before);
+    ++stats.commands;
+    stats.max_calls = std::max(stats.max_calls,
+                               io.reads + io.writes - before.reads - before.writes);
+    stats.time += time;
+
+    size_t bucket = 0;
+    for (double ms = time.count() * 1000; ms >= 1 && bucket < LATENCY_BUCKETS - 1; ms /= 2) {
+        ++bucket;
+    }
+    ++stats.latency[bucket];
+}
+
+// fsync() that counts the call and the time it took.
+static int sync_fd(int fd) {
+    auto start = std::chrono::steady_clock::now();
+    int status = ota_fsync(fd);
+    io.fsync_time += std::chrono::steady_clock::now() - start;
+    ++io.fsyncs;
+    return status;
+}
+
+// Direct I/O of the partition. The partition is opened a second time with
+// O_DIRECT, and transfers on the regular descriptor 'buffered_fd' that are
+// aligned to DIRECT_IO_ALIGN on the device are made on 'fd' instead. The
+// buffers of the commands come from std::vector and aren't aligned in
+// memory, so their data is copied through buffers of MAX_IO_SIZE from a
+// pool that is shared by all threads and kept until the update ends.
+//
+// Transfers that don't start and end on a block boundary, such as the
+// partial blocks of a patch output, still use the page cache. The kernel
+// writes back cached pages before a direct transfer of the same range, and
+// drops them after a direct write, so the two views stay coherent.
+
+struct DirectIo {
+    int fd;
+    int buffered_fd;
+    pthread_mutex_t mu;
+    std::vector<uint8_t*> free;         // buffers of MAX_IO_SIZE
+    size_t buffers;                     // allocated
+    std::atomic<size_t> direct;         // transfers made with O_DIRECT
+    std::atomic<size_t> copied;         // of those, copied through a buffer
+    std::atomic<size_t> buffered;       // unaligned transfers left to the page cache
+};
 
-    if (num == 0 || num % 2) {
-        goto err; // must be even
-    } else if (num != pieces.size() - 1) {
-        goto err;
+static DirectIo direct_io = { -1, -1, PTHREAD_MUTEX_INITIALIZER };
+
+static uint8_t* GetDirectBuffer() {
+    pthread_mutex_lock(&direct_io.mu);
+    uint8_t* buffer = nullptr;
+    if (!direct_io.free.empty()) {
+        buffer = direct_io.free.back();
+        direct_io.free.pop_back();
+    } else {
+        void* p;
+        if (posix_memalign(&p, DIRECT_IO_ALIGN, MAX_IO_SIZE) == 0) {
+            buffer = static_cast<uint8_t*>(p);
+            ++direct_io.buffers;
+        }
     }
+    pthread_mutex_unlock(&direct_io.mu);
+    return buffer;
+}
 
-    rs.pos.resize(num);
-    rs.count = num / 2;
-    rs.size = 0;
+static void PutDirectBuffer(uint8_t* buffer) {
+    pthread_mutex_lock(&direct_io.mu);
+    direct_io.free.push_back(buffer);
+    pthread_mutex_unlock(&direct_io.mu);
+}
+
+static int transfer_direct(struct iovec* iov, int iovcnt, off64_t offset, bool write);
 
-    for (size_t i = 0; i < num; i += 2) {
-        if (!android::base::ParseUint(pieces[i+1].c_str(), &rs.pos[i],
-                                      static_cast<size_t>(INT_MAX))) {
-            goto err;
+// Transfers the buffers described by iov to or from the file at offset,
+// without moving the file offset. The iovec array is modified as the
+// transfer progresses.
+
+static int transfer_all(int fd, struct iovec* iov, int iovcnt, off64_t offset, bool write) {
+    if (fd == direct_io.buffered_fd && direct_io.fd != -1) {
+        size_t size = 0;
+        for (int i = 0; i < iovcnt; ++i) {
+            size += iov[i].iov_len;
+        }
+        if (offset % DIRECT_IO_ALIGN == 0 && size % DIRECT_IO_ALIGN == 0) {
+            return transfer_direct(iov, iovcnt, offset, write);
         }
+        ++direct_io.buffered;
+    }
 
-        if (!android::base::ParseUint(pieces[i+2].c_str(), &rs.pos[i+1],
-                                      static_cast<size_t>(INT_MAX))) {
-            goto err;
+    while (iovcnt > 0) {
+        int count = std::min(iovcnt, IOV_MAX);
+        ssize_t r;
+        if (write) {
+            r = TEMP_FAILURE_RETRY(ota_pwritev(fd, iov, count, offset));
+            ++io.writes;
+        } else {
+            r = TEMP_FAILURE_RETRY(ota_preadv(fd, iov, count, offset));
+            ++io.reads;
         }
 
-        if (rs.pos[i] >= rs.pos[i+1]) {
-            goto err; // empty or negative range
+        if (r == -1 || (r == 0 && !write)) {
+            failure_type = write ? kFwriteFailure : kFreadFailure;
+            fprintf(stderr, "%s failed: %s\n", write ? "write" : "read",
+                    r == -1 ? strerror(errno) : "unexpected end of file");
+            return -1;
         }
 
-        size_t sz = rs.pos[i+1] - rs.pos[i];
-        if (rs.size > SIZE_MAX - sz) {
-            goto err; // overflow
+        if (write) {
+            io.bytes_written += r;
+        } else {
+            io.bytes_read += r;
         }
 
-        rs.size += sz;
+        offset += r;
+        size_t done = r;
+        while (iovcnt > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + done;
+            iov->iov_len -= done;
+        }
     }
 
-    return;
-
-err:
-    fprintf(stderr, "failed to parse range '%s'\n", range_text.c_str());
-    exit(1);
+    return 0;
 }
 
-static bool range_overlaps(const RangeSet& r1, const RangeSet& r2) {
-    for (size_t i = 0; i < r1.count; ++i) {
-        size_t r1_0 = r1.pos[i * 2];
-        size_t r1_1 = r1.pos[i * 2 + 1];
+// Makes an aligned transfer on the O_DIRECT descriptor, copying the data
+// through a buffer of the pool unless all of iov is aligned in memory.
 
-        for (size_t j = 0; j < r2.count; ++j) {
-            size_t r2_0 = r2.pos[j * 2];
-            size_t r2_1 = r2.pos[j * 2 + 1];
+static int transfer_direct(struct iovec* iov, int iovcnt, off64_t offset, bool write) {
+    bool aligned = true;
+    for (int i = 0; i < iovcnt; ++i) {
+        if (reinterpret_cast<uintptr_t>(iov[i].iov_base) % DIRECT_IO_ALIGN != 0 ||
+                iov[i].iov_len % DIRECT_IO_ALIGN != 0) {
+            aligned = false;
+            break;
+        }
+    }
 
-            if (!(r2_0 >= r1_1 || r1_0 >= r2_1)) {
-                return true;
+    ++direct_io.direct;
+    if (aligned) {
+        return transfer_all(direct_io.fd, iov, iovcnt, offset, write);
+    }
+
+    uint8_t* buffer = GetDirectBuffer();
+    if (buffer == nullptr) {
+        fprintf(stderr, "failed to allocate direct I/O buffer\n");
+        return -1;
+    }
+    ++direct_io.copied;
+
+    // The chunks are whole blocks, as both offset and the total are.
+    int status = 0;
+    int i = 0;
+    size_t done = 0;                    // of iov[i]
+    while (i < iovcnt && status == 0) {
+        size_t len = 0;
+        size_t skip = done;
+        for (int j = i; j < iovcnt && len < MAX_IO_SIZE; ++j) {
+            len += std::min(iov[j].iov_len - skip, MAX_IO_SIZE - len);
+            skip = 0;
+        }
+        if (len == 0) {
+            break;
+        }
+
+        if (write) {
+            for (size_t p = 0; p < len; ) {
+                size_t n = std::min(iov[i].iov_len - done, len - p);
+                memcpy(buffer + p, static_cast<uint8_t*>(iov[i].iov_base) + done, n);
+                p += n;
+                done += n;
+                if (done == iov[i].iov_len) {
+                    ++i;
+                    done = 0;
+                }
+            }
+        }
+
+        struct iovec chunk = { buffer, len };
+        status = transfer_all(direct_io.fd, &chunk, 1, offset, write);
+        offset += len;
+
+        if (!write && status == 0) {
+            for (size_t p = 0; p < len; ) {
+                size_t n = std::min(iov[i].iov_len - done, len - p);
+                memcpy(static_cast<uint8_t*>(iov[i].iov_base) + done, buffer + p, n);
+                p += n;
+                done += n;
+                if (done == iov[i].iov_len) {
+                    ++i;
+                    done = 0;
+                }
             }
         }
     }
 
-    return false;
+    PutDirectBuffer(buffer);
+    return status;
 }
 
-static int read_all(int fd, uint8_t* data, size_t size) {
-    size_t so_far = 0;
-    while (so_far < size) {
-        ssize_t r = TEMP_FAILURE_RETRY(ota_read(fd, data+so_far, size-so_far));
-        if (r == -1) {
-            failure_type = kFreadFailure;
-            fprintf(stderr, "read failed: %s\n", strerror(errno));
+static int transfer_all(int fd, uint8_t* data, size_t size, off64_t offset, bool write) {
+    while (size > 0) {
+        size_t len = std::min<size_t>(size, MAX_IO_SIZE - offset % MAX_IO_SIZE);
+        struct iovec iov = { data, len };
+        if (transfer_all(fd, &iov, 1, offset, write) == -1) {
             return -1;
         }
-        so_far += r;
+        data += len;
+        size -= len;
+        offset += len;
     }
+
     return 0;
 }
 
-static int read_all(int fd, std::vector<uint8_t>& buffer, size_t size) {
-    return read_all(fd, buffer.data(), size);
+static int pread_all(int fd, uint8_t* data, size_t size, off64_t offset) {
+    return transfer_all(fd, data, size, offset, false);
 }
 
-static int write_all(int fd, const uint8_t* data, size_t size) {
-    size_t written = 0;
-    while (written < size) {
-        ssize_t w = TEMP_FAILURE_RETRY(ota_write(fd, data+written, size-written));
-        if (w == -1) {
-            failure_type = kFwriteFailure;
-            fprintf(stderr, "write failed: %s\n", strerror(errno));
+static int pread_all(int fd, std::vector<uint8_t>& buffer, size_t size, off64_t offset) {
+    return pread_all(fd, buffer.data(), size, offset);
+}
+
+static int pwrite_all(int fd, const uint8_t* data, size_t size, off64_t offset) {
+    return transfer_all(fd, const_cast<uint8_t*>(data), size, offset, true);
+}
+
+// Writes size bytes of zeroes at offset, gathering up to MAX_IO_SIZE of them
+// from a single zeroed block per call.
+
+static int pwrite_zeroes(int fd, size_t size, off64_t offset) {
+    static const uint8_t zero[BLOCKSIZE] = {};
+    struct iovec iov[MAX_IO_SIZE / BLOCKSIZE];
+
+    while (size > 0) {
+        size_t len = std::min<size_t>(size, MAX_IO_SIZE - offset % MAX_IO_SIZE);
+        int count = 0;
+        for (size_t p = 0; p < len; p += BLOCKSIZE) {
+            iov[count].iov_base = const_cast<uint8_t*>(zero);
+            iov[count].iov_len = std::min<size_t>(len - p, BLOCKSIZE);
+            ++count;
+        }
+        if (transfer_all(fd, iov, count, offset, true) == -1) {
             return -1;
         }
-        written += w;
+        size -= len;
+        offset += len;
     }
 
     return 0;
 }
 
-static int write_all(int fd, const std::vector<uint8_t>& buffer, size_t size) {
-    return write_all(fd, buffer.data(), size);
-}
+// Ways of zeroing blocks, in order of preference. See zero_blocks().
+enum {
+    ZEROOUT_UNKNOWN = 0,        // not probed yet
+    ZEROOUT_BLKZEROOUT,         // the device zeroes block device ranges
+    ZEROOUT_PUNCH_HOLE,         // the file system deallocates file ranges
+    ZEROOUT_WRITE               // pwrite_zeroes()
+};
 
-static bool discard_blocks(int fd, off64_t offset, uint64_t size) {
-    // Don't discard blocks unless the update is a retry run.
-    if (!is_retry) {
-        return true;
+// Zeroes size bytes at offset, with a single request to the kernel where the
+// file supports it. 'method' is probed on the first call and falls back to
+// ZEROOUT_WRITE if the kernel or device doesn't support the request.
+
+static int zero_blocks(int fd, int& method, off64_t offset, uint64_t size) {
+    if (method == ZEROOUT_UNKNOWN) {
+        struct stat sb;
+        if (fstat(fd, &sb) == -1) {
+            method = ZEROOUT_WRITE;
+        } else if (S_ISBLK(sb.st_mode)) {
+            method = ZEROOUT_BLKZEROOUT;
+        } else if (S_ISREG(sb.st_mode)) {
+            method = ZEROOUT_PUNCH_HOLE;
+        } else {
+            method = ZEROOUT_WRITE;
+        }
+    }
+
+    int status = 0;
+    if (method == ZEROOUT_BLKZEROOUT) {
+        // BLKZEROOUT bypasses the page cache, so dirty pages in the range
+        // must be written first, and clean ones are dropped afterwards, as
+        // older kernels don't invalidate them.
+        uint64_t range[2] = { static_cast<uint64_t>(offset), size };
+        status = sync_file_range(fd, offset, size, SYNC_FILE_RANGE_WAIT_BEFORE |
+                                 SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        if (status == 0) {
+            status = ioctl(fd, BLKZEROOUT, &range);
+            ++io.writes;
+        }
+        if (status == 0) {
+            posix_fadvise64(fd, offset, size, POSIX_FADV_DONTNEED);
+            io.bytes_written += size;
+            return 0;
+        }
+        fprintf(stderr, "BLKZEROOUT ioctl failed: %s\n", strerror(errno));
+    } else if (method == ZEROOUT_PUNCH_HOLE) {
+        status = fallocate64(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size);
+        ++io.writes;
+        if (status == 0) {
+            io.bytes_written += size;
+            return 0;
+        }
+        fprintf(stderr, "fallocate failed: %s\n", strerror(errno));
+    }
+
+    if (status == -1 && (errno == EOPNOTSUPP || errno == ENOTTY || errno == EINVAL)) {
+        fprintf(stderr, "writing zeroes instead from now on\n");
+        method = ZEROOUT_WRITE;
     }
 
+    return pwrite_zeroes(fd, size, offset);
+}
+
+static bool blkdiscard(int fd, off64_t offset, uint64_t size) {
     uint64_t args[2] = {static_cast<uint64_t>(offset), size};
     int status = ioctl(fd, BLKDISCARD, &args);
     if (status == -1) {
@@ -195,14 +582,233 @@ static bool discard_blocks(int fd, off64_t offset, uint64_t size) {
     return true;
 }
 
-static bool check_lseek(int fd, off64_t offset, int whence) {
-    off64_t rc = TEMP_FAILURE_RETRY(lseek64(fd, offset, whence));
-    if (rc == -1) {
-        failure_type = kLseekFailure;
-        fprintf(stderr, "lseek64 failed: %s\n", strerror(errno));
-        return false;
+// Writes and discards of the partition on their way to the device. The
+// patchers emit their output in chunks that RangeSinkWrite() splits at every
+// range of the target, which would make each piece a write of its own, plus
+// a discard per range on retries. Instead, the pieces are appended to 'data'
+// and issued together once 'limit' bytes have accumulated: sorted by
+// offset, with pieces that are adjacent on the device merged into pwritev()
+// calls of up to MAX_IO_SIZE, and the discards merged the same way before
+// them.
+//
+// The buffer is flushed before a piece is queued over a block that already
+// has a pending write, or a discard over a pending write, so the order of
+// writes to the same block is kept. The caller flushes it before the
+// partition is synced and before a command reads or writes any block
+// that is still pending (see WriteBackOverlaps()). As long as syncs are
+// batched, the writes of several commands are merged this way.
+
+struct WriteBackPiece {
+    off64_t offset;
+    size_t pos;                             // in WriteBack::data
+    size_t size;
+};
+
+struct WriteBack {
+    int fd;
+    size_t limit;                           // WRITEBACK_PROPERTY
+    std::vector<uint8_t> data;
+    std::vector<WriteBackPiece> pieces;
+    std::vector<std::pair<off64_t, uint64_t>> discards;
+    std::vector<bool> written;              // blocks with a pending write
+    std::vector<bool> discarded;            // blocks with a pending discard
+    size_t queued_writes;
+    size_t issued_writes;
+    size_t queued_discards;
+    size_t issued_discards;
+};
+
+static void MarkBlocks(std::vector<bool>& blocks, size_t first, size_t end) {
+    if (end > blocks.size()) {
+        blocks.resize(end);
     }
-    return true;
+    std::fill(blocks.begin() + first, blocks.begin() + end, true);
+}
+
+static bool AnyBlock(const std::vector<bool>& blocks, size_t first, size_t end) {
+    end = std::min(end, blocks.size());
+    for (size_t i = first; i < end; ++i) {
+        if (blocks[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns true if a block of rs has a pending write or discard.
+
+static bool WriteBackOverlaps(const WriteBack& wb, const RangeSet& rs) {
+    for (size_t i = 0; i < rs.count; ++i) {
+        if (AnyBlock(wb.written, rs.pos[i * 2], rs.pos[i * 2 + 1]) ||
+                AnyBlock(wb.discarded, rs.pos[i * 2], rs.pos[i * 2 + 1])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ComparePieces(const WriteBackPiece& a, const WriteBackPiece& b) {
+    return a.offset < b.offset;
+}
+
+static int IssueWrite(WriteBack& wb, std::vector<struct iovec>& iov, off64_t offset) {
+    if (iov.empty()) {
+        return 0;
+    }
+
+    int status = transfer_all(wb.fd, iov.data(), iov.size(), offset, true);
+    iov.clear();
+    ++wb.issued_writes;
+    return status;
+}
+
+// Adds the counters of 'from' to 'to' and resets them.
+
+static void AddWriteBackStats(WriteBack& to, WriteBack& from) {
+    to.queued_writes += from.queued_writes;
+    to.issued_writes += from.issued_writes;
+    to.queued_discards += from.queued_discards;
+    to.issued_discards += from.issued_discards;
+    from.queued_writes = 0;
+    from.issued_writes = 0;
+    from.queued_discards = 0;
+    from.issued_discards = 0;
+}
+
+static int FlushWriteBack(WriteBack& wb) {
+    std::sort(wb.discards.begin(), wb.discards.end());
+    for (size_t i = 0; i < wb.discards.size(); ) {
+        off64_t offset = wb.discards[i].first;
+        off64_t end = offset + wb.discards[i].second;
+        for (++i; i < wb.discards.size() && wb.discards[i].first <= end; ++i) {
+            end = std::max<off64_t>(end, wb.discards[i].first + wb.discards[i].second);
+        }
+
+        ++wb.issued_discards;
+        if (!blkdiscard(wb.fd, offset, end - offset)) {
+            return -1;
+        }
+    }
+
+    // Pieces never overlap, see QueueWrite().
+    std::sort(wb.pieces.begin(), wb.pieces.end(), ComparePieces);
+
+    std::vector<struct iovec> iov;
+    off64_t start = 0;
+    off64_t next = 0;
+    for (const auto& piece : wb.pieces) {
+        uint8_t* data = wb.data.data() + piece.pos;
+        off64_t offset = piece.offset;
+        size_t left = piece.size;
+
+        while (left > 0) {
+            if (!iov.empty() && (offset != next || iov.size() == IOV_MAX)) {
+                if (IssueWrite(wb, iov, start) == -1) {
+                    return -1;
+                }
+            }
+            if (iov.empty()) {
+                start = offset;
+            }
+
+            size_t len = std::min<size_t>(left, MAX_IO_SIZE - offset % MAX_IO_SIZE);
+            iov.push_back({ data, len });
+            data += len;
+            offset += len;
+            left -= len;
+            next = offset;
+
+            if (offset % MAX_IO_SIZE == 0 && IssueWrite(wb, iov, start) == -1) {
+                return -1;
+            }
+        }
+    }
+
+    if (IssueWrite(wb, iov, start) == -1) {
+        return -1;
+    }
+
+    wb.data.clear();
+    wb.pieces.clear();
+    wb.discards.clear();
+    wb.written.assign(wb.written.size(), false);
+    wb.discarded.assign(wb.discarded.size(), false);
+    return 0;
+}
+
+static int QueueWrite(WriteBack& wb, const uint8_t* data, size_t size, off64_t offset) {
+    ++wb.queued_writes;
+    if (wb.limit == 0) {
+        return pwrite_all(wb.fd, data, size, offset);
+    }
+
+    while (size > 0) {
+        if (wb.data.size() >= wb.limit && FlushWriteBack(wb) == -1) {
+            return -1;
+        }
+
+        // A piece continuing the last one only extends into the blocks after
+        // the one it ends in.
+        const WriteBackPiece* last = wb.pieces.empty() ? nullptr : &wb.pieces.back();
+        bool extend = last != nullptr && last->offset + static_cast<off64_t>(last->size) == offset &&
+                last->pos + last->size == wb.data.size();
+        size_t len = std::min(size, wb.limit - wb.data.size());
+        size_t first = (extend ? offset + BLOCKSIZE - 1 : offset) / BLOCKSIZE;
+        size_t end = (offset + len + BLOCKSIZE - 1) / BLOCKSIZE;
+
+        if (AnyBlock(wb.written, first, end)) {
+            if (FlushWriteBack(wb) == -1) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (extend) {
+            wb.pieces.back().size += len;
+        } else {
+            wb.pieces.push_back({ offset, wb.data.size(), len });
+        }
+        wb.data.insert(wb.data.end(), data, data + len);
+        MarkBlocks(wb.written, offset / BLOCKSIZE, end);
+
+        data += len;
+        size -= len;
+        offset += len;
+    }
+
+    return 0;
+}
+
+static int QueueDiscard(WriteBack& wb, off64_t offset, uint64_t size) {
+    ++wb.queued_discards;
+    if (wb.limit == 0) {
+        ++wb.issued_discards;
+        return blkdiscard(wb.fd, offset, size) ? 0 : -1;
+    }
+
+    size_t first = offset / BLOCKSIZE;
+    size_t end = (offset + size + BLOCKSIZE - 1) / BLOCKSIZE;
+    if (AnyBlock(wb.written, first, end) && FlushWriteBack(wb) == -1) {
+        return -1;
+    }
+
+    wb.discards.emplace_back(offset, size);
+    MarkBlocks(wb.discarded, first, end);
+    return 0;
+}
+
+// Discards the blocks before they are rewritten, through 'wb' if given.
+
+static bool discard_blocks(int fd, off64_t offset, uint64_t size, WriteBack* wb = nullptr) {
+    // Don't discard blocks unless the update is a retry run.
+    if (!is_retry) {
+        return true;
+    }
+
+    if (wb != nullptr) {
+        return QueueDiscard(*wb, offset, size) == 0;
+    }
+    return blkdiscard(fd, offset, size);
 }
 
 static void allocate(size_t size, std::vector<uint8_t>& buffer) {
@@ -215,10 +821,12 @@ static void allocate(size_t size, std::vector<uint8_t>& buffer) {
 struct RangeSinkState {
     RangeSinkState(RangeSet& rs) : tgt(rs) { };
 
-    int fd;
+    int fd;                             // -1 to skip the data
+    WriteBack* wb;
     const RangeSet& tgt;
     size_t p_block;
     size_t p_remain;
+    off64_t offset;
 };
 
 static ssize_t RangeSinkWrite(const uint8_t* data, ssize_t size, void* token) {
@@ -237,12 +845,13 @@ static ssize_t RangeSinkWrite(const uint8_t* data, ssize_t size, void* token) {
             write_now = rss->p_remain;
         }
 
-        if (write_all(rss->fd, data, write_now) == -1) {
+        if (rss->fd != -1 && QueueWrite(*rss->wb, data, write_now, rss->offset) == -1) {
             break;
         }
 
         data += write_now;
         size -= write_now;
+        rss->offset += write_now;
 
         rss->p_remain -= write_now;
         written += write_now;
@@ -254,12 +863,10 @@ static ssize_t RangeSinkWrite(const uint8_t* data, ssize_t size, void* token) {
                 rss->p_remain = (rss->tgt.pos[rss->p_block * 2 + 1] -
                                  rss->tgt.pos[rss->p_block * 2]) * BLOCKSIZE;
 
-                off64_t offset = static_cast<off64_t>(rss->tgt.pos[rss->p_block*2]) * BLOCKSIZE;
-                if (!discard_blocks(rss->fd, offset, rss->p_remain)) {
-                    break;
-                }
-
-                if (!check_lseek(rss->fd, offset, SEEK_SET)) {
+                rss->offset = static_cast<off64_t>(rss->tgt.pos[rss->p_block*2]) * BLOCKSIZE;
+                if (rss->fd == -1) {
+                    // Data is being skipped, nothing to write.
+                } else if (!discard_blocks(rss->fd, rss->offset, rss->p_remain, rss->wb)) {
                     break;
                 }
 
@@ -281,1099 +888,3650 @@ static ssize_t RangeSinkWrite(const uint8_t* data, ssize_t size, void* token) {
 // can't write each section until it's that transfer's turn to go.
 //
 // To achieve this, we expand the new data from the archive in a
-// background thread, and block that threads 'receive uncompressed
-// data' function until the main thread has reached a point where we
-// want some new data to be written.  We signal the background thread
-// with the destination for the data and block the main thread,
-// waiting for the background thread to complete writing that section.
-// Then it signals the main thread to wake up and goes back to
-// blocking waiting for a transfer.
+// background thread into a bounded ring buffer, and the thread executing
+// a 'new' command drains the ring into the target blocks.  The
+// background thread can run ahead of the commands by up to the size of
+// the ring, so inflating the data overlaps with the I/O of the other
+// commands instead of only running while a 'new' command waits for it.
 //
-// NewThreadInfo is the struct used to pass information back and forth
-// between the two threads.  When the main thread wants some data
-// written, it sets rss to the destination location and signals the
-// condition.  When the background thread is done writing, it clears
-// rss and signals the condition again.
+// The ring has a single producer (the background thread) and a single
+// consumer at any time (the 'new' commands are executed in order, also
+// by the parallel executor).  The positions are atomic counts of the
+// bytes produced and consumed, so no lock is taken while data flows;
+// the mutex and condition are only used to put a thread to sleep while
+// the ring is full or empty, and to wake it up again.
+
+enum NewDataFormat {
+    NEW_DATA_DEFLATE,                   // an entry of the package in any format
+    NEW_DATA_XZ,
+    NEW_DATA_ZSTD,
+};
 
 struct NewThreadInfo {
+    pthread_t thread;
     ZipArchive* za;
     const ZipEntry* entry;
 
-    RangeSinkState* rss;
+    // Stored entry that has to be decompressed, for the formats other than
+    // NEW_DATA_DEFLATE
+    NewDataFormat format;
+    const uint8_t* data;
+    size_t data_size;
+    size_t decoder_mem;
+
+    std::vector<uint8_t> ring;
+    std::atomic<uint64_t> produced;
+    std::atomic<uint64_t> consumed;
+    std::atomic<bool> producer_waiting;
+    std::atomic<bool> consumer_waiting;
+    std::atomic<bool> done;
+    std::atomic<bool> error;            // with done: the new data couldn't be decoded
+    std::atomic<bool> abort;            // the update stopped; quit without filling the ring
 
     pthread_mutex_t mu;
     pthread_cond_t cv;
-};
 
-static bool receive_new_data(const unsigned char* data, int size, void* cookie) {
-    NewThreadInfo* nti = reinterpret_cast<NewThreadInfo*>(cookie);
+    // Restart index for the new data and the number of threads to inflate
+    // it with; see InflateNewDataParallel()
+    std::vector<uint8_t> index;
+    int inflate_threads;
 
-    while (size > 0) {
-        // Wait for nti->rss to be non-null, indicating some of this
-        // data is wanted.
+    // Time spent waiting for space in the ring, and for data
+    std::chrono::duration<double> producer_stall;
+    std::chrono::duration<double> consumer_stall;
+};
+
+static void WakeNewDataThread(NewThreadInfo* nti, const std::atomic<bool>& waiting) {
+    if (waiting) {
         pthread_mutex_lock(&nti->mu);
-        while (nti->rss == nullptr) {
-            pthread_cond_wait(&nti->cv, &nti->mu);
-        }
+        pthread_cond_broadcast(&nti->cv);
         pthread_mutex_unlock(&nti->mu);
+    }
+}
 
-        // At this point nti->rss is set, and we own it.  The main
-        // thread is waiting for it to disappear from nti.
-        ssize_t written = RangeSinkWrite(data, size, nti->rss);
-        data += written;
-        size -= written;
+static bool receive_new_data(const unsigned char* data, int size, void* cookie) {
+    NewThreadInfo* nti = reinterpret_cast<NewThreadInfo*>(cookie);
+    uint64_t capacity = nti->ring.size();
 
-        if (nti->rss->p_block == nti->rss->tgt.count) {
-            // we have written all the bytes desired by this rss.
+    while (size > 0) {
+        uint64_t produced = nti->produced.load(std::memory_order_relaxed);
+        uint64_t space = capacity - (produced - nti->consumed);
 
+        if (space == 0) {
+            // The ring is full; wait for the consumer to catch up.
+            auto start = std::chrono::steady_clock::now();
             pthread_mutex_lock(&nti->mu);
-            nti->rss = nullptr;
-            pthread_cond_broadcast(&nti->cv);
+            nti->producer_waiting = true;
+            while (produced - nti->consumed == capacity && !nti->abort) {
+                pthread_cond_wait(&nti->cv, &nti->mu);
+            }
+            nti->producer_waiting = false;
             pthread_mutex_unlock(&nti->mu);
+            nti->producer_stall += std::chrono::steady_clock::now() - start;
+            if (nti->abort) {
+                return false;
+            }
+            continue;
         }
+
+        size_t pos = produced % capacity;
+        size_t len = std::min(std::min(space, capacity - pos), static_cast<uint64_t>(size));
+        memcpy(nti->ring.data() + pos, data, len);
+        data += len;
+        size -= len;
+
+        nti->produced = produced + len;
+        WakeNewDataThread(nti, nti->consumer_waiting);
     }
 
     return true;
 }
 
-static void* unzip_new_data(void* cookie) {
-    NewThreadInfo* nti = (NewThreadInfo*) cookie;
-    mzProcessZipEntryContents(nti->za, nti->entry, receive_new_data, nti);
-    return nullptr;
-}
+// Parallel inflate, used when the package has a restart index for the new
+// data (see new_data_index.h). The segments of the new data between two
+// access points are inflated by a pool of threads, each into a buffer of
+// its own, and passed to receive_new_data() in order by the new data
+// thread. Worker k inflates the segments k, k + threads, ... so it only
+// has to wait for its previous segment to be consumed before it starts on
+// the next one.
+
+struct InflateSlot {
+    std::vector<uint8_t> data;
+    bool ready;
+    bool failed;
+};
 
-static int ReadBlocks(const RangeSet& src, std::vector<uint8_t>& buffer, int fd) {
-    size_t p = 0;
-    uint8_t* data = buffer.data();
+struct InflatePool {
+    NewThreadInfo* nti;
+    size_t segments;
+    size_t threads;
+    std::vector<InflateSlot> slots;
+    bool abort;
 
-    for (size_t i = 0; i < src.count; ++i) {
-        if (!check_lseek(fd, (off64_t) src.pos[i * 2] * BLOCKSIZE, SEEK_SET)) {
-            return -1;
-        }
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+};
 
-        size_t size = (src.pos[i * 2 + 1] - src.pos[i * 2]) * BLOCKSIZE;
+struct InflateWorker {
+    InflatePool* pool;
+    size_t id;
+    pthread_t thread;
+};
 
-        if (read_all(fd, data + p, size) == -1) {
-            return -1;
-        }
+static const NewDataIndexHeader* GetIndexHeader(const NewThreadInfo* nti) {
+    return reinterpret_cast<const NewDataIndexHeader*>(nti->index.data());
+}
 
-        p += size;
-    }
+static const NewDataIndexPoint* GetIndexPoint(const NewThreadInfo* nti, size_t i) {
+    return reinterpret_cast<const NewDataIndexPoint*>(nti->index.data() +
+            sizeof(NewDataIndexHeader) + i * NEW_DATA_INDEX_POINT_SIZE);
+}
 
-    return 0;
+static uint64_t GetSegmentEnd(const NewThreadInfo* nti, size_t i) {
+    const NewDataIndexHeader* header = GetIndexHeader(nti);
+    return i + 1 < header->point_count ? GetIndexPoint(nti, i + 1)->out :
+                                         header->uncompressed_size;
 }
 
-static int WriteBlocks(const RangeSet& tgt, const std::vector<uint8_t>& buffer, int fd) {
-    const uint8_t* data = buffer.data();
+// Checks that the index belongs to the new data entry and is consistent, so
+// every segment can be inflated within the bounds of the entry.
 
-    size_t p = 0;
-    for (size_t i = 0; i < tgt.count; ++i) {
-        off64_t offset = static_cast<off64_t>(tgt.pos[i * 2]) * BLOCKSIZE;
-        size_t size = (tgt.pos[i * 2 + 1] - tgt.pos[i * 2]) * BLOCKSIZE;
-        if (!discard_blocks(fd, offset, size)) {
-            return -1;
-        }
+static bool ValidateNewDataIndex(const NewThreadInfo* nti) {
+    if (nti->index.size() < sizeof(NewDataIndexHeader)) {
+        return false;
+    }
 
-        if (!check_lseek(fd, offset, SEEK_SET)) {
-            return -1;
-        }
+    const NewDataIndexHeader* header = GetIndexHeader(nti);
+    if (memcmp(header->magic, NEW_DATA_INDEX_MAGIC, NEW_DATA_INDEX_MAGIC_SIZE) != 0 ||
+            header->point_count == 0 ||
+            (nti->index.size() - sizeof(NewDataIndexHeader)) / NEW_DATA_INDEX_POINT_SIZE !=
+            header->point_count) {
+        fprintf(stderr, "invalid new data index\n");
+        return false;
+    }
 
-        if (write_all(fd, data + p, size) == -1) {
-            return -1;
-        }
+    if (nti->entry->compression != Z_DEFLATED ||
+            header->crc32 != static_cast<uint32_t>(nti->entry->crc32) ||
+            header->compressed_size != static_cast<uint64_t>(nti->entry->compLen) ||
+            header->uncompressed_size != static_cast<uint64_t>(nti->entry->uncompLen)) {
+        fprintf(stderr, "new data index doesn't match the new data\n");
+        return false;
+    }
 
-        p += size;
+    for (size_t i = 0; i < header->point_count; ++i) {
+        const NewDataIndexPoint* point = GetIndexPoint(nti, i);
+        uint64_t end = GetSegmentEnd(nti, i);
+        if ((i == 0 && (point->out != 0 || point->in != 0 || point->bits != 0)) ||
+                point->out >= end || end - point->out > MAX_INFLATE_SEGMENT ||
+                point->in > header->compressed_size || point->bits > 7 ||
+                (point->bits != 0 && point->in == 0)) {
+            fprintf(stderr, "invalid access point %zu in new data index\n", i);
+            return false;
+        }
     }
 
-    return 0;
+    return true;
 }
 
-// Parameters for transfer list command functions
-struct CommandParameters {
-    std::vector<std::string> tokens;
-    size_t cpos;
-    const char* cmdname;
-    const char* cmdline;
-    std::string freestash;
-    std::string stashbase;
-    bool canwrite;
-    int createdstash;
-    int fd;
-    bool foundwrites;
-    bool isunresumable;
-    int version;
-    size_t written;
-    size_t stashed;
-    NewThreadInfo nti;
-    pthread_t thread;
-    std::vector<uint8_t> buffer;
-    uint8_t* patch_start;
-};
+// Inflates the data between access point i and the next one into 'out',
+// priming zlib with the bit offset and window of the access point.
 
-// Do a source/target load for move/bsdiff/imgdiff in version 1.
-// We expect to parse the remainder of the parameter tokens as:
-//
-//    <src_range> <tgt_range>
-//
-// The source range is loaded into the provided buffer, reallocating
-// it to make it larger if necessary.
+static bool InflateSegment(const NewThreadInfo* nti, size_t i, std::vector<uint8_t>& out) {
+    const NewDataIndexPoint* point = GetIndexPoint(nti, i);
+    const uint8_t* window = reinterpret_cast<const uint8_t*>(point + 1);
+    const uint8_t* comp = nti->za->addr + mzGetZipEntryOffset(nti->entry);
+    uint64_t comp_len = nti->entry->compLen;
 
-static int LoadSrcTgtVersion1(CommandParameters& params, RangeSet& tgt, size_t& src_blocks,
-        std::vector<uint8_t>& buffer, int fd) {
+    out.resize(GetSegmentEnd(nti, i) - point->out);
 
-    if (params.cpos + 1 >= params.tokens.size()) {
-        fprintf(stderr, "invalid parameters\n");
-        return -1;
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+        return false;
     }
 
-    // <src_range>
-    RangeSet src;
-    parse_range(params.tokens[params.cpos++], src);
+    bool success = false;
+    int ret;
 
-    // <tgt_range>
-    parse_range(params.tokens[params.cpos++], tgt);
+    if (point->bits != 0 && inflatePrime(&strm, point->bits,
+            comp[point->in - 1] >> (8 - point->bits)) != Z_OK) {
+        goto done;
+    }
 
-    allocate(src.size * BLOCKSIZE, buffer);
-    int rc = ReadBlocks(src, buffer, fd);
-    src_blocks = src.size;
+    if (point->out != 0) {
+        uInt len = std::min<uint64_t>(point->out, NEW_DATA_INDEX_WINDOW);
+        if (inflateSetDictionary(&strm, window + NEW_DATA_INDEX_WINDOW - len, len) != Z_OK) {
+            goto done;
+        }
+    }
 
-    return rc;
+    strm.next_in = const_cast<uint8_t*>(comp + point->in);
+    strm.avail_in = comp_len - point->in;
+    strm.next_out = out.data();
+    strm.avail_out = out.size();
+
+    do {
+        ret = inflate(&strm, Z_NO_FLUSH);
+    } while (ret == Z_OK && strm.avail_out != 0);
+
+    success = (ret == Z_OK || ret == Z_STREAM_END) && strm.avail_out == 0;
+
+done:
+    inflateEnd(&strm);
+    if (!success) {
+        fprintf(stderr, "failed to inflate new data segment %zu\n", i);
+    }
+    return success;
 }
 
-static int VerifyBlocks(const std::string& expected, const std::vector<uint8_t>& buffer,
-        const size_t blocks, bool printerror) {
-    uint8_t digest[SHA_DIGEST_LENGTH];
-    const uint8_t* data = buffer.data();
+static void* InflateWorkerThread(void* cookie) {
+    InflateWorker* worker = reinterpret_cast<InflateWorker*>(cookie);
+    InflatePool* pool = worker->pool;
+    InflateSlot& slot = pool->slots[worker->id];
 
-    SHA1(data, blocks * BLOCKSIZE, digest);
+    for (size_t i = worker->id; i < pool->segments; i += pool->threads) {
+        pthread_mutex_lock(&pool->mu);
+        while (slot.ready && !pool->abort) {
+            pthread_cond_wait(&pool->cv, &pool->mu);
+        }
+        bool abort = pool->abort;
+        pthread_mutex_unlock(&pool->mu);
 
-    std::string hexdigest = print_sha1(digest);
+        if (abort) {
+            break;
+        }
 
-    if (hexdigest != expected) {
-        if (printerror) {
-            fprintf(stderr, "failed to verify blocks (expected %s, read %s)\n",
-                    expected.c_str(), hexdigest.c_str());
+        bool success = InflateSegment(pool->nti, i, slot.data);
+
+        pthread_mutex_lock(&pool->mu);
+        slot.ready = true;
+        slot.failed = !success;
+        pthread_cond_broadcast(&pool->cv);
+        pthread_mutex_unlock(&pool->mu);
+
+        if (!success) {
+            break;
         }
-        return -1;
     }
 
-    return 0;
+    return nullptr;
 }
 
-static std::string GetStashFileName(const std::string& base, const std::string& id,
-        const std::string& postfix) {
-    if (base.empty()) {
-        return "";
+static bool InflateNewDataParallel(NewThreadInfo* nti) {
+    InflatePool pool;
+    pool.nti = nti;
+    pool.segments = GetIndexHeader(nti)->point_count;
+    pool.threads = std::min<size_t>(nti->inflate_threads, pool.segments);
+    pool.slots.resize(pool.threads);
+    pool.abort = false;
+    pthread_mutex_init(&pool.mu, nullptr);
+    pthread_cond_init(&pool.cv, nullptr);
+
+    fprintf(stderr, "inflating %zu new data segments on %zu threads\n", pool.segments,
+            pool.threads);
+
+    std::vector<InflateWorker> workers(pool.threads);
+    size_t started = 0;
+    for (; started < pool.threads; ++started) {
+        workers[started].pool = &pool;
+        workers[started].id = started;
+        int error = pthread_create(&workers[started].thread, nullptr, InflateWorkerThread,
+                                   &workers[started]);
+        if (error != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(error));
+            break;
+        }
     }
 
-    std::string fn(STASH_DIRECTORY_BASE);
-    fn += "/" + base + "/" + id + postfix;
+    bool success = (started == pool.threads);
+    for (size_t i = 0; success && i < pool.segments; ++i) {
+        InflateSlot& slot = pool.slots[i % pool.threads];
 
-    return fn;
-}
+        pthread_mutex_lock(&pool.mu);
+        while (!slot.ready) {
+            pthread_cond_wait(&pool.cv, &pool.mu);
+        }
+        pthread_mutex_unlock(&pool.mu);
 
-typedef void (*StashCallback)(const std::string&, void*);
+        if (slot.failed) {
+            success = false;
+            break;
+        }
 
-// Does a best effort enumeration of stash files. Ignores possible non-file
-// items in the stash directory and continues despite of errors. Calls the
-// 'callback' function for each file and passes 'data' to the function as a
-// parameter.
+        if (!receive_new_data(slot.data.data(), slot.data.size(), nti)) {
+            success = false;
+            break;
+        }
 
-static void EnumerateStash(const std::string& dirname, StashCallback callback, void* data) {
-    if (dirname.empty() || callback == nullptr) {
-        return;
+        pthread_mutex_lock(&pool.mu);
+        slot.ready = false;
+        pthread_cond_broadcast(&pool.cv);
+        pthread_mutex_unlock(&pool.mu);
     }
 
-    std::unique_ptr<DIR, int(*)(DIR*)> directory(opendir(dirname.c_str()), closedir);
+    pthread_mutex_lock(&pool.mu);
+    pool.abort = true;
+    pthread_cond_broadcast(&pool.cv);
+    pthread_mutex_unlock(&pool.mu);
 
-    if (directory == nullptr) {
-        if (errno != ENOENT) {
-            fprintf(stderr, "opendir \"%s\" failed: %s\n", dirname.c_str(), strerror(errno));
-        }
-        return;
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, nullptr);
     }
 
-    struct dirent* item;
-    while ((item = readdir(directory.get())) != nullptr) {
-        if (item->d_type != DT_REG) {
-            continue;
+    pthread_cond_destroy(&pool.cv);
+    pthread_mutex_destroy(&pool.mu);
+    return success;
+}
+
+// Decompresses new data in the xz format with the multi-call decoder of
+// xz-embedded, which allocates the dictionary as the stream header asks
+// for it, up to nti->decoder_mem. xz-embedded only verifies CRC32 checks,
+// so the data has to be compressed with 'xz --check=crc32'. Streams with any
+// other check are rejected rather than written unverified.
+
+static bool DecodeNewDataXz(NewThreadInfo* nti) {
+    InitXzCrc32();
+    struct xz_dec* dec = xz_dec_init(XZ_DYNALLOC, nti->decoder_mem);
+    if (dec == nullptr) {
+        fprintf(stderr, "failed to create xz decoder\n");
+        return false;
+    }
+
+    fprintf(stderr, "decompressing %zu bytes of xz new data, dictionary up to %zu KiB\n",
+            nti->data_size, nti->decoder_mem / 1024);
+
+    std::vector<uint8_t> out(NEW_DATA_DECODE_CHUNK);
+    struct xz_buf buf;
+    buf.in = nti->data;
+    buf.in_pos = 0;
+    buf.in_size = nti->data_size;
+    buf.out = out.data();
+    buf.out_size = out.size();
+
+    enum xz_ret ret;
+    bool aborted = false;
+    do {
+        buf.out_pos = 0;
+        ret = xz_dec_run(dec, &buf);
+        if (!receive_new_data(out.data(), buf.out_pos, nti)) {
+            aborted = true;
+            break;
         }
+    } while (ret == XZ_OK);
 
-        std::string fn = dirname + "/" + std::string(item->d_name);
-        callback(fn, data);
+    xz_dec_end(dec);
+    if (aborted) {
+        return false;
+    }
+    if (ret != XZ_STREAM_END) {
+        // Depending on how libxz is built, a check other than CRC32 is
+        // either XZ_UNSUPPORTED_CHECK or an XZ_OPTIONS_ERROR in the header.
+        const char* reason = "";
+        if (ret == XZ_MEMLIMIT_ERROR) {
+            reason = " (dictionary larger than the decoder memory)";
+        } else if (ret == XZ_UNSUPPORTED_CHECK || ret == XZ_OPTIONS_ERROR) {
+            reason = " (unsupported check or filter; compress with 'xz --check=crc32')";
+        }
+        fprintf(stderr, "failed to decompress new data: xz error %d%s\n", ret, reason);
+        return false;
     }
+    return true;
 }
 
-static void UpdateFileSize(const std::string& fn, void* data) {
-    if (fn.empty() || !data) {
-        return;
+// Decompresses new data in the zstd format, which may consist of several
+// frames, refusing frames with a window larger than nti->decoder_mem.
+
+static bool DecodeNewDataZstd(NewThreadInfo* nti) {
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    if (dctx == nullptr) {
+        fprintf(stderr, "failed to create zstd decoder\n");
+        return false;
     }
 
-    struct stat sb;
-    if (stat(fn.c_str(), &sb) == -1) {
-        fprintf(stderr, "stat \"%s\" failed: %s\n", fn.c_str(), strerror(errno));
-        return;
+    ZSTD_bounds bounds = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax);
+    int window_log = bounds.lowerBound;
+    while (window_log < bounds.upperBound &&
+            (static_cast<uint64_t>(1) << (window_log + 1)) <= nti->decoder_mem) {
+        ++window_log;
     }
+    ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, window_log);
+    fprintf(stderr, "decompressing %zu bytes of zstd new data, window up to %zu KiB\n",
+            nti->data_size, (static_cast<size_t>(1) << window_log) / 1024);
 
-    int* size = reinterpret_cast<int*>(data);
-    *size += sb.st_size;
-}
+    std::vector<uint8_t> out(NEW_DATA_DECODE_CHUNK);
+    ZSTD_inBuffer input = { nti->data, nti->data_size, 0 };
+    size_t ret = 0;
+    bool full;
+    bool aborted = false;
 
-// Deletes the stash directory and all files in it. Assumes that it only
-// contains files. There is nothing we can do about unlikely, but possible
-// errors, so they are merely logged.
+    do {
+        ZSTD_outBuffer output = { out.data(), out.size(), 0 };
+        ret = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(ret)) {
+            break;
+        }
+        if (!receive_new_data(out.data(), output.pos, nti)) {
+            aborted = true;
+            break;
+        }
+        full = (output.pos == output.size);
+    } while (input.pos < input.size || full);
 
-static void DeleteFile(const std::string& fn, void* /* data */) {
-    if (!fn.empty()) {
-        fprintf(stderr, "deleting %s\n", fn.c_str());
+    ZSTD_freeDCtx(dctx);
+    if (aborted) {
+        return false;
+    }
+    if (ZSTD_isError(ret)) {
+        fprintf(stderr, "failed to decompress new data: zstd error %d (%s)\n",
+                ZSTD_getErrorCode(ret), ZSTD_getErrorName(ret));
+        return false;
+    }
+    if (ret != 0) {
+        fprintf(stderr, "failed to decompress new data: zstd frame truncated\n");
+        return false;
+    }
+    return true;
+}
 
-        if (unlink(fn.c_str()) == -1 && errno != ENOENT) {
-            fprintf(stderr, "unlink \"%s\" failed: %s\n", fn.c_str(), strerror(errno));
+// Finds the new data 'name' in the package. If there is no such entry, the
+// same name with a ".zst" or ".xz" suffix is looked for, so a package can
+// carry either without changing the updater script. Entries in these
+// formats have to be stored, so they are decompressed straight from the
+// mapped package. ".xz" entries have to use CRC32 checks ('xz --check=crc32'),
+// as the default CRC64 isn't supported.
+
+static const ZipEntry* FindNewData(const ZipArchive* za, const std::string& name,
+        NewDataFormat* format) {
+    static const struct {
+        const char* suffix;
+        NewDataFormat format;
+    } kFormats[] = {
+        { ".zst", NEW_DATA_ZSTD },
+        { ".xz", NEW_DATA_XZ },
+    };
+
+    std::string fn = name;
+    const ZipEntry* entry = mzFindZipEntry(za, fn.c_str());
+    for (const auto& f : kFormats) {
+        if (entry != nullptr) {
+            break;
         }
+        fn = name + f.suffix;
+        entry = mzFindZipEntry(za, fn.c_str());
     }
-}
 
-static void DeletePartial(const std::string& fn, void* data) {
-    if (android::base::EndsWith(fn, ".partial")) {
-        DeleteFile(fn, data);
+    if (entry == nullptr) {
+        return nullptr;
     }
-}
 
-static void DeleteStash(const std::string& base) {
-    if (base.empty()) {
-        return;
+    *format = NEW_DATA_DEFLATE;
+    for (const auto& f : kFormats) {
+        if (android::base::EndsWith(fn, f.suffix)) {
+            *format = f.format;
+        }
     }
 
-    fprintf(stderr, "deleting stash %s\n", base.c_str());
+    if (*format != NEW_DATA_DEFLATE && entry->compression == Z_DEFLATED) {
+        fprintf(stderr, "%s has to be stored in the package, not deflated\n", fn.c_str());
+        return nullptr;
+    }
 
-    std::string dirname = GetStashFileName(base, "", "");
-    EnumerateStash(dirname, DeleteFile, nullptr);
+    if (fn != name) {
+        fprintf(stderr, "using new data from %s\n", fn.c_str());
+    }
+    return entry;
+}
 
-    if (rmdir(dirname.c_str()) == -1) {
-        if (errno != ENOENT && errno != ENOTDIR) {
-            fprintf(stderr, "rmdir \"%s\" failed: %s\n", dirname.c_str(), strerror(errno));
+static void* unzip_new_data(void* cookie) {
+    NewThreadInfo* nti = (NewThreadInfo*) cookie;
+    bool success;
+    if (nti->format == NEW_DATA_XZ) {
+        success = DecodeNewDataXz(nti);
+    } else if (nti->format == NEW_DATA_ZSTD) {
+        success = DecodeNewDataZstd(nti);
+    } else if (!nti->index.empty()) {
+        success = InflateNewDataParallel(nti);
+    } else {
+        success = mzProcessZipEntryContents(nti->za, nti->entry, receive_new_data, nti);
+        if (!success && !nti->abort) {
+            fprintf(stderr, "failed to inflate new data\n");
         }
     }
+
+    pthread_mutex_lock(&nti->mu);
+    nti->error = !success && !nti->abort;
+    nti->done = true;
+    pthread_cond_broadcast(&nti->cv);
+    pthread_mutex_unlock(&nti->mu);
+    return nullptr;
 }
 
-static int LoadStash(CommandParameters& params, const std::string& base, const std::string& id,
-        bool verify, size_t* blocks, std::vector<uint8_t>& buffer, bool printnoent) {
-    // In verify mode, if source range_set was saved for the given hash,
-    // check contents in the source blocks first. If the check fails,
-    // search for the stashed files on /cache as usual.
-    if (!params.canwrite) {
-        if (stash_map.find(id) != stash_map.end()) {
-            const RangeSet& src = stash_map[id];
-            allocate(src.size * BLOCKSIZE, buffer);
+// Stops the new data thread, which may still be waiting for room in the
+// ring if the update failed, and waits for it to exit.
 
-            if (ReadBlocks(src, buffer, params.fd) == -1) {
-                fprintf(stderr, "failed to read source blocks in stash map.\n");
+static void StopNewDataThread(NewThreadInfo* nti) {
+    pthread_mutex_lock(&nti->mu);
+    nti->abort = true;
+    pthread_cond_broadcast(&nti->cv);
+    pthread_mutex_unlock(&nti->mu);
+    pthread_join(nti->thread, nullptr);
+}
+
+// Consumes new data from the ring until all the blocks of rss have been
+// written. Returns 0 on success and -1 on a write error, if the new data
+// ends early or if it couldn't be decoded; the last is reported as a read
+// failure of the package.
+
+static int ReadNewData(NewThreadInfo* nti, RangeSinkState& rss) {
+    uint64_t capacity = nti->ring.size();
+
+    while (rss.p_block < rss.tgt.count) {
+        uint64_t consumed = nti->consumed.load(std::memory_order_relaxed);
+        uint64_t avail = nti->produced - consumed;
+
+        if (avail == 0) {
+            // The ring is empty; wait for the producer.
+            auto start = std::chrono::steady_clock::now();
+            pthread_mutex_lock(&nti->mu);
+            nti->consumer_waiting = true;
+            while (nti->produced == consumed && !nti->done) {
+                pthread_cond_wait(&nti->cv, &nti->mu);
+            }
+            nti->consumer_waiting = false;
+            bool eof = (nti->produced == consumed);
+            pthread_mutex_unlock(&nti->mu);
+            nti->consumer_stall += std::chrono::steady_clock::now() - start;
+
+            if (eof && nti->error) {
+                failure_type = kFreadFailure;
+                fprintf(stderr, "new data couldn't be decoded\n");
                 return -1;
             }
-            if (VerifyBlocks(id, buffer, src.size, true) != 0) {
-                fprintf(stderr, "failed to verify loaded source blocks in stash map.\n");
+            if (eof) {
+                fprintf(stderr, "new data ended %zu blocks early\n",
+                        rss.tgt.count - rss.p_block);
                 return -1;
             }
-            return 0;
+            continue;
         }
-    }
-
-    if (base.empty()) {
-        return -1;
-    }
 
-    size_t blockcount = 0;
+        size_t pos = consumed % capacity;
+        size_t len = std::min(avail, capacity - pos);
+        ssize_t written = RangeSinkWrite(nti->ring.data() + pos, len, &rss);
+        if (written < static_cast<ssize_t>(len) && rss.p_block < rss.tgt.count) {
+            return -1;
+        }
 
-    if (!blocks) {
-        blocks = &blockcount;
+        nti->consumed = consumed + written;
+        WakeNewDataThread(nti, nti->producer_waiting);
     }
 
-    std::string fn = GetStashFileName(base, id, "");
+    return 0;
+}
 
-    struct stat sb;
-    int res = stat(fn.c_str(), &sb);
+static int ReadBlocks(const RangeSet& src, std::vector<uint8_t>& buffer, int fd) {
+    size_t p = 0;
+    uint8_t* data = buffer.data();
 
-    if (res == -1) {
-        if (errno != ENOENT || printnoent) {
-            fprintf(stderr, "stat \"%s\" failed: %s\n", fn.c_str(), strerror(errno));
-        }
-        return -1;
-    }
+    for (size_t i = 0; i < src.count; ) {
+        size_t j = ExtentEnd(src, i);
+        off64_t offset = static_cast<off64_t>(src.pos[i * 2]) * BLOCKSIZE;
+        size_t size = (src.pos[j * 2 - 1] - src.pos[i * 2]) * BLOCKSIZE;
 
-    fprintf(stderr, " loading %s\n", fn.c_str());
+        if (pread_all(fd, data + p, size, offset) == -1) {
+            return -1;
+        }
 
-    if ((sb.st_size % BLOCKSIZE) != 0) {
-        fprintf(stderr, "%s size %" PRId64 " not multiple of block size %d",
-                fn.c_str(), static_cast<int64_t>(sb.st_size), BLOCKSIZE);
-        return -1;
+        p += size;
+        i = j;
     }
 
-    int fd = TEMP_FAILURE_RETRY(open(fn.c_str(), O_RDONLY));
-    unique_fd fd_holder(fd);
-
-    if (fd == -1) {
-        fprintf(stderr, "open \"%s\" failed: %s\n", fn.c_str(), strerror(errno));
-        return -1;
-    }
+    return 0;
+}
 
-    allocate(sb.st_size, buffer);
+static int WriteBlocks(const RangeSet& tgt, const std::vector<uint8_t>& buffer, WriteBack& wb) {
+    const uint8_t* data = buffer.data();
 
-    if (read_all(fd, buffer, sb.st_size) == -1) {
-        return -1;
-    }
+    size_t p = 0;
+    for (size_t i = 0; i < tgt.count; ) {
+        size_t j = ExtentEnd(tgt, i);
+        off64_t offset = static_cast<off64_t>(tgt.pos[i * 2]) * BLOCKSIZE;
+        size_t size = (tgt.pos[j * 2 - 1] - tgt.pos[i * 2]) * BLOCKSIZE;
+        if (!discard_blocks(wb.fd, offset, size, &wb)) {
+            return -1;
+        }
 
-    *blocks = sb.st_size / BLOCKSIZE;
+        if (QueueWrite(wb, data + p, size, offset) == -1) {
+            return -1;
+        }
 
-    if (verify && VerifyBlocks(id, buffer, *blocks, true) != 0) {
-        fprintf(stderr, "unexpected contents in %s\n", fn.c_str());
-        DeleteFile(fn, nullptr);
-        return -1;
+        p += size;
+        i = j;
     }
 
     return 0;
 }
 
-static int WriteStash(const std::string& base, const std::string& id, int blocks,
-        std::vector<uint8_t>& buffer, bool checkspace, bool *exists) {
-    if (base.empty()) {
-        return -1;
-    }
+// Computes the SHA-1 of the blocks in 'rs' without reading them into memory
+// all at once. 'buffer' holds one read at a time.
 
-    if (checkspace && CacheSizeCheck(blocks * BLOCKSIZE) != 0) {
-        fprintf(stderr, "not enough space to write stash\n");
-        return -1;
-    }
+static int HashBlocks(const RangeSet& rs, std::vector<uint8_t>& buffer, int fd,
+        uint8_t* digest) {
+    SHA_CTX ctx;
+    SHA1_Init(&ctx);
 
-    std::string fn = GetStashFileName(base, id, ".partial");
-    std::string cn = GetStashFileName(base, id, "");
+    allocate(std::min<size_t>(rs.size * BLOCKSIZE, MAX_IO_SIZE), buffer);
+    for (size_t i = 0; i < rs.count; ) {
+        size_t j = ExtentEnd(rs, i);
+        off64_t offset = static_cast<off64_t>(rs.pos[i * 2]) * BLOCKSIZE;
+        size_t size = (rs.pos[j * 2 - 1] - rs.pos[i * 2]) * BLOCKSIZE;
 
-    if (exists) {
-        struct stat sb;
-        int res = stat(cn.c_str(), &sb);
+        while (size > 0) {
+            size_t len = std::min<size_t>(size, MAX_IO_SIZE - offset % MAX_IO_SIZE);
+            if (pread_all(fd, buffer, len, offset) == -1) {
+                return -1;
+            }
 
-        if (res == 0) {
-            // The file already exists and since the name is the hash of the contents,
-            // it's safe to assume the contents are identical (accidental hash collisions
-            // are unlikely)
-            fprintf(stderr, " skipping %d existing blocks in %s\n", blocks, cn.c_str());
-            *exists = true;
-            return 0;
+            SHA1_Update(&ctx, buffer.data(), len);
+            io.bytes_hashed += len;
+            offset += len;
+            size -= len;
         }
 
-        *exists = false;
+        i = j;
     }
 
-    fprintf(stderr, " writing %d blocks to %s\n", blocks, cn.c_str());
-
-    int fd = TEMP_FAILURE_RETRY(open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, STASH_FILE_MODE));
-    unique_fd fd_holder(fd);
+    SHA1_Final(digest, &ctx);
+    return 0;
+}
 
-    if (fd == -1) {
-        fprintf(stderr, "failed to create \"%s\": %s\n", fn.c_str(), strerror(errno));
-        return -1;
-    }
+// State of batched syncs ("group commit"). Commands executed since the last
+// flush are not durable yet, so the blocks they read or wrote are tracked in
+// 'pending' and a command that would overwrite any of them forces a flush
+// first; otherwise a command could destroy the source of an earlier command
+// that still has to be redone after a power loss. Stashes freed since the
+// last flush are only deleted after the next one, as the commands that loaded
+// them may have to be redone as well.
+//
+// Each flush records the index of the last completed command and the stashes
+// present at that point in a checkpoint file in the stash directory, which
+// lets a retry skip the completed commands instead of re-reading and hashing
+// their blocks.
+
+struct Checkpoint {
+    std::string tlhash;                     // SHA-1 of the transfer list
+    size_t sync_bytes;
+    int sync_ms;
+    size_t last;                            // index of the last completed command
+    size_t pending_bytes;
+    size_t written;                         // params.written at the last update
+    size_t stashed;                         // params.stashed at the last update
+    std::vector<bool> pending;              // blocks read or written since the last flush
+    std::vector<std::string> stash_files;   // stashes written since the last flush
+    std::vector<std::string> frees;         // stashes to delete after the next flush
+    std::chrono::steady_clock::time_point last_flush;
+    size_t flushes;
+    size_t checkpoints;
+    size_t commands;
+    std::chrono::duration<double> sync_time;
+};
 
-    if (write_all(fd, buffer, blocks * BLOCKSIZE) == -1) {
-        return -1;
+static void MarkCheckpointPending(Checkpoint& cp, const RangeSet& rs) {
+    for (size_t i = 0; i < rs.count; ++i) {
+        if (rs.pos[i * 2 + 1] > cp.pending.size()) {
+            cp.pending.resize(rs.pos[i * 2 + 1]);
+        }
+        std::fill(cp.pending.begin() + rs.pos[i * 2], cp.pending.begin() + rs.pos[i * 2 + 1],
+                  true);
     }
+}
 
-    if (ota_fsync(fd) == -1) {
-        failure_type = kFsyncFailure;
-        fprintf(stderr, "fsync \"%s\" failed: %s\n", fn.c_str(), strerror(errno));
-        return -1;
+// A stash kept in memory.
+struct StashEntry {
+    std::vector<uint8_t> data;
+    RangeSet src;                           // blocks the stash was read from
+    bool ondisk;                            // the stash file has been written too
+};
+
+struct StashCache {
+    size_t budget;                          // STASH_CACHE_PROPERTY
+    size_t size;                            // bytes in entries
+    std::map<std::string, StashEntry> entries;
+    std::map<std::string, std::vector<size_t>> uses;   // commands loading each stash
+    size_t hits;
+    size_t spills;
+};
+
+// Digests of ranges of a partition, kept across updater runs in
+// /cache/recovery/<hash of the block device>.hashes. The index remembers what
+// block_image_verify() and range_sha1() have hashed and what commands have
+// written; the "already applied?" check of a command and range_sha1() are
+// answered from it when the digest of exactly that range is known. A W record
+// only holds the digest a command was meant to write, so the checks that
+// decide what gets written, i.e. those of an update and range_sha1(), only
+// take digests of blocks that were read.
+//
+// The digest of a range can't be derived from those of its blocks, so
+// entries are ranges, and their validity is tracked per block instead: each
+// block has the logical time of its last write in 'gen', and an entry is only
+// used if none of its blocks was written after it was recorded.
+//
+// The file is a log of text lines, replayed when it's loaded:
+//
+//    D <range>               the blocks may be written from here on
+//    W <range> <sha1>        the blocks were written with this digest and synced
+//    H <range> <sha1>        the blocks were found to have this digest
+//    P <provenance>          the partition state the records above apply to
+//
+// A D record is made durable before any block of its range is written, and
+// the blocks stay dirty until a W or H record covers them; entries with
+// dirty blocks are dropped at the end of the replay, as an interrupted
+// command may have changed them. An update only makes W records, for the
+// last command writing each of their blocks, and appends them after the
+// partition has been synced. Writes the updater doesn't know about are
+// caught by the provenance: the fields of the ext4 superblock that change
+// whenever the file system is mounted read-write. If it doesn't match the
+// partition when the index is loaded, the whole index is dropped.
+
+struct HashIndexEntry {
+    RangeSet rs;
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    uint64_t time;
+    bool read;                          // from reading the blocks, not from a W record
+};
+
+struct HashIndex {
+    std::string fn;
+    int fd;                             // fn opened for appending
+    int dev;                            // the partition
+    WriteBack* writeback;               // writes queued for dev, or null
+    uint64_t time;
+    std::vector<uint64_t> gen;          // time of the last write of each block
+    std::vector<bool> dirty;            // during the replay
+    std::map<std::string, HashIndexEntry> entries;     // by range text
+    std::vector<uint32_t> writer;       // last command writing each block, for updates
+    std::string pending;                // records to append
+    std::string unsynced;               // records to append after the next sync
+    bool writing;                       // an update is running
+    size_t announced;                   // commands before this one are covered by D records
+    size_t lookups;
+    size_t hits;
+    size_t blocks;                      // not read thanks to hits
+};
+
+static std::string GetHashIndexFileName(const char* blockdev) {
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const uint8_t*>(blockdev), strlen(blockdev), digest);
+    return std::string(STASH_DIRECTORY_BASE) + "/" + print_sha1(digest) + ".hashes";
+}
+
+static void DeleteHashIndex(const char* blockdev) {
+    std::string fn = GetHashIndexFileName(blockdev);
+    if (unlink(fn.c_str()) == -1 && errno != ENOENT) {
+        fprintf(stderr, "unlink \"%s\" failed: %s\n", fn.c_str(), strerror(errno));
     }
+}
 
-    if (rename(fn.c_str(), cn.c_str()) == -1) {
-        fprintf(stderr, "rename(\"%s\", \"%s\") failed: %s\n", fn.c_str(), cn.c_str(),
-                strerror(errno));
-        return -1;
+// Returns s_mtime, s_wtime, s_mnt_count and s_max_mnt_count of the ext4
+// superblock in hex, or an empty string if they can't be read or the
+// partition doesn't hold ext4, whose mounts wouldn't change them.
+
+static std::string ReadProvenance(int fd) {
+    // The fields are followed by s_magic.
+    uint8_t fields[14];
+    if (TEMP_FAILURE_RETRY(pread64(fd, fields, sizeof(fields), 1024 + 44)) !=
+            static_cast<ssize_t>(sizeof(fields))) {
+        return "";
+    }
+    if (fields[12] != (HASH_INDEX_EXT4_MAGIC & 0xff) || fields[13] != (HASH_INDEX_EXT4_MAGIC >> 8)) {
+        return "";
     }
+    return print_hex(fields, 12);
+}
 
-    std::string dname = GetStashFileName(base, "", "");
-    int dfd = TEMP_FAILURE_RETRY(open(dname.c_str(), O_RDONLY | O_DIRECTORY));
-    unique_fd dfd_holder(dfd);
+static std::string RangeText(const RangeSet& rs) {
+    std::string text = std::to_string(rs.count * 2);
+    for (size_t p : rs.pos) {
+        text += "," + std::to_string(p);
+    }
+    return text;
+}
 
-    if (dfd == -1) {
-        failure_type = kFileOpenFailure;
-        fprintf(stderr, "failed to open \"%s\" failed: %s\n", dname.c_str(), strerror(errno));
-        return -1;
+static void MarkWritten(HashIndex& hi, const RangeSet& rs) {
+    ++hi.time;
+    for (size_t i = 0; i < rs.count; ++i) {
+        if (rs.pos[i * 2 + 1] > hi.gen.size()) {
+            hi.gen.resize(rs.pos[i * 2 + 1]);
+        }
+        std::fill(hi.gen.begin() + rs.pos[i * 2], hi.gen.begin() + rs.pos[i * 2 + 1], hi.time);
     }
+}
 
-    if (ota_fsync(dfd) == -1) {
-        failure_type = kFsyncFailure;
-        fprintf(stderr, "fsync \"%s\" failed: %s\n", dname.c_str(), strerror(errno));
-        return -1;
+static void MarkDirty(HashIndex& hi, const RangeSet& rs, bool dirty) {
+    for (size_t i = 0; i < rs.count; ++i) {
+        if (rs.pos[i * 2 + 1] > hi.dirty.size()) {
+            hi.dirty.resize(rs.pos[i * 2 + 1]);
+        }
+        std::fill(hi.dirty.begin() + rs.pos[i * 2], hi.dirty.begin() + rs.pos[i * 2 + 1], dirty);
     }
+}
 
-    return 0;
+static void SetHash(HashIndex& hi, const RangeSet& rs, const uint8_t* digest, bool read) {
+    HashIndexEntry& entry = hi.entries[RangeText(rs)];
+    entry.rs = rs;
+    memcpy(entry.digest, digest, SHA_DIGEST_LENGTH);
+    entry.time = ++hi.time;
+    entry.read = read;
 }
 
-// Creates a directory for storing stash files and checks if the /cache partition
-// hash enough space for the expected amount of blocks we need to store. Returns
-// >0 if we created the directory, zero if it existed already, and <0 of failure.
+static std::string HashRecord(char type, const RangeSet& rs, const uint8_t* digest) {
+    return std::string(1, type) + " " + RangeText(rs) + " " + print_sha1(digest) + "\n";
+}
 
-static int CreateStash(State* state, int maxblocks, const char* blockdev, std::string& base) {
-    if (blockdev == nullptr) {
-        return -1;
+// Records that 'rs' was found to have the given digest. During an update,
+// blocks announced by D records may still change before the next sync, so
+// the digest is only kept in memory.
+
+static void AddHash(HashIndex* hi, const RangeSet& rs, const uint8_t* digest) {
+    if (hi == nullptr) {
+        return;
+    }
+    SetHash(*hi, rs, digest, true);
+    if (!hi->writing) {
+        hi->pending += HashRecord('H', rs, digest);
     }
+}
 
-    // Stash directory should be different for each partition to avoid conflicts
-    // when updating multiple partitions at the same time, so we use the hash of
-    // the block device name as the base directory
-    uint8_t digest[SHA_DIGEST_LENGTH];
-    SHA1(reinterpret_cast<const uint8_t*>(blockdev), strlen(blockdev), digest);
-    base = print_sha1(digest);
+// Records that command 'index' has written 'rs' with the given digest, or
+// with unknown contents if 'digest' is null.
 
-    std::string dirname = GetStashFileName(base, "", "");
-    struct stat sb;
-    int res = stat(dirname.c_str(), &sb);
+static void AddWritten(HashIndex* hi, size_t index, const RangeSet& rs,
+        const uint8_t* digest) {
+    if (hi == nullptr || rs.count == 0) {
+        return;
+    }
 
-    if (res == -1 && errno != ENOENT) {
-        ErrorAbort(state, kStashCreationFailure, "stat \"%s\" failed: %s\n",
-                   dirname.c_str(), strerror(errno));
-        return -1;
-    } else if (res != 0) {
-        fprintf(stderr, "creating stash %s\n", dirname.c_str());
-        res = mkdir(dirname.c_str(), STASH_DIRECTORY_MODE);
+    MarkWritten(*hi, rs);
 
-        if (res != 0) {
-            ErrorAbort(state, kStashCreationFailure, "mkdir \"%s\" failed: %s\n",
-                       dirname.c_str(), strerror(errno));
-            return -1;
-        }
+    if (digest == nullptr) {
+        return;
+    }
 
-        if (CacheSizeCheck(maxblocks * BLOCKSIZE) != 0) {
-            ErrorAbort(state, kStashCreationFailure, "not enough space for stash\n");
-            return -1;
+    // Blocks that a later command writes again stay dirty until then.
+    for (size_t i = 0; i < rs.count; ++i) {
+        size_t end = std::min(rs.pos[i * 2 + 1], hi->writer.size());
+        for (size_t b = rs.pos[i * 2]; b < end; ++b) {
+            if (hi->writer[b] != index) {
+                return;
+            }
         }
-
-        return 1;  // Created directory
     }
 
-    fprintf(stderr, "using existing stash %s\n", dirname.c_str());
+    SetHash(*hi, rs, digest, false);
+    hi->unsynced += HashRecord('W', rs, digest);
+}
 
-    // If the directory already exists, calculate the space already allocated to
-    // stash files and check if there's enough for all required blocks. Delete any
-    // partially completed stash files first.
+// Looks up the digest of 'rs'. If 'read' is set, only digests of blocks
+// that were actually read count, and not the expected digests of writes.
 
-    EnumerateStash(dirname, DeletePartial, nullptr);
-    int size = 0;
-    EnumerateStash(dirname, UpdateFileSize, &size);
+static bool LookupHash(HashIndex* hi, const RangeSet& rs, uint8_t* digest, bool read) {
+    if (hi == nullptr) {
+        return false;
+    }
 
-    size = maxblocks * BLOCKSIZE - size;
+    ++hi->lookups;
+    auto it = hi->entries.find(RangeText(rs));
+    if (it == hi->entries.end() || (read && !it->second.read)) {
+        return false;
+    }
 
-    if (size > 0 && CacheSizeCheck(size) != 0) {
-        ErrorAbort(state, kStashCreationFailure, "not enough space for stash (%d more needed)\n",
-                   size);
-        return -1;
+    for (size_t i = 0; i < rs.count; ++i) {
+        size_t end = std::min(rs.pos[i * 2 + 1], hi->gen.size());
+        for (size_t b = rs.pos[i * 2]; b < end; ++b) {
+            if (hi->gen[b] > it->second.time) {
+                hi->entries.erase(it);
+                return false;
+            }
+        }
     }
 
-    return 0; // Using existing directory
+    memcpy(digest, it->second.digest, SHA_DIGEST_LENGTH);
+    ++hi->hits;
+    hi->blocks += rs.size;
+    return true;
 }
 
-static int SaveStash(CommandParameters& params, const std::string& base,
-        std::vector<uint8_t>& buffer, int fd, bool usehash) {
+// Replays the records of 'content'. Returns the last provenance, or an empty
+// string if the log is malformed.
 
-    // <stash_id> <src_range>
-    if (params.cpos + 1 >= params.tokens.size()) {
-        fprintf(stderr, "missing id and/or src range fields in stash command\n");
-        return -1;
-    }
-    const std::string& id = params.tokens[params.cpos++];
+static std::string ReplayHashIndex(HashIndex& hi, std::string content) {
+    // An incomplete last line is the end of an interrupted append.
+    content.erase(content.rfind('\n') + 1);
 
-    size_t blocks = 0;
-    if (usehash && LoadStash(params, base, id, true, &blocks, buffer, false) == 0) {
-        // Stash file already exists and has expected contents. Do not
-        // read from source again, as the source may have been already
-        // overwritten during a previous attempt.
-        return 0;
+    std::vector<std::string> lines = android::base::Split(content, "\n");
+    if (lines.size() < 2 || lines[0] != HASH_INDEX_MAGIC) {
+        return "";
     }
 
-    RangeSet src;
-    parse_range(params.tokens[params.cpos++], src);
+    std::string provenance;
+    for (size_t i = 1; i < lines.size() - 1; ++i) {
+        std::vector<std::string> fields = android::base::Split(lines[i], " ");
+        RangeSet rs;
+        uint8_t digest[SHA_DIGEST_LENGTH];
 
-    allocate(src.size * BLOCKSIZE, buffer);
-    if (ReadBlocks(src, buffer, fd) == -1) {
-        return -1;
+        if (fields.size() == 2 && fields[0] == "D" && ParseRange(fields[1], rs)) {
+            MarkWritten(hi, rs);
+            MarkDirty(hi, rs, true);
+        } else if (fields.size() == 3 && (fields[0] == "W" || fields[0] == "H") &&
+                ParseRange(fields[1], rs) && ParseSha1(fields[2].c_str(), digest) == 0) {
+            if (fields[0] == "W") {
+                MarkWritten(hi, rs);
+            }
+            MarkDirty(hi, rs, false);
+            SetHash(hi, rs, digest, fields[0] == "H");
+        } else if (fields.size() == 2 && fields[0] == "P") {
+            provenance = fields[1];
+        } else {
+            return "";
+        }
     }
-    blocks = src.size;
 
-    if (usehash && VerifyBlocks(id, buffer, blocks, true) != 0) {
-        // Source blocks have unexpected contents. If we actually need this
-        // data later, this is an unrecoverable error. However, the command
-        // that uses the data may have already completed previously, so the
-        // possible failure will occur during source block verification.
-        fprintf(stderr, "failed to load source blocks for stash %s\n", id.c_str());
-        return 0;
+    for (auto it = hi.entries.begin(); it != hi.entries.end(); ) {
+        const RangeSet& rs = it->second.rs;
+        bool dirty = false;
+        for (size_t i = 0; i < rs.count && !dirty; ++i) {
+            size_t end = std::min(rs.pos[i * 2 + 1], hi.dirty.size());
+            for (size_t b = rs.pos[i * 2]; b < end && !dirty; ++b) {
+                dirty = hi.dirty[b];
+            }
+        }
+        it = dirty ? hi.entries.erase(it) : std::next(it);
     }
+    hi.dirty.clear();
 
-    // In verify mode, save source range_set instead of stashing blocks.
-    if (!params.canwrite && usehash) {
-        stash_map[id] = src;
-        return 0;
+    return provenance;
+}
+
+// Loads the index of 'blockdev', whose descriptor is 'fd', and opens it for
+// appending. Starts a new index if there is none or it can't be trusted.
+// Returns false if the index can't be used at all.
+
+static bool LoadHashIndex(HashIndex& hi, const char* blockdev, int fd) {
+    hi.fn = GetHashIndexFileName(blockdev);
+    hi.dev = fd;
+    hi.fd = -1;
+
+    std::string provenance = ReadProvenance(fd);
+    if (provenance.empty()) {
+        // Nothing would tell if the partition was changed since.
+        fprintf(stderr, "not using a hash index; %s isn't ext4\n", blockdev);
+        DeleteHashIndex(blockdev);
+        return false;
     }
 
-    fprintf(stderr, "stashing %zu blocks to %s\n", blocks, id.c_str());
-    params.stashed += blocks;
-    return WriteStash(base, id, blocks, buffer, false, nullptr);
-}
+    std::string content;
+    bool trusted = false;
 
-static int FreeStash(const std::string& base, const std::string& id) {
-    if (base.empty() || id.empty()) {
-        return -1;
+    if (android::base::ReadFileToString(hi.fn, &content)) {
+        std::string last = ReplayHashIndex(hi, content);
+        trusted = !last.empty() && last == provenance;
+        if (!trusted) {
+            fprintf(stderr, "ignoring hash index %s; partition changed since\n", hi.fn.c_str());
+        }
     }
 
-    std::string fn = GetStashFileName(base, id, "");
-    DeleteFile(fn, nullptr);
+    int flags = O_WRONLY | O_CREAT | O_APPEND;
+    if (!trusted) {
+        hi.entries.clear();
+        hi.gen.clear();
+        flags |= O_TRUNC;
+    }
 
-    return 0;
+    hi.fd = TEMP_FAILURE_RETRY(open(hi.fn.c_str(), flags, STASH_FILE_MODE));
+    if (hi.fd == -1) {
+        fprintf(stderr, "failed to open \"%s\": %s\n", hi.fn.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!trusted) {
+        hi.pending = HASH_INDEX_MAGIC "\n";
+    }
+
+    fprintf(stderr, "hash index has %zu ranges\n", hi.entries.size());
+    return true;
 }
 
-static void MoveRange(std::vector<uint8_t>& dest, const RangeSet& locs,
-        const std::vector<uint8_t>& source) {
-    // source contains packed data, which we want to move to the
-    // locations given in locs in the dest buffer.  source and dest
-    // may be the same buffer.
+// Prepares the index for an update with 'tl', which writes the partition.
 
-    const uint8_t* from = source.data();
-    uint8_t* to = dest.data();
-    size_t start = locs.size;
-    for (int i = locs.count-1; i >= 0; --i) {
-        size_t blocks = locs.pos[i*2+1] - locs.pos[i*2];
-        start -= blocks;
-        memmove(to + (locs.pos[i*2] * BLOCKSIZE), from + (start * BLOCKSIZE),
-                blocks * BLOCKSIZE);
+static void StartHashIndexUpdate(HashIndex& hi, const TransferList& tl, size_t start) {
+    hi.writing = true;
+    hi.announced = start;
+
+    TransferCommand cmd = TransferCommand();
+    for (size_t i = start; i < tl.end; ++i) {
+        CommandFootprint fp;
+        if (!LoadCommand(tl, i, cmd) || GetCommandFootprint(cmd, fp) == -1) {
+            continue;
+        }
+
+        for (size_t j = 0; j < fp.tgt.count; ++j) {
+            if (fp.tgt.pos[j * 2 + 1] > hi.writer.size()) {
+                hi.writer.resize(fp.tgt.pos[j * 2 + 1], UINT32_MAX);
+            }
+            std::fill(hi.writer.begin() + fp.tgt.pos[j * 2],
+                      hi.writer.begin() + fp.tgt.pos[j * 2 + 1], i);
+        }
     }
 }
 
-// Do a source/target load for move/bsdiff/imgdiff in version 2.
-// We expect to parse the remainder of the parameter tokens as one of:
-//
-//    <tgt_range> <src_block_count> <src_range>
-//        (loads data from source image only)
-//
-//    <tgt_range> <src_block_count> - <[stash_id:stash_range] ...>
-//        (loads data from stashes only)
-//
-//    <tgt_range> <src_block_count> <src_range> <src_loc> <[stash_id:stash_range] ...>
-//        (loads data from both source image and stashes)
-//
-// On return, buffer is filled with the loaded source data (rearranged
-// and combined with stashed data as necessary).  buffer may be
-// reallocated if needed to accommodate the source data.  *tgt is the
-// target RangeSet.  Any stashes required are loaded using LoadStash.
+static void CloseHashIndex(HashIndex& hi) {
+    if (hi.fd != -1) {
+        close(hi.fd);
+        hi.fd = -1;
+    }
+}
 
-static int LoadSrcTgtVersion2(CommandParameters& params, RangeSet& tgt, size_t& src_blocks,
-        std::vector<uint8_t>& buffer, int fd, const std::string& stashbase, bool* overlap) {
+// Writes the pending records and the current provenance, syncing the file
+// if 'sync' is set. If this fails, the file is removed, as the partition
+// may be written next without the D records in place.
 
-    // At least it needs to provide three parameters: <tgt_range>,
-    // <src_block_count> and "-"/<src_range>.
-    if (params.cpos + 2 >= params.tokens.size()) {
-        fprintf(stderr, "invalid parameters\n");
-        return -1;
+static int AppendHashIndex(HashIndex* hi, bool sync) {
+    if (hi == nullptr || hi->fd == -1) {
+        return 0;
     }
 
-    // <tgt_range>
-    parse_range(params.tokens[params.cpos++], tgt);
-
-    // <src_block_count>
-    const std::string& token = params.tokens[params.cpos++];
-    if (!android::base::ParseUint(token.c_str(), &src_blocks)) {
-        fprintf(stderr, "invalid src_block_count \"%s\"\n", token.c_str());
+    // The provenance is read from the superblock, so a write of it that is
+    // still queued has to reach the partition first.
+    if (hi->writeback != nullptr && (AnyBlock(hi->writeback->written, 0, 1) ||
+            AnyBlock(hi->writeback->discarded, 0, 1)) && FlushWriteBack(*hi->writeback) == -1) {
         return -1;
     }
 
-    allocate(src_blocks * BLOCKSIZE, buffer);
-
-    // "-" or <src_range> [<src_loc>]
-    if (params.tokens[params.cpos] == "-") {
-        // no source ranges, only stashes
-        params.cpos++;
-    } else {
-        RangeSet src;
-        parse_range(params.tokens[params.cpos++], src);
-        int res = ReadBlocks(src, buffer, fd);
-
-        if (overlap) {
-            *overlap = range_overlaps(src, tgt);
-        }
+    std::string records = hi->pending + "P " + ReadProvenance(hi->dev) + "\n";
+    hi->pending.clear();
 
-        if (res == -1) {
+    if (!android::base::WriteStringToFd(records, hi->fd) || (sync && sync_fd(hi->fd) == -1)) {
+        fprintf(stderr, "failed to write \"%s\": %s\n", hi->fn.c_str(), strerror(errno));
+        if (unlink(hi->fn.c_str()) == -1 && errno != ENOENT) {
+            // The updater can't tell whether the D records made it.
+            fprintf(stderr, "unlink \"%s\" failed: %s\n", hi->fn.c_str(), strerror(errno));
             return -1;
         }
+        CloseHashIndex(*hi);
+    }
 
-        if (params.cpos >= params.tokens.size()) {
-            // no stashes, only source range
-            return 0;
-        }
+    return 0;
+}
 
-        RangeSet locs;
-        parse_range(params.tokens[params.cpos++], locs);
-        MoveRange(buffer, locs, buffer);
+// Called after the partition has been synced, which makes the records of
+// the update so far safe to append.
+
+static int HashIndexSynced(HashIndex* hi) {
+    if (hi == nullptr || hi->unsynced.empty()) {
+        return 0;
     }
 
-    // <[stash_id:stash_range]>
-    while (params.cpos < params.tokens.size()) {
-        // Each word is a an index into the stash table, a colon, and
-        // then a rangeset describing where in the source block that
-        // stashed data should go.
-        std::vector<std::string> tokens = android::base::Split(params.tokens[params.cpos++], ":");
-        if (tokens.size() != 2) {
-            fprintf(stderr, "invalid parameter\n");
-            return -1;
-        }
+    hi->pending += hi->unsynced;
+    hi->unsynced.clear();
+    return AppendHashIndex(hi, false);
+}
 
-        std::vector<uint8_t> stash;
-        int res = LoadStash(params, stashbase, tokens[0], false, nullptr, stash, true);
+// Makes sure that the targets of the commands from 'index' on are covered
+// by durable D records before the command at 'index' writes anything. The
+// records are written for HASH_INDEX_BATCH commands at a time.
 
-        if (res == -1) {
-            // These source blocks will fail verification if used later, but we
-            // will let the caller decide if this is a fatal failure
-            fprintf(stderr, "failed to load stash %s\n", tokens[0].c_str());
-            continue;
+static int AnnounceWrites(HashIndex* hi, const TransferList& tl, size_t index) {
+    if (hi == nullptr || hi->fd == -1 || index < hi->announced) {
+        return 0;
+    }
+
+    TransferCommand cmd = TransferCommand();
+    size_t end = std::min(index + HASH_INDEX_BATCH, tl.end);
+    for (size_t i = index; i < end; ++i) {
+        CommandFootprint fp;
+        if (LoadCommand(tl, i, cmd) && GetCommandFootprint(cmd, fp) == 0 && fp.tgt.count > 0) {
+            hi->pending += "D " + RangeText(fp.tgt) + "\n";
         }
+    }
+    hi->announced = end;
 
-        RangeSet locs;
-        parse_range(tokens[1], locs);
+    return AppendHashIndex(hi, true);
+}
 
-        MoveRange(buffer, locs, stash);
-    }
+// Digests of the blocks a command checks during verification, computed by
+// a VerifyPool thread. A digest is only set if it covers exactly the data
+// the command would hash itself.
+struct VerifyResult {
+    bool has_src;
+    bool has_tgt;
+    uint8_t src[SHA_DIGEST_LENGTH];
+    uint8_t tgt[SHA_DIGEST_LENGTH];
+};
 
-    return 0;
+// Parses the transfer list with ParseTransferList(), aborting the update if
+// it's malformed. Returns -1 on error.
+
+static int LoadTransferList(State* state, const char* data, size_t size, TransferList& tl) {
+    std::string error;
+    int rc = ParseTransferList(data, size, tl, error);
+    if (rc == -1) {
+        ErrorAbort(state, kArgsParsingFailure, "%s\n", error.c_str());
+    } else if (rc == -2) {
+        fprintf(stderr, "%s\n", error.c_str());
+    }
+    return rc == 0 ? 0 : -1;
 }
 
-// Do a source/target load for move/bsdiff/imgdiff in version 3.
-//
-// Parameters are the same as for LoadSrcTgtVersion2, except for 'onehash', which
-// tells the function whether to expect separate source and targe block hashes, or
-// if they are both the same and only one hash should be expected, and
-// 'isunresumable', which receives a non-zero value if block verification fails in
-// a way that the update cannot be resumed anymore.
-//
-// If the function is unable to load the necessary blocks or their contents don't
-// match the hashes, the return value is -1 and the command should be aborted.
+// Parameters for transfer list command functions. The command itself is
+// loaded with LoadCommand() and its arguments are read with the functions of
+// transfer_list_parser.h.
+struct CommandParameters : TransferCommand {
+    std::string freestash;
+    std::string stashbase;
+    bool canwrite = false;
+    int createdstash = 0;
+    int fd = -1;
+    bool foundwrites = false;
+    bool isunresumable = false;
+    int version = 0;
+    size_t written = 0;
+    size_t stashed = 0;
+    NewThreadInfo* nti = nullptr;
+    std::vector<uint8_t> buffer;
+    uint8_t* patch_start = nullptr;
+    Checkpoint* checkpoint = nullptr;
+    StashCache* stash_cache = nullptr;
+    HashIndex* hash_index = nullptr;
+    bool has_tgtdigest = false;
+    uint8_t tgtdigest[SHA_DIGEST_LENGTH] = {};  // expected digest of the target, once known
+    int zeroout = 0;                    // ZEROOUT_* method of zero_blocks()
+    const VerifyResult* verified = nullptr;     // digests computed ahead, or null
+    bool uptodate = false;              // the target blocks were found up to date
+    size_t patch_alloc = 0;             // most memory the patcher held besides the source
+    WriteBack writeback = WriteBack();  // of the writes to fd
+    size_t move_window = 0;             // MOVE_WINDOW_PROPERTY
+};
+
+// Do a source/target load for move/bsdiff/imgdiff in version 1.
+// We expect to parse the remainder of the parameter tokens as:
 //
-// If the return value is 1, the command has already been completed according to
-// the contents of the target blocks, and should not be performed again.
+//    <src_range> <tgt_range>
 //
-// If the return value is 0, source blocks have expected content and the command
-// can be performed.
+// The source range is loaded into the provided buffer, reallocating
+// it to make it larger if necessary.
 
-static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t& src_blocks,
-        bool onehash, bool& overlap) {
+static int LoadSrcTgtVersion1(CommandParameters& params, RangeSet& tgt, size_t& src_blocks,
+        std::vector<uint8_t>& buffer, int fd) {
 
-    if (params.cpos >= params.tokens.size()) {
-        fprintf(stderr, "missing source hash\n");
+    if (params.cpos + 1 >= params.argc) {
+        fprintf(stderr, "invalid parameters\n");
         return -1;
     }
 
-    std::string srchash = params.tokens[params.cpos++];
-    std::string tgthash;
+    // <src_range>
+    RangeSet src;
+    NextRangeArg(params, src);
 
-    if (onehash) {
-        tgthash = srchash;
-    } else {
-        if (params.cpos >= params.tokens.size()) {
-            fprintf(stderr, "missing target hash\n");
-            return -1;
+    // <tgt_range>
+    NextRangeArg(params, tgt);
+
+    allocate(src.size * BLOCKSIZE, buffer);
+    int rc = ReadBlocks(src, buffer, fd);
+    src_blocks = src.size;
+
+    return rc;
+}
+
+static int VerifyDigest(const std::string& expected, const uint8_t* digest, bool printerror) {
+    std::string hexdigest = print_sha1(digest);
+
+    if (hexdigest != expected) {
+        if (printerror) {
+            fprintf(stderr, "failed to verify blocks (expected %s, read %s)\n",
+                    expected.c_str(), hexdigest.c_str());
         }
-        tgthash = params.tokens[params.cpos++];
+        return -1;
     }
 
-    if (LoadSrcTgtVersion2(params, tgt, src_blocks, params.buffer, params.fd, params.stashbase,
-            &overlap) == -1) {
+    return 0;
+}
+
+// Same as above for a digest read with NextDigestArg(), which is only
+// printed if it doesn't match.
+static int VerifyDigest(const uint8_t* expected, const uint8_t* digest, bool printerror) {
+    if (memcmp(expected, digest, SHA_DIGEST_LENGTH) != 0) {
+        if (printerror) {
+            fprintf(stderr, "failed to verify blocks (expected %s, read %s)\n",
+                    print_sha1(expected).c_str(), print_sha1(digest).c_str());
+        }
         return -1;
     }
 
-    std::vector<uint8_t> tgtbuffer(tgt.size * BLOCKSIZE);
+    return 0;
+}
+
+static int VerifyBlocks(const std::string& expected, const std::vector<uint8_t>& buffer,
+        const size_t blocks, bool printerror) {
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(buffer.data(), blocks * BLOCKSIZE, digest);
+    io.bytes_hashed += blocks * BLOCKSIZE;
+    return VerifyDigest(expected, digest, printerror);
+}
 
-    if (ReadBlocks(tgt, tgtbuffer, params.fd) == -1) {
-        return -1;
+static int VerifyBlocks(const uint8_t* expected, const std::vector<uint8_t>& buffer,
+        const size_t blocks, bool printerror) {
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(buffer.data(), blocks * BLOCKSIZE, digest);
+    io.bytes_hashed += blocks * BLOCKSIZE;
+    return VerifyDigest(expected, digest, printerror);
+}
+
+static std::string GetStashFileName(const std::string& base, const std::string& id,
+        const std::string& postfix) {
+    if (base.empty()) {
+        return "";
     }
 
-    if (VerifyBlocks(tgthash, tgtbuffer, tgt.size, false) == 0) {
-        // Target blocks already have expected content, command should be skipped
-        return 1;
+    std::string fn(STASH_DIRECTORY_BASE);
+    fn += "/" + base + "/" + id + postfix;
+
+    return fn;
+}
+
+typedef void (*StashCallback)(const std::string&, void*);
+
+// Does a best effort enumeration of stash files. Ignores possible non-file
+// items in the stash directory and continues despite of errors. Calls the
+// 'callback' function for each file and passes 'data' to the function as a
+// parameter.
+
+static void EnumerateStash(const std::string& dirname, StashCallback callback, void* data) {
+    if (dirname.empty() || callback == nullptr) {
+        return;
     }
 
-    if (VerifyBlocks(srchash, params.buffer, src_blocks, true) == 0) {
-        // If source and target blocks overlap, stash the source blocks so we can
-        // resume from possible write errors. In verify mode, we can skip stashing
-        // because the source blocks won't be overwritten.
-        if (overlap && params.canwrite) {
-            fprintf(stderr, "stashing %zu overlapping blocks to %s\n", src_blocks,
-                    srchash.c_str());
+    std::unique_ptr<DIR, int(*)(DIR*)> directory(opendir(dirname.c_str()), closedir);
 
-            bool stash_exists = false;
-            if (WriteStash(params.stashbase, srchash, src_blocks, params.buffer, true,
-                           &stash_exists) != 0) {
-                fprintf(stderr, "failed to stash overlapping source blocks\n");
+    if (directory == nullptr) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "opendir \"%s\" failed: %s\n", dirname.c_str(), strerror(errno));
+        }
+        return;
+    }
+
+    struct dirent* item;
+    while ((item = readdir(directory.get())) != nullptr) {
+        if (item->d_type != DT_REG) {
+            continue;
+        }
+
+        std::string fn = dirname + "/" + std::string(item->d_name);
+        callback(fn, data);
+    }
+}
+
+static void UpdateFileSize(const std::string& fn, void* data) {
+    if (fn.empty() || !data) {
+        return;
+    }
+
+    struct stat sb;
+    if (stat(fn.c_str(), &sb) == -1) {
+        fprintf(stderr, "stat \"%s\" failed: %s\n", fn.c_str(), strerror(errno));
+        return;
+    }
+
+    int* size = reinterpret_cast<int*>(data);
+    *size += sb.st_size;
+}
+
+// Deletes the stash directory and all files in it. Assumes that it only
+// contains files. There is nothing we can do about unlikely, but possible
+// errors, so they are merely logged.
+
+static void DeleteFile(const std::string& fn, void* /* data */) {
+    if (!fn.empty()) {
+        fprintf(stderr, "deleting %s\n", fn.c_str());
+
+        if (unlink(fn.c_str()) == -1 && errno != ENOENT) {
+            fprintf(stderr, "unlink \"%s\" failed: %s\n", fn.c_str(), strerror(errno));
+        }
+    }
+}
+
+static void DeletePartial(const std::string& fn, void* data) {
+    if (android::base::EndsWith(fn, ".partial")) {
+        DeleteFile(fn, data);
+    }
+}
+
+static void DeleteStash(const std::string& base) {
+    if (base.empty()) {
+        return;
+    }
+
+    fprintf(stderr, "deleting stash %s\n", base.c_str());
+
+    std::string dirname = GetStashFileName(base, "", "");
+    EnumerateStash(dirname, DeleteFile, nullptr);
+
+    if (rmdir(dirname.c_str()) == -1) {
+        if (errno != ENOENT && errno != ENOTDIR) {
+            fprintf(stderr, "rmdir \"%s\" failed: %s\n", dirname.c_str(), strerror(errno));
+        }
+    }
+}
+
+static int LoadStash(CommandParameters& params, const std::string& base, const std::string& id,
+        bool verify, size_t* blocks, std::vector<uint8_t>& buffer, bool printnoent) {
+    // In verify mode, if source range_set was saved for the given hash,
+    // check contents in the source blocks first. If the check fails,
+    // search for the stashed files on /cache as usual.
+    if (!params.canwrite) {
+        if (stash_map.find(id) != stash_map.end()) {
+            const RangeSet& src = stash_map[id];
+            allocate(src.size * BLOCKSIZE, buffer);
+
+            if (ReadBlocks(src, buffer, params.fd) == -1) {
+                fprintf(stderr, "failed to read source blocks in stash map.\n");
                 return -1;
             }
-
-            params.stashed += src_blocks;
-            // Can be deleted when the write has completed
-            if (!stash_exists) {
-                params.freestash = srchash;
+            if (VerifyBlocks(id, buffer, src.size, true) != 0) {
+                fprintf(stderr, "failed to verify loaded source blocks in stash map.\n");
+                return -1;
             }
+            return 0;
+        }
+    }
+
+    if (base.empty()) {
+        return -1;
+    }
+
+    size_t blockcount = 0;
+
+    if (!blocks) {
+        blocks = &blockcount;
+    }
+
+    if (params.stash_cache != nullptr) {
+        auto it = params.stash_cache->entries.find(id);
+        if (it != params.stash_cache->entries.end()) {
+            const std::vector<uint8_t>& data = it->second.data;
+            allocate(data.size(), buffer);
+            std::copy(data.begin(), data.end(), buffer.begin());
+            *blocks = data.size() / BLOCKSIZE;
+            params.stash_cache->hits++;
+            return 0;
+        }
+    }
+
+    std::string fn = GetStashFileName(base, id, "");
+
+    struct stat sb;
+    int res = stat(fn.c_str(), &sb);
+
+    if (res == -1) {
+        if (errno != ENOENT || printnoent) {
+            fprintf(stderr, "stat \"%s\" failed: %s\n", fn.c_str(), strerror(errno));
+        }
+        return -1;
+    }
+
+    fprintf(stderr, " loading %s\n", fn.c_str());
+
+    int fd = TEMP_FAILURE_RETRY(open(fn.c_str(), O_RDONLY));
+    unique_fd fd_holder(fd);
+
+    if (fd == -1) {
+        fprintf(stderr, "open \"%s\" failed: %s\n", fn.c_str(), strerror(errno));
+        return -1;
+    }
+
+    allocate(sb.st_size, buffer);
+
+    if (pread_all(fd, buffer, sb.st_size, 0) == -1) {
+        return -1;
+    }
+
+    ++io.stash_loads;
+    io.stash_bytes_read += sb.st_size;
+
+    if (IsCompressedStash(buffer.data(), sb.st_size)) {
+        std::vector<uint8_t> compressed(buffer.begin(), buffer.begin() + sb.st_size);
+        if (!DecompressStash(compressed.data(), compressed.size(), BLOCKSIZE, buffer, blocks)) {
+            fprintf(stderr, "failed to decompress %s\n", fn.c_str());
+            DeleteFile(fn, nullptr);
+            return -1;
         }
+    } else if ((sb.st_size % BLOCKSIZE) != 0) {
+        fprintf(stderr, "%s size %" PRId64 " not multiple of block size %d",
+                fn.c_str(), static_cast<int64_t>(sb.st_size), BLOCKSIZE);
+        return -1;
+    } else {
+        *blocks = sb.st_size / BLOCKSIZE;
+    }
+
+    if (verify && VerifyBlocks(id, buffer, *blocks, true) != 0) {
+        fprintf(stderr, "unexpected contents in %s\n", fn.c_str());
+        DeleteFile(fn, nullptr);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int FsyncStashDirectory(const std::string& base) {
+    std::string dname = GetStashFileName(base, "", "");
+    int dfd = TEMP_FAILURE_RETRY(open(dname.c_str(), O_RDONLY | O_DIRECTORY));
+    unique_fd dfd_holder(dfd);
+
+    if (dfd == -1) {
+        failure_type = kFileOpenFailure;
+        fprintf(stderr, "failed to open \"%s\" failed: %s\n", dname.c_str(), strerror(errno));
+        return -1;
+    }
+
+    if (sync_fd(dfd) == -1) {
+        failure_type = kFsyncFailure;
+        fprintf(stderr, "fsync \"%s\" failed: %s\n", dname.c_str(), strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Writes a stash file. If 'cp' is given, syncing the file and the stash
+// directory is left to the next FlushCheckpoint().
+
+static int WriteStash(const std::string& base, const std::string& id, int blocks,
+        const std::vector<uint8_t>& buffer, bool checkspace, bool *exists, Checkpoint* cp) {
+    if (base.empty()) {
+        return -1;
+    }
+
+    std::string fn = GetStashFileName(base, id, ".partial");
+    std::string cn = GetStashFileName(base, id, "");
+
+    if (exists) {
+        struct stat sb;
+        int res = stat(cn.c_str(), &sb);
+
+        if (res == 0) {
+            // The file already exists and since the name is the hash of the contents,
+            // it's safe to assume the contents are identical (accidental hash collisions
+            // are unlikely)
+            fprintf(stderr, " skipping %d existing blocks in %s\n", blocks, cn.c_str());
+            *exists = true;
+            return 0;
+        }
+
+        *exists = false;
+    }
+
+    // Compressed stashes are only used if that saves space.
+    std::vector<uint8_t> compressed;
+    const uint8_t* data = buffer.data();
+    size_t size = blocks * BLOCKSIZE;
+    if (compress_stash && CompressStash(data, blocks, BLOCKSIZE, compressed)) {
+        data = compressed.data();
+        size = compressed.size();
+    }
+
+    if (checkspace && CacheSizeCheck(size) != 0) {
+        fprintf(stderr, "not enough space to write stash\n");
+        return -1;
+    }
+
+    fprintf(stderr, " writing %d blocks to %s\n", blocks, cn.c_str());
+
+    int fd = TEMP_FAILURE_RETRY(open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, STASH_FILE_MODE));
+    unique_fd fd_holder(fd);
+
+    if (fd == -1) {
+        fprintf(stderr, "failed to create \"%s\": %s\n", fn.c_str(), strerror(errno));
+        return -1;
+    }
+
+    if (pwrite_all(fd, data, size, 0) == -1) {
+        return -1;
+    }
+
+    ++io.stash_writes;
+    io.stash_bytes_written += size;
+
+    if (cp == nullptr && sync_fd(fd) == -1) {
+        failure_type = kFsyncFailure;
+        fprintf(stderr, "fsync \"%s\" failed: %s\n", fn.c_str(), strerror(errno));
+        return -1;
+    }
+
+    if (rename(fn.c_str(), cn.c_str()) == -1) {
+        fprintf(stderr, "rename(\"%s\", \"%s\") failed: %s\n", fn.c_str(), cn.c_str(),
+                strerror(errno));
+        return -1;
+    }
+
+    if (cp != nullptr) {
+        // A stash that was renamed before its contents were synced fails
+        // verification when loaded, and is written again by SaveStash().
+        cp->stash_files.push_back(cn);
+        return 0;
+    }
+
+    return FsyncStashDirectory(base);
+}
+
+// Creates a directory for storing stash files and checks if the /cache partition
+// hash enough space for the expected amount of blocks we need to store. Returns
+// >0 if we created the directory, zero if it existed already, and <0 of failure.
+
+static int CreateStash(State* state, int maxblocks, const char* blockdev, std::string& base) {
+    if (blockdev == nullptr) {
+        return -1;
+    }
+
+    // Stash directory should be different for each partition to avoid conflicts
+    // when updating multiple partitions at the same time, so we use the hash of
+    // the block device name as the base directory
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const uint8_t*>(blockdev), strlen(blockdev), digest);
+    base = print_sha1(digest);
+
+    std::string dirname = GetStashFileName(base, "", "");
+    struct stat sb;
+    int res = stat(dirname.c_str(), &sb);
+
+    if (res == -1 && errno != ENOENT) {
+        ErrorAbort(state, kStashCreationFailure, "stat \"%s\" failed: %s\n",
+                   dirname.c_str(), strerror(errno));
+        return -1;
+    } else if (res != 0) {
+        fprintf(stderr, "creating stash %s\n", dirname.c_str());
+        res = mkdir(dirname.c_str(), STASH_DIRECTORY_MODE);
+
+        if (res != 0) {
+            ErrorAbort(state, kStashCreationFailure, "mkdir \"%s\" failed: %s\n",
+                       dirname.c_str(), strerror(errno));
+            return -1;
+        }
+
+        if (CacheSizeCheck(maxblocks * BLOCKSIZE) != 0) {
+            ErrorAbort(state, kStashCreationFailure, "not enough space for stash\n");
+            return -1;
+        }
+
+        return 1;  // Created directory
+    }
+
+    fprintf(stderr, "using existing stash %s\n", dirname.c_str());
+
+    // If the directory already exists, calculate the space already allocated to
+    // stash files and check if there's enough for all required blocks. Delete any
+    // partially completed stash files first.
+
+    EnumerateStash(dirname, DeletePartial, nullptr);
+    int size = 0;
+    EnumerateStash(dirname, UpdateFileSize, &size);
+
+    size = maxblocks * BLOCKSIZE - size;
+
+    if (size > 0 && CacheSizeCheck(size) != 0) {
+        ErrorAbort(state, kStashCreationFailure, "not enough space for stash (%d more needed)\n",
+                   size);
+        return -1;
+    }
+
+    return 0; // Using existing directory
+}
+
+// Returns the index of the first command after 'index' that loads stash
+// 'id', or SIZE_MAX if there is none.
+
+static size_t NextStashUse(const StashCache& sc, const std::string& id, size_t index) {
+    auto it = sc.uses.find(id);
+    if (it == sc.uses.end()) {
+        return SIZE_MAX;
+    }
+
+    auto next = std::upper_bound(it->second.begin(), it->second.end(), index);
+    return next == it->second.end() ? SIZE_MAX : *next;
+}
+
+// Writes a stash kept in memory to its stash file, unless that has been done
+// already. If syncing is left to the next checkpoint, the source blocks are
+// marked pending, so that they aren't overwritten before the file is durable.
+
+static int SpillStash(CommandParameters& params, const std::string& id, StashEntry& entry,
+        bool sync) {
+    if (entry.ondisk) {
+        return 0;
+    }
+
+    Checkpoint* cp = sync ? nullptr : params.checkpoint;
+    if (WriteStash(params.stashbase, id, entry.data.size() / BLOCKSIZE, entry.data, false,
+            nullptr, cp) != 0) {
+        return -1;
+    }
+
+    if (cp != nullptr) {
+        MarkCheckpointPending(*cp, entry.src);
+    }
+
+    entry.ondisk = true;
+    params.stash_cache->spills++;
+    return 0;
+}
+
+// Stashes kept in memory survive an interruption only as long as their source
+// blocks do, as the stash commands are then executed again. Before a command
+// overwrites any of them, the stashes read from there are written to /cache.
+
+static int SpillOverwrittenStashes(CommandParameters& params, const RangeSet& tgt) {
+    for (auto& it : params.stash_cache->entries) {
+        if (!it.second.ondisk && range_overlaps(it.second.src, tgt) &&
+                SpillStash(params, it.first, it.second, false) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Stores a stash that was just read from 'src', keeping it in memory if it
+// fits in the budget. Otherwise the stashes that are needed furthest in the
+// future are written to /cache and dropped from memory to make room, or the
+// new stash itself if it is needed last.
+
+static int CacheStash(CommandParameters& params, const std::string& id,
+        const std::vector<uint8_t>& buffer, size_t blocks, const RangeSet& src) {
+    StashCache* sc = params.stash_cache;
+    size_t bytes = blocks * BLOCKSIZE;
+
+    if (sc->budget == 0 || bytes > sc->budget) {
+        return WriteStash(params.stashbase, id, blocks, buffer, false, nullptr, params.checkpoint);
+    }
+
+    size_t next = NextStashUse(*sc, id, params.index);
+    while (sc->size + bytes > sc->budget) {
+        auto victim = sc->entries.end();
+        size_t farthest = next;
+        for (auto it = sc->entries.begin(); it != sc->entries.end(); ++it) {
+            size_t use = NextStashUse(*sc, it->first, params.index);
+            if (use > farthest) {
+                farthest = use;
+                victim = it;
+            }
+        }
+
+        if (victim == sc->entries.end()) {
+            return WriteStash(params.stashbase, id, blocks, buffer, false, nullptr,
+                    params.checkpoint);
+        }
+
+        if (SpillStash(params, victim->first, victim->second, false) == -1) {
+            return -1;
+        }
+        sc->size -= victim->second.data.size();
+        sc->entries.erase(victim);
+    }
+
+    fprintf(stderr, " keeping %zu blocks in memory\n", blocks);
+
+    StashEntry& entry = sc->entries[id];
+    entry.data.assign(buffer.begin(), buffer.begin() + bytes);
+    entry.src = src;
+    entry.ondisk = false;
+    sc->size += bytes;
+    return 0;
+}
+
+static int SaveStash(CommandParameters& params, const std::string& base,
+        std::vector<uint8_t>& buffer, int fd, bool usehash) {
+
+    // <stash_id> <src_range>
+    if (params.cpos + 1 >= params.argc) {
+        fprintf(stderr, "missing id and/or src range fields in stash command\n");
+        return -1;
+    }
+    const std::string id = NextArg(params);
+
+    size_t blocks = 0;
+    if (usehash && LoadStash(params, base, id, true, &blocks, buffer, false) == 0) {
+        // Stash file already exists and has expected contents. Do not
+        // read from source again, as the source may have been already
+        // overwritten during a previous attempt.
+        return 0;
+    }
+
+    RangeSet src;
+    NextRangeArg(params, src);
+    blocks = src.size;
+
+    int verified = 0;
+    if (usehash && params.verified != nullptr && params.verified->has_src) {
+        verified = VerifyDigest(id, params.verified->src, true);
+    } else {
+        allocate(src.size * BLOCKSIZE, buffer);
+        if (ReadBlocks(src, buffer, fd) == -1) {
+            return -1;
+        }
+
+        if (usehash) {
+            verified = VerifyBlocks(id, buffer, blocks, true);
+        }
+    }
+
+    if (verified != 0) {
+        // Source blocks have unexpected contents. If we actually need this
+        // data later, this is an unrecoverable error. However, the command
+        // that uses the data may have already completed previously, so the
+        // possible failure will occur during source block verification.
+        fprintf(stderr, "failed to load source blocks for stash %s\n", id.c_str());
+        return 0;
+    }
+
+    // In verify mode, save source range_set instead of stashing blocks.
+    if (!params.canwrite && usehash) {
+        stash_map[id] = src;
+        return 0;
+    }
+
+    fprintf(stderr, "stashing %zu blocks to %s\n", blocks, id.c_str());
+    params.stashed += blocks;
+    if (usehash && params.stash_cache != nullptr) {
+        return CacheStash(params, id, buffer, blocks, src);
+    }
+    return WriteStash(base, id, blocks, buffer, false, nullptr, params.checkpoint);
+}
+
+static int FreeStash(const std::string& base, const std::string& id) {
+    if (base.empty() || id.empty()) {
+        return -1;
+    }
+
+    std::string fn = GetStashFileName(base, id, "");
+    DeleteFile(fn, nullptr);
+
+    return 0;
+}
+
+// Frees a stash once the commands that used it are durable.
+
+static int ReleaseStash(CommandParameters& params, const std::string& id) {
+    StashCache* sc = params.stash_cache;
+    if (sc != nullptr) {
+        auto it = sc->entries.find(id);
+        if (it != sc->entries.end()) {
+            bool ondisk = it->second.ondisk;
+            sc->size -= it->second.data.size();
+            sc->entries.erase(it);
+            if (!ondisk) {
+                return 0;
+            }
+        }
+    }
+
+    if (params.checkpoint != nullptr) {
+        params.checkpoint->frees.push_back(id);
+        return 0;
+    }
+
+    return FreeStash(params.stashbase, id);
+}
+
+static void MoveRange(std::vector<uint8_t>& dest, const RangeSet& locs,
+        const std::vector<uint8_t>& source) {
+    // source contains packed data, which we want to move to the
+    // locations given in locs in the dest buffer.  source and dest
+    // may be the same buffer.
+
+    const uint8_t* from = source.data();
+    uint8_t* to = dest.data();
+    size_t start = locs.size;
+    for (int i = locs.count-1; i >= 0; --i) {
+        size_t blocks = locs.pos[i*2+1] - locs.pos[i*2];
+        start -= blocks;
+        memmove(to + (locs.pos[i*2] * BLOCKSIZE), from + (start * BLOCKSIZE),
+                blocks * BLOCKSIZE);
+    }
+}
+
+// Do a source/target load for move/bsdiff/imgdiff in version 2.
+// We expect to parse the remainder of the parameter tokens as one of:
+//
+//    <tgt_range> <src_block_count> <src_range>
+//        (loads data from source image only)
+//
+//    <tgt_range> <src_block_count> - <[stash_id:stash_range] ...>
+//        (loads data from stashes only)
+//
+//    <tgt_range> <src_block_count> <src_range> <src_loc> <[stash_id:stash_range] ...>
+//        (loads data from both source image and stashes)
+//
+// On return, buffer is filled with the loaded source data (rearranged
+// and combined with stashed data as necessary).  buffer may be
+// reallocated if needed to accommodate the source data.  *tgt is the
+// target RangeSet.  Any stashes required are loaded using LoadStash.
+
+static int LoadSrcTgtVersion2(CommandParameters& params, RangeSet& tgt, size_t& src_blocks,
+        std::vector<uint8_t>& buffer, int fd, const std::string& stashbase, bool* overlap) {
+
+    // At least it needs to provide three parameters: <tgt_range>,
+    // <src_block_count> and "-"/<src_range>.
+    if (params.cpos + 2 >= params.argc) {
+        fprintf(stderr, "invalid parameters\n");
+        return -1;
+    }
+
+    // <tgt_range>
+    NextRangeArg(params, tgt);
+
+    // <src_block_count>
+    if (!NextUintArg(params, &src_blocks)) {
+        fprintf(stderr, "invalid src_block_count\n");
+        return -1;
+    }
+
+    allocate(src_blocks * BLOCKSIZE, buffer);
+
+    // "-" or <src_range> [<src_loc>]
+    if (ArgIsNone(params)) {
+        // no source ranges, only stashes
+        params.cpos++;
+    } else {
+        RangeSet src;
+        NextRangeArg(params, src);
+
+        // The source has been hashed already if it's read from here only.
+        int res = 0;
+        if (params.verified == nullptr || !params.verified->has_src) {
+            res = ReadBlocks(src, buffer, fd);
+        }
+
+        if (overlap) {
+            *overlap = range_overlaps(src, tgt);
+        }
+
+        if (res == -1) {
+            return -1;
+        }
+
+        if (params.cpos >= params.argc) {
+            // no stashes, only source range
+            return 0;
+        }
+
+        RangeSet locs;
+        NextRangeArg(params, locs);
+        MoveRange(buffer, locs, buffer);
+    }
+
+    // <[stash_id:stash_range]>
+    while (params.cpos < params.argc) {
+        // Each word is a an index into the stash table, a colon, and
+        // then a rangeset describing where in the source block that
+        // stashed data should go.
+        std::string id;
+        RangeSet locs;
+        if (!NextStashArg(params, id, locs)) {
+            fprintf(stderr, "invalid parameter\n");
+            return -1;
+        }
+
+        std::vector<uint8_t> stash;
+        int res = LoadStash(params, stashbase, id, false, nullptr, stash, true);
+
+        if (res == -1) {
+            // These source blocks will fail verification if used later, but we
+            // will let the caller decide if this is a fatal failure
+            fprintf(stderr, "failed to load stash %s\n", id.c_str());
+            continue;
+        }
+
+        MoveRange(buffer, locs, stash);
+    }
+
+    return 0;
+}
+
+// Do a source/target load for move/bsdiff/imgdiff in version 3.
+//
+// Parameters are the same as for LoadSrcTgtVersion2, except for 'onehash', which
+// tells the function whether to expect separate source and targe block hashes, or
+// if they are both the same and only one hash should be expected, and
+// 'isunresumable', which receives a non-zero value if block verification fails in
+// a way that the update cannot be resumed anymore.
+//
+// If the function is unable to load the necessary blocks or their contents don't
+// match the hashes, the return value is -1 and the command should be aborted.
+//
+// If the return value is 1, the command has already been completed according to
+// the contents of the target blocks, and should not be performed again.
+//
+// If the return value is 0, source blocks have expected content and the command
+// can be performed.
+
+static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t& src_blocks,
+        bool onehash, bool& overlap) {
+
+    if (params.cpos >= params.argc) {
+        fprintf(stderr, "missing source hash\n");
+        return -1;
+    }
+
+    uint8_t srchash[SHA_DIGEST_LENGTH];
+    if (!NextDigestArg(params, srchash)) {
+        fprintf(stderr, "invalid source hash\n");
+        return -1;
+    }
+
+    uint8_t* tgthash = params.tgtdigest;
+    if (onehash) {
+        memcpy(tgthash, srchash, SHA_DIGEST_LENGTH);
+    } else {
+        if (params.cpos >= params.argc) {
+            fprintf(stderr, "missing target hash\n");
+            return -1;
+        }
+        if (!NextDigestArg(params, tgthash)) {
+            fprintf(stderr, "invalid target hash\n");
+            return -1;
+        }
+    }
+
+    params.has_tgtdigest = true;
+
+    // If the digest of the target is known, an up to date command doesn't
+    // need to read its source either.
+    uint8_t known[SHA_DIGEST_LENGTH];
+    bool tgtknown = false;
+    if (params.hash_index != nullptr && params.cpos + 2 < params.argc) {
+        size_t cpos = params.cpos;
+        NextRangeArg(params, tgt);
+        tgtknown = LookupHash(params.hash_index, tgt, known, params.canwrite);
+        if (tgtknown && VerifyDigest(tgthash, known, false) == 0) {
+            if (!NextUintArg(params, &src_blocks)) {
+                fprintf(stderr, "invalid src_block_count\n");
+                return -1;
+            }
+            params.uptodate = true;
+            return 1;
+        }
+        params.cpos = cpos;
+    }
+
+    if (LoadSrcTgtVersion2(params, tgt, src_blocks, params.buffer, params.fd, params.stashbase,
+            &overlap) == -1) {
+        return -1;
+    }
+
+    const VerifyResult* vr = params.verified;
+    int tgtstatus;
+    if (tgtknown) {
+        tgtstatus = -1;
+    } else if (vr != nullptr && vr->has_tgt) {
+        tgtstatus = VerifyDigest(tgthash, vr->tgt, false);
+        AddHash(params.hash_index, tgt, vr->tgt);
+    } else {
+        // Hash the target a window at a time, so that checking it doesn't
+        // need as much memory as the source on top of the source.
+        std::vector<uint8_t> tgtbuffer;
+        uint8_t digest[SHA_DIGEST_LENGTH];
+
+        if (HashBlocks(tgt, tgtbuffer, params.fd, digest) == -1) {
+            return -1;
+        }
+
+        tgtstatus = VerifyDigest(tgthash, digest, false);
+        AddHash(params.hash_index, tgt, digest);
+    }
+
+    if (tgtstatus == 0) {
+        // Target blocks already have expected content, command should be skipped
+        params.uptodate = true;
+        return 1;
+    }
+
+    int srcstatus;
+    if (vr != nullptr && vr->has_src) {
+        srcstatus = VerifyDigest(srchash, vr->src, true);
+    } else {
+        srcstatus = VerifyBlocks(srchash, params.buffer, src_blocks, true);
+    }
+
+    if (srcstatus == 0) {
+        // If source and target blocks overlap, stash the source blocks so we can
+        // resume from possible write errors. In verify mode, we can skip stashing
+        // because the source blocks won't be overwritten.
+        if (overlap && params.canwrite) {
+            // The source is stashed under its hash.
+            std::string id = print_sha1(srchash);
+            fprintf(stderr, "stashing %zu overlapping blocks to %s\n", src_blocks, id.c_str());
+
+            // A stash with the same contents may only be in memory.
+            if (params.stash_cache != nullptr) {
+                auto it = params.stash_cache->entries.find(id);
+                if (it != params.stash_cache->entries.end() &&
+                        SpillStash(params, id, it->second, true) == -1) {
+                    return -1;
+                }
+            }
+
+            bool stash_exists = false;
+            if (WriteStash(params.stashbase, id, src_blocks, params.buffer, true,
+                           &stash_exists, nullptr) != 0) {
+                fprintf(stderr, "failed to stash overlapping source blocks\n");
+                return -1;
+            }
+
+            params.stashed += src_blocks;
+            // Can be deleted when the write has completed
+            if (!stash_exists) {
+                params.freestash = id;
+            }
+        }
+
+        // Source blocks have expected content, command can proceed
+        return 0;
+    }
+
+    if (overlap && LoadStash(params, params.stashbase, print_sha1(srchash), true, nullptr,
+                             params.buffer, true) == 0) {
+        // Overlapping source blocks were previously stashed, command can proceed.
+        // We are recovering from an interrupted command, so we don't know if the
+        // stash can safely be deleted after this command.
+        return 0;
+    }
+
+    // Valid source data not available, update cannot be resumed
+    fprintf(stderr, "partition has unexpected contents\n");
+    params.isunresumable = true;
+
+    return -1;
+}
+
+// A part of the source buffer of a move: 'count' blocks at buffer position
+// 'pos', read from the partition at block 'block', or copied from 'stash'
+// at block 'block'.
+
+struct MovePiece {
+    size_t pos;
+    size_t count;
+    size_t block;
+    const std::vector<uint8_t>* stash;
+};
+
+// Fills the window of the source buffer starting at block 'first' from the
+// pieces, as LoadSrcTgtVersion2() would fill the whole buffer.
+
+static int FillMoveWindow(const std::vector<MovePiece>& pieces, size_t first,
+        size_t blocks, std::vector<uint8_t>& window, int fd) {
+    std::fill(window.begin(), window.begin() + blocks * BLOCKSIZE, 0);
+
+    for (const auto& piece : pieces) {
+        size_t start = std::max(piece.pos, first);
+        size_t end = std::min(piece.pos + piece.count, first + blocks);
+        if (start >= end) {
+            continue;
+        }
+
+        uint8_t* to = window.data() + (start - first) * BLOCKSIZE;
+        size_t block = piece.block + start - piece.pos;
+        size_t size = (end - start) * BLOCKSIZE;
+        if (piece.stash == nullptr) {
+            if (pread_all(fd, to, size, static_cast<off64_t>(block) * BLOCKSIZE) == -1) {
+                return -1;
+            }
+        } else {
+            memcpy(to, piece.stash->data() + block * BLOCKSIZE, size);
+        }
+    }
+
+    return 0;
+}
+
+// Adds pieces for the blocks of 'from', packed in that order, that go to the
+// buffer positions in 'locs'. A null 'stash' means 'from' is on the partition.
+
+static void AddMovePieces(std::vector<MovePiece>& pieces, const RangeSet& from,
+        const RangeSet& locs, const std::vector<uint8_t>* stash) {
+    size_t i = 0;
+    size_t used = 0;                    // of range i of 'from'
+    for (size_t j = 0; j < locs.count && i < from.count; ++j) {
+        size_t pos = locs.pos[j * 2];
+        size_t left = locs.pos[j * 2 + 1] - pos;
+        while (left > 0 && i < from.count) {
+            size_t block = from.pos[i * 2] + used;
+            size_t count = std::min(left, from.pos[i * 2 + 1] - block);
+            pieces.push_back({ pos, count, block, stash });
+            pos += count;
+            left -= count;
+            used += count;
+            if (from.pos[i * 2] + used == from.pos[i * 2 + 1]) {
+                ++i;
+                used = 0;
+            }
+        }
+    }
+}
+
+// Queues the writes of the target blocks at buffer positions 'first' up to
+// 'first' + 'blocks' from the window.
+
+static int WriteMoveWindow(const RangeSet& tgt, size_t first, size_t blocks,
+        const std::vector<uint8_t>& window, WriteBack& wb) {
+    size_t p = 0;
+    for (size_t i = 0; i < tgt.count; ++i) {
+        size_t count = tgt.pos[i * 2 + 1] - tgt.pos[i * 2];
+        size_t start = std::max(p, first);
+        size_t end = std::min(p + count, first + blocks);
+        if (start < end) {
+            off64_t offset = static_cast<off64_t>(tgt.pos[i * 2] + start - p) * BLOCKSIZE;
+            size_t size = (end - start) * BLOCKSIZE;
+            if (!discard_blocks(wb.fd, offset, size, &wb) ||
+                    QueueWrite(wb, window.data() + (start - first) * BLOCKSIZE, size,
+                               offset) == -1) {
+                return -1;
+            }
+        }
+        p += count;
+    }
+
+    return 0;
+}
+
+// Executes a version 3+ move whose source is larger than the move window and
+// doesn't overlap the target without holding the whole source in memory.
+// The source is hashed a window at a time first, and only if it matches is
+// it read again and written a window at a time, hashing it once more to make
+// sure the second read returned the same data. Stashes that contribute to
+// the source are loaded whole. As the source isn't written, an interrupted
+// move is simply executed again.
+//
+// Returns -2 without consuming any parameters if the move has to be loaded
+// with LoadSrcTgtVersion3() instead; otherwise returns as that does.
+
+static int PerformStreamedMove(CommandParameters& params, RangeSet& tgt, size_t& src_blocks) {
+    size_t cpos = params.cpos;
+    size_t window_blocks = params.move_window / BLOCKSIZE;
+
+    // <hash> <tgt_range> <src_block_count> <src_range> [<src_loc> <stashes>...]
+    if (window_blocks == 0 || params.cpos + 3 >= params.argc) {
+        return -2;
+    }
+
+    uint8_t* srchash = params.tgtdigest;
+    if (!NextDigestArg(params, srchash)) {
+        params.cpos = cpos;
+        return -2;
+    }
+    NextRangeArg(params, tgt);
+    if (!NextUintArg(params, &src_blocks) || src_blocks <= window_blocks) {
+        params.cpos = cpos;
+        return -2;
+    }
+
+    std::vector<MovePiece> pieces;
+    std::map<std::string, std::vector<uint8_t>> stashes;
+    RangeSet src = RangeSet();
+    RangeSet locs;
+    if (ArgIsNone(params)) {
+        params.cpos++;
+    } else {
+        NextRangeArg(params, src);
+        if (params.cpos < params.argc) {
+            NextRangeArg(params, locs);
+        } else {
+            locs.count = 1;
+            locs.size = src.size;
+            locs.pos = { 0, src.size };
+        }
+    }
+
+    if (range_overlaps(src, tgt)) {
+        params.cpos = cpos;
+        return -2;
+    }
+
+    params.has_tgtdigest = true;
+
+    // Same as the checks of LoadSrcTgtVersion3(), but before the source.
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    const VerifyResult* vr = params.verified;
+    if (LookupHash(params.hash_index, tgt, digest, params.canwrite)) {
+        // Known
+    } else if (vr != nullptr && vr->has_tgt) {
+        memcpy(digest, vr->tgt, SHA_DIGEST_LENGTH);
+        AddHash(params.hash_index, tgt, digest);
+    } else {
+        std::vector<uint8_t> tgtbuffer;
+        if (HashBlocks(tgt, tgtbuffer, params.fd, digest) == -1) {
+            return -1;
+        }
+        AddHash(params.hash_index, tgt, digest);
+    }
+
+    if (VerifyDigest(srchash, digest, false) == 0) {
+        params.uptodate = true;
+        return 1;
+    }
+
+    AddMovePieces(pieces, src, locs, nullptr);
+
+    // <[stash_id:stash_range]>
+    while (params.cpos < params.argc) {
+        std::string id;
+        RangeSet stash_locs;
+        if (!NextStashArg(params, id, stash_locs)) {
+            fprintf(stderr, "invalid parameter\n");
+            return -1;
+        }
+
+        std::vector<uint8_t>& stash = stashes[id];
+        size_t blocks = 0;
+        if (stash.empty() && LoadStash(params, params.stashbase, id, false, &blocks, stash,
+                true) == -1) {
+            // These blocks fail verification below, as in LoadSrcTgtVersion2().
+            fprintf(stderr, "failed to load stash %s\n", id.c_str());
+            continue;
+        }
+
+        RangeSet packed;
+        packed.count = 1;
+        packed.size = stash_locs.size;
+        packed.pos = { 0, stash_locs.size };
+        AddMovePieces(pieces, packed, stash_locs, &stash);
+    }
+
+    // Pieces from stashes take precedence, as in LoadSrcTgtVersion2().
+    std::stable_sort(pieces.begin(), pieces.end(), [](const MovePiece& a, const MovePiece& b) {
+        return (a.stash == nullptr) > (b.stash == nullptr);
+    });
+
+    allocate(window_blocks * BLOCKSIZE, params.buffer);
+
+    // The verify pool has already hashed the source, so the first pass
+    // isn't needed to check it.
+    bool hashed = false;
+    if (vr != nullptr && vr->has_src) {
+        hashed = true;
+        if (VerifyDigest(srchash, vr->src, true) != 0) {
+            // Valid source data not available, update cannot be resumed
+            fprintf(stderr, "partition has unexpected contents\n");
+            params.isunresumable = true;
+            return -1;
+        }
+    }
+
+    for (int pass = hashed ? 1 : 0; pass < (params.canwrite ? 2 : 1); ++pass) {
+        SHA_CTX ctx;
+        SHA1_Init(&ctx);
+        for (size_t first = 0; first < src_blocks; first += window_blocks) {
+            size_t blocks = std::min(window_blocks, src_blocks - first);
+            if (FillMoveWindow(pieces, first, blocks, params.buffer, params.fd) == -1) {
+                return -1;
+            }
+            SHA1_Update(&ctx, params.buffer.data(), blocks * BLOCKSIZE);
+            io.bytes_hashed += blocks * BLOCKSIZE;
+
+            if (pass == 1 && WriteMoveWindow(tgt, first, blocks, params.buffer,
+                    params.writeback) == -1) {
+                return -1;
+            }
+        }
+        SHA1_Final(digest, &ctx);
+
+        if (VerifyDigest(srchash, digest, pass == 0) != 0) {
+            if (pass == 1) {
+                fprintf(stderr, "source of move changed while it was copied\n");
+                return -1;
+            }
+
+            // Valid source data not available, update cannot be resumed
+            fprintf(stderr, "partition has unexpected contents\n");
+            params.isunresumable = true;
+            return -1;
+        }
+
+        if (pass == 1) {
+            fprintf(stderr, "  moved %zu blocks through a window of %zu\n", src_blocks,
+                    window_blocks);
+        }
+    }
+
+    return 0;
+}
+
+static int PerformCommandMove(CommandParameters& params) {
+    size_t blocks = 0;
+    bool overlap = false;
+    bool streamed = false;
+    int status = 0;
+    RangeSet tgt;
+
+    if (params.version == 1) {
+        status = LoadSrcTgtVersion1(params, tgt, blocks, params.buffer, params.fd);
+    } else if (params.version == 2) {
+        status = LoadSrcTgtVersion2(params, tgt, blocks, params.buffer, params.fd,
+                params.stashbase, nullptr);
+    } else if (params.version >= 3) {
+        status = PerformStreamedMove(params, tgt, blocks);
+        streamed = (status != -2);
+        if (!streamed) {
+            status = LoadSrcTgtVersion3(params, tgt, blocks, true, overlap);
+        }
+    }
+
+    if (status == -1) {
+        fprintf(stderr, "failed to read blocks for move\n");
+        return -1;
+    }
+
+    if (status == 0) {
+        params.foundwrites = true;
+    } else if (params.foundwrites) {
+        fprintf(stderr, "warning: commands executed out of order [%s]\n", params.cmdname);
+    }
+
+    if (params.canwrite) {
+        if (status == 0 && streamed) {
+            // Written already
+        } else if (status == 0) {
+            fprintf(stderr, "  moving %zu blocks\n", blocks);
+
+            if (WriteBlocks(tgt, params.buffer, params.writeback) == -1) {
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "skipping %zu already moved blocks\n", blocks);
+        }
+
+    }
+
+    if (!params.freestash.empty()) {
+        ReleaseStash(params, params.freestash);
+        params.freestash.clear();
+    }
+
+    params.written += tgt.size;
+
+    return 0;
+}
+
+static int PerformCommandStash(CommandParameters& params) {
+    return SaveStash(params, params.stashbase, params.buffer, params.fd,
+            (params.version >= 3));
+}
+
+static int PerformCommandFree(CommandParameters& params) {
+    // <stash_id>
+    if (params.cpos >= params.argc) {
+        fprintf(stderr, "missing stash id in free command\n");
+        return -1;
+    }
+
+    const std::string id = NextArg(params);
+
+    if (!params.canwrite && stash_map.find(id) != stash_map.end()) {
+        stash_map.erase(id);
+        return 0;
+    }
+
+    if (params.createdstash || params.canwrite) {
+        return ReleaseStash(params, id);
+    }
+
+    return 0;
+}
+
+static int PerformCommandZero(CommandParameters& params) {
+
+    if (params.cpos >= params.argc) {
+        fprintf(stderr, "missing target blocks for zero\n");
+        return -1;
+    }
+
+    RangeSet tgt;
+    NextRangeArg(params, tgt);
+
+    fprintf(stderr, "  zeroing %zu blocks\n", tgt.size);
+
+    if (params.canwrite) {
+        // The zeros are written to fd directly, so writes and discards of
+        // these blocks that are still queued have to go first.
+        if (WriteBackOverlaps(params.writeback, tgt) && FlushWriteBack(params.writeback) == -1) {
+            return -1;
+        }
+
+        for (size_t i = 0; i < tgt.count; ) {
+            size_t j = ExtentEnd(tgt, i);
+            off64_t offset = static_cast<off64_t>(tgt.pos[i * 2]) * BLOCKSIZE;
+            size_t size = (tgt.pos[j * 2 - 1] - tgt.pos[i * 2]) * BLOCKSIZE;
+            if (!discard_blocks(params.fd, offset, size)) {
+                return -1;
+            }
+
+            if (zero_blocks(params.fd, params.zeroout, offset, size) == -1) {
+                return -1;
+            }
+
+            i = j;
+        }
+    }
+
+    if (params.cmdname[0] == 'z') {
+        // Update only for the zero command, as the erase command will call
+        // this if DEBUG_ERASE is defined.
+        params.written += tgt.size;
+    }
+
+    return 0;
+}
+
+static int PerformCommandNew(CommandParameters& params) {
+
+    if (params.cpos >= params.argc) {
+        fprintf(stderr, "missing target blocks for new\n");
+        return -1;
+    }
+
+    RangeSet tgt;
+    NextRangeArg(params, tgt);
+
+    if (params.canwrite) {
+        fprintf(stderr, " writing %zu blocks of new data\n", tgt.size);
+
+        RangeSinkState rss(tgt);
+        rss.fd = params.fd;
+        rss.wb = &params.writeback;
+        rss.p_block = 0;
+        rss.p_remain = (tgt.pos[1] - tgt.pos[0]) * BLOCKSIZE;
+        rss.offset = static_cast<off64_t>(tgt.pos[0]) * BLOCKSIZE;
+
+        if (!discard_blocks(params.fd, rss.offset, tgt.size * BLOCKSIZE, rss.wb)) {
+            return -1;
+        }
+
+        if (ReadNewData(params.nti, rss) == -1) {
+            return -1;
+        }
+    }
+
+    params.written += tgt.size;
+
+    return 0;
+}
+
+static int PerformCommandDiff(CommandParameters& params) {
+
+    // <offset> <length>
+    if (params.cpos + 1 >= params.argc) {
+        fprintf(stderr, "missing patch offset or length for %s\n", params.cmdname);
+        return -1;
+    }
+
+    size_t offset;
+    if (!NextUintArg(params, &offset)) {
+        fprintf(stderr, "invalid patch offset\n");
+        return -1;
+    }
+
+    size_t len;
+    if (!NextUintArg(params, &len)) {
+        fprintf(stderr, "invalid patch offset\n");
+        return -1;
+    }
+
+    RangeSet tgt;
+    size_t blocks = 0;
+    bool overlap = false;
+    int status = 0;
+    if (params.version == 1) {
+        status = LoadSrcTgtVersion1(params, tgt, blocks, params.buffer, params.fd);
+    } else if (params.version == 2) {
+        status = LoadSrcTgtVersion2(params, tgt, blocks, params.buffer, params.fd,
+                params.stashbase, nullptr);
+    } else if (params.version >= 3) {
+        status = LoadSrcTgtVersion3(params, tgt, blocks, false, overlap);
+    }
+
+    if (status == -1) {
+        fprintf(stderr, "failed to read blocks for diff\n");
+        return -1;
+    }
+
+    if (status == 0) {
+        params.foundwrites = true;
+    } else if (params.foundwrites) {
+        fprintf(stderr, "warning: commands executed out of order [%s]\n", params.cmdname);
+    }
+
+    if (params.canwrite) {
+        if (status == 0) {
+            fprintf(stderr, "patching %zu blocks to %zu\n", blocks, tgt.size);
+
+            Value patch_value;
+            patch_value.type = VAL_BLOB;
+            patch_value.size = len;
+            patch_value.data = (char*) (params.patch_start + offset);
+
+            RangeSinkState rss(tgt);
+            rss.fd = params.fd;
+            rss.wb = &params.writeback;
+            rss.p_block = 0;
+            rss.p_remain = (tgt.pos[1] - tgt.pos[0]) * BLOCKSIZE;
+            rss.offset = static_cast<off64_t>(tgt.pos[0]) * BLOCKSIZE;
+
+            if (!discard_blocks(params.fd, rss.offset, rss.p_remain, rss.wb)) {
+                return -1;
+            }
+
+            if (params.cmdname[0] == 'i') {      // imgdiff
+                if (ApplyImagePatch(params.buffer.data(), blocks * BLOCKSIZE, &patch_value,
+                        &RangeSinkWrite, &rss, nullptr, nullptr) != 0) {
+                    fprintf(stderr, "Failed to apply image patch.\n");
+                    return -1;
+                }
+            } else {
+                if (ApplyBSDiffPatch(params.buffer.data(), blocks * BLOCKSIZE, &patch_value,
+                        0, &RangeSinkWrite, &rss, nullptr) != 0) {
+                    fprintf(stderr, "Failed to apply bsdiff patch.\n");
+                    return -1;
+                }
+            }
+
+            params.patch_alloc = std::max(params.patch_alloc, TakePatchPeakAlloc());
+
+            // We expect the output of the patcher to fill the tgt ranges exactly.
+            if (rss.p_block != tgt.count || rss.p_remain != 0) {
+                fprintf(stderr, "range sink underrun?\n");
+            }
+        } else {
+            fprintf(stderr, "skipping %zu blocks already patched to %zu [%s]\n",
+                blocks, tgt.size, params.cmdline);
+        }
+    }
+
+    if (!params.freestash.empty()) {
+        ReleaseStash(params, params.freestash);
+        params.freestash.clear();
+    }
+
+    params.written += tgt.size;
+
+    return 0;
+}
+
+static int PerformCommandErase(CommandParameters& params) {
+    if (DEBUG_ERASE) {
+        return PerformCommandZero(params);
+    }
+
+    struct stat sb;
+    if (fstat(params.fd, &sb) == -1) {
+        fprintf(stderr, "failed to fstat device to erase: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (!S_ISBLK(sb.st_mode)) {
+        fprintf(stderr, "not a block device; skipping erase\n");
+        return -1;
+    }
+
+    if (params.cpos >= params.argc) {
+        fprintf(stderr, "missing target blocks for erase\n");
+        return -1;
+    }
+
+    RangeSet tgt;
+    NextRangeArg(params, tgt);
+
+    if (params.canwrite) {
+        fprintf(stderr, " erasing %zu blocks\n", tgt.size);
+
+        for (size_t i = 0; i < tgt.count; ++i) {
+            // offset and length in bytes
+            off64_t offset = tgt.pos[i * 2] * (uint64_t) BLOCKSIZE;
+            uint64_t size = (tgt.pos[i * 2 + 1] - tgt.pos[i * 2]) * (uint64_t) BLOCKSIZE;
+
+#ifndef SUPPRESS_EMMC_WIPE
+            // Adjacent ranges are discarded at once.
+            if (QueueDiscard(params.writeback, offset, size) == -1) {
+                return -1;
+            }
+#endif
+        }
+
+        // The blocks are erased when the command returns.
+        if (FlushWriteBack(params.writeback) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Definitions for transfer list command functions
+typedef int (*CommandFunction)(CommandParameters&);
+
+struct Command {
+    const char* name;
+    CommandFunction f;
+};
+
+// CompareCommands and CompareCommandNames are for the hash table
+
+static int CompareCommands(const void* c1, const void* c2) {
+    return strcmp(((const Command*) c1)->name, ((const Command*) c2)->name);
+}
+
+static int CompareCommandNames(const void* c1, const void* c2) {
+    return strcmp(((const Command*) c1)->name, (const char*) c2);
+}
+
+// HashString is used to hash command names for the hash table
+
+static unsigned int HashString(const char *s) {
+    unsigned int hash = 0;
+    if (s) {
+        while (*s) {
+            hash = hash * 33 + *s++;
+        }
+    }
+    return hash;
+}
+
+// Blocks and stashes touched by a single transfer list command. Used by the
+// parallel executor to find commands that must not run concurrently.
+
+static bool stash_overlaps(const std::vector<std::string>& ids1,
+        const std::vector<std::string>& ids2) {
+    for (const auto& id1 : ids1) {
+        for (const auto& id2 : ids2) {
+            if (id1 == id2) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Returns true if the two commands must be executed in transfer list order.
+
+static bool CommandsConflict(const CommandFootprint& fp1, const CommandFootprint& fp2) {
+    if (fp1.new_data && fp2.new_data) {
+        return true;
+    }
+
+    return range_overlaps(fp1.tgt, fp2.tgt) ||
+           range_overlaps(fp1.tgt, fp2.src) ||
+           range_overlaps(fp1.src, fp2.tgt) ||
+           stash_overlaps(fp1.stash_write, fp2.stash_write) ||
+           stash_overlaps(fp1.stash_write, fp2.stash_read) ||
+           stash_overlaps(fp1.stash_read, fp2.stash_write);
+}
+
+// One node in the dependency graph. A node is ready to run once all the
+// earlier commands it conflicts with have completed.
+
+struct CommandNode {
+    size_t index;
+    const Command* cmd;
+    CommandFootprint fp;
+    size_t pending;
+    bool done;
+    std::vector<CommandNode*> successors;
+};
+
+struct ParallelExecutor {
+    pthread_mutex_t mu;
+    pthread_cond_t work_cv;   // signaled when nodes become ready or on stop
+    pthread_cond_t done_cv;   // signaled when a node completes
+    std::deque<std::unique_ptr<CommandNode>> window;
+    std::map<size_t, CommandNode*> ready;
+    bool failed;
+    bool stop;
+
+    // Shared parameters; the counters are updated under mu.
+    CommandParameters* params;
+    std::map<const char*, CommandIoStats>* io_stats;
+    CommandIoStats io;                  // of the workers, when they exit
+};
+
+struct WorkerInfo {
+    ParallelExecutor* pe;
+    CommandParameters params;
+    pthread_t thread;
+};
+
+static void* ParallelWorker(void* cookie) {
+    WorkerInfo* wi = reinterpret_cast<WorkerInfo*>(cookie);
+    ParallelExecutor* pe = wi->pe;
+    CommandParameters& params = wi->params;
+
+    pthread_mutex_lock(&pe->mu);
+
+    while (true) {
+        while (!pe->stop && !pe->failed && pe->ready.empty()) {
+            pthread_cond_wait(&pe->work_cv, &pe->mu);
+        }
+
+        if (pe->failed || pe->ready.empty()) {
+            break;
+        }
+
+        // Prefer the earliest ready command to keep the 'new' data stream and
+        // memory use close to the serial order.
+        CommandNode* node = pe->ready.begin()->second;
+        pe->ready.erase(pe->ready.begin());
+        pthread_mutex_unlock(&pe->mu);
+
+        LoadCommand(*params.tl, node->index, params);
+
+        CommandIoStats before = io;
+        auto cmd_start = std::chrono::steady_clock::now();
+
+        bool success = true;
+        if (node->cmd->f != nullptr && node->cmd->f(params) == -1) {
+            fprintf(stderr, "failed to execute command [%s]\n", params.cmdline);
+            success = false;
+        } else if (FlushWriteBack(params.writeback) == -1) {
+            success = false;
+        } else if (sync_fd(params.fd) == -1) {
+            failure_type = kFsyncFailure;
+            fprintf(stderr, "fsync failed: %s\n", strerror(errno));
+            success = false;
+        }
+
+        auto cmd_time = std::chrono::steady_clock::now() - cmd_start;
+
+        pthread_mutex_lock(&pe->mu);
+
+        if (success) {
+            RecordCommand((*pe->io_stats)[node->cmd->name], before, cmd_time);
+        }
+        pe->params->written += params.written;
+        pe->params->stashed += params.stashed;
+        pe->params->patch_alloc = std::max(pe->params->patch_alloc, params.patch_alloc);
+        AddWriteBackStats(pe->params->writeback, params.writeback);
+        params.written = 0;
+        params.stashed = 0;
+        if (params.isunresumable) {
+            pe->params->isunresumable = true;
+        }
+
+        if (!success) {
+            pe->failed = true;
+            pthread_cond_broadcast(&pe->work_cv);
+            pthread_cond_signal(&pe->done_cv);
+            break;
+        }
+
+        node->done = true;
+        for (CommandNode* succ : node->successors) {
+            if (--succ->pending == 0) {
+                pe->ready[succ->index] = succ;
+            }
+        }
+        if (!node->successors.empty()) {
+            pthread_cond_broadcast(&pe->work_cv);
+        }
+        pthread_cond_signal(&pe->done_cv);
+    }
+
+    AddIoStats(pe->io, io, CommandIoStats());
+    pthread_mutex_unlock(&pe->mu);
+    return nullptr;
+}
+
+// Executes the commands of 'tl' from 'start' on 'workers' threads.
+//
+// The main thread keeps a window of upcoming commands and links each command
+// entering it to every earlier, unfinished command it conflicts with. A
+// command becomes ready once all of its predecessors have completed, and
+// ready commands are picked up by the workers lowest index first. Commands
+// that don't conflict write disjoint blocks from data nobody else modifies,
+// so the result is identical to running the list in order.
+//
+// A worker fsyncs the partition before it reports a command as completed,
+// which means a command only starts after everything it depends on is on
+// disk. After an interruption the set of completed commands is therefore
+// closed under dependencies, and the version 3 resume logic applies as is.
+//
+// All block device I/O is positional, so the workers share the descriptor
+// of the main thread. Statistics of the commands are added to 'io_stats'.
+// Returns 0 when all commands have been executed successfully and -1
+// otherwise.
+
+static int PerformCommandsParallel(CommandParameters& params, const TransferList& tl, size_t start, HashTable* cmdht, int workers, FILE* cmd_pipe, std::map<const char*, CommandIoStats>& io_stats) {
+    fprintf(stderr, "executing transfer list on %d threads\n", workers);
+
+    ParallelExecutor pe;
+    pthread_mutex_init(&pe.mu, nullptr);
+    pthread_cond_init(&pe.work_cv, nullptr);
+    pthread_cond_init(&pe.done_cv, nullptr);
+    pe.failed = false;
+    pe.stop = false;
+    pe.params = &params;
+    pe.io_stats = &io_stats;
+    pe.io = CommandIoStats();
+
+    std::vector<std::unique_ptr<WorkerInfo>> pool;
+
+    for (int i = 0; i < workers; ++i) {
+        std::unique_ptr<WorkerInfo> wi(new WorkerInfo);
+        wi->pe = &pe;
+        wi->params = params;
+        wi->params.written = 0;
+        wi->params.stashed = 0;
+        wi->params.checkpoint = nullptr;
+        wi->params.stash_cache = nullptr;
+
+        int error = pthread_create(&wi->thread, nullptr, ParallelWorker, wi.get());
+        if (error != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(error));
+            pe.failed = true;
+            break;
+        }
+        pool.push_back(std::move(wi));
+    }
+
+    size_t next = start;
+    CommandParameters cmd = CommandParameters();
+
+    pthread_mutex_lock(&pe.mu);
+
+    while (!pe.failed) {
+        // Retire completed commands from the head of the window.
+        bool progress = false;
+        while (!pe.window.empty() && pe.window.front()->done) {
+            pe.window.pop_front();
+            progress = true;
+        }
+
+        if (progress) {
+            fprintf(cmd_pipe, "set_progress %.4f\n", (double) params.written / tl.total_blocks);
+            fflush(cmd_pipe);
+        }
+
+        // Admit new commands into the window and link them to all unfinished
+        // commands they conflict with.
+        while (!pe.failed && next < tl.end && pe.window.size() < PARALLEL_WINDOW) {
+            size_t index = next++;
+            if (!LoadCommand(tl, index, cmd)) {
+                continue;
+            }
+
+            std::unique_ptr<CommandNode> node(new CommandNode());
+            node->index = index;
+            node->pending = 0;
+            node->done = false;
+
+            unsigned int cmdhash = HashString(cmd.cmdname);
+            node->cmd = reinterpret_cast<const Command*>(mzHashTableLookup(cmdht, cmdhash,
+                    const_cast<char*>(cmd.cmdname), CompareCommandNames, false));
+
+            if (node->cmd == nullptr) {
+                fprintf(stderr, "unexpected command [%s]\n", cmd.cmdname);
+                pe.failed = true;
+                break;
+            }
+
+            if (GetCommandFootprint(cmd, node->fp) == -1) {
+                fprintf(stderr, "invalid parameters [%s]\n", cmd.cmdline);
+                pe.failed = true;
+                break;
+            }
+
+            for (auto& prev : pe.window) {
+                if (!prev->done && CommandsConflict(prev->fp, node->fp)) {
+                    prev->successors.push_back(node.get());
+                    node->pending++;
+                }
+            }
+
+            if (node->pending == 0) {
+                pe.ready[node->index] = node.get();
+                pthread_cond_signal(&pe.work_cv);
+            }
+
+            pe.window.push_back(std::move(node));
+        }
+
+        if (pe.failed || (next == tl.end && pe.window.empty())) {
+            break;
+        }
+
+        pthread_cond_wait(&pe.done_cv, &pe.mu);
+    }
+
+    pe.stop = true;
+    pthread_cond_broadcast(&pe.work_cv);
+    pthread_mutex_unlock(&pe.mu);
+
+    for (auto& wi : pool) {
+        pthread_join(wi->thread, nullptr);
+        if (wi->params.buffer.size() > params.buffer.size()) {
+            params.buffer.swap(wi->params.buffer);
+        }
+    }
+
+    // The calling thread's counters cover the whole update.
+    AddIoStats(io, pe.io, CommandIoStats());
+
+    pthread_cond_destroy(&pe.done_cv);
+    pthread_cond_destroy(&pe.work_cv);
+    pthread_mutex_destroy(&pe.mu);
+
+    return pe.failed ? -1 : 0;
+}
+
+static bool CheckpointOverlaps(const Checkpoint& cp, const RangeSet& rs) {
+    for (size_t i = 0; i < rs.count; ++i) {
+        size_t end = std::min(rs.pos[i * 2 + 1], cp.pending.size());
+        for (size_t j = rs.pos[i * 2]; j < end; ++j) {
+            if (cp.pending[j]) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void ListStash(const std::string& fn, void* data) {
+    if (android::base::EndsWith(fn, ".partial") || android::base::EndsWith(fn, CHECKPOINT_FILE)) {
+        return;
+    }
+
+    std::vector<std::string>* ids = reinterpret_cast<std::vector<std::string>*>(data);
+    ids->push_back(fn.substr(fn.rfind('/') + 1));
+}
+
+// Makes everything done since the last flush durable. If 'record' is set,
+// also records the index of the last completed command and deletes the
+// stashes freed in the meantime.
+//
+// The checkpoint file contains the SHA-1 of the transfer list, the index of
+// the last completed command, and the names of the stashes present at that
+// point, one per line.
+
+static int FlushCheckpoint(CommandParameters& params, bool record) {
+    Checkpoint* cp = params.checkpoint;
+    auto start = std::chrono::steady_clock::now();
 
-        // Source blocks have expected content, command can proceed
-        return 0;
+    if (FlushWriteBack(params.writeback) == -1) {
+        return -1;
     }
 
-    if (overlap && LoadStash(params, params.stashbase, srchash, true, nullptr, params.buffer,
-                             true) == 0) {
-        // Overlapping source blocks were previously stashed, command can proceed.
-        // We are recovering from an interrupted command, so we don't know if the
-        // stash can safely be deleted after this command.
-        return 0;
+    if (sync_fd(params.fd) == -1) {
+        failure_type = kFsyncFailure;
+        fprintf(stderr, "fsync failed: %s\n", strerror(errno));
+        return -1;
     }
 
-    // Valid source data not available, update cannot be resumed
-    fprintf(stderr, "partition has unexpected contents\n");
-    params.isunresumable = true;
+    if (HashIndexSynced(params.hash_index) == -1) {
+        return -1;
+    }
 
-    return -1;
-}
+    for (const auto& fn : cp->stash_files) {
+        int fd = TEMP_FAILURE_RETRY(open(fn.c_str(), O_RDONLY));
+        unique_fd fd_holder(fd);
 
-static int PerformCommandMove(CommandParameters& params) {
-    size_t blocks = 0;
-    bool overlap = false;
-    int status = 0;
-    RangeSet tgt;
+        if (fd == -1) {
+            // Already freed
+            continue;
+        }
 
-    if (params.version == 1) {
-        status = LoadSrcTgtVersion1(params, tgt, blocks, params.buffer, params.fd);
-    } else if (params.version == 2) {
-        status = LoadSrcTgtVersion2(params, tgt, blocks, params.buffer, params.fd,
-                params.stashbase, nullptr);
-    } else if (params.version >= 3) {
-        status = LoadSrcTgtVersion3(params, tgt, blocks, true, overlap);
+        if (sync_fd(fd) == -1) {
+            failure_type = kFsyncFailure;
+            fprintf(stderr, "fsync \"%s\" failed: %s\n", fn.c_str(), strerror(errno));
+            return -1;
+        }
     }
 
-    if (status == -1) {
-        fprintf(stderr, "failed to read blocks for move\n");
+    if (!cp->stash_files.empty() && FsyncStashDirectory(params.stashbase) == -1) {
         return -1;
     }
 
-    if (status == 0) {
-        params.foundwrites = true;
-    } else if (params.foundwrites) {
-        fprintf(stderr, "warning: commands executed out of order [%s]\n", params.cmdname);
+    cp->pending.assign(cp->pending.size(), false);
+    cp->stash_files.clear();
+    cp->flushes++;
+
+    if (!record) {
+        cp->sync_time += std::chrono::steady_clock::now() - start;
+        return 0;
     }
 
-    if (params.canwrite) {
-        if (status == 0) {
-            fprintf(stderr, "  moving %zu blocks\n", blocks);
+    std::vector<std::string> ids;
+    EnumerateStash(GetStashFileName(params.stashbase, "", ""), ListStash, &ids);
 
-            if (WriteBlocks(tgt, params.buffer, params.fd) == -1) {
-                return -1;
-            }
-        } else {
-            fprintf(stderr, "skipping %zu already moved blocks\n", blocks);
+    std::string content = cp->tlhash + "\n" + std::to_string(cp->last) + "\n";
+    for (const auto& id : ids) {
+        if (std::find(cp->frees.begin(), cp->frees.end(), id) == cp->frees.end()) {
+            content += id + "\n";
         }
+    }
 
+    // A checkpoint that can't be written only makes a retry slower, as the
+    // previous one still describes a consistent state.
+    std::string fn = GetStashFileName(params.stashbase, CHECKPOINT_FILE, ".partial");
+    std::string cn = GetStashFileName(params.stashbase, CHECKPOINT_FILE, "");
+    int fd = TEMP_FAILURE_RETRY(open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, STASH_FILE_MODE));
+    unique_fd fd_holder(fd);
+
+    if (fd == -1) {
+        fprintf(stderr, "failed to create \"%s\": %s\n", fn.c_str(), strerror(errno));
+    } else if (pwrite_all(fd, reinterpret_cast<const uint8_t*>(content.data()),
+                          content.size(), 0) == -1 || sync_fd(fd) == -1) {
+        fprintf(stderr, "failed to write \"%s\": %s\n", fn.c_str(), strerror(errno));
+    } else if (rename(fn.c_str(), cn.c_str()) == -1) {
+        fprintf(stderr, "rename(\"%s\", \"%s\") failed: %s\n", fn.c_str(), cn.c_str(),
+                strerror(errno));
+    } else if (FsyncStashDirectory(params.stashbase) == -1) {
+        return -1;
     }
 
-    if (!params.freestash.empty()) {
-        FreeStash(params.stashbase, params.freestash);
-        params.freestash.clear();
+    for (const auto& id : cp->frees) {
+        FreeStash(params.stashbase, id);
     }
 
-    params.written += tgt.size;
+    cp->pending_bytes = 0;
+    cp->frees.clear();
+    cp->checkpoints++;
+
+    cp->last_flush = std::chrono::steady_clock::now();
+    cp->sync_time += cp->last_flush - start;
 
     return 0;
 }
 
-static int PerformCommandStash(CommandParameters& params) {
-    return SaveStash(params, params.stashbase, params.buffer, params.fd,
-            (params.version >= 3));
-}
+// Called after the command at 'index' has been executed. Flushes when the
+// configured amount of data or time has accumulated since the last flush.
 
-static int PerformCommandFree(CommandParameters& params) {
-    // <stash_id>
-    if (params.cpos >= params.tokens.size()) {
-        fprintf(stderr, "missing stash id in free command\n");
-        return -1;
-    }
+static int UpdateCheckpoint(CommandParameters& params, size_t index,
+        const CommandFootprint& fp) {
+    Checkpoint* cp = params.checkpoint;
 
-    const std::string& id = params.tokens[params.cpos++];
+    MarkCheckpointPending(*cp, fp.src);
+    MarkCheckpointPending(*cp, fp.tgt);
 
-    if (!params.canwrite && stash_map.find(id) != stash_map.end()) {
-        stash_map.erase(id);
-        return 0;
+    cp->pending_bytes += (params.written - cp->written + params.stashed - cp->stashed) * BLOCKSIZE;
+    cp->written = params.written;
+    cp->stashed = params.stashed;
+    cp->last = index;
+    cp->commands++;
+
+    if (cp->sync_bytes > 0 && cp->pending_bytes >= cp->sync_bytes) {
+        return FlushCheckpoint(params, true);
     }
 
-    if (params.createdstash || params.canwrite) {
-        return FreeStash(params.stashbase, id);
+    if (cp->sync_ms > 0) {
+        auto elapsed = std::chrono::steady_clock::now() - cp->last_flush;
+        if (elapsed >= std::chrono::milliseconds(cp->sync_ms)) {
+            return FlushCheckpoint(params, true);
+        }
     }
 
     return 0;
 }
 
-static int PerformCommandZero(CommandParameters& params) {
+// Reads the checkpoint left by a previous attempt of the same transfer list.
+// Returns true and sets 'index' to the last completed command if the
+// checkpoint is usable, i.e. all the stashes it lists still exist.
 
-    if (params.cpos >= params.tokens.size()) {
-        fprintf(stderr, "missing target blocks for zero\n");
-        return -1;
+static bool ReadCheckpoint(const std::string& base, const std::string& tlhash, size_t& index) {
+    std::string content;
+    std::string fn = GetStashFileName(base, CHECKPOINT_FILE, "");
+    if (!android::base::ReadFileToString(fn, &content)) {
+        return false;
     }
 
-    RangeSet tgt;
-    parse_range(params.tokens[params.cpos++], tgt);
+    std::vector<std::string> lines = android::base::Split(content, "\n");
+    if (lines.size() < 2 || lines[0] != tlhash) {
+        fprintf(stderr, "ignoring checkpoint for a different transfer list\n");
+        return false;
+    }
 
-    fprintf(stderr, "  zeroing %zu blocks\n", tgt.size);
+    if (!android::base::ParseUint(lines[1].c_str(), &index)) {
+        fprintf(stderr, "invalid checkpoint index [%s]\n", lines[1].c_str());
+        return false;
+    }
 
-    allocate(BLOCKSIZE, params.buffer);
-    memset(params.buffer.data(), 0, BLOCKSIZE);
+    for (size_t i = 2; i < lines.size(); ++i) {
+        if (lines[i].empty()) {
+            continue;
+        }
 
-    if (params.canwrite) {
-        for (size_t i = 0; i < tgt.count; ++i) {
-            off64_t offset = static_cast<off64_t>(tgt.pos[i * 2]) * BLOCKSIZE;
-            size_t size = (tgt.pos[i * 2 + 1] - tgt.pos[i * 2]) * BLOCKSIZE;
-            if (!discard_blocks(params.fd, offset, size)) {
-                return -1;
-            }
+        struct stat sb;
+        std::string sn = GetStashFileName(base, lines[i], "");
+        if (stat(sn.c_str(), &sb) == -1) {
+            fprintf(stderr, "ignoring checkpoint; stash %s is missing\n", lines[i].c_str());
+            return false;
+        }
+    }
 
-            if (!check_lseek(params.fd, offset, SEEK_SET)) {
-                return -1;
-            }
+    return true;
+}
+
+// Records which commands load each stash, for NextStashUse().
+
+static void FindStashUses(const TransferList& tl, StashCache& sc) {
+    CommandParameters cmd = CommandParameters();
+    for (size_t i = tl.start; i < tl.end; ++i) {
+        CommandFootprint fp;
+        if (!LoadCommand(tl, i, cmd) || GetCommandFootprint(cmd, fp) == -1) {
+            // Invalid commands are reported when executed.
+            continue;
+        }
+
+        for (const auto& id : fp.stash_read) {
+            sc.uses[id].push_back(i);
+        }
+    }
+}
+
+// Skips commands start..end, which were completed before the last checkpoint.
+// Only the new data for the 'new' commands in this range has to be consumed,
+// and stashes that are still needed but were only kept in memory have to be
+// read again.
+
+static int SkipCompletedCommands(CommandParameters& params, const TransferList& tl,
+        size_t start, size_t end) {
+    fprintf(stderr, "resuming after checkpoint at command %zu\n", end);
+
+    CommandParameters cmd = CommandParameters();
+    for (size_t i = start; i <= end && i < tl.end; ++i) {
+        if (!LoadCommand(tl, i, cmd)) {
+            continue;
+        }
+
+        CommandFootprint fp;
+        if (GetCommandFootprint(cmd, fp) == -1) {
+            fprintf(stderr, "invalid parameters [%s]\n", cmd.cmdline);
+            return -1;
+        }
 
-            for (size_t j = tgt.pos[i * 2]; j < tgt.pos[i * 2 + 1]; ++j) {
-                if (write_all(params.fd, params.buffer, BLOCKSIZE) == -1) {
+        if (strcmp(cmd.cmdname, "stash") == 0 && params.stash_cache != nullptr) {
+            const std::string& id = fp.stash_write[0];
+            std::string fn = GetStashFileName(params.stashbase, id, "");
+            struct stat sb;
+            if (NextStashUse(*params.stash_cache, id, end) != SIZE_MAX &&
+                    stat(fn.c_str(), &sb) == -1) {
+                LoadCommand(tl, i, params);
+                if (PerformCommandStash(params) == -1) {
                     return -1;
                 }
             }
+            continue;
         }
-    }
 
-    if (params.cmdname[0] == 'z') {
-        // Update only for the zero command, as the erase command will call
-        // this if DEBUG_ERASE is defined.
-        params.written += tgt.size;
+        if (strcmp(cmd.cmdname, "erase") == 0) {
+            continue;
+        }
+
+        params.written += fp.tgt.size;
+
+        if (fp.new_data) {
+            RangeSinkState rss(fp.tgt);
+            rss.fd = -1;
+            rss.wb = nullptr;
+            rss.p_block = 0;
+            rss.p_remain = (fp.tgt.pos[1] - fp.tgt.pos[0]) * BLOCKSIZE;
+            rss.offset = 0;
+
+            if (ReadNewData(params.nti, rss) == -1) {
+                return -1;
+            }
+        }
     }
 
     return 0;
 }
 
-static int PerformCommandNew(CommandParameters& params) {
+// Hashes the blocks checked by upcoming commands during verification on
+// several threads, while the main thread checks the commands in order using
+// the digests. Nothing is written during verification, so the digests don't
+// depend on the order. The threads stay at most PARALLEL_WINDOW commands
+// ahead, which bounds the work wasted if verification fails.
 
-    if (params.cpos >= params.tokens.size()) {
-        fprintf(stderr, "missing target blocks for new\n");
-        return -1;
-    }
+struct VerifyPool {
+    pthread_mutex_t mu;
+    pthread_cond_t cv;                  // signaled when a result is ready or limit changes
+    const TransferList* tl;
+    int fd;
+    size_t next;                        // next command to hash
+    size_t limit;                       // one past the last command that may be hashed
+    bool stop;
+    std::vector<VerifyResult> results;  // by command index
+    std::vector<bool> ready;
+    std::vector<pthread_t> threads;
+    size_t bytes;                       // hashed by the threads
+};
 
+// Hashes the target and source blocks of a move/bsdiff/imgdiff command and
+// the source blocks of a stash command, as LoadSrcTgtVersion3() and
+// SaveStash() would. Sources that are combined with stashes are left to the
+// main thread.
+
+static void HashCommandBlocks(CommandParameters& cmd, int fd, std::vector<uint8_t>& buffer,
+        VerifyResult& vr, size_t& bytes) {
+    const std::string cmdname(cmd.cmdname);
+    RangeSet src;
     RangeSet tgt;
-    parse_range(params.tokens[params.cpos++], tgt);
 
-    if (params.canwrite) {
-        fprintf(stderr, " writing %zu blocks of new data\n", tgt.size);
+    if (cmdname == "stash") {
+        // <stash_id> <src_range>
+        if (cmd.argc < 3) {
+            return;
+        }
+        cmd.cpos = 2;
+        NextRangeArg(cmd, src);
+        vr.has_src = (HashBlocks(src, buffer, fd, vr.src) == 0);
+        bytes += src.size * BLOCKSIZE;
+        return;
+    } else if (cmdname == "move") {
+        // <hash> <tgt_range> <src_block_count> ...
+        if (cmd.argc < 5) {
+            return;
+        }
+        cmd.cpos = 2;
+    } else if (cmdname == "bsdiff" || cmdname == "imgdiff") {
+        // <offset> <length> <srchash> <tgthash> <tgt_range> <src_block_count> ...
+        if (cmd.argc < 8) {
+            return;
+        }
+        cmd.cpos = 5;
+    } else {
+        return;
+    }
 
-        RangeSinkState rss(tgt);
-        rss.fd = params.fd;
-        rss.p_block = 0;
-        rss.p_remain = (tgt.pos[1] - tgt.pos[0]) * BLOCKSIZE;
+    NextRangeArg(cmd, tgt);
+    vr.has_tgt = (HashBlocks(tgt, buffer, fd, vr.tgt) == 0);
+    bytes += tgt.size * BLOCKSIZE;
 
-        off64_t offset = static_cast<off64_t>(tgt.pos[0]) * BLOCKSIZE;
-        if (!discard_blocks(params.fd, offset, tgt.size * BLOCKSIZE)) {
-            return -1;
+    size_t src_blocks;
+    if (!NextUintArg(cmd, &src_blocks) || ArgIsNone(cmd)) {
+        return;
+    }
+
+    NextRangeArg(cmd, src);
+    if (cmd.cpos < cmd.argc || src.size != src_blocks) {
+        return;
+    }
+
+    vr.has_src = (HashBlocks(src, buffer, fd, vr.src) == 0);
+    bytes += src.size * BLOCKSIZE;
+}
+
+static void* VerifyWorker(void* cookie) {
+    VerifyPool* pool = reinterpret_cast<VerifyPool*>(cookie);
+    CommandParameters cmd = CommandParameters();
+    std::vector<uint8_t> buffer;
+
+    pthread_mutex_lock(&pool->mu);
+
+    while (true) {
+        while (!pool->stop && pool->next >= pool->limit) {
+            pthread_cond_wait(&pool->cv, &pool->mu);
         }
 
-        if (!check_lseek(params.fd, offset, SEEK_SET)) {
-            return -1;
+        if (pool->stop) {
+            break;
         }
 
-        pthread_mutex_lock(&params.nti.mu);
-        params.nti.rss = &rss;
-        pthread_cond_broadcast(&params.nti.cv);
+        size_t index = pool->next++;
+        pthread_mutex_unlock(&pool->mu);
 
-        while (params.nti.rss) {
-            pthread_cond_wait(&params.nti.cv, &params.nti.mu);
+        VerifyResult vr = {};
+        size_t bytes = 0;
+        if (LoadCommand(*pool->tl, index, cmd)) {
+            HashCommandBlocks(cmd, pool->fd, buffer, vr, bytes);
         }
 
-        pthread_mutex_unlock(&params.nti.mu);
+        pthread_mutex_lock(&pool->mu);
+        pool->results[index] = vr;
+        pool->ready[index] = true;
+        pool->bytes += bytes;
+        pthread_cond_broadcast(&pool->cv);
     }
 
-    params.written += tgt.size;
-
-    return 0;
+    pthread_mutex_unlock(&pool->mu);
+    return nullptr;
 }
 
-static int PerformCommandDiff(CommandParameters& params) {
-
-    // <offset> <length>
-    if (params.cpos + 1 >= params.tokens.size()) {
-        fprintf(stderr, "missing patch offset or length for %s\n", params.cmdname);
-        return -1;
+static bool StartVerifyPool(VerifyPool& pool, const TransferList& tl, size_t start, int fd,
+        int threads) {
+    pthread_mutex_init(&pool.mu, nullptr);
+    pthread_cond_init(&pool.cv, nullptr);
+    pool.tl = &tl;
+    pool.fd = fd;
+    pool.next = start;
+    pool.limit = start;
+    pool.stop = false;
+    pool.results.resize(tl.end);
+    pool.ready.resize(tl.end);
+    pool.bytes = 0;
+
+    for (int i = 0; i < threads; ++i) {
+        pthread_t thread;
+        int error = pthread_create(&thread, nullptr, VerifyWorker, &pool);
+        if (error != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(error));
+            break;
+        }
+        pool.threads.push_back(thread);
     }
 
-    size_t offset;
-    if (!android::base::ParseUint(params.tokens[params.cpos++].c_str(), &offset)) {
-        fprintf(stderr, "invalid patch offset\n");
-        return -1;
+    if (pool.threads.empty()) {
+        pthread_cond_destroy(&pool.cv);
+        pthread_mutex_destroy(&pool.mu);
+        return false;
     }
 
-    size_t len;
-    if (!android::base::ParseUint(params.tokens[params.cpos++].c_str(), &len)) {
-        fprintf(stderr, "invalid patch offset\n");
-        return -1;
-    }
+    fprintf(stderr, "hashing blocks on %zu threads\n", pool.threads.size());
+    return true;
+}
 
-    RangeSet tgt;
-    size_t blocks = 0;
-    bool overlap = false;
-    int status = 0;
-    if (params.version == 1) {
-        status = LoadSrcTgtVersion1(params, tgt, blocks, params.buffer, params.fd);
-    } else if (params.version == 2) {
-        status = LoadSrcTgtVersion2(params, tgt, blocks, params.buffer, params.fd,
-                params.stashbase, nullptr);
-    } else if (params.version >= 3) {
-        status = LoadSrcTgtVersion3(params, tgt, blocks, false, overlap);
+static void StopVerifyPool(VerifyPool& pool) {
+    if (pool.threads.empty()) {
+        return;
     }
 
-    if (status == -1) {
-        fprintf(stderr, "failed to read blocks for diff\n");
-        return -1;
+    pthread_mutex_lock(&pool.mu);
+    pool.stop = true;
+    pthread_cond_broadcast(&pool.cv);
+    pthread_mutex_unlock(&pool.mu);
+
+    for (pthread_t thread : pool.threads) {
+        pthread_join(thread, nullptr);
     }
+    pool.threads.clear();
 
-    if (status == 0) {
-        params.foundwrites = true;
-    } else if (params.foundwrites) {
-        fprintf(stderr, "warning: commands executed out of order [%s]\n", params.cmdname);
+    pthread_cond_destroy(&pool.cv);
+    pthread_mutex_destroy(&pool.mu);
+}
+
+// Returns the digests for command 'index', waiting for them if necessary.
+
+static const VerifyResult* WaitVerifyResult(VerifyPool& pool, size_t index) {
+    pthread_mutex_lock(&pool.mu);
+
+    size_t limit = std::min(index + PARALLEL_WINDOW, pool.tl->end);
+    if (limit > pool.limit) {
+        pool.limit = limit;
+        pthread_cond_broadcast(&pool.cv);
     }
 
-    if (params.canwrite) {
-        if (status == 0) {
-            fprintf(stderr, "patching %zu blocks to %zu\n", blocks, tgt.size);
+    while (!pool.ready[index]) {
+        pthread_cond_wait(&pool.cv, &pool.mu);
+    }
 
-            Value patch_value;
-            patch_value.type = VAL_BLOB;
-            patch_value.size = len;
-            patch_value.data = (char*) (params.patch_start + offset);
+    pthread_mutex_unlock(&pool.mu);
+    return &pool.results[index];
+}
 
-            RangeSinkState rss(tgt);
-            rss.fd = params.fd;
-            rss.p_block = 0;
-            rss.p_remain = (tgt.pos[1] - tgt.pos[0]) * BLOCKSIZE;
+// Asks the kernel to read the source blocks of the next commands into the
+// page cache, so that they are ready when the commands get to them. Writes
+// go through the same page cache, so a block can't be read stale; blocks
+// that a command before the reader overwrites are skipped anyway, as reading
+// them ahead would be wasted.
 
-            off64_t offset = static_cast<off64_t>(tgt.pos[0]) * BLOCKSIZE;
-            if (!discard_blocks(params.fd, offset, rss.p_remain)) {
-                return -1;
-            }
+struct PrefetchEntry {
+    size_t index;
+    RangeSet src;
+    RangeSet tgt;
+};
 
-            if (!check_lseek(params.fd, offset, SEEK_SET)) {
-                return -1;
-            }
+struct Prefetcher {
+    int depth;                          // PREFETCH_PROPERTY
+    size_t next;                        // next command to prefetch for
+    std::deque<PrefetchEntry> window;   // commands from the current one to next
+    size_t prefetched;                  // blocks requested ahead
+    size_t read;                        // source blocks read by the sampled commands
+    size_t cached;                      // ... of which were in the page cache
+};
 
-            if (params.cmdname[0] == 'i') {      // imgdiff
-                if (ApplyImagePatch(params.buffer.data(), blocks * BLOCKSIZE, &patch_value,
-                        &RangeSinkWrite, &rss, nullptr, nullptr) != 0) {
-                    fprintf(stderr, "Failed to apply image patch.\n");
-                    return -1;
-                }
-            } else {
-                if (ApplyBSDiffPatch(params.buffer.data(), blocks * BLOCKSIZE, &patch_value,
-                        0, &RangeSinkWrite, &rss, nullptr) != 0) {
-                    fprintf(stderr, "Failed to apply bsdiff patch.\n");
-                    return -1;
-                }
-            }
+static void PrefetchSources(const TransferList& tl, int fd, Prefetcher& pf, size_t index) {
+    while (!pf.window.empty() && pf.window.front().index < index) {
+        pf.window.pop_front();
+    }
 
-            // We expect the output of the patcher to fill the tgt ranges exactly.
-            if (rss.p_block != tgt.count || rss.p_remain != 0) {
-                fprintf(stderr, "range sink underrun?\n");
-            }
-        } else {
-            fprintf(stderr, "skipping %zu blocks already patched to %zu [%s]\n",
-                blocks, tgt.size, params.cmdline);
+    pf.next = std::max(pf.next, index);
+
+    CommandParameters cmd = CommandParameters();
+    for (; pf.next < tl.end && pf.next <= index + pf.depth; ++pf.next) {
+        CommandFootprint fp;
+        if (!LoadCommand(tl, pf.next, cmd) || GetCommandFootprint(cmd, fp) == -1) {
+            continue;
         }
-    }
 
-    if (!params.freestash.empty()) {
-        FreeStash(params.stashbase, params.freestash);
-        params.freestash.clear();
-    }
+        // The current command reads its source right away.
+        if (pf.next > index) {
+            for (size_t i = 0; i < fp.src.count; ) {
+                size_t j = ExtentEnd(fp.src, i);
+                RangeSet extent = { 1, fp.src.pos[j * 2 - 1] - fp.src.pos[i * 2],
+                                    { fp.src.pos[i * 2], fp.src.pos[j * 2 - 1] } };
+                i = j;
+
+                bool overwritten = false;
+                for (const auto& entry : pf.window) {
+                    if (range_overlaps(extent, entry.tgt)) {
+                        overwritten = true;
+                        break;
+                    }
+                }
 
-    params.written += tgt.size;
+                if (!overwritten) {
+                    posix_fadvise64(fd, static_cast<off64_t>(extent.pos[0]) * BLOCKSIZE,
+                            static_cast<off64_t>(extent.size) * BLOCKSIZE, POSIX_FADV_WILLNEED);
+                    pf.prefetched += extent.size;
+                }
+            }
+        }
 
-    return 0;
+        pf.window.push_back(PrefetchEntry{ pf.next, std::move(fp.src), std::move(fp.tgt) });
+    }
 }
 
-static int PerformCommandErase(CommandParameters& params) {
-    if (DEBUG_ERASE) {
-        return PerformCommandZero(params);
-    }
+// Counts how many source blocks of the command at 'index' are in the page
+// cache, right before the command reads them, for one command in
+// PREFETCH_SAMPLE_INTERVAL.
 
-    struct stat sb;
-    if (fstat(params.fd, &sb) == -1) {
-        fprintf(stderr, "failed to fstat device to erase: %s\n", strerror(errno));
-        return -1;
+static void CountPrefetchHits(int fd, Prefetcher& pf, size_t index) {
+    if (index % PREFETCH_SAMPLE_INTERVAL != 0 || pf.window.empty() ||
+            pf.window.front().index != index) {
+        return;
     }
 
-    if (!S_ISBLK(sb.st_mode)) {
-        fprintf(stderr, "not a block device; skipping erase\n");
-        return -1;
-    }
+    const RangeSet& src = pf.window.front().src;
+    std::vector<unsigned char> vec;
+    for (size_t i = 0; i < src.count; ) {
+        size_t j = ExtentEnd(src, i);
+        size_t blocks = src.pos[j * 2 - 1] - src.pos[i * 2];
+        off64_t offset = static_cast<off64_t>(src.pos[i * 2]) * BLOCKSIZE;
+        i = j;
 
-    if (params.cpos >= params.tokens.size()) {
-        fprintf(stderr, "missing target blocks for erase\n");
-        return -1;
+        void* addr = mmap64(nullptr, blocks * BLOCKSIZE, PROT_READ, MAP_SHARED, fd, offset);
+        if (addr == MAP_FAILED) {
+            continue;
+        }
+
+        vec.resize(blocks);
+        if (mincore(addr, blocks * BLOCKSIZE, vec.data()) == 0) {
+            pf.read += blocks;
+            for (size_t k = 0; k < blocks; ++k) {
+                pf.cached += vec[k] & 1;
+            }
+        }
+        munmap(addr, blocks * BLOCKSIZE);
     }
+}
 
-    RangeSet tgt;
-    parse_range(params.tokens[params.cpos++], tgt);
+typedef std::vector<std::pair<std::string, std::string>> StatsFields;
 
-    if (params.canwrite) {
-        fprintf(stderr, " erasing %zu blocks\n", tgt.size);
+static void AddStatsField(StatsFields& fields, const char* name, uint64_t value) {
+    fields.emplace_back(name, std::to_string(value));
+}
 
-        for (size_t i = 0; i < tgt.count; ++i) {
-            uint64_t blocks[2];
-            // offset in bytes
-            blocks[0] = tgt.pos[i * 2] * (uint64_t) BLOCKSIZE;
-            // length in bytes
-            blocks[1] = (tgt.pos[i * 2 + 1] - tgt.pos[i * 2]) * (uint64_t) BLOCKSIZE;
+static void AddStatsField(StatsFields& fields, const char* name,
+        std::chrono::duration<double> value) {
+    AddStatsField(fields, name, static_cast<uint64_t>(value.count() * 1000));
+}
 
-#ifndef SUPPRESS_EMMC_WIPE
-            if (ioctl(params.fd, BLKDISCARD, &blocks) == -1) {
-                fprintf(stderr, "BLKDISCARD ioctl failed: %s\n", strerror(errno));
-                return -1;
-            }
-#endif
+// Lists the statistics as name and value pairs. Times are in milliseconds.
+// The latency histogram is only meaningful for the commands of one type.
+
+static StatsFields GetStatsFields(const CommandIoStats& stats, bool histogram) {
+    StatsFields fields;
+    if (histogram) {
+        AddStatsField(fields, "commands", stats.commands);
+    }
+    AddStatsField(fields, "time_ms", stats.time);
+    AddStatsField(fields, "reads", stats.reads);
+    AddStatsField(fields, "writes", stats.writes);
+    AddStatsField(fields, "bytes_read", stats.bytes_read);
+    AddStatsField(fields, "bytes_written", stats.bytes_written);
+    AddStatsField(fields, "bytes_hashed", stats.bytes_hashed);
+    AddStatsField(fields, "fsyncs", stats.fsyncs);
+    AddStatsField(fields, "fsync_ms", stats.fsync_time);
+    AddStatsField(fields, "stash_loads", stats.stash_loads);
+    AddStatsField(fields, "stash_writes", stats.stash_writes);
+    AddStatsField(fields, "stash_bytes_read", stats.stash_bytes_read);
+    AddStatsField(fields, "stash_bytes_written", stats.stash_bytes_written);
+    if (histogram) {
+        AddStatsField(fields, "max_calls", stats.max_calls);
+        std::vector<std::string> buckets;
+        for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+            buckets.push_back(std::to_string(stats.latency[i]));
         }
+        fields.emplace_back("latency_ms", android::base::Join(buckets, ','));
     }
+    return fields;
+}
 
-    return 0;
+// Reports the statistics of an update as "log" lines on the command pipe,
+// which end up in last_install, and as JSON in STATS_FILE_FORMAT:
+//
+//    log blockimg_<partition>: time_ms=... reads=... ...
+//    log blockimg_<command>_<partition>: commands=... ... latency_ms=0,3,...
+//
+// latency_ms is the histogram described at LATENCY_BUCKETS.
+
+static void ReportStats(FILE* cmd_pipe, const char* partition, const StatsFields& total,
+        const std::map<const char*, CommandIoStats>& io_stats) {
+    std::vector<std::pair<std::string, StatsFields>> groups;
+    groups.emplace_back("blockimg_" + std::string(partition), total);
+    for (const auto& it : io_stats) {
+        groups.emplace_back("blockimg_" + std::string(it.first) + "_" + partition,
+                            GetStatsFields(it.second, true));
+    }
+
+    std::string json = "{\n";
+    for (size_t i = 0; i < groups.size(); ++i) {
+        std::vector<std::string> pairs;
+        std::vector<std::string> members;
+        for (const auto& field : groups[i].second) {
+            pairs.push_back(field.first + "=" + field.second);
+            bool list = field.second.find(',') != std::string::npos;
+            members.push_back("\"" + field.first + "\": " + (list ? "[" : "") + field.second +
+                              (list ? "]" : ""));
+        }
+        fprintf(cmd_pipe, "log %s: %s\n", groups[i].first.c_str(),
+                android::base::Join(pairs, ' ').c_str());
+        json += "  \"" + groups[i].first + "\": { " + android::base::Join(members, ", ") + " }" +
+                (i + 1 < groups.size() ? ",\n" : "\n");
+    }
+    json += "}\n";
+    fflush(cmd_pipe);
+
+    std::string fn = android::base::StringPrintf(STATS_FILE_FORMAT, partition);
+    if (!android::base::WriteStringToFile(json, fn)) {
+        fprintf(stderr, "failed to write \"%s\": %s\n", fn.c_str(), strerror(errno));
+    }
 }
 
-// Definitions for transfer list command functions
-typedef int (*CommandFunction)(CommandParameters&);
+// Opens 'blockdev', which is open as 'fd' already, for direct I/O. Returns
+// false if the device doesn't support it, in which case all transfers keep
+// using the page cache.
 
-struct Command {
-    const char* name;
-    CommandFunction f;
-};
+static bool OpenDirectIo(const char* blockdev, int fd) {
+    int dfd = TEMP_FAILURE_RETRY(open(blockdev, O_RDWR | O_DIRECT));
+    if (dfd == -1) {
+        fprintf(stderr, "open \"%s\" with O_DIRECT failed: %s; using the page cache\n",
+                blockdev, strerror(errno));
+        return false;
+    }
 
-// CompareCommands and CompareCommandNames are for the hash table
+    // Some file systems accept the flag on open and fail the transfers.
+    uint8_t* buffer = GetDirectBuffer();
+    if (buffer == nullptr ||
+            TEMP_FAILURE_RETRY(pread64(dfd, buffer, DIRECT_IO_ALIGN, 0)) == -1) {
+        fprintf(stderr, "direct read of \"%s\" failed: %s; using the page cache\n",
+                blockdev, strerror(errno));
+        if (buffer != nullptr) {
+            PutDirectBuffer(buffer);
+        }
+        close(dfd);
+        return false;
+    }
+    PutDirectBuffer(buffer);
 
-static int CompareCommands(const void* c1, const void* c2) {
-    return strcmp(((const Command*) c1)->name, ((const Command*) c2)->name);
+    direct_io.fd = dfd;
+    direct_io.buffered_fd = fd;
+    fprintf(stderr, "using direct I/O on %s\n", blockdev);
+    return true;
 }
 
-static int CompareCommandNames(const void* c1, const void* c2) {
-    return strcmp(((const Command*) c1)->name, (const char*) c2);
+static void CloseDirectIo(DirectIo* dio) {
+    if (dio->fd != -1) {
+        close(dio->fd);
+    }
+    for (uint8_t* buffer : dio->free) {
+        free(buffer);
+    }
+    dio->fd = -1;
+    dio->buffered_fd = -1;
+    dio->free.clear();
+    dio->buffers = 0;
+    dio->direct = 0;
+    dio->copied = 0;
+    dio->buffered = 0;
 }
 
-// HashString is used to hash command names for the hash table
+// Share of the mapped package in the page cache while the partition is
+// written, sampled at most once a second. Partition writes through the page
+// cache compete with the package for memory.
 
-static unsigned int HashString(const char *s) {
-    unsigned int hash = 0;
-    if (s) {
-        while (*s) {
-            hash = hash * 33 + *s++;
-        }
+struct PackageCacheSamples {
+    double first;                       // percent
+    double min;
+    double last;
+    size_t count;
+    std::chrono::steady_clock::time_point time;
+};
+
+static void SamplePackageCache(const UpdaterInfo* ui, PackageCacheSamples& pcs, bool force) {
+    auto now = std::chrono::steady_clock::now();
+    if (!force && pcs.count > 0 && now - pcs.time < std::chrono::seconds(1)) {
+        return;
     }
-    return hash;
+    pcs.time = now;
+
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> vec((ui->package_zip_len + pagesize - 1) / pagesize);
+    if (vec.empty() || mincore(ui->package_zip_addr, ui->package_zip_len, vec.data()) == -1) {
+        return;
+    }
+
+    size_t resident = 0;
+    for (unsigned char v : vec) {
+        resident += v & 1;
+    }
+    pcs.last = 100.0 * resident / vec.size();
+    pcs.first = pcs.count == 0 ? pcs.last : pcs.first;
+    pcs.min = pcs.count == 0 ? pcs.last : std::min(pcs.min, pcs.last);
+    ++pcs.count;
 }
 
 // args:
@@ -1384,15 +4542,18 @@ static unsigned int HashString(const char *s) {
 
 static Value* PerformBlockImageUpdate(const char* name, State* state, int /* argc */, Expr* argv[],
         const Command* commands, size_t cmdcount, bool dryrun) {
-    CommandParameters params;
-    memset(&params, 0, sizeof(params));
+    CommandParameters params{};
     params.canwrite = !dryrun;
 
+    NewThreadInfo nti{};
+    params.nti = &nti;
+
     fprintf(stderr, "performing %s\n", dryrun ? "verification" : "update");
     if (state->is_retry) {
         is_retry = true;
         fprintf(stderr, "This update is a retry.\n");
     }
+    compress_stash = property_get_int32(STASH_COMPRESS_PROPERTY, 0) != 0;
 
     Value* blockdev_filename = nullptr;
     Value* transfer_list_value = nullptr;
@@ -1414,8 +4575,9 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int /* arg
                    name);
         return StringValue(strdup(""));
     }
-    if (transfer_list_value->type != VAL_BLOB) {
-        ErrorAbort(state, kArgsParsingFailure, "transfer_list argument to %s must be blob", name);
+    if (transfer_list_value->type != VAL_BLOB && transfer_list_value->type != VAL_STRING) {
+        ErrorAbort(state, kArgsParsingFailure,
+                   "transfer_list argument to %s must be blob or string", name);
         return StringValue(strdup(""));
     }
     if (new_data_fn->type != VAL_STRING) {
@@ -1448,7 +4610,24 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int /* arg
     }
 
     params.patch_start = ui->package_zip_addr + mzGetZipEntryOffset(patch_entry);
-    const ZipEntry* new_entry = mzFindZipEntry(za, new_data_fn->data);
+
+    // A string names a transfer list stored uncompressed in the package, which
+    // is used directly from the mapped package like the patch data.
+    const char* transfer_list_data = transfer_list_value->data;
+    size_t transfer_list_size = transfer_list_value->size;
+    if (transfer_list_value->type == VAL_STRING) {
+        const ZipEntry* transfer_list_entry = mzFindZipEntry(za, transfer_list_value->data);
+        if (transfer_list_entry == nullptr) {
+            fprintf(stderr, "%s(): no file \"%s\" in package", name, transfer_list_value->data);
+            return StringValue(strdup(""));
+        }
+
+        transfer_list_data = reinterpret_cast<const char*>(ui->package_zip_addr +
+                mzGetZipEntryOffset(transfer_list_entry));
+        transfer_list_size = mzGetZipEntryUncompLen(transfer_list_entry);
+    }
+    NewDataFormat new_format;
+    const ZipEntry* new_entry = FindNewData(za, new_data_fn->data, &new_format);
     if (new_entry == nullptr) {
         fprintf(stderr, "%s(): no file \"%s\" in package", name, new_data_fn->data);
         return StringValue(strdup(""));
@@ -1462,79 +4641,100 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int /* arg
         return StringValue(strdup(""));
     }
 
+    std::unique_ptr<DirectIo, decltype(&CloseDirectIo)> direct_io_holder(nullptr, CloseDirectIo);
+    if (property_get_int32(DIRECT_IO_PROPERTY, 0) != 0 &&
+            OpenDirectIo(blockdev_filename->data, params.fd)) {
+        direct_io_holder.reset(&direct_io);
+    }
+
+    params.writeback.fd = params.fd;
+    if (params.canwrite) {
+        params.writeback.limit = std::max<int64_t>(property_get_int64(WRITEBACK_PROPERTY,
+                                                                      WRITEBACK_SIZE), 0);
+    }
+    params.move_window = std::max<int64_t>(property_get_int64(MOVE_WINDOW_PROPERTY,
+                                                              MOVE_WINDOW_SIZE), 0);
+    if (params.canwrite) {
+        int imgpatch_threads = property_get_int32(IMGPATCH_THREADS_PROPERTY,
+                                                  sysconf(_SC_NPROCESSORS_ONLN));
+        SetImagePatchParallelism(std::min(imgpatch_threads, MAX_IMGPATCH_THREADS),
+                                 property_get_int32(IMGPATCH_CHUNKS_PROPERTY, IMGPATCH_CHUNKS));
+    }
+
+    // The new data thread is stopped on every return, before nti goes away.
+    std::unique_ptr<NewThreadInfo, decltype(&StopNewDataThread)> new_data_holder(
+            nullptr, StopNewDataThread);
     if (params.canwrite) {
-        params.nti.za = za;
-        params.nti.entry = new_entry;
+        nti.za = za;
+        nti.entry = new_entry;
+        nti.format = new_format;
+        nti.data = ui->package_zip_addr + mzGetZipEntryOffset(new_entry);
+        nti.data_size = mzGetZipEntryUncompLen(new_entry);
+        nti.decoder_mem = std::max<int64_t>(property_get_int64(NEW_DATA_DECODER_MEM_PROPERTY,
+                                                               NEW_DATA_DECODER_MEM), 0);
+
+        int64_t ring_size = property_get_int64(NEW_DATA_BUFFER_PROPERTY, NEW_DATA_BUFFER_SIZE);
+        ring_size = std::max<int64_t>(ring_size, MIN_NEW_DATA_BUFFER);
+        ring_size = std::min<int64_t>(ring_size, MAX_NEW_DATA_BUFFER);
+        nti.ring.resize(ring_size);
+
+        // Inflate the new data on several threads if the package has an
+        // index of restart points for it.
+        std::string index_fn = std::string(new_data_fn->data) + NEW_DATA_INDEX_SUFFIX;
+        const ZipEntry* index_entry = mzFindZipEntry(za, index_fn.c_str());
+        nti.inflate_threads = property_get_int32(INFLATE_THREADS_PROPERTY,
+                                                 sysconf(_SC_NPROCESSORS_ONLN));
+        nti.inflate_threads = std::min(nti.inflate_threads, MAX_INFLATE_THREADS);
+        if (index_entry != nullptr && nti.inflate_threads > 1 &&
+                nti.format == NEW_DATA_DEFLATE) {
+            nti.index.resize(mzGetZipEntryUncompLen(index_entry));
+            if (!mzReadZipEntry(za, index_entry, reinterpret_cast<char*>(nti.index.data()),
+                                nti.index.size()) || !ValidateNewDataIndex(&nti)) {
+                fprintf(stderr, "ignoring %s\n", index_fn.c_str());
+                nti.index.clear();
+            }
+        }
 
-        pthread_mutex_init(&params.nti.mu, nullptr);
-        pthread_cond_init(&params.nti.cv, nullptr);
+        pthread_mutex_init(&nti.mu, nullptr);
+        pthread_cond_init(&nti.cv, nullptr);
         pthread_attr_t attr;
         pthread_attr_init(&attr);
         pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
 
-        int error = pthread_create(&params.thread, &attr, unzip_new_data, &params.nti);
+        int error = pthread_create(&nti.thread, &attr, unzip_new_data, &nti);
         if (error != 0) {
             fprintf(stderr, "pthread_create failed: %s\n", strerror(error));
             return StringValue(strdup(""));
         }
+        new_data_holder.reset(&nti);
     }
 
-    // Copy all the lines in transfer_list_value into std::string for
-    // processing.
-    const std::string transfer_list(transfer_list_value->data, transfer_list_value->size);
-    std::vector<std::string> lines = android::base::Split(transfer_list, "\n");
-    if (lines.size() < 2) {
-        ErrorAbort(state, kArgsParsingFailure, "too few lines in the transfer list [%zd]\n",
-                   lines.size());
+    TransferList tl = TransferList();
+    if (LoadTransferList(state, transfer_list_data, transfer_list_size, tl) == -1) {
         return StringValue(strdup(""));
     }
 
-    // First line in transfer list is the version number
-    if (!android::base::ParseInt(lines[0].c_str(), &params.version, 1, 4)) {
-        fprintf(stderr, "unexpected transfer list version [%s]\n", lines[0].c_str());
-        return StringValue(strdup(""));
-    }
-
-    fprintf(stderr, "blockimg version is %d\n", params.version);
-
-    // Second line in transfer list is the total number of blocks we expect to write
-    int total_blocks;
-    if (!android::base::ParseInt(lines[1].c_str(), &total_blocks, 0)) {
-        ErrorAbort(state, kArgsParsingFailure, "unexpected block count [%s]\n", lines[1].c_str());
-        return StringValue(strdup(""));
-    }
+    params.tl = &tl;
+    params.version = tl.version;
+    fprintf(stderr, "blockimg version is %d%s\n", params.version,
+            tl.header != nullptr ? " (binary)" : "");
 
+    int total_blocks = tl.total_blocks;
     if (total_blocks == 0) {
         return StringValue(strdup("t"));
     }
 
-    size_t start = 2;
+    size_t start = tl.start;
     if (params.version >= 2) {
-        if (lines.size() < 4) {
-            ErrorAbort(state, kArgsParsingFailure, "too few lines in the transfer list [%zu]\n",
-                       lines.size());
-            return StringValue(strdup(""));
-        }
+        fprintf(stderr, "maximum stash entries %d\n", tl.stash_entries);
 
-        // Third line is how many stash entries are needed simultaneously
-        fprintf(stderr, "maximum stash entries %s\n", lines[2].c_str());
-
-        // Fourth line is the maximum number of blocks that will be stashed simultaneously
-        int stash_max_blocks;
-        if (!android::base::ParseInt(lines[3].c_str(), &stash_max_blocks, 0)) {
-            ErrorAbort(state, kArgsParsingFailure, "unexpected maximum stash blocks [%s]\n",
-                       lines[3].c_str());
-            return StringValue(strdup(""));
-        }
-
-        int res = CreateStash(state, stash_max_blocks, blockdev_filename->data, params.stashbase);
+        int res = CreateStash(state, tl.stash_max_blocks, blockdev_filename->data,
+                              params.stashbase);
         if (res == -1) {
             return StringValue(strdup(""));
         }
 
         params.createdstash = res;
-
-        start += 2;
     }
 
     // Build a hash table of the available commands
@@ -1548,50 +4748,267 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int /* arg
 
     int rc = -1;
 
-    // Subsequent lines are all individual transfer commands
-    for (auto it = lines.cbegin() + start; it != lines.cend(); it++) {
-        const std::string& line_str(*it);
-        if (line_str.empty()) {
-            continue;
+    int workers = property_get_int32(WORKERS_PROPERTY, 1);
+    if (workers > MAX_WORKERS) {
+        workers = MAX_WORKERS;
+    }
+
+    Checkpoint checkpoint = {};
+    StashCache stash_cache = {};
+    VerifyPool verify_pool = {};
+    Prefetcher prefetcher = {};
+    HashIndex hash_index = HashIndex();
+    std::string verify_map;
+    auto verify_start = std::chrono::steady_clock::now();
+    std::map<const char*, CommandIoStats> io_stats;
+    PackageCacheSamples package_cache = {};
+    io = CommandIoStats();
+    auto update_start = std::chrono::steady_clock::now();
+
+    if (params.canwrite && params.version >= 3) {
+        uint8_t digest[SHA_DIGEST_LENGTH];
+        SHA1(reinterpret_cast<const uint8_t*>(transfer_list_data), transfer_list_size, digest);
+        checkpoint.tlhash = print_sha1(digest);
+
+        // The parallel workers only use stash files.
+        if (workers <= 1) {
+            stash_cache.budget = property_get_int64(STASH_CACHE_PROPERTY, 0);
+        }
+        if (stash_cache.budget > 0) {
+            fprintf(stderr, "keeping up to %zu bytes of stashes in memory\n", stash_cache.budget);
+        }
+        FindStashUses(tl, stash_cache);
+        params.stash_cache = &stash_cache;
+
+        // Commands up to a checkpoint left by a previous attempt are known to
+        // be complete and durable.
+        size_t resume;
+        if (params.createdstash == 0 && ReadCheckpoint(params.stashbase, checkpoint.tlhash,
+                resume) && resume >= start) {
+            if (SkipCompletedCommands(params, tl, start, resume) == -1) {
+                goto pbiudone;
+            }
+            start = resume + 1;
+        }
+
+        checkpoint.sync_bytes = property_get_int64(SYNC_BYTES_PROPERTY, 0);
+        checkpoint.sync_ms = property_get_int32(SYNC_MS_PROPERTY, 0);
+        if (workers <= 1 && (checkpoint.sync_bytes > 0 || checkpoint.sync_ms > 0)) {
+            fprintf(stderr, "syncing every %zu bytes / %d ms\n", checkpoint.sync_bytes,
+                    checkpoint.sync_ms);
+            checkpoint.last_flush = std::chrono::steady_clock::now();
+            checkpoint.written = params.written;
+            checkpoint.stashed = params.stashed;
+            params.checkpoint = &checkpoint;
         }
+    }
 
-        params.tokens = android::base::Split(line_str, " ");
-        params.cpos = 0;
-        params.cmdname = params.tokens[params.cpos++].c_str();
-        params.cmdline = line_str.c_str();
+    // The index follows the writes of the commands in order, which the
+    // parallel workers don't have.
+    if (params.version >= 3 && (!params.canwrite || workers <= 1) &&
+            property_get_int32(HASH_INDEX_PROPERTY, 0) != 0) {
+        if (LoadHashIndex(hash_index, blockdev_filename->data, params.fd)) {
+            params.hash_index = &hash_index;
+            hash_index.writeback = &params.writeback;
+            if (params.canwrite) {
+                StartHashIndexUpdate(hash_index, tl, start);
+            }
+        }
+    } else if (params.canwrite) {
+        DeleteHashIndex(blockdev_filename->data);
+    }
 
-        unsigned int cmdhash = HashString(params.cmdname);
-        const Command* cmd = reinterpret_cast<const Command*>(mzHashTableLookup(cmdht, cmdhash,
-                const_cast<char*>(params.cmdname), CompareCommandNames,
-                false));
+    if (params.canwrite) {
+        SamplePackageCache(ui, package_cache, true);
+    }
 
-        if (cmd == nullptr) {
-            fprintf(stderr, "unexpected command [%s]\n", params.cmdname);
+    if (params.canwrite && params.version >= 3 && workers > 1) {
+        if (PerformCommandsParallel(params, tl, start, cmdht, workers, cmd_pipe, io_stats) == -1) {
             goto pbiudone;
         }
+    } else {
+        if (!params.canwrite && params.version >= 3) {
+            int threads = property_get_int32(VERIFY_THREADS_PROPERTY,
+                                             sysconf(_SC_NPROCESSORS_ONLN));
+            threads = std::min(threads, MAX_VERIFY_THREADS);
+            if (threads > 1) {
+                StartVerifyPool(verify_pool, tl, start, params.fd, threads);
+            }
+            verify_map.assign(tl.end, ' ');
+        }
 
-        if (cmd->f != nullptr && cmd->f(params) == -1) {
-            fprintf(stderr, "failed to execute command [%s]\n", line_str.c_str());
-            goto pbiudone;
+        if (params.canwrite && params.version >= 3) {
+            prefetcher.depth = property_get_int32(PREFETCH_PROPERTY, PREFETCH_DEPTH);
+            if (BLOCKSIZE != sysconf(_SC_PAGESIZE) || direct_io.fd != -1) {
+                prefetcher.depth = 0;
+            }
         }
 
-        if (params.canwrite) {
-            if (ota_fsync(params.fd) == -1) {
-                failure_type = kFsyncFailure;
-                fprintf(stderr, "fsync failed: %s\n", strerror(errno));
+        // Subsequent lines are all individual transfer commands
+        for (size_t index = start; index < tl.end; ++index) {
+            if (prefetcher.depth > 0) {
+                PrefetchSources(tl, params.fd, prefetcher, index);
+                CountPrefetchHits(params.fd, prefetcher, index);
+            }
+
+            if (!LoadCommand(tl, index, params)) {
+                continue;
+            }
+
+            if (!verify_pool.threads.empty()) {
+                params.verified = WaitVerifyResult(verify_pool, index);
+            }
+            params.uptodate = false;
+
+            // Make sure the command doesn't overwrite the source of a stash
+            // that is only in memory, and with batched syncs, anything an
+            // earlier command that isn't durable yet used.
+            CommandFootprint fp;
+            if (params.checkpoint != nullptr || !stash_cache.entries.empty() ||
+                    params.hash_index != nullptr) {
+                if (GetCommandFootprint(params, fp) == -1) {
+                    fprintf(stderr, "invalid parameters [%s]\n", params.cmdline);
+                    goto pbiudone;
+                }
+
+                if (!stash_cache.entries.empty() &&
+                        SpillOverwrittenStashes(params, fp.tgt) == -1) {
+                    goto pbiudone;
+                }
+
+                if (params.checkpoint != nullptr &&
+                        CheckpointOverlaps(*params.checkpoint, fp.tgt) &&
+                        FlushCheckpoint(params, false) == -1) {
+                    goto pbiudone;
+                }
+
+                // Writes of earlier commands may still be in the write-back
+                // buffer until the next sync.
+                if ((WriteBackOverlaps(params.writeback, fp.src) ||
+                        WriteBackOverlaps(params.writeback, fp.tgt)) &&
+                        FlushWriteBack(params.writeback) == -1) {
+                    goto pbiudone;
+                }
+
+                if (params.canwrite &&
+                        AnnounceWrites(params.hash_index, tl, index) == -1) {
+                    goto pbiudone;
+                }
+            }
+
+            params.has_tgtdigest = false;
+            unsigned int cmdhash = HashString(params.cmdname);
+            const Command* cmd = reinterpret_cast<const Command*>(mzHashTableLookup(cmdht,
+                    cmdhash, const_cast<char*>(params.cmdname), CompareCommandNames, false));
+
+            if (cmd == nullptr) {
+                fprintf(stderr, "unexpected command [%s]\n", params.cmdname);
                 goto pbiudone;
             }
-            fprintf(cmd_pipe, "set_progress %.4f\n", (double) params.written / total_blocks);
-            fflush(cmd_pipe);
+
+            CommandIoStats before = io;
+            auto cmd_start = std::chrono::steady_clock::now();
+
+            if (cmd->f != nullptr && cmd->f(params) == -1) {
+                fprintf(stderr, "failed to execute command [%s]\n", params.cmdline);
+                if (!verify_map.empty()) {
+                    verify_map[index] = 'X';
+                }
+                goto pbiudone;
+            }
+
+            if (!verify_map.empty()) {
+                verify_map[index] = params.uptodate ? '=' : '.';
+            }
+
+            if (params.canwrite) {
+                if (params.checkpoint != nullptr) {
+                    if (UpdateCheckpoint(params, index, fp) == -1) {
+                        goto pbiudone;
+                    }
+                } else if (FlushWriteBack(params.writeback) == -1) {
+                    goto pbiudone;
+                } else if (sync_fd(params.fd) == -1) {
+                    failure_type = kFsyncFailure;
+                    fprintf(stderr, "fsync failed: %s\n", strerror(errno));
+                    goto pbiudone;
+                }
+
+                if (params.hash_index != nullptr) {
+                    AddWritten(params.hash_index, index, fp.tgt,
+                               params.has_tgtdigest ? params.tgtdigest : nullptr);
+                    if (params.checkpoint == nullptr &&
+                            HashIndexSynced(params.hash_index) == -1) {
+                        goto pbiudone;
+                    }
+                }
+            }
+
+            RecordCommand(io_stats[cmd->name], before,
+                          std::chrono::steady_clock::now() - cmd_start);
+
+            if (params.canwrite) {
+                fprintf(cmd_pipe, "set_progress %.4f\n", (double) params.written / total_blocks);
+                fflush(cmd_pipe);
+                SamplePackageCache(ui, package_cache, false);
+            }
         }
     }
 
     if (params.canwrite) {
-        pthread_join(params.thread, nullptr);
+        new_data_holder.reset();
+        fprintf(stderr, "new data: inflater waited %.3f s, writers waited %.3f s (%zu KiB)\n",
+                nti.producer_stall.count(), nti.consumer_stall.count(),
+                nti.ring.size() / 1024);
+
+        // Everything has to be durable before the stash can be deleted.
+        if (params.checkpoint != nullptr) {
+            if (FlushCheckpoint(params, true) == -1) {
+                goto pbiudone;
+            }
+            fprintf(stderr, "synced %zu times (%zu checkpoints) for %zu commands (%.3f s)\n",
+                    checkpoint.flushes, checkpoint.checkpoints, checkpoint.commands,
+                    checkpoint.sync_time.count());
+        }
 
         fprintf(stderr, "wrote %zu blocks; expected %d\n", params.written, total_blocks);
         fprintf(stderr, "stashed %zu blocks\n", params.stashed);
+        if (stash_cache.budget > 0) {
+            fprintf(stderr, "loaded %zu stashes from memory, wrote %zu to /cache later\n",
+                    stash_cache.hits, stash_cache.spills);
+        }
         fprintf(stderr, "max alloc needed was %zu\n", params.buffer.size());
+        fprintf(stderr, "max patch output alloc needed was %zu\n", params.patch_alloc);
+        io.time = std::chrono::steady_clock::now() - update_start;
+        fprintf(stderr, "issued %zu reads and %zu writes, %zu fsyncs (%.3f s) in %.3f s\n",
+                io.reads, io.writes, io.fsyncs, io.fsync_time.count(), io.time.count());
+        if (params.writeback.limit > 0) {
+            fprintf(stderr, "write-back merged %zu writes into %zu and %zu discards into %zu\n",
+                    params.writeback.queued_writes, params.writeback.issued_writes,
+                    params.writeback.queued_discards, params.writeback.issued_discards);
+        }
+        if (direct_io.fd != -1) {
+            fprintf(stderr, "direct I/O: %zu transfers, %zu copied through %zu buffers; %zu "
+                    "unaligned ones used the page cache\n", direct_io.direct.load(),
+                    direct_io.copied.load(), direct_io.buffers, direct_io.buffered.load());
+        }
+        SamplePackageCache(ui, package_cache, true);
+        if (package_cache.count > 0) {
+            fprintf(stderr, "package in page cache: %.1f%% at start, %.1f%% at least, %.1f%% at "
+                    "end\n", package_cache.first, package_cache.min, package_cache.last);
+        }
+        if (prefetcher.depth > 0) {
+            fprintf(stderr, "prefetched %zu blocks up to %d commands ahead; %zu of %zu sampled "
+                    "source blocks were cached when read (%.1f%%)\n", prefetcher.prefetched,
+                    prefetcher.depth, prefetcher.cached, prefetcher.read,
+                    prefetcher.read > 0 ? 100.0 * prefetcher.cached / prefetcher.read : 0.0);
+        }
+        for (const auto& it : io_stats) {
+            const CommandIoStats& stats = it.second;
+            fprintf(stderr, "  %s: %zu commands in %.3f s, %zu reads, %zu writes, at most %zu "
+                    "per command\n", it.first, stats.commands, stats.time.count(), stats.reads,
+                    stats.writes, stats.max_calls);
+        }
 
         const char* partition = strrchr(blockdev_filename->data, '/');
         if (partition != nullptr && *(partition+1) != 0) {
@@ -1600,6 +5017,19 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int /* arg
             fprintf(cmd_pipe, "log bytes_stashed_%s: %zu\n", partition + 1,
                     params.stashed * BLOCKSIZE);
             fflush(cmd_pipe);
+
+            StatsFields total = GetStatsFields(io, false);
+            AddStatsField(total, "new_data_inflater_wait_ms", nti.producer_stall);
+            AddStatsField(total, "new_data_writer_wait_ms", nti.consumer_stall);
+            if (package_cache.count > 0) {
+                AddStatsField(total, "package_cached_start_pct",
+                              static_cast<uint64_t>(package_cache.first));
+                AddStatsField(total, "package_cached_min_pct",
+                              static_cast<uint64_t>(package_cache.min));
+                AddStatsField(total, "package_cached_end_pct",
+                              static_cast<uint64_t>(package_cache.last));
+            }
+            ReportStats(cmd_pipe, partition + 1, total, io_stats);
         }
         // Delete stash only after successfully completing the update, as it
         // may contain blocks needed to complete the update later.
@@ -1608,12 +5038,49 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int /* arg
         fprintf(stderr, "verified partition contents; update may be resumed\n");
     }
 
+    if (params.hash_index != nullptr) {
+        fprintf(stderr, "hash index answered %zu of %zu checks (%zu blocks not read)\n",
+                hash_index.hits, hash_index.lookups, hash_index.blocks);
+    }
+
     rc = 0;
 
 pbiudone:
-    if (ota_fsync(params.fd) == -1) {
+    new_data_holder.reset();
+    size_t verify_threads = verify_pool.threads.size();
+    StopVerifyPool(verify_pool);
+    params.verified = nullptr;
+
+    if (!verify_map.empty()) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - verify_start;
+        fprintf(stderr, "verification map ('.' verified, '=' already updated, 'X' failed):\n");
+        for (size_t i = tl.start; i < tl.end; i += 64) {
+            fprintf(stderr, "%8zu %s\n", i, verify_map.substr(i, 64).c_str());
+        }
+
+        if (verify_threads > 0) {
+            double mib = verify_pool.bytes / 1048576.0;
+            fprintf(stderr, "hashed %.1f MiB on %zu threads in %.3f s (%.1f MiB/s)\n", mib,
+                    verify_threads, elapsed.count(), mib / elapsed.count());
+        }
+    }
+
+    // Record what has been completed so far for the retry.
+    if (rc != 0 && params.checkpoint != nullptr && !params.isunresumable) {
+        FlushCheckpoint(params, true);
+    }
+
+    FlushWriteBack(params.writeback);
+    if (sync_fd(params.fd) == -1) {
         failure_type = kFsyncFailure;
         fprintf(stderr, "fsync failed: %s\n", strerror(errno));
+    } else if (params.canwrite) {
+        HashIndexSynced(params.hash_index);
+    } else {
+        AppendHashIndex(params.hash_index, false);
+    }
+    if (params.hash_index != nullptr) {
+        CloseHashIndex(hash_index);
     }
     // params.fd will be automatically closed because of the fd_holder above.
 
@@ -1685,6 +5152,15 @@ pbiudone:
 // before the range parameters, which are used to check if the
 // command has already been completed and verify the integrity of
 // the source data.
+//
+// The same commands may also be provided in the binary encoding from
+// transfer_list.h, created with transfer_list_convert. The transfer_list
+// argument is then either the blob, or the name of the list stored
+// uncompressed in the package, in which case it is used in place.
+//
+// Version 3+ lists may also be executed out of order by
+// PerformCommandsParallel() when WORKERS_PROPERTY is set; commands
+// whose blocks or stashes conflict still run in list order.
 
 Value* BlockImageVerifyFn(const char* name, State* state, int argc, Expr* argv[]) {
     // Commands which are not tested are set to nullptr to skip them completely
@@ -1752,29 +5228,33 @@ Value* RangeSha1Fn(const char* name, State* state, int /* argc */, Expr* argv[])
     RangeSet rs;
     parse_range(ranges->data, rs);
 
-    SHA_CTX ctx;
-    SHA1_Init(&ctx);
+    HashIndex hash_index = HashIndex();
+    HashIndex* hi = nullptr;
+    if (property_get_int32(HASH_INDEX_PROPERTY, 0) != 0 &&
+            LoadHashIndex(hash_index, blockdev_filename->data, fd)) {
+        hi = &hash_index;
+    }
 
-    std::vector<uint8_t> buffer(BLOCKSIZE);
-    for (size_t i = 0; i < rs.count; ++i) {
-        if (!check_lseek(fd, (off64_t)rs.pos[i*2] * BLOCKSIZE, SEEK_SET)) {
-            ErrorAbort(state, kLseekFailure, "failed to seek %s: %s", blockdev_filename->data,
+    std::vector<uint8_t> buffer;
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    // The script checks the result of the update with this, so it can't
+    // take the digests that the update meant to write for granted.
+    if (!LookupHash(hi, rs, digest, true)) {
+        if (HashBlocks(rs, buffer, fd, digest) == -1) {
+            ErrorAbort(state, kFreadFailure, "failed to read %s: %s", blockdev_filename->data,
                        strerror(errno));
+            if (hi != nullptr) {
+                CloseHashIndex(hash_index);
+            }
             return StringValue(strdup(""));
         }
+        AddHash(hi, rs, digest);
+    }
 
-        for (size_t j = rs.pos[i*2]; j < rs.pos[i*2+1]; ++j) {
-            if (read_all(fd, buffer, BLOCKSIZE) == -1) {
-                ErrorAbort(state, kFreadFailure, "failed to read %s: %s", blockdev_filename->data,
-                        strerror(errno));
-                return StringValue(strdup(""));
-            }
-
-            SHA1_Update(&ctx, buffer.data(), BLOCKSIZE);
-        }
+    if (hi != nullptr) {
+        AppendHashIndex(hi, false);
+        CloseHashIndex(hash_index);
     }
-    uint8_t digest[SHA_DIGEST_LENGTH];
-    SHA1_Final(digest, &ctx);
 
     return StringValue(strdup(print_sha1(digest).c_str()));
 }
@@ -1833,6 +5313,93 @@ Value* CheckFirstBlockFn(const char* name, State* state, int argc, Expr* argv[])
 }
 
 
+// Recovery of a partition is split into contiguous spans of the requested
+// blocks, one per thread. Each thread reads its span through a libfec
+// handle of its own, which corrects and rewrites the corrupted blocks.
+
+struct RecoverState {
+    const char* filename;
+    pthread_mutex_t mu;
+    FILE* cmd_pipe;
+    size_t total;                       // blocks to read
+    size_t done;
+    size_t reported;                    // blocks done at the last progress update
+    bool failed;
+    std::string error;
+};
+
+struct RecoverWorker {
+    RecoverState* rs;
+    std::vector<std::pair<size_t, size_t>> spans;    // first block and count
+    pthread_t thread;
+    uint64_t errors;                    // corrected by this thread's handle
+};
+
+static void* RecoverThread(void* cookie) {
+    RecoverWorker* worker = reinterpret_cast<RecoverWorker*>(cookie);
+    RecoverState* rs = worker->rs;
+    std::string error;
+
+    // When opened with O_RDWR, libfec rewrites corrupted blocks when they are read
+    fec::io fh(rs->filename, O_RDWR);
+    std::vector<uint8_t> buffer(MAX_IO_SIZE);
+
+    if (!fh) {
+        error = android::base::StringPrintf("fec_open \"%s\" failed: %s", rs->filename,
+                                            strerror(errno));
+    }
+
+    for (size_t i = 0; i < worker->spans.size() && error.empty(); ++i) {
+        size_t block = worker->spans[i].first;
+        size_t end = block + worker->spans[i].second;
+
+        while (block < end) {
+            size_t blocks = std::min<size_t>(end - block, MAX_IO_SIZE / BLOCKSIZE);
+            size_t size = blocks * BLOCKSIZE;
+            if (fh.pread(buffer.data(), size, static_cast<off64_t>(block) * BLOCKSIZE) !=
+                    static_cast<ssize_t>(size)) {
+                error = android::base::StringPrintf("failed to recover %s (blocks %zu-%zu): %s",
+                                                    rs->filename, block, block + blocks - 1,
+                                                    strerror(errno));
+                break;
+            }
+            block += blocks;
+
+            pthread_mutex_lock(&rs->mu);
+            rs->done += blocks;
+            if (rs->cmd_pipe != nullptr && rs->done - rs->reported >= rs->total / 100) {
+                fprintf(rs->cmd_pipe, "set_progress %.4f\n",
+                        static_cast<double>(rs->done) / rs->total);
+                fflush(rs->cmd_pipe);
+                rs->reported = rs->done;
+            }
+            bool failed = rs->failed;
+            pthread_mutex_unlock(&rs->mu);
+
+            // Another thread failed, so the result doesn't matter
+            if (failed) {
+                return nullptr;
+            }
+        }
+    }
+
+    fec_status status;
+    if (error.empty() && fh.get_status(status)) {
+        worker->errors = status.errors;
+    }
+
+    if (!error.empty()) {
+        pthread_mutex_lock(&rs->mu);
+        if (!rs->failed) {
+            rs->failed = true;
+            rs->error = error;
+        }
+        pthread_mutex_unlock(&rs->mu);
+    }
+
+    return nullptr;
+}
+
 Value* BlockImageRecoverFn(const char* name, State* state, int argc, Expr* argv[]) {
     Value* arg_filename;
     Value* arg_ranges;
@@ -1856,6 +5423,9 @@ Value* BlockImageRecoverFn(const char* name, State* state, int argc, Expr* argv[
     // Output notice to log when recover is attempted
     fprintf(stderr, "%s image corrupted, attempting to recover...\n", filename->data);
 
+    // The repair rewrites blocks behind the back of the hash index.
+    DeleteHashIndex(filename->data);
+
     // When opened with O_RDWR, libfec rewrites corrupted blocks when they are read
     fec::io fh(filename->data, O_RDWR);
 
@@ -1880,33 +5450,102 @@ Value* BlockImageRecoverFn(const char* name, State* state, int argc, Expr* argv[
     RangeSet rs;
     parse_range(ranges->data, rs);
 
-    uint8_t buffer[BLOCKSIZE];
-
+    // Stay within the data area, libfec validates and corrects metadata
+    size_t data_blocks = status.data_size / BLOCKSIZE;
+    std::vector<std::pair<size_t, size_t>> extents;
+    size_t total = 0;
     for (size_t i = 0; i < rs.count; ++i) {
-        for (size_t j = rs.pos[i * 2]; j < rs.pos[i * 2 + 1]; ++j) {
-            // Stay within the data area, libfec validates and corrects metadata
-            if (status.data_size <= (uint64_t)j * BLOCKSIZE) {
-                continue;
-            }
+        size_t first = rs.pos[i * 2];
+        size_t end = std::min(rs.pos[i * 2 + 1], data_blocks);
+        if (first < end) {
+            extents.emplace_back(first, end - first);
+            total += end - first;
+        }
+    }
 
-            if (fh.pread(buffer, BLOCKSIZE, (off64_t)j * BLOCKSIZE) != BLOCKSIZE) {
-                ErrorAbort(state, kLibfecFailure, "failed to recover %s (block %zu): %s",
-                           filename->data, j, strerror(errno));
-                return StringValue(strdup(""));
+    int threads = property_get_int32(RECOVER_THREADS_PROPERTY, sysconf(_SC_NPROCESSORS_ONLN));
+    threads = std::max(1, std::min(threads, MAX_RECOVER_THREADS));
+    threads = std::max<size_t>(1, std::min<size_t>(threads, total / (MAX_IO_SIZE / BLOCKSIZE)));
+
+    UpdaterInfo* ui = reinterpret_cast<UpdaterInfo*>(state->cookie);
+    RecoverState recover;
+    recover.filename = filename->data;
+    pthread_mutex_init(&recover.mu, nullptr);
+    recover.cmd_pipe = ui != nullptr ? ui->cmd_pipe : nullptr;
+    recover.total = total;
+    recover.done = 0;
+    recover.reported = 0;
+    recover.failed = false;
+
+    // Split the blocks into 'threads' contiguous spans of about the same size.
+    std::vector<RecoverWorker> workers(threads);
+    size_t e = 0;
+    size_t used = 0;                    // of extents[e]
+    for (int i = 0; i < threads; ++i) {
+        workers[i].rs = &recover;
+        workers[i].errors = 0;
+
+        size_t left = total / threads + (static_cast<size_t>(i) < total % threads ? 1 : 0);
+        while (left > 0) {
+            size_t n = std::min(left, extents[e].second - used);
+            workers[i].spans.emplace_back(extents[e].first + used, n);
+            left -= n;
+            used += n;
+            if (used == extents[e].second) {
+                ++e;
+                used = 0;
             }
+        }
+    }
 
-            // If we want to be able to recover from a situation where rewriting a corrected
-            // block doesn't guarantee the same data will be returned when re-read later, we
-            // can save a copy of corrected blocks to /cache. Note:
-            //
-            //  1. Maximum space required from /cache is the same as the maximum number of
-            //     corrupted blocks we can correct. For RS(255, 253) and a 2 GiB partition,
-            //     this would be ~16 MiB, for example.
-            //
-            //  2. To find out if this block was corrupted, call fec_get_status after each
-            //     read and check if the errors field value has increased.
+    auto start = std::chrono::steady_clock::now();
+
+    // The first worker runs on this thread.
+    size_t started = 1;
+    for (; started < workers.size(); ++started) {
+        int error = pthread_create(&workers[started].thread, nullptr, RecoverThread,
+                                   &workers[started]);
+        if (error != 0) {
+            fprintf(stderr, "pthread_create failed: %s\n", strerror(error));
+            break;
         }
     }
+
+    // Spans of threads that couldn't be started are read by this thread.
+    for (size_t i = started; i < workers.size(); ++i) {
+        workers[0].spans.insert(workers[0].spans.end(), workers[i].spans.begin(),
+                                workers[i].spans.end());
+    }
+    RecoverThread(&workers[0]);
+
+    uint64_t errors = workers[0].errors;
+    for (size_t i = 1; i < started; ++i) {
+        pthread_join(workers[i].thread, nullptr);
+        errors += workers[i].errors;
+    }
+    pthread_mutex_destroy(&recover.mu);
+
+    if (recover.failed) {
+        ErrorAbort(state, kLibfecFailure, "%s", recover.error.c_str());
+        return StringValue(strdup(""));
+    }
+
+    // If we want to be able to recover from a situation where rewriting a corrected
+    // block doesn't guarantee the same data will be returned when re-read later, we
+    // can save a copy of corrected blocks to /cache. Note:
+    //
+    //  1. Maximum space required from /cache is the same as the maximum number of
+    //     corrupted blocks we can correct. For RS(255, 253) and a 2 GiB partition,
+    //     this would be ~16 MiB, for example.
+    //
+    //  2. To find out if this block was corrupted, call fec_get_status after each
+    //     read and check if the errors field value has increased.
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    double mib = static_cast<double>(total) * BLOCKSIZE / 1048576;
+    fprintf(stderr, "read %zu blocks on %zu threads in %.3f s (%.1f MiB/s), corrected %" PRIu64
+            " errors\n", total, started, elapsed.count(),
+            elapsed.count() > 0 ? mib / elapsed.count() : 0.0, errors);
     fprintf(stderr, "...%s image recovered successfully.\n", filename->data);
     return StringValue(strdup("t"));
 }
@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Creates the restart index described in new_data_index.h for a deflated
+// entry of an update package:
+//
+//    new_data_index [-s <span>] <package.zip> <entry> <index>
+//
+// Access points are placed at the first deflate block boundary after every
+// <span> bytes of uncompressed data (8 MiB by default). The index has to be
+// added to the package as "<entry>.idx" for the updater to use it.
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <zlib.h>
+
+#include "new_data_index.h"
+
+#define DEFAULT_SPAN (8 << 20)
+
+static uint32_t Read16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t Read32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+struct DeflatedEntry {
+    const uint8_t* data;
+    uint32_t compressed_size;
+    uint32_t uncompressed_size;
+    uint32_t crc32;
+};
+
+// Finds the compressed data of 'name' through the central directory.
+
+static bool FindEntry(const std::string& zip, const std::string& name, DeflatedEntry& entry) {
+    const uint8_t* base = reinterpret_cast<const uint8_t*>(zip.data());
+    size_t size = zip.size();
+
+    if (size < 22) {
+        return false;
+    }
+
+    size_t eocd = size - 22;
+    while (Read32(base + eocd) != 0x06054b50) {
+        if (eocd == 0 || size - eocd > 65535 + 22) {
+            fprintf(stderr, "no end of central directory found\n");
+            return false;
+        }
+        --eocd;
+    }
+
+    uint32_t count = Read16(base + eocd + 10);
+    size_t p = Read32(base + eocd + 16);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        if (p + 46 > size || Read32(base + p) != 0x02014b50) {
+            fprintf(stderr, "invalid central directory\n");
+            return false;
+        }
+
+        uint32_t name_len = Read16(base + p + 28);
+        uint32_t extra_len = Read16(base + p + 30);
+        uint32_t comment_len = Read16(base + p + 32);
+        if (p + 46 + name_len > size) {
+            return false;
+        }
+
+        if (name.compare(0, std::string::npos, reinterpret_cast<const char*>(base + p + 46),
+                         name_len) == 0) {
+            if (Read16(base + p + 10) != Z_DEFLATED) {
+                fprintf(stderr, "%s is not deflated\n", name.c_str());
+                return false;
+            }
+
+            entry.crc32 = Read32(base + p + 16);
+            entry.compressed_size = Read32(base + p + 20);
+            entry.uncompressed_size = Read32(base + p + 24);
+
+            size_t local = Read32(base + p + 42);
+            if (local + 30 > size || Read32(base + local) != 0x04034b50) {
+                return false;
+            }
+            size_t offset = local + 30 + Read16(base + local + 26) + Read16(base + local + 28);
+            if (offset > size || size - offset < entry.compressed_size) {
+                return false;
+            }
+
+            entry.data = base + offset;
+            return true;
+        }
+
+        p += 46 + name_len + extra_len + comment_len;
+    }
+
+    fprintf(stderr, "no entry %s in package\n", name.c_str());
+    return false;
+}
+
+static void AddPoint(std::string& index, uint64_t out, uint64_t in, int bits,
+        const uint8_t* window, size_t left) {
+    NewDataIndexPoint point;
+    memset(&point, 0, sizeof(point));
+    point.out = out;
+    point.in = in;
+    point.bits = bits;
+    index.append(reinterpret_cast<const char*>(&point), sizeof(point));
+
+    // The window is circular; 'left' bytes at its end are the oldest.
+    index.append(reinterpret_cast<const char*>(window) + NEW_DATA_INDEX_WINDOW - left, left);
+    index.append(reinterpret_cast<const char*>(window), NEW_DATA_INDEX_WINDOW - left);
+}
+
+// Inflates the whole entry, stopping at every deflate block boundary to
+// record an access point once 'span' bytes have been produced since the
+// last one. This follows build_index() in zran.c.
+
+static bool BuildIndex(const DeflatedEntry& entry, uint64_t span, std::string& index) {
+    std::vector<uint8_t> window(NEW_DATA_INDEX_WINDOW);
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+        return false;
+    }
+
+    NewDataIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, NEW_DATA_INDEX_MAGIC, NEW_DATA_INDEX_MAGIC_SIZE);
+    header.crc32 = entry.crc32;
+    header.compressed_size = entry.compressed_size;
+    header.uncompressed_size = entry.uncompressed_size;
+    index.assign(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    // The first point is the start of the stream, which needs no window.
+    AddPoint(index, 0, 0, 0, window.data(), NEW_DATA_INDEX_WINDOW);
+    uint32_t points = 1;
+
+    strm.next_in = const_cast<uint8_t*>(entry.data);
+    strm.avail_in = entry.compressed_size;
+    uint64_t totin = 0;
+    uint64_t totout = 0;
+    uint64_t last = 0;
+    int ret;
+
+    do {
+        if (strm.avail_out == 0) {
+            strm.next_out = window.data();
+            strm.avail_out = NEW_DATA_INDEX_WINDOW;
+        }
+
+        totin += strm.avail_in;
+        totout += strm.avail_out;
+        ret = inflate(&strm, Z_BLOCK);
+        totin -= strm.avail_in;
+        totout -= strm.avail_out;
+
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            fprintf(stderr, "inflate failed: %d\n", ret);
+            inflateEnd(&strm);
+            return false;
+        }
+
+        // At the end of a block which isn't the last one
+        if ((strm.data_type & 128) && !(strm.data_type & 64) && totout - last > span) {
+            AddPoint(index, totout, totin, strm.data_type & 7, window.data(), strm.avail_out);
+            last = totout;
+            ++points;
+        }
+    } while (ret != Z_STREAM_END);
+
+    inflateEnd(&strm);
+
+    if (totout != entry.uncompressed_size) {
+        fprintf(stderr, "size mismatch: %llu != %u\n", static_cast<unsigned long long>(totout),
+                entry.uncompressed_size);
+        return false;
+    }
+
+    memcpy(&index[offsetof(NewDataIndexHeader, point_count)], &points, sizeof(points));
+    printf("%u access points for %llu bytes\n", points, static_cast<unsigned long long>(totout));
+    return true;
+}
+
+int main(int argc, char** argv) {
+    uint64_t span = DEFAULT_SPAN;
+
+    if (argc == 6 && strcmp(argv[1], "-s") == 0) {
+        if (!android::base::ParseUint(argv[2], &span) || span < NEW_DATA_INDEX_WINDOW) {
+            fprintf(stderr, "invalid span %s\n", argv[2]);
+            return 2;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
+    if (argc != 4) {
+        printf("usage: %s [-s <span>] <package.zip> <entry> <index>\n", argv[0]);
+        return 2;
+    }
+
+    std::string zip;
+    if (!android::base::ReadFileToString(argv[1], &zip)) {
+        fprintf(stderr, "failed to read %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    DeflatedEntry entry;
+    if (!FindEntry(zip, argv[2], entry)) {
+        return 1;
+    }
+
+    std::string index;
+    if (!BuildIndex(entry, span, index)) {
+        return 1;
+    }
+
+    if (!android::base::WriteStringToFile(index, argv[3])) {
+        fprintf(stderr, "failed to write %s: %s\n", argv[3], strerror(errno));
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_NEW_DATA_INDEX_H_
+#define _UPDATER_NEW_DATA_INDEX_H_
+
+#include <stdint.h>
+
+// Restart index for the deflated new data of a block image update.
+//
+// Inflating can only start at the beginning of a deflate stream, unless
+// the decompressor is given the state it would have had at that point: the
+// bit position in the compressed data, and the last 32 KiB of output, which
+// later blocks may refer back to. The index records this state at deflate
+// block boundaries spaced roughly evenly through the stream, so the data
+// between two access points can be inflated independently of the rest (see
+// zlib's examples/zran.c).
+//
+// The index is stored in the package next to the new data, named
+// "<new data>" NEW_DATA_INDEX_SUFFIX. It is a NewDataIndexHeader followed by
+// point_count NewDataIndexPoints, each followed by its NEW_DATA_INDEX_WINDOW
+// bytes of window. The first point is always at the start of the stream.
+// All fields are little-endian.
+//
+// Use new_data_index to create the index for a package.
+
+#define NEW_DATA_INDEX_MAGIC "NDINDEX1"
+#define NEW_DATA_INDEX_MAGIC_SIZE 8
+#define NEW_DATA_INDEX_SUFFIX ".idx"
+#define NEW_DATA_INDEX_WINDOW 32768
+
+struct NewDataIndexHeader {
+    char magic[NEW_DATA_INDEX_MAGIC_SIZE];
+    uint32_t point_count;
+    uint32_t crc32;               // of the uncompressed data, as in the zip entry
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+};
+
+struct NewDataIndexPoint {
+    uint64_t out;                 // offset in the uncompressed data
+    uint64_t in;                  // offset of the first full byte in the compressed data
+    uint32_t bits;                // bits of the byte before 'in' that belong to the block
+    uint32_t reserved;
+};
+
+static_assert(sizeof(NewDataIndexHeader) == 32, "unexpected NewDataIndexHeader size");
+static_assert(sizeof(NewDataIndexPoint) == 24, "unexpected NewDataIndexPoint size");
+
+#define NEW_DATA_INDEX_POINT_SIZE (sizeof(NewDataIndexPoint) + NEW_DATA_INDEX_WINDOW)
+
+#endif  // _UPDATER_NEW_DATA_INDEX_H_
@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures how fast stash files are written and loaded in the raw and the
+// compressed format of stash_format.h:
+//
+//    stash_bench [-d <directory>] [-b <blocks per stash>] [-n <stashes>] <image>
+//
+// The stashes are cut from consecutive blocks of <image>, which should be a
+// partition image, as the compression ratio depends on the data. Each stash
+// is written the way block_image_update() writes it, to a .partial file that
+// is synced and renamed, and loaded back after its pages are dropped from
+// the page cache. The directory (/cache/recovery by default) should be on
+// the file system the stashes would be kept on.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+
+#include "stash_format.h"
+
+#define BLOCKSIZE 4096
+
+struct BenchResult {
+    size_t stashes;
+    uint64_t raw_bytes;
+    uint64_t file_bytes;
+    std::chrono::duration<double> write_time;
+    std::chrono::duration<double> load_time;
+};
+
+static bool WriteStashFile(const std::string& dir, size_t index, const uint8_t* data,
+        size_t size) {
+    std::string fn = dir + "/stash_bench." + std::to_string(index) + ".partial";
+    std::string cn = dir + "/stash_bench." + std::to_string(index);
+
+    int fd = TEMP_FAILURE_RETRY(open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600));
+    if (fd == -1) {
+        fprintf(stderr, "failed to create \"%s\": %s\n", fn.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool ok = android::base::WriteFully(fd, data, size) && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(fn.c_str(), cn.c_str()) == -1) {
+        fprintf(stderr, "failed to write \"%s\": %s\n", cn.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool LoadStashFile(const std::string& dir, size_t index, std::vector<uint8_t>& file,
+        std::vector<uint8_t>& buffer, size_t* blocks) {
+    std::string fn = dir + "/stash_bench." + std::to_string(index);
+    int fd = TEMP_FAILURE_RETRY(open(fn.c_str(), O_RDONLY));
+    struct stat sb;
+    if (fd == -1 || fstat(fd, &sb) == -1) {
+        fprintf(stderr, "failed to open \"%s\": %s\n", fn.c_str(), strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+
+    file.resize(sb.st_size);
+    bool ok = android::base::ReadFully(fd, file.data(), file.size());
+    close(fd);
+    if (!ok) {
+        fprintf(stderr, "failed to read \"%s\": %s\n", fn.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (IsCompressedStash(file.data(), file.size())) {
+        return DecompressStash(file.data(), file.size(), BLOCKSIZE, buffer, blocks);
+    }
+
+    buffer.swap(file);
+    *blocks = buffer.size() / BLOCKSIZE;
+    return true;
+}
+
+static void DropStashFile(const std::string& dir, size_t index) {
+    std::string fn = dir + "/stash_bench." + std::to_string(index);
+    int fd = TEMP_FAILURE_RETRY(open(fn.c_str(), O_RDONLY));
+    if (fd != -1) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static bool RunBench(const std::string& dir, const std::string& image, size_t blocks,
+        size_t stashes, bool compress, BenchResult& result) {
+    size_t size = blocks * BLOCKSIZE;
+    result = BenchResult();
+
+    for (size_t i = 0; i < stashes; ++i) {
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(image.data()) + i * size;
+        std::vector<uint8_t> compressed;
+
+        auto start = std::chrono::steady_clock::now();
+        const uint8_t* out = data;
+        size_t out_size = size;
+        if (compress && CompressStash(data, blocks, BLOCKSIZE, compressed)) {
+            out = compressed.data();
+            out_size = compressed.size();
+        }
+        if (!WriteStashFile(dir, i, out, out_size)) {
+            return false;
+        }
+        result.write_time += std::chrono::steady_clock::now() - start;
+        result.raw_bytes += size;
+        result.file_bytes += out_size;
+    }
+
+    for (size_t i = 0; i < stashes; ++i) {
+        DropStashFile(dir, i);
+    }
+
+    std::vector<uint8_t> file;
+    std::vector<uint8_t> buffer;
+    for (size_t i = 0; i < stashes; ++i) {
+        size_t loaded;
+        auto start = std::chrono::steady_clock::now();
+        if (!LoadStashFile(dir, i, file, buffer, &loaded)) {
+            return false;
+        }
+        result.load_time += std::chrono::steady_clock::now() - start;
+
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(image.data()) + i * size;
+        if (loaded != blocks || memcmp(buffer.data(), data, size) != 0) {
+            fprintf(stderr, "stash %zu doesn't match what was written\n", i);
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < stashes; ++i) {
+        unlink((dir + "/stash_bench." + std::to_string(i)).c_str());
+    }
+
+    result.stashes = stashes;
+    return true;
+}
+
+static void PrintResult(const char* format, const BenchResult& r) {
+    double mib = r.raw_bytes / 1048576.0;
+    printf("%-10s %6zu stashes  %8.1f MiB on disk (%5.1f%%)  write %7.1f MiB/s  "
+           "load %7.1f MiB/s\n", format, r.stashes, r.file_bytes / 1048576.0,
+           r.raw_bytes > 0 ? 100.0 * r.file_bytes / r.raw_bytes : 0.0,
+           mib / r.write_time.count(), mib / r.load_time.count());
+}
+
+int main(int argc, char** argv) {
+    std::string dir = "/cache/recovery";
+    size_t blocks = 64;
+    size_t stashes = SIZE_MAX;
+
+    int c;
+    while ((c = getopt(argc, argv, "d:b:n:")) != -1) {
+        switch (c) {
+          case 'd':
+            dir = optarg;
+            break;
+          case 'b':
+            if (!android::base::ParseUint(optarg, &blocks) || blocks == 0) {
+                fprintf(stderr, "invalid block count %s\n", optarg);
+                return 2;
+            }
+            break;
+          case 'n':
+            if (!android::base::ParseUint(optarg, &stashes) || stashes == 0) {
+                fprintf(stderr, "invalid stash count %s\n", optarg);
+                return 2;
+            }
+            break;
+          default:
+            return 2;
+        }
+    }
+
+    if (optind != argc - 1) {
+        printf("usage: %s [-d <directory>] [-b <blocks per stash>] [-n <stashes>] <image>\n",
+               argv[0]);
+        return 2;
+    }
+
+    std::string image;
+    if (!android::base::ReadFileToString(argv[optind], &image)) {
+        fprintf(stderr, "failed to read %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    stashes = std::min(stashes, image.size() / (blocks * BLOCKSIZE));
+    if (stashes == 0) {
+        fprintf(stderr, "%s is smaller than one stash\n", argv[optind]);
+        return 1;
+    }
+
+    BenchResult raw;
+    BenchResult compressed;
+    if (!RunBench(dir, image, blocks, stashes, false, raw) ||
+            !RunBench(dir, image, blocks, stashes, true, compressed)) {
+        return 1;
+    }
+
+    PrintResult("raw", raw);
+    PrintResult("compressed", compressed);
+    return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "stash_format.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <zlib.h>
+
+bool IsCompressedStash(const uint8_t* data, size_t size) {
+    if (size < sizeof(CompressedStashHeader) ||
+            memcmp(data, COMPRESSED_STASH_MAGIC, COMPRESSED_STASH_MAGIC_SIZE) != 0) {
+        return false;
+    }
+
+    CompressedStashHeader header;
+    memcpy(&header, data, sizeof(header));
+    return header.compressed_size == size - sizeof(header);
+}
+
+bool CompressStash(const uint8_t* data, size_t blocks, size_t blocksize,
+                   std::vector<uint8_t>& out) {
+    size_t size = blocks * blocksize;
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    // Stashes are written and read back within one update; speed matters more
+    // than the last few percent of space.
+    if (deflateInit2(&strm, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+
+    out.resize(sizeof(CompressedStashHeader) + deflateBound(&strm, size));
+    strm.next_in = const_cast<uint8_t*>(data);
+    strm.avail_in = size;
+    strm.next_out = out.data() + sizeof(CompressedStashHeader);
+    strm.avail_out = out.size() - sizeof(CompressedStashHeader);
+
+    int ret = deflate(&strm, Z_FINISH);
+    size_t compressed_size = strm.total_out;
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || sizeof(CompressedStashHeader) + compressed_size >= size) {
+        return false;
+    }
+
+    CompressedStashHeader header;
+    memcpy(header.magic, COMPRESSED_STASH_MAGIC, COMPRESSED_STASH_MAGIC_SIZE);
+    header.blocks = blocks;
+    header.compressed_size = compressed_size;
+    memcpy(out.data(), &header, sizeof(header));
+    out.resize(sizeof(header) + compressed_size);
+    return true;
+}
+
+bool DecompressStash(const uint8_t* data, size_t size, size_t blocksize,
+                     std::vector<uint8_t>& buffer, size_t* blocks) {
+    if (!IsCompressedStash(data, size)) {
+        return false;
+    }
+
+    CompressedStashHeader header;
+    memcpy(&header, data, sizeof(header));
+    size_t expected = static_cast<size_t>(header.blocks) * blocksize;
+
+    // Deflate can't compress more than 1032:1, so a larger size is corrupt
+    // and shouldn't be allocated.
+    if (header.blocks == 0 || expected / blocksize != header.blocks ||
+            expected / 1032 > header.compressed_size) {
+        fprintf(stderr, "invalid compressed stash: %u blocks in %u bytes\n", header.blocks,
+                header.compressed_size);
+        return false;
+    }
+
+    if (buffer.size() < expected) {
+        buffer.resize(expected);
+    }
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+        return false;
+    }
+
+    strm.next_in = const_cast<uint8_t*>(data + sizeof(header));
+    strm.avail_in = header.compressed_size;
+    strm.next_out = buffer.data();
+    strm.avail_out = expected;
+
+    int ret = inflate(&strm, Z_FINISH);
+    size_t produced = strm.total_out;
+    size_t unused = strm.avail_in;
+    inflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || produced != expected || unused != 0) {
+        fprintf(stderr, "invalid compressed stash: inflate returned %d after %zu of %zu bytes\n",
+                ret, produced, expected);
+        return false;
+    }
+
+    *blocks = header.blocks;
+    return true;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_STASH_FORMAT_H_
+#define _UPDATER_STASH_FORMAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Contents of stash files. A stash file either holds the stashed blocks as
+// they are, or a CompressedStashHeader followed by the blocks compressed as
+// a raw deflate stream. Raw stashes are always a multiple of the block size
+// long; a compressed stash is only written if it's smaller than the raw one.
+// All fields are little-endian.
+
+#define COMPRESSED_STASH_MAGIC "STASHZ01"
+#define COMPRESSED_STASH_MAGIC_SIZE 8
+
+struct CompressedStashHeader {
+    char magic[COMPRESSED_STASH_MAGIC_SIZE];
+    uint32_t blocks;
+    uint32_t compressed_size;     // of the deflate stream after the header
+};
+
+static_assert(sizeof(CompressedStashHeader) == 16, "unexpected CompressedStashHeader size");
+
+// Returns true if the 'size' bytes of a stash file at 'data' are in the
+// compressed format.
+bool IsCompressedStash(const uint8_t* data, size_t size);
+
+// Compresses 'blocks' blocks of 'blocksize' bytes at 'data' into 'out',
+// header included. Returns false if that doesn't save any space, in which
+// case the blocks should be stashed as they are.
+bool CompressStash(const uint8_t* data, size_t blocks, size_t blocksize,
+                   std::vector<uint8_t>& out);
+
+// Decompresses a stash file in the compressed format into 'buffer', which
+// is grown as needed, and sets 'blocks'. Returns false if it's malformed.
+bool DecompressStash(const uint8_t* data, size_t size, size_t blocksize,
+                     std::vector<uint8_t>& buffer, size_t* blocks);
+
+#endif  // _UPDATER_STASH_FORMAT_H_
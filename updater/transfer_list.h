@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_TRANSFER_LIST_H_
+#define _UPDATER_TRANSFER_LIST_H_
+
+#include <stdint.h>
+#include <string.h>
+
+// Binary encoding of a block image transfer list.
+//
+// The binary list carries exactly the commands of the text list, but with
+// every argument decoded ahead of time: ranges are stored as integer pairs,
+// hashes as raw digests and numbers as integers. The updater validates the
+// tables once and then executes the commands in place, without copying the
+// list or parsing any text.
+//
+// All fields are little-endian. The file starts with a TransferListHeader,
+// followed by these tables:
+//
+//    TransferListCommand  commands[command_count];
+//    TransferListArg      args[arg_count];
+//    uint32_t             ranges[range_words];
+//    uint8_t              hashes[hash_count][TRANSFER_LIST_HASH_SIZE];
+//    char                 strings[string_bytes];
+//
+// Each command owns a run of consecutive arguments, which correspond to the
+// tokens following the command name in the text format. A range argument
+// refers to a record in the range table made of the number of block ranges,
+// the total number of blocks and the ranges themselves as start/end pairs.
+//
+// Use transfer_list_convert to create a binary list from a text list.
+
+#define TRANSFER_LIST_MAGIC "BTLIST\0\0"
+#define TRANSFER_LIST_MAGIC_SIZE 8
+#define TRANSFER_LIST_FORMAT 1
+#define TRANSFER_LIST_HASH_SIZE 20
+
+// Command opcodes, in the order of kTransferListOps.
+enum {
+    TL_OP_BSDIFF = 0,
+    TL_OP_ERASE,
+    TL_OP_FREE,
+    TL_OP_IMGDIFF,
+    TL_OP_MOVE,
+    TL_OP_NEW,
+    TL_OP_STASH,
+    TL_OP_ZERO,
+    TL_OP_COUNT
+};
+
+static const char* const kTransferListOps[TL_OP_COUNT] = {
+    "bsdiff", "erase", "free", "imgdiff", "move", "new", "stash", "zero"
+};
+
+// Argument types. The meaning of the a/b/c fields of a TransferListArg
+// depends on the type.
+enum {
+    TL_ARG_NONE = 0,        // "-"
+    TL_ARG_RANGE,           // a: offset of the range record in ranges[]
+    TL_ARG_HASH,            // a: index into hashes[]
+    TL_ARG_UINT,            // a: low 32 bits, b: high 32 bits
+    TL_ARG_STRING,          // a: offset into strings[], b: length
+    TL_ARG_STASH_HASH,      // <id>:<range> with a hash id; a: as TL_ARG_HASH, c: as TL_ARG_RANGE
+    TL_ARG_STASH_STRING,    // <id>:<range> with any other id; a, b: as TL_ARG_STRING, c: as TL_ARG_RANGE
+    TL_ARG_COUNT
+};
+
+struct TransferListHeader {
+    char magic[TRANSFER_LIST_MAGIC_SIZE];
+    uint32_t format;            // TRANSFER_LIST_FORMAT
+    uint32_t version;           // transfer list version (1-4)
+    uint32_t total_blocks;
+    uint32_t stash_entries;     // version 2+
+    uint32_t stash_max_blocks;  // version 2+
+    uint32_t command_count;
+    uint32_t arg_count;
+    uint32_t range_words;
+    uint32_t hash_count;
+    uint32_t string_bytes;
+};
+
+struct TransferListCommand {
+    uint16_t op;
+    uint16_t arg_count;
+    uint32_t first_arg;
+};
+
+struct TransferListArg {
+    uint32_t type;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+};
+
+static_assert(sizeof(TransferListHeader) == 48, "unexpected TransferListHeader size");
+static_assert(sizeof(TransferListCommand) == 8, "unexpected TransferListCommand size");
+static_assert(sizeof(TransferListArg) == 16, "unexpected TransferListArg size");
+
+static inline bool IsBinaryTransferList(const void* data, size_t size) {
+    return size >= sizeof(TransferListHeader) &&
+           memcmp(data, TRANSFER_LIST_MAGIC, TRANSFER_LIST_MAGIC_SIZE) == 0;
+}
+
+#endif  // _UPDATER_TRANSFER_LIST_H_
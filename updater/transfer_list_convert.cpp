@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Converts block image transfer lists between the text format and the
+// binary encoding described in transfer_list.h.
+//
+//    transfer_list_convert <input> <output>
+//      - convert a text list to binary, or a binary list back to text
+//
+//    transfer_list_convert -b <list> [<iterations>]
+//      - compare the time needed to parse the arguments of every command
+//        in the text and the binary encoding of the list
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+
+#include "transfer_list.h"
+#include "transfer_list_encoder.h"
+
+// Views of the tables of an encoded list. Only the table sizes are checked;
+// the updater validates the contents before it uses a list.
+
+struct TransferListView {
+    const TransferListHeader* header;
+    const TransferListCommand* commands;
+    const TransferListArg* args;
+    const uint32_t* ranges;
+    const uint8_t* hashes;
+    const char* strings;
+};
+
+static bool CheckTableSizes(const std::string& data) {
+    const TransferListHeader* h = reinterpret_cast<const TransferListHeader*>(data.data());
+    uint64_t size = sizeof(TransferListHeader) +
+                    static_cast<uint64_t>(h->command_count) * sizeof(TransferListCommand) +
+                    static_cast<uint64_t>(h->arg_count) * sizeof(TransferListArg) +
+                    static_cast<uint64_t>(h->range_words) * sizeof(uint32_t) +
+                    static_cast<uint64_t>(h->hash_count) * TRANSFER_LIST_HASH_SIZE +
+                    h->string_bytes;
+    if (h->format != TRANSFER_LIST_FORMAT || size > data.size()) {
+        fprintf(stderr, "invalid binary transfer list\n");
+        return false;
+    }
+    return true;
+}
+
+static TransferListView MapTransferList(const std::string& data) {
+    TransferListView v;
+    const char* p = data.data();
+    v.header = reinterpret_cast<const TransferListHeader*>(p);
+    p += sizeof(TransferListHeader);
+    v.commands = reinterpret_cast<const TransferListCommand*>(p);
+    p += v.header->command_count * sizeof(TransferListCommand);
+    v.args = reinterpret_cast<const TransferListArg*>(p);
+    p += v.header->arg_count * sizeof(TransferListArg);
+    v.ranges = reinterpret_cast<const uint32_t*>(p);
+    p += v.header->range_words * sizeof(uint32_t);
+    v.hashes = reinterpret_cast<const uint8_t*>(p);
+    p += v.header->hash_count * TRANSFER_LIST_HASH_SIZE;
+    v.strings = p;
+    return v;
+}
+
+static std::string HashText(const TransferListView& v, uint32_t index) {
+    static const char* hex = "0123456789abcdef";
+    std::string s;
+    const uint8_t* h = v.hashes + index * TRANSFER_LIST_HASH_SIZE;
+    for (size_t i = 0; i < TRANSFER_LIST_HASH_SIZE; ++i) {
+        s += hex[h[i] >> 4];
+        s += hex[h[i] & 0xf];
+    }
+    return s;
+}
+
+static std::string RangeText(const TransferListView& v, uint32_t offset) {
+    const uint32_t* r = v.ranges + offset;
+    std::string s = std::to_string(r[0] * 2);
+    for (uint32_t i = 0; i < r[0] * 2; ++i) {
+        s += "," + std::to_string(r[2 + i]);
+    }
+    return s;
+}
+
+static std::string ArgText(const TransferListView& v, const TransferListArg& arg) {
+    switch (arg.type) {
+        case TL_ARG_NONE:
+            return "-";
+        case TL_ARG_RANGE:
+            return RangeText(v, arg.a);
+        case TL_ARG_HASH:
+            return HashText(v, arg.a);
+        case TL_ARG_UINT:
+            return std::to_string((static_cast<uint64_t>(arg.b) << 32) | arg.a);
+        case TL_ARG_STRING:
+            return std::string(v.strings + arg.a, arg.b);
+        case TL_ARG_STASH_HASH:
+            return HashText(v, arg.a) + ":" + RangeText(v, arg.c);
+        case TL_ARG_STASH_STRING:
+            return std::string(v.strings + arg.a, arg.b) + ":" + RangeText(v, arg.c);
+    }
+    return "";
+}
+
+static std::string DecodeTransferList(const std::string& data) {
+    TransferListView v = MapTransferList(data);
+    std::string out = std::to_string(v.header->version) + "\n" +
+                      std::to_string(v.header->total_blocks) + "\n";
+    if (v.header->version >= 2) {
+        out += std::to_string(v.header->stash_entries) + "\n" +
+               std::to_string(v.header->stash_max_blocks) + "\n";
+    }
+
+    for (uint32_t i = 0; i < v.header->command_count; ++i) {
+        const TransferListCommand& cmd = v.commands[i];
+        out += kTransferListOps[cmd.op];
+        for (uint32_t j = 0; j < cmd.arg_count; ++j) {
+            out += " " + ArgText(v, v.args[cmd.first_arg + j]);
+        }
+        out += "\n";
+    }
+
+    return out;
+}
+
+// Mirrors what the updater does with a text list: split it into lines and
+// tokens, and convert every range into a vector of block numbers.
+
+static size_t ParseTextRanges(const std::string& text) {
+    size_t blocks = 0;
+    std::vector<std::string> lines = android::base::Split(text, "\n");
+    for (const auto& line : lines) {
+        std::vector<std::string> tokens = android::base::Split(line, " ");
+        for (size_t i = 1; i < tokens.size(); ++i) {
+            size_t colon = tokens[i].find(':');
+            const std::string range = colon == std::string::npos ? tokens[i] :
+                                      tokens[i].substr(colon + 1);
+            if (range.find(',') == std::string::npos) {
+                continue;
+            }
+
+            std::vector<std::string> pieces = android::base::Split(range, ",");
+            std::vector<size_t> pos(pieces.size() - 1);
+            for (size_t j = 1; j < pieces.size(); ++j) {
+                android::base::ParseUint(pieces[j].c_str(), &pos[j - 1]);
+            }
+            for (size_t j = 0; j + 1 < pos.size(); j += 2) {
+                blocks += pos[j + 1] - pos[j];
+            }
+        }
+    }
+    return blocks;
+}
+
+// The same for a binary list, which only needs the ranges copied out.
+
+static size_t ParseBinaryRanges(const std::string& data) {
+    size_t blocks = 0;
+    TransferListView v = MapTransferList(data);
+    for (uint32_t i = 0; i < v.header->command_count; ++i) {
+        const TransferListCommand& cmd = v.commands[i];
+        for (uint32_t j = 0; j < cmd.arg_count; ++j) {
+            const TransferListArg& arg = v.args[cmd.first_arg + j];
+            uint32_t offset;
+            if (arg.type == TL_ARG_RANGE) {
+                offset = arg.a;
+            } else if (arg.type == TL_ARG_STASH_HASH || arg.type == TL_ARG_STASH_STRING) {
+                offset = arg.c;
+            } else {
+                continue;
+            }
+
+            const uint32_t* r = v.ranges + offset;
+            std::vector<size_t> pos(r + 2, r + 2 + r[0] * 2);
+            for (size_t k = 0; k + 1 < pos.size(); k += 2) {
+                blocks += pos[k + 1] - pos[k];
+            }
+        }
+    }
+    return blocks;
+}
+
+template <typename F>
+static double TimeMs(F f, const std::string& data, int iterations, size_t* blocks) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        *blocks = f(data);
+    }
+    std::chrono::duration<double, std::milli> d = std::chrono::steady_clock::now() - start;
+    return d.count() / iterations;
+}
+
+static int Benchmark(const char* fn, int iterations) {
+    std::string text;
+    if (!android::base::ReadFileToString(fn, &text)) {
+        fprintf(stderr, "failed to read %s: %s\n", fn, strerror(errno));
+        return 1;
+    }
+
+    std::string binary;
+    if (IsBinaryTransferList(text.data(), text.size())) {
+        if (!CheckTableSizes(text)) {
+            return 1;
+        }
+        binary = text;
+        text = DecodeTransferList(binary);
+    } else if (!EncodeTransferList(text, binary)) {
+        return 1;
+    }
+
+    size_t text_blocks, binary_blocks;
+    double text_ms = TimeMs(ParseTextRanges, text, iterations, &text_blocks);
+    double binary_ms = TimeMs(ParseBinaryRanges, binary, iterations, &binary_blocks);
+    uint32_t commands = MapTransferList(binary).header->command_count;
+
+    printf("%u commands, %zu range blocks\n", commands, text_blocks);
+    printf("text:   %zu bytes, %.3f ms (%.0f ns/command)\n", text.size(), text_ms,
+           text_ms * 1e6 / commands);
+    printf("binary: %zu bytes, %.3f ms (%.0f ns/command)\n", binary.size(), binary_ms,
+           binary_ms * 1e6 / commands);
+
+    if (text_blocks != binary_blocks) {
+        fprintf(stderr, "range mismatch: %zu != %zu\n", text_blocks, binary_blocks);
+        return 1;
+    }
+    return 0;
+}
+
+static int Usage(const char* name) {
+    printf("usage: %s <input> <output>\n"
+           "       %s -b <list> [<iterations>]\n", name, name);
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
+        int iterations = 10;
+        if (argc > 4 || (argc == 4 && !android::base::ParseInt(argv[3], &iterations, 1))) {
+            return Usage(argv[0]);
+        }
+        return Benchmark(argv[2], iterations);
+    }
+
+    if (argc != 3) {
+        return Usage(argv[0]);
+    }
+
+    std::string in;
+    if (!android::base::ReadFileToString(argv[1], &in)) {
+        fprintf(stderr, "failed to read %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+
+    std::string out;
+    if (IsBinaryTransferList(in.data(), in.size())) {
+        if (!CheckTableSizes(in)) {
+            return 1;
+        }
+        out = DecodeTransferList(in);
+    } else if (!EncodeTransferList(in, out)) {
+        fprintf(stderr, "failed to convert %s\n", argv[1]);
+        return 1;
+    }
+
+    if (!android::base::WriteStringToFile(out, argv[2])) {
+        fprintf(stderr, "failed to write %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+
+#include "transfer_list.h"
+#include "transfer_list_encoder.h"
+
+struct BinaryTransferList {
+    TransferListHeader header;
+    std::vector<TransferListCommand> commands;
+    std::vector<TransferListArg> args;
+    std::vector<uint32_t> ranges;
+    std::vector<uint8_t> hashes;
+    std::string strings;
+    std::map<std::string, uint32_t> hash_index;
+};
+
+static bool IsHash(const std::string& s) {
+    if (s.size() != TRANSFER_LIST_HASH_SIZE * 2) {
+        return false;
+    }
+    for (char c : s) {
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool IsUint(const std::string& s, uint64_t* value) {
+    if (s.empty() || (s[0] == '0' && s.size() > 1)) {
+        return false;
+    }
+    for (char c : s) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+    }
+    return android::base::ParseUint(s.c_str(), value);
+}
+
+// Parses a range with the same rules as the updater and appends its record
+// to the range table. Returns the offset of the record, or -1.
+
+static int64_t AddRange(BinaryTransferList& bl, const std::string& text) {
+    std::vector<std::string> pieces = android::base::Split(text, ",");
+    uint32_t num;
+    if (pieces.size() < 3 || !android::base::ParseUint(pieces[0].c_str(), &num) ||
+            num == 0 || num % 2 != 0 || num != pieces.size() - 1) {
+        return -1;
+    }
+
+    size_t offset = bl.ranges.size();
+    bl.ranges.push_back(num / 2);
+    bl.ranges.push_back(0);
+
+    uint64_t size = 0;
+    for (size_t i = 1; i < pieces.size(); i += 2) {
+        uint32_t first, last;
+        if (!android::base::ParseUint(pieces[i].c_str(), &first, static_cast<uint32_t>(INT_MAX)) ||
+                !android::base::ParseUint(pieces[i + 1].c_str(), &last,
+                                          static_cast<uint32_t>(INT_MAX)) ||
+                first >= last) {
+            bl.ranges.resize(offset);
+            return -1;
+        }
+        bl.ranges.push_back(first);
+        bl.ranges.push_back(last);
+        size += last - first;
+    }
+
+    if (size > UINT32_MAX) {
+        bl.ranges.resize(offset);
+        return -1;
+    }
+    bl.ranges[offset + 1] = size;
+
+    return offset;
+}
+
+static uint32_t AddHash(BinaryTransferList& bl, const std::string& hex) {
+    auto it = bl.hash_index.find(hex);
+    if (it != bl.hash_index.end()) {
+        return it->second;
+    }
+
+    uint32_t index = bl.hash_index.size();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        bl.hashes.push_back(strtoul(hex.substr(i, 2).c_str(), nullptr, 16));
+    }
+    bl.hash_index[hex] = index;
+    return index;
+}
+
+static void AddString(BinaryTransferList& bl, const std::string& s, TransferListArg& arg) {
+    arg.a = bl.strings.size();
+    arg.b = s.size();
+    bl.strings += s;
+}
+
+// Encodes one token following the command name. The type is derived from
+// the token itself, so the updater gets the same text back for any token.
+
+static bool AddArg(BinaryTransferList& bl, const std::string& token) {
+    TransferListArg arg = {};
+    uint64_t value;
+
+    size_t colon = token.find(':');
+    if (colon != std::string::npos) {
+        std::string id = token.substr(0, colon);
+        int64_t range = AddRange(bl, token.substr(colon + 1));
+        if (range == -1) {
+            fprintf(stderr, "invalid stash range in \"%s\"\n", token.c_str());
+            return false;
+        }
+        if (IsHash(id)) {
+            arg.type = TL_ARG_STASH_HASH;
+            arg.a = AddHash(bl, id);
+        } else {
+            arg.type = TL_ARG_STASH_STRING;
+            AddString(bl, id, arg);
+        }
+        arg.c = range;
+    } else if (token == "-") {
+        arg.type = TL_ARG_NONE;
+    } else if (IsHash(token)) {
+        arg.type = TL_ARG_HASH;
+        arg.a = AddHash(bl, token);
+    } else if (IsUint(token, &value)) {
+        arg.type = TL_ARG_UINT;
+        arg.a = value & 0xffffffff;
+        arg.b = value >> 32;
+    } else {
+        int64_t range = token.find(',') != std::string::npos ? AddRange(bl, token) : -1;
+        if (range != -1) {
+            arg.type = TL_ARG_RANGE;
+            arg.a = range;
+        } else {
+            arg.type = TL_ARG_STRING;
+            AddString(bl, token, arg);
+        }
+    }
+
+    bl.args.push_back(arg);
+    return true;
+}
+
+static bool ParseHeaderLine(const std::vector<std::string>& lines, size_t i, uint32_t* value) {
+    if (i >= lines.size() || !android::base::ParseUint(lines[i].c_str(), value)) {
+        fprintf(stderr, "invalid header line %zu\n", i + 1);
+        return false;
+    }
+    return true;
+}
+
+bool EncodeTransferList(const std::string& text, std::string& out) {
+    BinaryTransferList bl;
+    memset(&bl.header, 0, sizeof(bl.header));
+    memcpy(bl.header.magic, TRANSFER_LIST_MAGIC, TRANSFER_LIST_MAGIC_SIZE);
+    bl.header.format = TRANSFER_LIST_FORMAT;
+
+    std::vector<std::string> lines = android::base::Split(text, "\n");
+    if (!ParseHeaderLine(lines, 0, &bl.header.version) ||
+            !ParseHeaderLine(lines, 1, &bl.header.total_blocks)) {
+        return false;
+    }
+
+    if (bl.header.version < 1 || bl.header.version > 4) {
+        fprintf(stderr, "unsupported transfer list version %u\n", bl.header.version);
+        return false;
+    }
+
+    size_t start = 2;
+    if (bl.header.version >= 2) {
+        if (!ParseHeaderLine(lines, 2, &bl.header.stash_entries) ||
+                !ParseHeaderLine(lines, 3, &bl.header.stash_max_blocks)) {
+            return false;
+        }
+        start += 2;
+    }
+
+    for (size_t i = start; i < lines.size(); ++i) {
+        if (lines[i].empty()) {
+            continue;
+        }
+
+        std::vector<std::string> tokens = android::base::Split(lines[i], " ");
+        TransferListCommand cmd = {};
+        while (cmd.op < TL_OP_COUNT && tokens[0] != kTransferListOps[cmd.op]) {
+            cmd.op++;
+        }
+        if (cmd.op == TL_OP_COUNT || tokens.size() - 1 > UINT16_MAX) {
+            fprintf(stderr, "unexpected command on line %zu [%s]\n", i + 1, lines[i].c_str());
+            return false;
+        }
+
+        cmd.first_arg = bl.args.size();
+        cmd.arg_count = tokens.size() - 1;
+        for (size_t j = 1; j < tokens.size(); ++j) {
+            if (!AddArg(bl, tokens[j])) {
+                fprintf(stderr, "failed to encode line %zu\n", i + 1);
+                return false;
+            }
+        }
+        bl.commands.push_back(cmd);
+    }
+
+    bl.header.command_count = bl.commands.size();
+    bl.header.arg_count = bl.args.size();
+    bl.header.range_words = bl.ranges.size();
+    bl.header.hash_count = bl.hash_index.size();
+    bl.header.string_bytes = bl.strings.size();
+
+    out.assign(reinterpret_cast<const char*>(&bl.header), sizeof(bl.header));
+    out.append(reinterpret_cast<const char*>(bl.commands.data()),
+               bl.commands.size() * sizeof(TransferListCommand));
+    out.append(reinterpret_cast<const char*>(bl.args.data()),
+               bl.args.size() * sizeof(TransferListArg));
+    out.append(reinterpret_cast<const char*>(bl.ranges.data()),
+               bl.ranges.size() * sizeof(uint32_t));
+    out.append(reinterpret_cast<const char*>(bl.hashes.data()), bl.hashes.size());
+    out.append(bl.strings);
+
+    return true;
+}
@@ -0,0 +1,27 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_TRANSFER_LIST_ENCODER_H_
+#define _UPDATER_TRANSFER_LIST_ENCODER_H_
+
+#include <string>
+
+// Encodes the text transfer list 'text' in the binary format of
+// transfer_list.h into 'out'. Returns false, after printing the reason, if
+// the list is malformed.
+bool EncodeTransferList(const std::string& text, std::string& out);
+
+#endif  // _UPDATER_TRANSFER_LIST_ENCODER_H_
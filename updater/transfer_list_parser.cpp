@@ -0,0 +1,543 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+#include "print_sha1.h"
+#include "transfer_list_parser.h"
+
+bool ParseRange(const std::string& range_text, RangeSet& rs) {
+
+    std::vector<std::string> pieces = android::base::Split(range_text, ",");
+    if (pieces.size() < 3) {
+        return false;
+    }
+
+    size_t num;
+    if (!android::base::ParseUint(pieces[0].c_str(), &num, static_cast<size_t>(INT_MAX))) {
+        return false;
+    }
+
+    if (num == 0 || num % 2) {
+        return false; // must be even
+    } else if (num != pieces.size() - 1) {
+        return false;
+    }
+
+    rs.pos.resize(num);
+    rs.count = num / 2;
+    rs.size = 0;
+
+    for (size_t i = 0; i < num; i += 2) {
+        if (!android::base::ParseUint(pieces[i+1].c_str(), &rs.pos[i],
+                                      static_cast<size_t>(INT_MAX))) {
+            return false;
+        }
+
+        if (!android::base::ParseUint(pieces[i+2].c_str(), &rs.pos[i+1],
+                                      static_cast<size_t>(INT_MAX))) {
+            return false;
+        }
+
+        if (rs.pos[i] >= rs.pos[i+1]) {
+            return false; // empty or negative range
+        }
+
+        size_t sz = rs.pos[i+1] - rs.pos[i];
+        if (rs.size > SIZE_MAX - sz) {
+            return false; // overflow
+        }
+
+        rs.size += sz;
+    }
+
+    return true;
+}
+
+void parse_range(const std::string& range_text, RangeSet& rs) {
+    if (!ParseRange(range_text, rs)) {
+        fprintf(stderr, "failed to parse range '%s'\n", range_text.c_str());
+        exit(1);
+    }
+}
+
+bool range_overlaps(const RangeSet& r1, const RangeSet& r2) {
+    for (size_t i = 0; i < r1.count; ++i) {
+        size_t r1_0 = r1.pos[i * 2];
+        size_t r1_1 = r1.pos[i * 2 + 1];
+
+        for (size_t j = 0; j < r2.count; ++j) {
+            size_t r2_0 = r2.pos[j * 2];
+            size_t r2_1 = r2.pos[j * 2 + 1];
+
+            if (!(r2_0 >= r1_1 || r1_0 >= r2_1)) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+size_t ExtentEnd(const RangeSet& rs, size_t i) {
+    while (++i < rs.count && rs.pos[i * 2] == rs.pos[i * 2 - 1]) {
+    }
+    return i;
+}
+
+static bool ValidateBinaryRange(const TransferListHeader* header, const uint32_t* ranges,
+        uint32_t offset) {
+    if (offset > header->range_words || header->range_words - offset < 2) {
+        return false;
+    }
+
+    const uint32_t* r = ranges + offset;
+    uint32_t count = r[0];
+    if (count == 0 || count > (header->range_words - offset - 2) / 2) {
+        return false;
+    }
+
+    uint64_t size = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t first = r[2 + i * 2];
+        uint32_t last = r[2 + i * 2 + 1];
+        if (first >= last || last > INT_MAX) {
+            return false;
+        }
+        size += last - first;
+    }
+
+    return size == r[1];
+}
+
+// Checks the tables of a binary transfer list and every reference between
+// them, so the commands can be executed without further bounds checks.
+
+static bool LoadBinaryTransferList(const uint8_t* data, size_t size, TransferList& tl) {
+    if (reinterpret_cast<uintptr_t>(data) % sizeof(uint32_t) != 0) {
+        tl.aligned.resize((size + sizeof(uint32_t) - 1) / sizeof(uint32_t));
+        memcpy(tl.aligned.data(), data, size);
+        data = reinterpret_cast<const uint8_t*>(tl.aligned.data());
+    }
+
+    const TransferListHeader* header = reinterpret_cast<const TransferListHeader*>(data);
+    if (header->format != TRANSFER_LIST_FORMAT) {
+        fprintf(stderr, "unsupported binary transfer list format %u\n", header->format);
+        return false;
+    }
+
+    if (header->total_blocks > INT_MAX || header->stash_entries > INT_MAX ||
+            header->stash_max_blocks > INT_MAX) {
+        return false;
+    }
+
+    uint64_t offset = sizeof(TransferListHeader);
+    uint64_t commands = offset;
+    offset += static_cast<uint64_t>(header->command_count) * sizeof(TransferListCommand);
+    uint64_t args = offset;
+    offset += static_cast<uint64_t>(header->arg_count) * sizeof(TransferListArg);
+    uint64_t ranges = offset;
+    offset += static_cast<uint64_t>(header->range_words) * sizeof(uint32_t);
+    uint64_t hashes = offset;
+    offset += static_cast<uint64_t>(header->hash_count) * TRANSFER_LIST_HASH_SIZE;
+    uint64_t strings = offset;
+    offset += header->string_bytes;
+    if (offset > size) {
+        fprintf(stderr, "binary transfer list is truncated\n");
+        return false;
+    }
+
+    tl.version = header->version;
+    tl.total_blocks = header->total_blocks;
+    tl.stash_entries = header->stash_entries;
+    tl.stash_max_blocks = header->stash_max_blocks;
+    tl.start = 0;
+    tl.end = header->command_count;
+    tl.header = header;
+    tl.commands = reinterpret_cast<const TransferListCommand*>(data + commands);
+    tl.args = reinterpret_cast<const TransferListArg*>(data + args);
+    tl.ranges = reinterpret_cast<const uint32_t*>(data + ranges);
+    tl.hashes = data + hashes;
+    tl.strings = reinterpret_cast<const char*>(data + strings);
+
+    for (uint32_t i = 0; i < header->command_count; ++i) {
+        const TransferListCommand& cmd = tl.commands[i];
+        if (cmd.op >= TL_OP_COUNT || cmd.first_arg > header->arg_count ||
+                header->arg_count - cmd.first_arg < cmd.arg_count) {
+            fprintf(stderr, "invalid command %u in binary transfer list\n", i);
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < header->arg_count; ++i) {
+        const TransferListArg& arg = tl.args[i];
+        bool valid = false;
+        switch (arg.type) {
+            case TL_ARG_NONE:
+            case TL_ARG_UINT:
+                valid = true;
+                break;
+            case TL_ARG_RANGE:
+                valid = ValidateBinaryRange(header, tl.ranges, arg.a);
+                break;
+            case TL_ARG_HASH:
+                valid = arg.a < header->hash_count;
+                break;
+            case TL_ARG_STRING:
+                valid = arg.a <= header->string_bytes && header->string_bytes - arg.a >= arg.b;
+                break;
+            case TL_ARG_STASH_HASH:
+                valid = arg.a < header->hash_count &&
+                        ValidateBinaryRange(header, tl.ranges, arg.c);
+                break;
+            case TL_ARG_STASH_STRING:
+                valid = arg.a <= header->string_bytes && header->string_bytes - arg.a >= arg.b &&
+                        ValidateBinaryRange(header, tl.ranges, arg.c);
+                break;
+        }
+
+        if (!valid) {
+            fprintf(stderr, "invalid argument %u in binary transfer list\n", i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int ParseTransferList(const char* data, size_t size, TransferList& tl, std::string& error) {
+    if (IsBinaryTransferList(data, size)) {
+        if (!LoadBinaryTransferList(reinterpret_cast<const uint8_t*>(data), size, tl)) {
+            error = "invalid binary transfer list";
+            return -1;
+        }
+
+        if (tl.version < 1 || tl.version > 4) {
+            error = android::base::StringPrintf("unexpected transfer list version [%d]",
+                                                tl.version);
+            return -2;
+        }
+
+        return 0;
+    }
+
+    // Copy all the lines in data into std::string for processing.
+    const std::string transfer_list(data, size);
+    tl.lines = android::base::Split(transfer_list, "\n");
+    if (tl.lines.size() < 2) {
+        error = android::base::StringPrintf("too few lines in the transfer list [%zd]",
+                                            tl.lines.size());
+        return -1;
+    }
+
+    // First line in transfer list is the version number
+    if (!android::base::ParseInt(tl.lines[0].c_str(), &tl.version, 1, 4)) {
+        error = android::base::StringPrintf("unexpected transfer list version [%s]",
+                                            tl.lines[0].c_str());
+        return -2;
+    }
+
+    // Second line in transfer list is the total number of blocks we expect to write
+    if (!android::base::ParseInt(tl.lines[1].c_str(), &tl.total_blocks, 0)) {
+        error = android::base::StringPrintf("unexpected block count [%s]", tl.lines[1].c_str());
+        return -1;
+    }
+
+    tl.start = 2;
+    tl.end = tl.lines.size();
+
+    if (tl.version >= 2 && tl.total_blocks != 0) {
+        if (tl.lines.size() < 4) {
+            error = android::base::StringPrintf("too few lines in the transfer list [%zu]",
+                                                tl.lines.size());
+            return -1;
+        }
+
+        // Third line is how many stash entries are needed simultaneously
+        if (!android::base::ParseInt(tl.lines[2].c_str(), &tl.stash_entries, 0)) {
+            tl.stash_entries = -1;
+        }
+
+        // Fourth line is the maximum number of blocks that will be stashed simultaneously
+        if (!android::base::ParseInt(tl.lines[3].c_str(), &tl.stash_max_blocks, 0)) {
+            error = android::base::StringPrintf("unexpected maximum stash blocks [%s]",
+                                                tl.lines[3].c_str());
+            return -1;
+        }
+
+        tl.start += 2;
+    }
+
+    return 0;
+}
+
+bool LoadCommand(const TransferList& tl, size_t index, TransferCommand& cmd) {
+    cmd.tl = &tl;
+    cmd.cpos = 1;
+    cmd.index = index;
+
+    if (tl.header == nullptr) {
+        const std::string& line = tl.lines[index];
+        if (line.empty()) {
+            return false;
+        }
+
+        cmd.tokens = android::base::Split(line, " ");
+        cmd.binargs = nullptr;
+        cmd.argc = cmd.tokens.size();
+        cmd.cmdname = cmd.tokens[0].c_str();
+        cmd.cmdline = line.c_str();
+    } else {
+        const TransferListCommand& command = tl.commands[index];
+        cmd.tokens.clear();
+        cmd.binargs = tl.args + command.first_arg;
+        cmd.argc = command.arg_count + 1;
+        cmd.cmdname = kTransferListOps[command.op];
+        cmd.cmdline = cmd.cmdname;
+    }
+
+    return true;
+}
+
+static void DecodeRange(const TransferList& tl, uint32_t offset, RangeSet& rs) {
+    const uint32_t* r = tl.ranges + offset;
+    rs.count = r[0];
+    rs.size = r[1];
+    rs.pos.assign(r + 2, r + 2 + rs.count * 2);
+}
+
+// Returns the text format of a binary argument.
+
+static std::string BinaryArgText(const TransferList& tl, const TransferListArg& arg) {
+    std::string text;
+
+    switch (arg.type) {
+        case TL_ARG_NONE:
+            return "-";
+        case TL_ARG_UINT:
+            return std::to_string((static_cast<uint64_t>(arg.b) << 32) | arg.a);
+        case TL_ARG_HASH:
+        case TL_ARG_STASH_HASH:
+            text = print_sha1(tl.hashes + arg.a * TRANSFER_LIST_HASH_SIZE,
+                              TRANSFER_LIST_HASH_SIZE);
+            break;
+        case TL_ARG_STRING:
+        case TL_ARG_STASH_STRING:
+            text.assign(tl.strings + arg.a, arg.b);
+            break;
+    }
+
+    if (arg.type == TL_ARG_RANGE || arg.type == TL_ARG_STASH_HASH ||
+            arg.type == TL_ARG_STASH_STRING) {
+        const uint32_t* r = tl.ranges + (arg.type == TL_ARG_RANGE ? arg.a : arg.c);
+        if (arg.type != TL_ARG_RANGE) {
+            text += ':';
+        }
+        text += std::to_string(r[0] * 2);
+        for (uint32_t i = 0; i < r[0] * 2; ++i) {
+            text += ',' + std::to_string(r[2 + i]);
+        }
+    }
+
+    return text;
+}
+
+std::string NextArg(TransferCommand& cmd) {
+    if (cmd.binargs == nullptr) {
+        return cmd.tokens[cmd.cpos++];
+    }
+    return BinaryArgText(*cmd.tl, cmd.binargs[cmd.cpos++ - 1]);
+}
+
+// Decodes a digest printed by print_sha1(), i.e. in lowercase hex.
+static bool DecodeDigest(const std::string& text, uint8_t* digest) {
+    if (text.size() != TRANSFER_LIST_HASH_SIZE * 2) {
+        return false;
+    }
+
+    for (size_t i = 0; i < text.size(); ++i) {
+        int digit;
+        if (text[i] >= '0' && text[i] <= '9') {
+            digit = text[i] - '0';
+        } else if (text[i] >= 'a' && text[i] <= 'f') {
+            digit = text[i] - 'a' + 10;
+        } else {
+            return false;
+        }
+
+        if (i % 2 == 0) {
+            digest[i / 2] = digit << 4;
+        } else {
+            digest[i / 2] |= digit;
+        }
+    }
+
+    return true;
+}
+
+bool NextDigestArg(TransferCommand& cmd, uint8_t* digest) {
+    if (cmd.binargs == nullptr) {
+        return DecodeDigest(cmd.tokens[cmd.cpos++], digest);
+    }
+
+    const TransferListArg& arg = cmd.binargs[cmd.cpos++ - 1];
+    if (arg.type != TL_ARG_HASH) {
+        return false;
+    }
+
+    memcpy(digest, cmd.tl->hashes + arg.a * TRANSFER_LIST_HASH_SIZE, TRANSFER_LIST_HASH_SIZE);
+    return true;
+}
+
+bool ArgIsNone(const TransferCommand& cmd) {
+    if (cmd.binargs == nullptr) {
+        return cmd.tokens[cmd.cpos] == "-";
+    }
+    return cmd.binargs[cmd.cpos - 1].type == TL_ARG_NONE;
+}
+
+void NextRangeArg(TransferCommand& cmd, RangeSet& rs) {
+    if (cmd.binargs != nullptr && cmd.binargs[cmd.cpos - 1].type == TL_ARG_RANGE) {
+        DecodeRange(*cmd.tl, cmd.binargs[cmd.cpos++ - 1].a, rs);
+        return;
+    }
+    parse_range(NextArg(cmd), rs);
+}
+
+bool NextUintArg(TransferCommand& cmd, size_t* value) {
+    if (cmd.binargs != nullptr && cmd.binargs[cmd.cpos - 1].type == TL_ARG_UINT) {
+        const TransferListArg& arg = cmd.binargs[cmd.cpos++ - 1];
+        uint64_t v = (static_cast<uint64_t>(arg.b) << 32) | arg.a;
+        if (v > SIZE_MAX) {
+            return false;
+        }
+        *value = static_cast<size_t>(v);
+        return true;
+    }
+    return android::base::ParseUint(NextArg(cmd).c_str(), value);
+}
+
+bool NextStashArg(TransferCommand& cmd, std::string& id, RangeSet& locs) {
+    if (cmd.binargs != nullptr) {
+        const TransferListArg& arg = cmd.binargs[cmd.cpos - 1];
+        if (arg.type == TL_ARG_STASH_HASH) {
+            id = print_sha1(cmd.tl->hashes + arg.a * TRANSFER_LIST_HASH_SIZE,
+                            TRANSFER_LIST_HASH_SIZE);
+        } else if (arg.type == TL_ARG_STASH_STRING) {
+            id.assign(cmd.tl->strings + arg.a, arg.b);
+        }
+
+        if (arg.type == TL_ARG_STASH_HASH || arg.type == TL_ARG_STASH_STRING) {
+            DecodeRange(*cmd.tl, arg.c, locs);
+            cmd.cpos++;
+            return true;
+        }
+    }
+
+    std::vector<std::string> tokens = android::base::Split(NextArg(cmd), ":");
+    if (tokens.size() != 2) {
+        return false;
+    }
+
+    id = tokens[0];
+    parse_range(tokens[1], locs);
+    return true;
+}
+
+static int ParseCommandFootprint(TransferCommand& cmd, CommandFootprint& fp) {
+    const std::string cmdname(cmd.cmdname);
+
+    fp = CommandFootprint();
+    fp.new_data = (cmdname == "new");
+
+    if (cmdname == "stash") {
+        if (cmd.argc < 3) {
+            return -1;
+        }
+        fp.stash_write.push_back(NextArg(cmd));
+        NextRangeArg(cmd, fp.src);
+        return 0;
+    } else if (cmdname == "free") {
+        if (cmd.argc < 2) {
+            return -1;
+        }
+        fp.stash_write.push_back(NextArg(cmd));
+        return 0;
+    } else if (cmdname == "zero" || cmdname == "new" || cmdname == "erase") {
+        if (cmd.argc < 2) {
+            return -1;
+        }
+        NextRangeArg(cmd, fp.tgt);
+        return 0;
+    } else if (cmdname == "move") {
+        // <hash> <tgt_range> <src_block_count> ...
+        if (cmd.argc < 5) {
+            return -1;
+        }
+        fp.stash_write.push_back(NextArg(cmd));
+    } else if (cmdname == "bsdiff" || cmdname == "imgdiff") {
+        // <offset> <length> <srchash> <tgthash> <tgt_range> <src_block_count> ...
+        if (cmd.argc < 8) {
+            return -1;
+        }
+        cmd.cpos += 2;
+        fp.stash_write.push_back(NextArg(cmd));
+        cmd.cpos++;
+    } else {
+        return -1;
+    }
+
+    NextRangeArg(cmd, fp.tgt);
+    cmd.cpos++;  // <src_block_count>
+
+    if (ArgIsNone(cmd)) {
+        cmd.cpos++;
+    } else {
+        NextRangeArg(cmd, fp.src);
+        if (cmd.cpos < cmd.argc) {
+            cmd.cpos++;  // <src_loc>
+        }
+    }
+
+    while (cmd.cpos < cmd.argc) {
+        std::string id;
+        RangeSet locs;
+        if (!NextStashArg(cmd, id, locs)) {
+            return -1;
+        }
+        fp.stash_read.push_back(id);
+    }
+
+    return 0;
+}
+
+int GetCommandFootprint(TransferCommand& cmd, CommandFootprint& fp) {
+    cmd.cpos = 1;
+    int rc = ParseCommandFootprint(cmd, fp);
+    cmd.cpos = 1;
+    return rc;
+}
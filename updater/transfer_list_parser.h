@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_TRANSFER_LIST_PARSER_H_
+#define _UPDATER_TRANSFER_LIST_PARSER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "transfer_list.h"
+
+// Parsing of block image transfer lists, in the text format or the binary
+// encoding of transfer_list.h. This is shared by block_image_update() and
+// the host tools that need to interpret a list exactly as the updater does.
+
+struct RangeSet {
+    size_t count;             // Limit is INT_MAX.
+    size_t size;
+    std::vector<size_t> pos;  // Actual limit is INT_MAX.
+};
+
+// Parses a range in the text format. Returns false on malformed input.
+bool ParseRange(const std::string& range_text, RangeSet& rs);
+
+// Same as ParseRange(), but exits on malformed input.
+void parse_range(const std::string& range_text, RangeSet& rs);
+
+bool range_overlaps(const RangeSet& r1, const RangeSet& r2);
+
+// Returns the index of the first range after range i that doesn't continue
+// where the one before it ends. Ranges i up to there are one extent on the
+// device, which can be transferred at once.
+size_t ExtentEnd(const RangeSet& rs, size_t i);
+
+struct TransferList {
+    int version;
+    int total_blocks;
+    int stash_entries;
+    int stash_max_blocks;
+    size_t start;                       // index of the first command
+    size_t end;                         // one past the index of the last command
+
+    // Text format
+    std::vector<std::string> lines;
+
+    // Binary format; header is null for text lists
+    const TransferListHeader* header;
+    const TransferListCommand* commands;
+    const TransferListArg* args;
+    const uint32_t* ranges;
+    const uint8_t* hashes;
+    const char* strings;
+    std::vector<uint32_t> aligned;      // copy of a misaligned binary list
+};
+
+// Parses the header of the transfer list in data. Text lists are split into
+// lines; binary lists are validated and referenced in place, so 'data' has
+// to outlive 'tl'. Returns 0 on success, -1 if the list is malformed and -2
+// if its version isn't supported, with the reason in 'error'.
+int ParseTransferList(const char* data, size_t size, TransferList& tl, std::string& error);
+
+// A command of a transfer list, and the position of the next argument to
+// read with the functions below.
+struct TransferCommand {
+    std::vector<std::string> tokens;    // text command, including the name
+    const TransferListArg* binargs;     // arguments of a binary command
+    size_t argc;                        // number of arguments, including the name
+    size_t cpos;
+    const TransferList* tl;
+    const char* cmdname;
+    const char* cmdline;
+    size_t index;                       // of the command in the transfer list
+};
+
+// Loads command 'index' of the transfer list into cmd, positioned at its
+// first argument. Returns false if there is no command at this index, i.e.
+// for an empty line.
+bool LoadCommand(const TransferList& tl, size_t index, TransferCommand& cmd);
+
+// Returns the text of the next argument and advances to the one after it.
+std::string NextArg(TransferCommand& cmd);
+
+// Reads the next argument as a SHA-1 digest of TRANSFER_LIST_HASH_SIZE
+// bytes. Binary lists hold it as is, so this doesn't print or parse any
+// text for them. Returns false if the argument isn't a digest.
+bool NextDigestArg(TransferCommand& cmd, uint8_t* digest);
+
+bool ArgIsNone(const TransferCommand& cmd);
+void NextRangeArg(TransferCommand& cmd, RangeSet& rs);
+bool NextUintArg(TransferCommand& cmd, size_t* value);
+
+// Reads a <stash_id>:<stash_range> argument.
+bool NextStashArg(TransferCommand& cmd, std::string& id, RangeSet& locs);
+
+struct CommandFootprint {
+    RangeSet src;                          // partition blocks read
+    RangeSet tgt;                          // partition blocks written
+    std::vector<std::string> stash_read;   // stashes loaded
+    std::vector<std::string> stash_write;  // stashes created or freed
+    bool new_data;                         // consumes the new data stream
+};
+
+// Parses the footprint of a version 3+ command loaded with LoadCommand(),
+// and leaves the command positioned at its first argument. The parameters
+// of move/bsdiff/imgdiff are described in LoadSrcTgtVersion2/3 in
+// blockimg.cpp. The source hash of these commands is treated as a stash that
+// is written, as the source blocks are stashed under that name if they
+// overlap the target. Returns -1 if the command is malformed.
+int GetCommandFootprint(TransferCommand& cmd, CommandFootprint& fp);
+
+#endif  // _UPDATER_TRANSFER_LIST_PARSER_H_
@@ -0,0 +1,657 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Replays a block image transfer list against a model of the updater and
+// the storage instead of a device, and reports what applying it would cost:
+//
+//    transfer_list_sim [-p <patch data>] [-s <profile>] [-o <key>=<value>]...
+//                      [-m <max bytes>] [-t <max seconds>] <transfer list>
+//
+// The list is parsed with the updater's own parser (transfer_list_parser.h),
+// in the text or the binary format, and every command is accounted for as
+// block_image_update() executes it on a fresh update: the memory it
+// allocates, the blocks it reads, writes and hashes, the stash files it
+// writes and loads, and the fsyncs. Reads and writes are split into requests
+// and seeks the way the updater issues them.
+//
+// The apply time is predicted from a storage profile, a file of <key>=<value>
+// lines with the keys of kProfileKeys; -o overrides single keys. With the
+// patch data (patch.dat of the package), the memory needed by imgdiff
+// commands includes their deflate chunks; without it, only the memory of
+// bspatch is counted.
+//
+// The exit status is 1 if the list can't be simulated, uses more stash space
+// than it declares, or exceeds the limits given with -m or -t.
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+
+#include "applypatch/imgdiff.h"
+#include "transfer_list_parser.h"
+
+#define BLOCKSIZE 4096
+
+// Same as in blockimg.cpp and bspatch.cpp.
+#define MAX_IO_SIZE (1 << 20)
+#define BSPATCH_WINDOW (1 << 20)
+#define BSPATCH_PIPELINE_MIN (256 << 10)
+#define BSPATCH_RING (256 << 10)
+#define MOVE_WINDOW_SIZE (16 << 20)
+#define IMGPATCH_CHUNKS 4
+
+struct Profile {
+    double read_mbps;           // sequential read bandwidth
+    double write_mbps;          // sequential write bandwidth
+    double request_ms;          // per read or write request
+    double seek_ms;             // per request that doesn't continue the previous one
+    double fsync_ms;
+    double hash_mbps;           // SHA-1
+    double patch_mbps;          // bsdiff/imgdiff output
+    double new_mbps;            // inflating new data
+};
+
+struct ProfileKey {
+    const char* name;
+    double Profile::* value;
+};
+
+static const ProfileKey kProfileKeys[] = {
+    { "read_mbps", &Profile::read_mbps },
+    { "write_mbps", &Profile::write_mbps },
+    { "request_ms", &Profile::request_ms },
+    { "seek_ms", &Profile::seek_ms },
+    { "fsync_ms", &Profile::fsync_ms },
+    { "hash_mbps", &Profile::hash_mbps },
+    { "patch_mbps", &Profile::patch_mbps },
+    { "new_mbps", &Profile::new_mbps },
+};
+
+// A mid-range eMMC device.
+static const Profile kDefaultProfile = { 200, 80, 0.05, 0.2, 5, 300, 40, 60 };
+
+static bool SetProfileKey(Profile& profile, const std::string& line) {
+    std::vector<std::string> kv = android::base::Split(line, "=");
+    if (kv.size() != 2) {
+        return false;
+    }
+
+    std::string key = android::base::Trim(kv[0]);
+    for (const auto& pk : kProfileKeys) {
+        if (key == pk.name) {
+            char* end;
+            std::string value = android::base::Trim(kv[1]);
+            double v = strtod(value.c_str(), &end);
+            if (value.empty() || *end != '\0' || v < 0) {
+                return false;
+            }
+            profile.*pk.value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool LoadProfile(const char* fn, Profile& profile) {
+    std::string content;
+    if (!android::base::ReadFileToString(fn, &content)) {
+        fprintf(stderr, "failed to read %s: %s\n", fn, strerror(errno));
+        return false;
+    }
+
+    for (const auto& line : android::base::Split(content, "\n")) {
+        std::string l = android::base::Trim(line);
+        if (l.empty() || l[0] == '#') {
+            continue;
+        }
+        if (!SetProfileKey(profile, l)) {
+            fprintf(stderr, "invalid profile line \"%s\"\n", l.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// What the commands of one type, or all of them, cost.
+struct Cost {
+    size_t commands;
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+    uint64_t blocks_hashed;
+    uint64_t stash_blocks_read;         // included in blocks_read
+    uint64_t stash_blocks_written;      // included in blocks_written
+    uint64_t patch_bytes;               // produced by the patcher
+    uint64_t new_bytes;                 // taken from the new data
+    size_t requests;
+    size_t seeks;
+    uint64_t seek_blocks;               // total distance
+    size_t fsyncs;
+    double seconds;
+};
+
+static void AddCost(Cost& to, const Cost& c) {
+    to.commands += c.commands;
+    to.blocks_read += c.blocks_read;
+    to.blocks_written += c.blocks_written;
+    to.blocks_hashed += c.blocks_hashed;
+    to.stash_blocks_read += c.stash_blocks_read;
+    to.stash_blocks_written += c.stash_blocks_written;
+    to.patch_bytes += c.patch_bytes;
+    to.new_bytes += c.new_bytes;
+    to.requests += c.requests;
+    to.seeks += c.seeks;
+    to.seek_blocks += c.seek_blocks;
+    to.fsyncs += c.fsyncs;
+    to.seconds += c.seconds;
+}
+
+static double Seconds(const Profile& p, const Cost& c) {
+    const double mb = 1000000.0;
+    return c.blocks_read * BLOCKSIZE / (p.read_mbps * mb) +
+           c.blocks_written * BLOCKSIZE / (p.write_mbps * mb) +
+           c.blocks_hashed * BLOCKSIZE / (p.hash_mbps * mb) +
+           c.patch_bytes / (p.patch_mbps * mb) +
+           c.new_bytes / (p.new_mbps * mb) +
+           (c.requests * p.request_ms + c.seeks * p.seek_ms + c.fsyncs * p.fsync_ms) / 1000;
+}
+
+struct Simulator {
+    const TransferList* tl;
+    const std::string* patch;           // patch data, or null
+
+    size_t head;                        // block after the last one accessed
+    std::map<std::string, size_t> stashes;  // blocks by id
+    size_t stash_blocks;
+    size_t max_stash_blocks;
+    size_t max_stash_entries;
+    size_t buffer;                      // size of params.buffer
+    size_t max_alloc;                   // buffer plus temporary allocations
+    bool imgdiff_estimated;             // imgdiff memory is a lower bound
+
+    Cost cost;                          // of the current command
+};
+
+// Reads or writes the blocks of rs on the partition, in the requests the
+// updater would issue.
+
+static void AccessBlocks(Simulator& sim, const RangeSet& rs, bool write) {
+    for (size_t i = 0; i < rs.count; ) {
+        size_t j = ExtentEnd(rs, i);
+        size_t first = rs.pos[i * 2];
+        size_t last = rs.pos[j * 2 - 1];
+
+        if (first != sim.head) {
+            sim.cost.seeks++;
+            sim.cost.seek_blocks += first > sim.head ? first - sim.head : sim.head - first;
+        }
+        sim.cost.requests += (static_cast<uint64_t>(last - first) * BLOCKSIZE + MAX_IO_SIZE - 1) /
+                             MAX_IO_SIZE;
+        sim.head = last;
+        i = j;
+    }
+
+    if (write) {
+        sim.cost.blocks_written += rs.size;
+    } else {
+        sim.cost.blocks_read += rs.size;
+    }
+}
+
+// Stash files are written and read in one go, and /cache is a different
+// device, so they don't move the partition's head.
+
+static void WriteStashFile(Simulator& sim, const std::string& id, size_t blocks) {
+    sim.cost.blocks_written += blocks;
+    sim.cost.stash_blocks_written += blocks;
+    sim.cost.requests += (static_cast<uint64_t>(blocks) * BLOCKSIZE + MAX_IO_SIZE - 1) /
+                         MAX_IO_SIZE;
+    sim.cost.fsyncs += 2;               // the file and the directory
+
+    if (sim.stashes.find(id) == sim.stashes.end()) {
+        sim.stashes[id] = blocks;
+        sim.stash_blocks += blocks;
+        sim.max_stash_blocks = std::max(sim.max_stash_blocks, sim.stash_blocks);
+        sim.max_stash_entries = std::max(sim.max_stash_entries, sim.stashes.size());
+    }
+}
+
+static void FreeStashFile(Simulator& sim, const std::string& id) {
+    auto it = sim.stashes.find(id);
+    if (it != sim.stashes.end()) {
+        sim.stash_blocks -= it->second;
+        sim.stashes.erase(it);
+    }
+}
+
+static void Allocate(Simulator& sim, size_t bytes, size_t temporary) {
+    sim.buffer = std::max(sim.buffer, bytes);
+    sim.max_alloc = std::max(sim.max_alloc, sim.buffer + temporary);
+}
+
+static uint32_t Read4(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static uint64_t Read8(const uint8_t* p) {
+    return Read4(p) | (static_cast<uint64_t>(Read4(p + 4)) << 32);
+}
+
+// Returns the memory ApplyBSDiffPatch() holds for a target of 'target_len'
+// bytes: the output window, and the rings of the three streams where they
+// are decoded on threads, as on any device with more than one CPU.
+
+static uint64_t BSPatchAlloc(uint64_t target_len) {
+    return std::min<uint64_t>(target_len, BSPATCH_WINDOW) +
+           (target_len >= BSPATCH_PIPELINE_MIN ? 3 * BSPATCH_RING : 0);
+}
+
+// Returns the memory ApplyImagePatch() holds besides the source for the
+// patch at 'offset', or that of a bsdiff patch if the chunks can't be read.
+// The deflate chunks are patched on several threads, as on any device with
+// more than one CPU, so up to IMGPATCH_CHUNKS + 1 consecutive ones are held
+// at once while a bsdiff chunk may be applied.
+
+static size_t ImagePatchAlloc(Simulator& sim, size_t offset, size_t len, size_t tgt_bytes) {
+    const size_t window = BSPatchAlloc(tgt_bytes);
+    if (sim.patch == nullptr || offset > sim.patch->size() || sim.patch->size() - offset < len ||
+            len < 12 || memcmp(sim.patch->data() + offset, "IMGDIFF2", 8) != 0) {
+        sim.imgdiff_estimated = true;
+        return window;
+    }
+
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(sim.patch->data() + offset);
+    uint32_t chunks = Read4(p + 8);
+    size_t pos = 12;
+    std::vector<uint64_t> deflate;
+
+    for (uint32_t i = 0; i < chunks && pos + 4 <= len; ++i) {
+        uint32_t type = Read4(p + pos);
+        pos += 4;
+        if (type == CHUNK_NORMAL) {
+            pos += 24;
+        } else if (type == CHUNK_DEFLATE && pos + 60 <= len) {
+            uint64_t src_len = Read8(p + pos + 8);
+            uint64_t expanded_len = Read8(p + pos + 24);
+            uint64_t target_len = Read8(p + pos + 32);
+            // The expanded source, the bsdiff window the output is deflated
+            // from, and the compressed output, taken to be as large as the
+            // source.
+            deflate.push_back(expanded_len + BSPatchAlloc(target_len) + src_len);
+            pos += 60;
+        } else if (type == CHUNK_RAW && pos + 4 <= len) {
+            pos += 4 + Read4(p + pos);
+        } else {
+            sim.imgdiff_estimated = true;
+            break;
+        }
+    }
+
+    uint64_t held = 0;
+    uint64_t peak = 0;
+    for (size_t i = 0; i < deflate.size(); ++i) {
+        held += deflate[i];
+        if (i > IMGPATCH_CHUNKS) {
+            held -= deflate[i - IMGPATCH_CHUNKS - 1];
+        }
+        peak = std::max(peak, held);
+    }
+    return window + peak;
+}
+
+// <tgt_range> <src_block_count> <src_range>|- [<src_loc>] [<stash_id>:<stash_range>...]
+// as read by LoadSrcTgtVersion2(), including the target check and the
+// stashing of overlapping sources of version 3+. Large moves that don't
+// overlap are copied through the move window, as PerformStreamedMove() does
+// with the default of updater.blockimg.move_window.
+
+static int SimulateSrcTgt(Simulator& sim, TransferCommand& cmd, RangeSet& tgt,
+        size_t& src_blocks, const std::string& srchash, bool move) {
+    if (cmd.cpos + 2 >= cmd.argc) {
+        return -1;
+    }
+
+    NextRangeArg(cmd, tgt);
+    if (!NextUintArg(cmd, &src_blocks)) {
+        return -1;
+    }
+
+    if (sim.tl->version >= 3) {
+        // The target is hashed a window at a time to see whether the command
+        // is done already.
+        AccessBlocks(sim, tgt, false);
+        sim.cost.blocks_hashed += tgt.size;
+        Allocate(sim, 0, std::min<size_t>(tgt.size * BLOCKSIZE, MAX_IO_SIZE));
+    }
+
+    RangeSet src = RangeSet();
+    if (ArgIsNone(cmd)) {
+        cmd.cpos++;
+    } else {
+        NextRangeArg(cmd, src);
+        if (cmd.cpos < cmd.argc) {
+            cmd.cpos++;                 // <src_loc>
+        }
+    }
+
+    bool overlap = range_overlaps(src, tgt);
+    bool streamed = move && sim.tl->version >= 3 && !overlap &&
+                    src_blocks * BLOCKSIZE > MOVE_WINDOW_SIZE;
+
+    // A streamed source is read once to check it and once more to copy it.
+    Allocate(sim, streamed ? MOVE_WINDOW_SIZE : src_blocks * BLOCKSIZE, 0);
+    AccessBlocks(sim, src, false);
+    if (streamed) {
+        AccessBlocks(sim, src, false);
+    }
+
+    size_t held = 0;
+
+    while (cmd.cpos < cmd.argc) {
+        std::string id;
+        RangeSet locs;
+        if (!NextStashArg(cmd, id, locs)) {
+            return -1;
+        }
+
+        auto it = sim.stashes.find(id);
+        if (it == sim.stashes.end()) {
+            fprintf(stderr, "stash %s used before it is stashed [%s]\n", id.c_str(),
+                    cmd.cmdline);
+            return -1;
+        }
+        // Each stash is loaded into a buffer of its own first, and a
+        // streamed move holds them all until it's done.
+        sim.cost.blocks_read += it->second;
+        sim.cost.stash_blocks_read += it->second;
+        sim.cost.requests++;
+        if (streamed) {
+            held += it->second * BLOCKSIZE;
+            Allocate(sim, 0, held);
+        } else {
+            Allocate(sim, 0, it->second * BLOCKSIZE);
+        }
+    }
+
+    if (sim.tl->version >= 3) {
+        sim.cost.blocks_hashed += streamed ? src_blocks * 2 : src_blocks;
+        if (overlap) {
+            WriteStashFile(sim, srchash, src_blocks);
+        }
+    }
+
+    return 0;
+}
+
+static int SimulateCommand(Simulator& sim, TransferCommand& cmd) {
+    const std::string name(cmd.cmdname);
+    const int version = sim.tl->version;
+    RangeSet tgt;
+    RangeSet src;
+
+    if (name == "stash") {
+        if (cmd.cpos + 1 >= cmd.argc) {
+            return -1;
+        }
+        std::string id = NextArg(cmd);
+        NextRangeArg(cmd, src);
+        if (version >= 3 && sim.stashes.find(id) != sim.stashes.end()) {
+            // SaveStash() loads and verifies the existing file instead.
+            sim.cost.blocks_read += src.size;
+            sim.cost.stash_blocks_read += src.size;
+            sim.cost.blocks_hashed += src.size;
+            return 0;
+        }
+        Allocate(sim, src.size * BLOCKSIZE, 0);
+        AccessBlocks(sim, src, false);
+        if (version >= 3) {
+            sim.cost.blocks_hashed += src.size;
+        }
+        WriteStashFile(sim, id, src.size);
+    } else if (name == "free") {
+        if (cmd.cpos >= cmd.argc) {
+            return -1;
+        }
+        FreeStashFile(sim, NextArg(cmd));
+    } else if (name == "zero" || name == "new" || name == "erase") {
+        if (cmd.cpos >= cmd.argc) {
+            return -1;
+        }
+        NextRangeArg(cmd, tgt);
+        if (name == "erase") {
+            // One BLKDISCARD per range, which doesn't transfer any data.
+            sim.cost.requests += tgt.count;
+        } else {
+            AccessBlocks(sim, tgt, true);
+            if (name == "new") {
+                sim.cost.new_bytes += tgt.size * BLOCKSIZE;
+            }
+        }
+    } else if (name == "move" || name == "bsdiff" || name == "imgdiff") {
+        bool diff = name != "move";
+        size_t offset = 0;
+        size_t len = 0;
+        std::string srchash;
+        size_t src_blocks;
+
+        if (diff && (!NextUintArg(cmd, &offset) || !NextUintArg(cmd, &len))) {
+            return -1;
+        }
+
+        if (version == 1) {
+            if (cmd.cpos + 1 >= cmd.argc) {
+                return -1;
+            }
+            NextRangeArg(cmd, src);
+            NextRangeArg(cmd, tgt);
+            src_blocks = src.size;
+            Allocate(sim, src.size * BLOCKSIZE, 0);
+            AccessBlocks(sim, src, false);
+        } else {
+            if (version >= 3) {
+                if (cmd.cpos >= cmd.argc) {
+                    return -1;
+                }
+                srchash = NextArg(cmd);
+                if (diff) {
+                    cmd.cpos++;         // <tgthash>
+                }
+            }
+            if (SimulateSrcTgt(sim, cmd, tgt, src_blocks, srchash, !diff) == -1) {
+                return -1;
+            }
+        }
+
+        if (name == "bsdiff") {
+            Allocate(sim, 0, BSPatchAlloc(tgt.size * BLOCKSIZE));
+        } else if (name == "imgdiff") {
+            Allocate(sim, 0, ImagePatchAlloc(sim, offset, len, tgt.size * BLOCKSIZE));
+        }
+        if (diff) {
+            sim.cost.patch_bytes += tgt.size * BLOCKSIZE;
+        }
+
+        AccessBlocks(sim, tgt, true);
+
+        // The stash of an overlapping source is freed right after the command.
+        if (!srchash.empty()) {
+            FreeStashFile(sim, srchash);
+        }
+    } else {
+        fprintf(stderr, "unexpected command [%s]\n", cmd.cmdname);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void PrintCost(const char* name, const Cost& c) {
+    printf("%-8s %8zu %10.1f %10.1f %10.1f %8zu %8zu %8zu %10.3f\n", name, c.commands,
+           c.blocks_read * BLOCKSIZE / 1048576.0, c.blocks_written * BLOCKSIZE / 1048576.0,
+           c.blocks_hashed * BLOCKSIZE / 1048576.0, c.requests, c.seeks, c.fsyncs, c.seconds);
+}
+
+static int Usage(const char* name) {
+    printf("usage: %s [-p <patch data>] [-s <profile>] [-o <key>=<value>]...\n"
+           "       [-m <max bytes>] [-t <max seconds>] <transfer list>\n"
+           "profile keys:", name);
+    for (const auto& pk : kProfileKeys) {
+        printf(" %s", pk.name);
+    }
+    printf("\n");
+    return 2;
+}
+
+int main(int argc, char** argv) {
+    Profile profile = kDefaultProfile;
+    const char* patch_fn = nullptr;
+    uint64_t max_bytes = 0;
+    double max_seconds = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "p:s:o:m:t:")) != -1) {
+        switch (c) {
+            case 'p':
+                patch_fn = optarg;
+                break;
+            case 's':
+                if (!LoadProfile(optarg, profile)) {
+                    return 1;
+                }
+                break;
+            case 'o':
+                if (!SetProfileKey(profile, optarg)) {
+                    fprintf(stderr, "invalid profile setting \"%s\"\n", optarg);
+                    return Usage(argv[0]);
+                }
+                break;
+            case 'm':
+                if (!android::base::ParseUint(optarg, &max_bytes)) {
+                    return Usage(argv[0]);
+                }
+                break;
+            case 't':
+                max_seconds = strtod(optarg, nullptr);
+                break;
+            default:
+                return Usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1) {
+        return Usage(argv[0]);
+    }
+
+    for (const auto& pk : kProfileKeys) {
+        if (profile.*pk.value == 0 && strstr(pk.name, "mbps") != nullptr) {
+            fprintf(stderr, "%s must not be zero\n", pk.name);
+            return 1;
+        }
+    }
+
+    std::string data;
+    if (!android::base::ReadFileToString(argv[optind], &data)) {
+        fprintf(stderr, "failed to read %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    std::string patch;
+    if (patch_fn != nullptr && !android::base::ReadFileToString(patch_fn, &patch)) {
+        fprintf(stderr, "failed to read %s: %s\n", patch_fn, strerror(errno));
+        return 1;
+    }
+
+    TransferList tl = TransferList();
+    std::string error;
+    if (ParseTransferList(data.data(), data.size(), tl, error) != 0) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    Simulator sim = Simulator();
+    sim.tl = &tl;
+    sim.patch = patch_fn != nullptr ? &patch : nullptr;
+
+    std::map<std::string, Cost> by_type;
+    Cost total = Cost();
+    TransferCommand cmd = TransferCommand();
+
+    for (size_t i = tl.start; i < tl.end; ++i) {
+        if (!LoadCommand(tl, i, cmd)) {
+            continue;
+        }
+
+        sim.cost = Cost();
+        sim.cost.commands = 1;
+        if (SimulateCommand(sim, cmd) == -1) {
+            fprintf(stderr, "failed to simulate command %zu [%s]\n", i, cmd.cmdline);
+            return 1;
+        }
+
+        sim.cost.fsyncs++;              // of the partition after each command
+        sim.cost.seconds = Seconds(profile, sim.cost);
+        AddCost(by_type[cmd.cmdname], sim.cost);
+        AddCost(total, sim.cost);
+    }
+
+    printf("transfer list version %d, %d blocks to write\n", tl.version, tl.total_blocks);
+    printf("peak memory: %zu bytes (%zu in the command buffer)%s\n", sim.max_alloc, sim.buffer,
+           sim.imgdiff_estimated ? ", imgdiff chunks not included" : "");
+    printf("peak stash: %zu blocks in %zu entries, declared %d blocks in %d entries\n",
+           sim.max_stash_blocks, sim.max_stash_entries, tl.stash_max_blocks, tl.stash_entries);
+    printf("stash I/O: %.1f MiB written, %.1f MiB read\n",
+           total.stash_blocks_written * BLOCKSIZE / 1048576.0,
+           total.stash_blocks_read * BLOCKSIZE / 1048576.0);
+    printf("seeks: %zu of %zu requests, %.1f blocks apart on average\n", total.seeks,
+           total.requests, total.seeks > 0 ? static_cast<double>(total.seek_blocks) / total.seeks
+                                           : 0.0);
+    printf("\n%-8s %8s %10s %10s %10s %8s %8s %8s %10s\n", "command", "count", "read MiB",
+           "write MiB", "hash MiB", "requests", "seeks", "fsyncs", "seconds");
+    for (const auto& it : by_type) {
+        PrintCost(it.first.c_str(), it.second);
+    }
+    PrintCost("total", total);
+
+    int rc = 0;
+    if (tl.version >= 2 && sim.max_stash_blocks > static_cast<size_t>(tl.stash_max_blocks)) {
+        fprintf(stderr, "stash needs %zu blocks, more than the declared %d\n",
+                sim.max_stash_blocks, tl.stash_max_blocks);
+        rc = 1;
+    }
+    if (max_bytes > 0 && sim.max_alloc > max_bytes) {
+        fprintf(stderr, "needs %zu bytes of memory, more than %" PRIu64 "\n", sim.max_alloc,
+                max_bytes);
+        rc = 1;
+    }
+    if (max_seconds > 0 && total.seconds > max_seconds) {
+        fprintf(stderr, "predicted to take %.1f s, more than %.1f s\n", total.seconds,
+                max_seconds);
+        rc = 1;
+    }
+    return rc;
+}